@@ -0,0 +1,287 @@
+/*
+ * audio_host.c - file-backed stand-ins for the HFP audio engine and the mSBC codec
+ *
+ * The codec is G.711 mu-law, one byte a sample: lossy enough that the
+ * loopback's SNR measures something, and simple enough to be obviously
+ * right. The audio tasks keep the order of the real ones: the mic task
+ * converts, taps and encodes; the speaker task conceals, taps and plays.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include "audio_host.h"
+#include "bt_i2s.h"
+#include "bt_app_hf.h"
+#include "conceal.h"
+#include "audio_loopback.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#define PCM_FRAME_BYTES     (MSBC_FRAME_SAMPLES * sizeof(int16_t))
+#define ULAW_BIAS           0x84
+#define ULAW_CLIP           32635
+
+// A ring of fixed-size frames; each side takes the lock for one frame
+typedef struct {
+    uint8_t data[AUDIO_HOST_RING_FRAMES][PCM_FRAME_BYTES];
+    uint32_t head;
+    uint32_t tail;
+    bool prefetching;
+} host_ring_t;
+
+static const char *s_mic_path;
+static const char *s_spk_path;
+static FILE *s_mic_file;
+static FILE *s_spk_file;
+static SemaphoreHandle_t s_lock;
+static SemaphoreHandle_t s_mic_done;
+static SemaphoreHandle_t s_spk_done;
+static volatile bool s_running;
+static host_ring_t s_mic_ring;
+static host_ring_t s_spk_ring;
+static conceal_t s_conceal;
+
+void audio_host_set_files(const char *mic_path, const char *spk_path)
+{
+    s_mic_path = mic_path;
+    s_spk_path = spk_path;
+}
+
+bool bt_app_hf_audio_connected(void)
+{
+    return false;
+}
+
+static uint8_t ulaw_encode(int16_t pcm)
+{
+    int32_t s = pcm;
+    uint8_t sign = 0;
+    if (s < 0) {
+        s = -s;
+        sign = 0x80;
+    }
+    if (s > ULAW_CLIP) {
+        s = ULAW_CLIP;
+    }
+    s += ULAW_BIAS;
+    int exp = 7;
+    for (int32_t mask = 0x4000; exp > 0 && (s & mask) == 0; mask >>= 1) {
+        exp--;
+    }
+    uint8_t mantissa = (s >> (exp + 3)) & 0x0f;
+    return (uint8_t)~(sign | exp << 4 | mantissa);
+}
+
+static int16_t ulaw_decode(uint8_t u)
+{
+    u = ~u;
+    int exp = (u >> 4) & 0x07;
+    int32_t s = ((((int32_t)u & 0x0f) << 3) + ULAW_BIAS) << exp;
+    s -= ULAW_BIAS;
+    return (int16_t)((u & 0x80) ? -s : s);
+}
+
+int msbc_enc_open(void)
+{
+    return 0;
+}
+
+void msbc_enc_close(void)
+{
+}
+
+int msbc_dec_open(void)
+{
+    return 0;
+}
+
+void msbc_dec_close(void)
+{
+}
+
+int msbc_enc_data(const uint8_t *in_data, size_t in_data_len, uint8_t *out_data, size_t *out_data_len)
+{
+    if (in_data_len != PCM_FRAME_BYTES) {
+        return -1;
+    }
+    const int16_t *pcm = (const int16_t *)in_data;
+    for (size_t i = 0; i < MSBC_FRAME_SAMPLES; i++) {
+        out_data[i] = ulaw_encode(pcm[i]);
+    }
+    *out_data_len = ESP_HF_MSBC_ENCODED_FRAME_SIZE;
+    return 0;
+}
+
+int msbc_dec_data(const uint8_t *in_data, size_t in_data_len, uint8_t *out_data, size_t *out_data_len)
+{
+    if (in_data_len != ESP_HF_MSBC_ENCODED_FRAME_SIZE) {
+        return -1;
+    }
+    int16_t *pcm = (int16_t *)out_data;
+    for (size_t i = 0; i < MSBC_FRAME_SAMPLES; i++) {
+        pcm[i] = ulaw_decode(in_data[i]);
+    }
+    *out_data_len = PCM_FRAME_BYTES;
+    return 0;
+}
+
+/* as codec.c: the top 16 bits of each left-justified sample */
+void i2s_32bit_to_16bit_pcm(const int32_t *i2s_data, uint8_t *pcm_data, size_t num_samples)
+{
+    int16_t *pcm = (int16_t *)pcm_data;
+    for (size_t i = 0; i < num_samples; i++) {
+        pcm[i] = (int16_t)(i2s_data[i] >> 16);
+    }
+}
+
+static void ring_reset(host_ring_t *r)
+{
+    r->head = 0;
+    r->tail = 0;
+    r->prefetching = true;
+}
+
+// Queue a frame; it is dropped when the ring is full, as xRingbufferSend with no wait does
+static void ring_put(host_ring_t *r, const uint8_t *frame, size_t len, uint32_t prefetch)
+{
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (r->head - r->tail < AUDIO_HOST_RING_FRAMES) {
+        memset(r->data[r->head % AUDIO_HOST_RING_FRAMES], 0, PCM_FRAME_BYTES);
+        memcpy(r->data[r->head % AUDIO_HOST_RING_FRAMES], frame, len);
+        r->head++;
+    }
+    if (r->prefetching && r->head - r->tail >= prefetch) {
+        r->prefetching = false;
+    }
+    xSemaphoreGive(s_lock);
+}
+
+// Take a frame; an empty ring goes back to prefetching
+static bool ring_get(host_ring_t *r, uint8_t *frame, size_t len)
+{
+    bool got = false;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (!r->prefetching) {
+        if (r->head == r->tail) {
+            r->prefetching = true;
+        } else {
+            memcpy(frame, r->data[r->tail % AUDIO_HOST_RING_FRAMES], len);
+            r->tail++;
+            got = true;
+        }
+    }
+    xSemaphoreGive(s_lock);
+    return got;
+}
+
+static void next_frame(struct timespec *t)
+{
+    t->tv_nsec += AUDIO_HOST_FRAME_US * 1000;
+    if (t->tv_nsec >= 1000000000) {
+        t->tv_sec++;
+        t->tv_nsec -= 1000000000;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, t, NULL) == EINTR) {
+    }
+}
+
+/* the rx DMA completes a frame every 7.5 ms; the mic task handles it at once */
+static void audio_host_mic_task(void *arg)
+{
+    (void)arg;
+    int32_t dma[MSBC_FRAME_SAMPLES];
+    uint8_t pcm[PCM_FRAME_BYTES];
+    uint8_t encoded[ESP_HF_MSBC_ENCODED_FRAME_SIZE];
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    while (s_running) {
+        next_frame(&t);
+        memset(dma, 0, sizeof(dma));
+        if (s_mic_file && fread(dma, sizeof(dma), 1, s_mic_file) != 1) {
+            rewind(s_mic_file);
+        }
+        i2s_32bit_to_16bit_pcm(dma, pcm, MSBC_FRAME_SAMPLES);
+        audio_loopback_mic_tap((int16_t *)pcm, MSBC_FRAME_SAMPLES, esp_timer_get_time());
+        size_t len;
+        if (msbc_enc_data(pcm, sizeof(pcm), encoded, &len) == 0) {
+            ring_put(&s_mic_ring, encoded, len, AUDIO_HOST_MIC_PREFETCH);
+        }
+    }
+    xSemaphoreGive(s_mic_done);
+    vTaskDelete(NULL);
+}
+
+/* the tx DMA takes a frame every 7.5 ms: real audio, concealment once there was some, or silence */
+static void audio_host_spk_task(void *arg)
+{
+    (void)arg;
+    int16_t pcm[MSBC_FRAME_SAMPLES];
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    while (s_running) {
+        next_frame(&t);
+        if (ring_get(&s_spk_ring, (uint8_t *)pcm, sizeof(pcm))) {
+            conceal_real(&s_conceal, pcm, MSBC_FRAME_SAMPLES);
+        } else if (conceal_ready(&s_conceal)) {
+            conceal_fill(&s_conceal, pcm, MSBC_FRAME_SAMPLES);
+        } else {
+            memset(pcm, 0, sizeof(pcm));
+            if (s_spk_file) {
+                fwrite(pcm, sizeof(pcm), 1, s_spk_file);
+            }
+            continue;
+        }
+        audio_loopback_spk_tap(pcm, MSBC_FRAME_SAMPLES);
+        if (s_spk_file) {
+            fwrite(pcm, sizeof(pcm), 1, s_spk_file);
+        }
+    }
+    xSemaphoreGive(s_spk_done);
+    vTaskDelete(NULL);
+}
+
+void bt_i2s_hfp_start(void)
+{
+    if (s_lock == NULL) {
+        s_lock = xSemaphoreCreateMutex();
+        s_mic_done = xSemaphoreCreateBinary();
+        s_spk_done = xSemaphoreCreateBinary();
+    }
+    ring_reset(&s_mic_ring);
+    ring_reset(&s_spk_ring);
+    conceal_reset(&s_conceal, AUDIO_HOST_SAMPLE_RATE);
+    s_mic_file = s_mic_path ? fopen(s_mic_path, "rb") : NULL;
+    s_spk_file = s_spk_path ? fopen(s_spk_path, "wb") : NULL;
+    s_running = true;
+    xTaskCreatePinnedToCore(audio_host_mic_task, "HostMic", 0, NULL, 0, NULL, 0);
+    xTaskCreatePinnedToCore(audio_host_spk_task, "HostSpk", 0, NULL, 0, NULL, 0);
+}
+
+void bt_i2s_hfp_stop(void)
+{
+    s_running = false;
+    xSemaphoreTake(s_mic_done, portMAX_DELAY);
+    xSemaphoreTake(s_spk_done, portMAX_DELAY);
+    if (s_mic_file) {
+        fclose(s_mic_file);
+        s_mic_file = NULL;
+    }
+    if (s_spk_file) {
+        fclose(s_spk_file);
+        s_spk_file = NULL;
+    }
+}
+
+size_t bt_i2s_hfp_read_rx_ringbuf(uint8_t *mic_data)
+{
+    return ring_get(&s_mic_ring, mic_data, ESP_HF_MSBC_ENCODED_FRAME_SIZE) ? ESP_HF_MSBC_ENCODED_FRAME_SIZE : 0;
+}
+
+void bt_i2s_hfp_write_tx_ringbuf(const uint8_t *data, uint32_t size)
+{
+    ring_put(&s_spk_ring, data, size < PCM_FRAME_BYTES ? size : PCM_FRAME_BYTES, AUDIO_HOST_SPK_PREFETCH);
+}
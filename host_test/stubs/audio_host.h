@@ -0,0 +1,24 @@
+/*
+ * audio_host.h - file-backed stand-ins for the HFP audio engine of bt_i2s.c
+ * and for the mSBC codec, so the audio loopback runs on the host
+ *
+ * The mic "DMA" reads one frame of 32-bit I2S words from a file every
+ * 7.5 ms, looping at its end, and the speaker writes what it plays to a
+ * file of 16-bit PCM. Both ringbuffers prefetch like the real ones, with
+ * fewer frames, and a dry speaker ring is concealed with conceal.c as on
+ * the device. There is no time-stretching: both sides run off the host
+ * clock, so the levels hold where prefetching left them.
+ */
+
+#pragma once
+
+#include "codec.h"
+
+#define AUDIO_HOST_SAMPLE_RATE      16000
+#define AUDIO_HOST_FRAME_US         (MSBC_FRAME_SAMPLES * 1000000 / AUDIO_HOST_SAMPLE_RATE)
+#define AUDIO_HOST_MIC_PREFETCH     4       // frames the mic ring holds before the SCO side reads it
+#define AUDIO_HOST_SPK_PREFETCH     4       // frames the speaker ring holds before it plays
+#define AUDIO_HOST_RING_FRAMES      32
+
+// Files for the next bt_i2s_hfp_start(); a NULL mic path captures silence, a NULL speaker path discards
+void audio_host_set_files(const char *mic_path, const char *spk_path);
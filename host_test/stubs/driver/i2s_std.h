@@ -0,0 +1,3 @@
+/* host build stand-in: bt_i2s.h includes it; the host has no I2S driver, see audio_host.c */
+#pragma once
+#include "esp_err.h"
@@ -0,0 +1,6 @@
+/* host build stand-in: placement attributes are no-ops */
+#pragma once
+
+#define IRAM_ATTR
+#define DRAM_ATTR
+#define DRAM_STR(s) (s)
@@ -0,0 +1,6 @@
+/* host build stand-in: only the device address type */
+#pragma once
+#include <stdint.h>
+
+#define ESP_BD_ADDR_LEN 6
+typedef uint8_t esp_bd_addr_t[ESP_BD_ADDR_LEN];
@@ -0,0 +1,14 @@
+/*
+ * host build stand-in. The host codec in audio_host.c is G.711 mu-law, one
+ * byte a sample, so an encoded frame is larger than an mSBC one.
+ */
+#pragma once
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_bt_defs.h"
+#include "esp_hf_defs.h"
+
+#define ESP_HF_MSBC_ENCODED_FRAME_SIZE  120
+
+typedef int esp_hf_client_cb_event_t;
+typedef union { int unused; } esp_hf_client_cb_param_t;
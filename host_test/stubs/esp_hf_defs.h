@@ -0,0 +1,2 @@
+/* host build stand-in: bt_i2s.h includes it */
+#pragma once
@@ -0,0 +1,249 @@
+/*
+ * freertos_host.c - host stand-ins for FreeRTOS tasks and semaphores and
+ * for esp_timer periodic timers, on pthreads
+ *
+ * Enough for code that paces itself with task notifications, delays and
+ * timers, such as the audio loopback. Scheduling is the host's: a task
+ * gets no priority over another, so tests must allow for jitter.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+struct host_sem {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t count;
+};
+
+struct host_task {
+    pthread_t thread;
+    TaskFunction_t fn;
+    void *arg;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t notified;
+};
+
+struct host_timer {
+    esp_timer_create_args_t args;
+    pthread_t thread;
+    uint64_t period_us;
+    volatile bool running;
+};
+
+static __thread struct host_task *s_self;
+
+static void deadline_after(struct timespec *ts, uint64_t us)
+{
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    ts->tv_sec += us / 1000000;
+    ts->tv_nsec += (long)(us % 1000000) * 1000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+static void cond_init(pthread_cond_t *cond)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+// Wait on cond until *count is non-zero or the ticks run out; call with lock held
+static bool wait_count(pthread_mutex_t *lock, pthread_cond_t *cond, volatile uint32_t *count, TickType_t ticks)
+{
+    struct timespec deadline;
+    deadline_after(&deadline, (uint64_t)ticks * portTICK_PERIOD_MS * 1000);
+    while (*count == 0) {
+        int rc = ticks == portMAX_DELAY ? pthread_cond_wait(cond, lock)
+                                        : pthread_cond_timedwait(cond, lock, &deadline);
+        if (rc == ETIMEDOUT) {
+            return *count != 0;
+        }
+    }
+    return true;
+}
+
+static SemaphoreHandle_t sem_create(uint32_t count)
+{
+    struct host_sem *sem = calloc(1, sizeof(*sem));
+    if (sem) {
+        pthread_mutex_init(&sem->lock, NULL);
+        cond_init(&sem->cond);
+        sem->count = count;
+    }
+    return sem;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    return sem_create(1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    return sem_create(0);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t timeout)
+{
+    pthread_mutex_lock(&sem->lock);
+    bool got = wait_count(&sem->lock, &sem->cond, &sem->count, timeout);
+    if (got) {
+        sem->count = 0;
+    }
+    pthread_mutex_unlock(&sem->lock);
+    return got ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+    pthread_mutex_lock(&sem->lock);
+    BaseType_t given = sem->count == 0 ? pdTRUE : pdFALSE;
+    sem->count = 1;
+    pthread_cond_signal(&sem->cond);
+    pthread_mutex_unlock(&sem->lock);
+    return given;
+}
+
+static void *task_main(void *arg)
+{
+    s_self = arg;
+    s_self->fn(s_self->arg);
+    return NULL;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack, void *arg,
+                                   UBaseType_t prio, TaskHandle_t *handle, BaseType_t core)
+{
+    (void)name, (void)stack, (void)prio, (void)core;
+    struct host_task *task = calloc(1, sizeof(*task));
+    if (task == NULL) {
+        return pdFALSE;
+    }
+    task->fn = fn;
+    task->arg = arg;
+    pthread_mutex_init(&task->lock, NULL);
+    cond_init(&task->cond);
+    if (handle) {
+        *handle = task;
+    }
+    if (pthread_create(&task->thread, NULL, task_main, task) != 0) {
+        free(task);
+        return pdFALSE;
+    }
+    pthread_detach(task->thread);
+    return pdPASS;
+}
+
+// Only a task deleting itself is supported; as on the device, its handle is invalid from here
+void vTaskDelete(TaskHandle_t task)
+{
+    (void)task;
+    struct host_task *self = s_self;
+    pthread_mutex_destroy(&self->lock);
+    pthread_cond_destroy(&self->cond);
+    free(self);
+    pthread_exit(NULL);
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    struct timespec deadline;
+    deadline_after(&deadline, (uint64_t)ticks * portTICK_PERIOD_MS * 1000);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {
+    }
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    return (TickType_t)(esp_timer_get_time() / 1000 / portTICK_PERIOD_MS);
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    pthread_mutex_lock(&task->lock);
+    task->notified++;
+    pthread_cond_signal(&task->cond);
+    pthread_mutex_unlock(&task->lock);
+    return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t timeout)
+{
+    struct host_task *task = s_self;
+    pthread_mutex_lock(&task->lock);
+    wait_count(&task->lock, &task->cond, &task->notified, timeout);
+    uint32_t value = task->notified;
+    if (value > 0) {
+        task->notified = clear ? 0 : value - 1;
+    }
+    pthread_mutex_unlock(&task->lock);
+    return value;
+}
+
+/* a periodic timer keeps to its own schedule, however late one callback ran */
+static void *timer_main(void *arg)
+{
+    struct host_timer *timer = arg;
+    struct timespec next;
+    deadline_after(&next, timer->period_us);
+    while (timer->running) {
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR) {
+        }
+        if (!timer->running) {
+            break;
+        }
+        timer->args.callback(timer->args.arg);
+        next.tv_nsec += (long)(timer->period_us % 1000000) * 1000;
+        next.tv_sec += timer->period_us / 1000000 + next.tv_nsec / 1000000000;
+        next.tv_nsec %= 1000000000;
+    }
+    return NULL;
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *out)
+{
+    struct host_timer *timer = calloc(1, sizeof(*timer));
+    if (timer == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    timer->args = *args;
+    *out = timer;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period_us)
+{
+    if (timer->running) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    timer->period_us = period_us;
+    timer->running = true;
+    if (pthread_create(&timer->thread, NULL, timer_main, timer) != 0) {
+        timer->running = false;
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+    if (!timer->running) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    timer->running = false;
+    pthread_join(timer->thread, NULL);
+    return ESP_OK;
+}
@@ -0,0 +1,37 @@
+/*
+ * idf_stubs.c - host stand-ins for the IDF
+ *
+ * Files live in a directory of the build tree instead of the SPIFFS
+ * partition.
+ */
+
+#include <time.h>
+#include "esp_err.h"
+#include "esp_timer.h"
+#include "esp_spiffs.h"
+
+const char *esp_err_to_name(esp_err_t code)
+{
+    return code == ESP_OK ? "ESP_OK" : "ESP_FAIL";
+}
+
+int64_t esp_timer_get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+esp_err_t esp_vfs_spiffs_register(const esp_vfs_spiffs_conf_t *conf)
+{
+    (void)conf;
+    return ESP_OK;
+}
+
+esp_err_t esp_spiffs_info(const char *partition_label, size_t *total_bytes, size_t *used_bytes)
+{
+    (void)partition_label;
+    *total_bytes = 0;
+    *used_bytes = 0;
+    return ESP_OK;
+}
@@ -0,0 +1,9 @@
+/* host build stand-in: the project options the host-built sources read */
+#pragma once
+
+#define CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ     240
+#define CONFIG_FREERTOS_UNICORE             1
+#define CONFIG_APP_FLASH_SCHED_TASK_PRIO    3
+#define CONFIG_APP_FLASH_SCHED_TASK_STACK   3072
+#define CONFIG_APP_LOOPBACK_TASK_PRIO       22
+#define CONFIG_APP_LOOPBACK_TASK_STACK      3072
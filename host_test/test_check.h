@@ -0,0 +1,24 @@
+/*
+ * test_check.h - minimal assertions for the host tests
+ *
+ * CHECK() reports a failed condition and carries on, so one run lists
+ * every failure; main() ends with return CHECK_RESULT().
+ */
+
+#ifndef TEST_CHECK_H
+#define TEST_CHECK_H
+
+#include <stdio.h>
+
+static int s_check_fails;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            s_check_fails++; \
+        } \
+    } while (0)
+
+#define CHECK_RESULT() (printf(s_check_fails ? "%d check(s) failed\n" : "ok\n", s_check_fails), s_check_fails != 0)
+
+#endif // TEST_CHECK_H
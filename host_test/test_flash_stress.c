@@ -0,0 +1,132 @@
+/*
+ * test_flash_stress.c - flash writes queued through the real flash scheduler
+ * while the audio loopback streams
+ *
+ * A writer task pushes more than the RAM spill holds while the loopback
+ * keeps audio active. The loopback must measure clean meanwhile, only
+ * slices may reach the file during the call, and everything must be on
+ * disk, in order, once the loopback stops. The host has no flash cache to
+ * lose, so what this covers is the scheduler's side of the contract; the
+ * `fstress` console command measures the device.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "audio_loopback.h"
+#include "audio_host.h"
+#include "flash_sched.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "test_check.h"
+
+#define MIC_PATH            "stress_mic.raw"
+#define SPK_PATH            "stress_spk.raw"
+#define STRESS_PATH         "stress.tmp"
+#define STRESS_CHUNK        4096
+#define STRESS_BYTES        (FLASH_SCHED_MAX_PENDING + 8 * 1024)   // 8 slices past a full spill
+
+static SemaphoreHandle_t s_writer_done;
+static volatile int s_write_errors;
+
+static uint8_t pattern(size_t pos)
+{
+    return (uint8_t)(pos * 7 + pos / 251);
+}
+
+static void writer_task(void *arg)
+{
+    (void)arg;
+    static uint8_t chunk[STRESS_CHUNK];
+    for (size_t pos = 0; pos < STRESS_BYTES; pos += STRESS_CHUNK) {
+        for (size_t i = 0; i < STRESS_CHUNK; i++) {
+            chunk[i] = pattern(pos + i);
+        }
+        if ((pos == 0 ? flash_sched_create(STRESS_PATH, chunk, STRESS_CHUNK) :
+                        flash_sched_append(STRESS_PATH, chunk, STRESS_CHUNK)) != ESP_OK) {
+            s_write_errors++;
+        }
+    }
+    xSemaphoreGive(s_writer_done);
+    vTaskDelete(NULL);
+}
+
+static void write_mic_noise(void)
+{
+    FILE *f = fopen(MIC_PATH, "wb");
+    uint32_t rng = 7;
+    for (int i = 0; i < AUDIO_HOST_SAMPLE_RATE; i++) {
+        rng = rng * 1103515245u + 12345u;
+        int32_t word = ((int32_t)((rng >> 24) % 61) - 30) * 65536;
+        fwrite(&word, sizeof(word), 1, f);
+    }
+    fclose(f);
+}
+
+static long file_size(const char *path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 ? (long)st.st_size : 0;
+}
+
+static void test_stress(void)
+{
+    remove(STRESS_PATH);
+    CHECK(flash_sched_init() == ESP_OK);
+    s_writer_done = xSemaphoreCreateBinary();
+
+    CHECK(audio_loopback_start(0, 0) == ESP_OK);
+    vTaskDelay(pdMS_TO_TICKS(300));
+    CHECK(xTaskCreatePinnedToCore(writer_task, "stress", 4096, NULL, 1, NULL, 0) == pdPASS);
+
+    // measure while the writer is blocked on the full spill and slices trickle out
+    audio_loopback_result_t res;
+    CHECK(audio_loopback_measure(&res) == ESP_OK);
+    printf("during writes: latency %.1f ms, SNR %.1f dB, %u of %u frames glitched\n",
+           res.latency_us / 1000.0, (double)res.snr_db, (unsigned)res.glitches, (unsigned)res.frames);
+    CHECK(res.peak > 0.95f);
+    CHECK(res.snr_db > 25.0f);
+    CHECK(res.glitches == 0);
+
+    CHECK(xSemaphoreTake(s_writer_done, pdMS_TO_TICKS(10000)) == pdTRUE);
+    long in_call = file_size(STRESS_PATH);
+    flash_sched_stats_t st;
+    flash_sched_get_stats(&st);
+    printf("in call: %ld of %d bytes on disk in %u slices, peak spill %u\n",
+           in_call, STRESS_BYTES, (unsigned)st.slices, (unsigned)st.peak_pending);
+    CHECK(st.slices > 0);
+    CHECK(in_call <= (long)(st.slices + 1) * FLASH_SCHED_SLICE_BYTES);     // one may be in flight
+    CHECK(st.peak_pending <= FLASH_SCHED_MAX_PENDING);
+    CHECK(st.deferred_bytes == STRESS_BYTES);
+    CHECK(s_write_errors == 0);
+
+    audio_loopback_stop();
+    CHECK(flash_sched_flush(pdMS_TO_TICKS(5000)) == ESP_OK);
+    flash_sched_get_stats(&st);
+    CHECK(st.pending_bytes == 0);
+    CHECK(st.errors == 0);
+    CHECK(file_size(STRESS_PATH) == STRESS_BYTES);
+
+    FILE *f = fopen(STRESS_PATH, "rb");
+    CHECK(f != NULL);
+    if (f != NULL) {
+        size_t bad = 0;
+        for (size_t pos = 0; pos < STRESS_BYTES; pos++) {
+            int c = fgetc(f);
+            bad += (c != pattern(pos));
+        }
+        fclose(f);
+        CHECK(bad == 0);
+    }
+    remove(STRESS_PATH);
+}
+
+int main(void)
+{
+    write_mic_noise();
+    audio_host_set_files(MIC_PATH, SPK_PATH);
+    test_stress();
+    return CHECK_RESULT();
+}
@@ -0,0 +1,96 @@
+/*
+ * test_loopback.c - the audio loopback measurement against the file-backed audio stand-ins
+ *
+ * The mic plays a file of low-level noise, the SCO link is simulated by
+ * audio_loopback.c itself, and the speaker output goes to a file. The
+ * latency the measurement finds must be what the stand-ins' buffering adds
+ * up to, within host scheduling jitter.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include "audio_loopback.h"
+#include "audio_host.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "test_check.h"
+
+#define MIC_PATH            "loopback_mic.raw"
+#define SPK_PATH            "loopback_spk.raw"
+#define FRAME_MS            (AUDIO_HOST_FRAME_US / 1000.0)
+#define JITTER_MS           20.0    // host threads are not scheduled like the audio core
+
+static void write_mic_noise(void)
+{
+    FILE *f = fopen(MIC_PATH, "wb");
+    uint32_t rng = 1;
+    for (int i = 0; i < AUDIO_HOST_SAMPLE_RATE; i++) {
+        rng = rng * 1103515245u + 12345u;
+        int32_t word = ((int32_t)((rng >> 24) % 61) - 30) * 65536;  // +-30, about -60 dBFS
+        fwrite(&word, sizeof(word), 1, f);
+    }
+    fclose(f);
+}
+
+// Run the loop and measure it `runs` times; res holds the worst SNR and all the glitches
+static void measure(uint32_t delay_ms, uint32_t loss_pct, int runs, audio_loopback_result_t *res)
+{
+    audio_loopback_result_t r;
+    CHECK(audio_loopback_start(delay_ms, loss_pct) == ESP_OK);
+    vTaskDelay(pdMS_TO_TICKS(300));     // let both rings prefetch
+    for (int i = 0; i < runs; i++) {
+        CHECK(audio_loopback_measure(&r) == ESP_OK);
+        printf("delay %u ms, loss %u%%: latency %.1f ms, SNR %.1f dB, peak %.3f, %u of %u frames glitched\n",
+               (unsigned)delay_ms, (unsigned)loss_pct, r.latency_us / 1000.0, (double)r.snr_db,
+               (double)r.peak, (unsigned)r.glitches, (unsigned)r.frames);
+        if (i == 0) {
+            *res = r;
+        } else {
+            res->glitches += r.glitches;
+            res->snr_db = r.snr_db < res->snr_db ? r.snr_db : res->snr_db;
+        }
+    }
+    audio_loopback_status_t st;
+    audio_loopback_get_status(&st);
+    CHECK(st.running && st.frames > 0);
+    audio_loopback_stop();
+    CHECK(!audio_loopback_running());
+}
+
+// A clean link: the chirp comes through whole, delayed by the link and both rings
+static void test_clean(uint32_t delay_ms)
+{
+    audio_loopback_result_t res;
+    measure(delay_ms, 0, 1, &res);
+    double expect_ms = delay_ms + (AUDIO_HOST_MIC_PREFETCH + AUDIO_HOST_SPK_PREFETCH) * FRAME_MS;
+    CHECK(res.latency_us / 1000.0 > expect_ms - JITTER_MS);
+    CHECK(res.latency_us / 1000.0 < expect_ms + JITTER_MS);
+    CHECK(res.peak > 0.95f);
+    CHECK(res.snr_db > 25.0f);     // mu-law is about 38 dB on a -12 dBFS chirp
+    CHECK(res.glitches == 0);
+
+    struct stat st;
+    CHECK(stat(SPK_PATH, &st) == 0 && st.st_size > 0);
+}
+
+// A fifth of the packets lost. A lost frame is never written, as on the device, so the
+// speaker ring comes up short and the rest of the chirp plays late: that shows in the SNR
+// rather than as single glitched frames. The chirp spans 13 frames, so three measurements
+// all missing every loss is a 1 in 5000 chance.
+static void test_loss(void)
+{
+    audio_loopback_result_t res;
+    measure(30, 20, 3, &res);
+    CHECK(res.snr_db < 20.0f);
+}
+
+int main(void)
+{
+    write_mic_noise();
+    audio_host_set_files(MIC_PATH, SPK_PATH);
+    test_clean(0);
+    test_clean(90);
+    test_loss();
+    return CHECK_RESULT();
+}
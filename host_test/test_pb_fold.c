@@ -0,0 +1,38 @@
+/*
+ * test_pb_fold.c - search keys: case, accents, ligatures, scripts, truncation
+ */
+
+#include <string.h>
+#include "pb_fold.h"
+#include "test_check.h"
+
+static int folds_to(const char *name, size_t out_size, const char *want)
+{
+    char key[PB_FOLD_MAX];
+    size_t len = pb_fold(name, key, out_size);
+    if (strcmp(key, want) != 0 || len != strlen(want)) {
+        printf("  \"%s\" folded to \"%s\", want \"%s\"\n", name, key, want);
+        return 0;
+    }
+    return 1;
+}
+
+int main(void)
+{
+    CHECK(folds_to("Anna LEE", PB_FOLD_MAX, "anna lee"));
+    CHECK(folds_to("  \xc3\x89mile Zola", PB_FOLD_MAX, "emile zola"));                 // leading spaces, É
+    CHECK(folds_to("E\xcc\x81mile", PB_FOLD_MAX, "emile"));                             // decomposed accent
+    CHECK(folds_to("\xc3\x98ystein Stra\xc3\x9f" "e", PB_FOLD_MAX, "oystein strasse"));  // Ø, ß
+    CHECK(folds_to("\xc5\x81ukasz \xc5\x92uvre", PB_FOLD_MAX, "lukasz oeuvre"));        // Ł, Œ
+    CHECK(folds_to("\xc3\x86sa", PB_FOLD_MAX, "aesa"));                                 // Æ
+    CHECK(folds_to("\xce\x86\xce\xbd\xce\xbd\xce\xb1", PB_FOLD_MAX,
+                   "\xce\xb1\xce\xbd\xce\xbd\xce\xb1"));                                // Greek, tonos dropped
+    CHECK(folds_to("\xd0\x98\xd0\xb2\xd0\xb0\xd0\xbd", PB_FOLD_MAX,
+                   "\xd0\xb8\xd0\xb2\xd0\xb0\xd0\xbd"));                                // Cyrillic
+    CHECK(folds_to("\xe4\xb8\xad\xe6\x96\x87", PB_FOLD_MAX, "\xe4\xb8\xad\xe6\x96\x87"));  // kept as is
+    /* a full key is cut between characters, never inside one */
+    CHECK(folds_to("\xc3\x89\xc3\x89\xc3\x89", 3, "ee"));
+    CHECK(folds_to("\xe4\xb8\xad\xe6\x96\x87", 5, "\xe4\xb8\xad"));
+    CHECK(folds_to("", PB_FOLD_MAX, ""));
+    return CHECK_RESULT();
+}
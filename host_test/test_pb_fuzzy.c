@@ -0,0 +1,95 @@
+/*
+ * test_pb_fuzzy.c - typo-tolerant name search through the trigram index
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "phonebook.h"
+#include "test_check.h"
+
+static esp_bd_addr_t s_addr = { 2, 0, 0, 0, 0, 0x50 };
+static phonebook_match_t s_match[16];
+
+static const char *s_first[] = {
+    "Anna", "Bram", "Carla", "Daan", "Eva", "Finn", "Gijs", "Hanna", "Ilse", "Jesse", "Kees", "Lotte", "Milan",
+    "Noor", "Olaf", "Puck", "Quinten", "Roos", "Sem", "Tess", "Ugo", "Vera", "Wout", "Xander", "Yara", "Zoe",
+};
+
+static void add(phonebook_t *pb, const char *name, const char *number)
+{
+    char b[256];
+    int n = snprintf(b, sizeof(b), "BEGIN:VCARD\r\nFN:%s\r\nTEL;TYPE=CELL:%s\r\nEND:VCARD\r\n", name, number);
+    phonebook_process_chunk(pb, b, (uint16_t)n);
+}
+
+static int search(phonebook_t *pb, const char *text)
+{
+    return phonebook_fuzzy_search(pb, text, s_match, 16, 0);
+}
+
+static void test_small(void)
+{
+    phonebook_delete(s_addr);
+    phonebook_t *pb = phonebook_get_or_create(s_addr);
+    phonebook_begin_sync(pb);
+    add(pb, "Jon Smith", "0611");
+    add(pb, "Joanna Smit", "0622");
+    add(pb, "Anna Lee", "0633");
+    add(pb, "\xc3\x89mile Zola", "0644");
+    add(pb, "Johan de Vries", "0655");
+    add(pb, "Bob", "0666");
+    CHECK(phonebook_finalize_sync(pb) == ESP_OK);
+    CHECK(phonebook_indexes_current(pb));
+
+    CHECK(search(pb, "jonh smith") >= 1);                       // transposition
+    CHECK(strcmp(s_match[0].contact.full_name, "Jon Smith") == 0 && s_match[0].distance == 1);
+    CHECK(search(pb, "emlie") == 1);                            // folded, transposed
+    CHECK(strcmp(s_match[0].contact.full_name, "\xc3\x89mile Zola") == 0);
+    CHECK(search(pb, "vreis") == 1);                            // part of the name
+    CHECK(strcmp(s_match[0].contact.full_name, "Johan de Vries") == 0);
+    CHECK(search(pb, "smit") == 2);                             // both exact, the shorter name first
+    CHECK(strcmp(s_match[0].contact.full_name, "Jon Smith") == 0 && s_match[1].distance == 0);
+    CHECK(search(pb, "bob") == 1);
+    CHECK(search(pb, "zzzzzz") == 0);
+    CHECK(search(pb, "b") == 0);                                // too short to search
+    phonebook_delete(s_addr);
+}
+
+// One typo in a name of a large book still finds it first
+static void test_large(uint32_t n)
+{
+    phonebook_t *pb = phonebook_get_or_create(s_addr);
+    char name[64], typo[64], number[24];
+
+    phonebook_begin_sync(pb);
+    for (uint32_t i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "%s %05u", s_first[i % 26], (unsigned)i);
+        snprintf(number, sizeof(number), "06%08u", (unsigned)i);
+        add(pb, name, number);
+    }
+    CHECK(phonebook_finalize_sync(pb) == ESP_OK);
+
+    int first = 0;
+    for (uint32_t k = 0; k < 100; k++) {
+        uint32_t i = (k * 2654435761u) % n;
+        snprintf(name, sizeof(name), "%s %05u", s_first[i % 26], (unsigned)i);
+        strcpy(typo, name);
+        typo[1] = typo[1] == 'x' ? 'y' : 'x';
+        if (search(pb, typo) > 0 && strcmp(s_match[0].contact.full_name, name) == 0) {
+            first++;
+        }
+    }
+    CHECK(first == 100);
+
+    /* a budget too small to verify anything still returns cleanly */
+    CHECK(phonebook_fuzzy_search(pb, "lotte 0", s_match, 10, 1) <= 10);
+    phonebook_delete(s_addr);
+}
+
+int main(void)
+{
+    phonebook_init();
+    test_small();
+    test_large(5000);
+    return CHECK_RESULT();
+}
@@ -0,0 +1,343 @@
+/*
+ * test_pb_index.c - number and name indexes, directly and through a synced phonebook
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "phonebook.h"
+#include "pb_index.h"
+#include "pb_book.h"
+#include "pb_fold.h"
+#include "test_check.h"
+
+#define NUMBER_PATH     PB_SORT_DIR "/test.pbn"
+#define NAME_PATH       PB_SORT_DIR "/test.pbi"
+#define BOOK_SIZE       123456u
+
+static const char *s_first[] = {
+    "anna", "Bram", "Carla", "daan", "Eva", "Finn", "Gijs", "Hanna", "Ilse", "Jesse",
+    "Kees", "Lotte", "Milan", "Noor", "Olaf", "Puck", "Quinten", "Roos", "Sem", "Tess",
+    "Ugo", "Vera", "Wout", "Xander", "Yara", "Zoe", "+Ext", "123 Pizza", "\xc3\x89mile",
+};
+#define FIRST_NAMES (sizeof(s_first) / sizeof(s_first[0]))
+
+static void number_of(uint32_t i, char *out)
+{
+    sprintf(out, "+31612%06u", (unsigned)((i * 2654435761u) % 1000000));
+}
+
+static void test_number_index(uint32_t n)
+{
+    pb_number_builder_t b;
+    pb_number_index_t idx = {0};
+    char num[24];
+
+    CHECK(pb_number_index_begin(&b) == ESP_OK);
+    for (uint32_t i = 0; i < n; i++) {
+        number_of(i, num);
+        CHECK(pb_number_index_add(&b, num, i * 10) == ESP_OK);
+    }
+    CHECK(pb_number_index_finish(&b, NUMBER_PATH, BOOK_SIZE) == ESP_OK);
+    CHECK(pb_number_index_load(&idx, NUMBER_PATH, BOOK_SIZE + 1) == ESP_ERR_INVALID_STATE);
+    CHECK(pb_number_index_load(&idx, NUMBER_PATH, BOOK_SIZE) == ESP_OK);
+    CHECK(idx.entries == n);
+
+    uint32_t missing = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t offsets[8];
+        number_of(i, num);
+        int found = pb_number_index_find(&idx, NUMBER_PATH, pb_number_hash(num), offsets, 8);
+        bool hit = false;
+        for (int k = 0; k < found; k++) {
+            hit |= offsets[k] == i * 10;
+        }
+        missing += !hit;
+    }
+    CHECK(missing == 0);
+    uint32_t offsets[8];
+    CHECK(pb_number_index_find(&idx, NUMBER_PATH, pb_number_hash("+441234999999"), offsets, 8) == 0);
+    pb_number_index_unload(&idx);
+}
+
+// A header whose counts do not fit the file is rejected before anything is allocated from it
+static void test_number_index_damaged(void)
+{
+    pb_number_index_t idx = {0};
+    pb_index_header_t hdr;
+    test_number_index(300);
+
+    FILE *f = fopen(NUMBER_PATH, "r+b");
+    CHECK(f != NULL && fread(&hdr, sizeof(hdr), 1, f) == 1);
+    pb_index_header_t bad = hdr;
+    bad.blocks = 0x40000000;
+    fseek(f, 0, SEEK_SET);
+    fwrite(&bad, sizeof(bad), 1, f);
+    fclose(f);
+    CHECK(pb_number_index_load(&idx, NUMBER_PATH, BOOK_SIZE) == ESP_ERR_INVALID_STATE);
+
+    bad = hdr;
+    bad.entries += 1000;
+    bad.blocks = (bad.entries + PB_NUMBER_BLOCK_ENTRIES - 1) / PB_NUMBER_BLOCK_ENTRIES;
+    f = fopen(NUMBER_PATH, "r+b");
+    fwrite(&bad, sizeof(bad), 1, f);
+    fclose(f);
+    CHECK(pb_number_index_load(&idx, NUMBER_PATH, BOOK_SIZE) == ESP_ERR_INVALID_STATE);
+    CHECK(!idx.loaded);
+}
+
+// Keys longer than an entry's key field are cut, shorter ones zero padded
+static void test_name_keys(void)
+{
+    pb_name_builder_t b;
+    pb_name_index_t idx = {0};
+    char long_key[PB_NAME_KEY_LEN * 2];
+    memset(long_key, 'z', sizeof(long_key) - 1);
+    long_key[sizeof(long_key) - 1] = '\0';
+
+    CHECK(pb_name_index_begin(&b) == ESP_OK);
+    CHECK(pb_name_index_add(&b, long_key, 1) == ESP_OK);
+    CHECK(pb_name_index_add(&b, "al", 2) == ESP_OK);
+    CHECK(pb_name_index_finish(&b, NAME_PATH, BOOK_SIZE) == ESP_OK);
+    CHECK(pb_name_index_load(&idx, NAME_PATH, BOOK_SIZE) == ESP_OK);
+
+    FILE *f = fopen(NAME_PATH, "rb");
+    pb_index_header_t hdr;
+    pb_name_entry_t e[2];
+    CHECK(f != NULL && fread(&hdr, sizeof(hdr), 1, f) == 1);
+    fseek(f, -(long)sizeof(e), SEEK_END);
+    CHECK(fread(e, sizeof(e[0]), 2, f) == 2);
+    fclose(f);
+    CHECK(e[0].offset == 2 && memcmp(e[0].key, "al", 2) == 0);
+    for (int i = 2; i < PB_NAME_KEY_LEN; i++) {
+        CHECK(e[0].key[i] == '\0');
+    }
+    CHECK(e[1].offset == 1 && memcmp(e[1].key, long_key, PB_NAME_KEY_LEN) == 0);
+    pb_name_index_unload(&idx);
+}
+
+static void test_name_index(uint32_t n)
+{
+    pb_name_builder_t b;
+    pb_name_index_t idx = {0};
+    char name[64], key[PB_FOLD_MAX];
+
+    CHECK(pb_name_index_begin(&b) == ESP_OK);
+    for (uint32_t i = 0; i < n; i++) {
+        sprintf(name, "%s %05u", s_first[(i * 7) % FIRST_NAMES], (unsigned)((n - i) * 13 % n));
+        pb_fold(name, key, sizeof(key));
+        CHECK(pb_name_index_add(&b, key, i) == ESP_OK);
+    }
+    CHECK(pb_name_index_finish(&b, NAME_PATH, BOOK_SIZE) == ESP_OK);
+    CHECK(pb_name_index_load(&idx, NAME_PATH, BOOK_SIZE) == ESP_OK);
+    CHECK(idx.entries == n);
+    CHECK(idx.jump[0] == 0 && idx.jump[PB_NAME_BUCKETS] == n);
+
+    uint32_t *offsets = malloc(n * sizeof(uint32_t));
+    uint8_t *seen = calloc(n, 1);
+    CHECK(pb_name_index_read(&idx, NAME_PATH, 0, n, offsets) == n);
+    for (int bucket = 0; bucket < PB_NAME_BUCKETS; bucket++) {
+        CHECK(idx.jump[bucket] <= idx.jump[bucket + 1]);
+        for (uint32_t e = idx.jump[bucket]; e < idx.jump[bucket + 1]; e++) {
+            uint32_t i = offsets[e];
+            sprintf(name, "%s %05u", s_first[(i * 7) % FIRST_NAMES], (unsigned)((n - i) * 13 % n));
+            pb_fold(name, key, sizeof(key));
+            CHECK(pb_name_bucket(key[0]) == bucket);
+            seen[i]++;
+        }
+    }
+    uint32_t once = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        once += seen[i] == 1;
+    }
+    CHECK(once == n);
+    free(offsets);
+    free(seen);
+    pb_name_index_unload(&idx);
+}
+
+typedef struct {
+    char letter;
+    int bad;
+    char prev[PB_FOLD_MAX];
+} letter_check_t;
+
+static bool check_letter(const contact_t *c, void *ctx)
+{
+    letter_check_t *k = ctx;
+    char key[PB_FOLD_MAX];
+    pb_fold(c->full_name, key, sizeof(key));
+    int up = toupper((unsigned char)key[0]);
+    if (k->letter == '#' ? (up >= 'A' && up <= 'Z') : up != k->letter) {
+        k->bad++;
+    }
+    if (strcmp(k->prev, key) > 0) {
+        k->bad++;
+    }
+    strcpy(k->prev, key);
+    return true;
+}
+
+// A synced book answers number lookups and letter queries from its indexes
+static void test_phonebook(uint32_t n)
+{
+    esp_bd_addr_t addr = { 2, 0, 0, 0, 0, 0x41 };
+    char buf[4096], num[24];
+    int len = 0;
+
+    phonebook_delete(addr);
+    phonebook_t *pb = phonebook_get_or_create(addr);
+    CHECK(phonebook_begin_sync(pb) == ESP_OK);
+    for (uint32_t i = 0; i < n; i++) {
+        number_of(i, num);
+        len += sprintf(buf + len, "BEGIN:VCARD\r\nVERSION:2.1\r\nFN:%s %05u\r\nTEL;TYPE=CELL:%s\r\nEND:VCARD\r\n",
+                       s_first[(i * 7) % FIRST_NAMES], (unsigned)i, num);
+        if (len > 1500 || i == n - 1) {
+            phonebook_process_chunk(pb, buf, (uint16_t)len);
+            len = 0;
+        }
+    }
+    CHECK(phonebook_finalize_sync(pb) == ESP_OK);
+    CHECK(phonebook_get_count(pb) == n);
+    CHECK(phonebook_indexes_current(pb));
+
+    uint32_t wrong = 0;
+    for (uint32_t i = 0; i < n; i += 7) {
+        char want[64];
+        number_of(i, num);
+        sprintf(want, "%s %05u", s_first[(i * 7) % FIRST_NAMES], (unsigned)i);
+        contact_t *c = phonebook_search_by_number(pb, num);
+        wrong += c == NULL || strcmp(c->full_name, want) != 0;
+        free(c);
+    }
+    CHECK(wrong == 0);
+    CHECK(phonebook_search_by_number(pb, "+441234999999") == NULL);
+
+    uint32_t total = 0;
+    for (char l = 'A'; l <= 'Z' + 1; l++) {
+        letter_check_t k = { .letter = l > 'Z' ? '#' : l };
+        phonebook_query_t q = { .type = PHONEBOOK_QUERY_LETTER, .letter = k.letter };
+        total += phonebook_query(pb, &q, check_letter, &k);
+        CHECK(k.bad == 0);
+    }
+    CHECK(total == n);
+    phonebook_delete(addr);
+}
+
+static int vcard_of(uint32_t i, char *out)
+{
+    char num[24];
+    number_of(i, num);
+    return sprintf(out, "BEGIN:VCARD\r\nVERSION:2.1\r\nFN:%s %05u\r\nTEL;TYPE=CELL:%s\r\nEND:VCARD\r\n",
+                   s_first[(i * 7) % FIRST_NAMES], (unsigned)i, num);
+}
+
+// A page cut off partway is sent again from its start; what came in twice is stored once
+static void test_page_retry(void)
+{
+    esp_bd_addr_t addr = { 2, 0, 0, 0, 0, 0x42 };
+    const uint32_t page = 50, n = 200;
+    char buf[8192], one[128], num[24];
+
+    phonebook_delete(addr);
+    phonebook_t *pb = phonebook_get_or_create(addr);
+    CHECK(phonebook_begin_sync(pb) == ESP_OK);
+    for (uint32_t start = 0; start < n; start += page) {
+        int len = 0;
+        for (uint32_t i = start; i < start + page; i++) {
+            len += vcard_of(i, buf + len);
+        }
+        if (start == page) {
+            // the first try breaks off inside the 31st vCard
+            int cut = 0;
+            for (uint32_t i = start; i < start + 30; i++) {
+                cut += vcard_of(i, one);
+            }
+            phonebook_process_chunk(pb, buf, (uint16_t)(cut + 40));
+            phonebook_resume_at(pb, (uint16_t)start);
+        }
+        for (int off = 0; off < len; off += 1500) {
+            phonebook_process_chunk(pb, buf + off, (uint16_t)(len - off < 1500 ? len - off : 1500));
+        }
+    }
+    CHECK(phonebook_finalize_sync(pb) == ESP_OK);
+    CHECK(phonebook_get_count(pb) == n);
+
+    uint32_t wrong = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        char want[64];
+        number_of(i, num);
+        sprintf(want, "%s %05u", s_first[(i * 7) % FIRST_NAMES], (unsigned)i);
+        contact_t *c = phonebook_search_by_number(pb, num);
+        wrong += c == NULL || strcmp(c->full_name, want) != 0;
+        free(c);
+    }
+    CHECK(wrong == 0);
+
+    // the next sync counts into its shadow book; the live count holds until the swap
+    CHECK(phonebook_begin_sync(pb) == ESP_OK);
+    int len = vcard_of(n, buf);
+    phonebook_process_chunk(pb, buf, (uint16_t)len);
+    CHECK(phonebook_get_count(pb) == n);
+    phonebook_abort_sync(pb);
+    CHECK(phonebook_get_count(pb) == n);
+    phonebook_delete(addr);
+}
+
+// A version 1 book is converted into the other slot; the old file only goes once the new one is complete
+static void test_migrate(void)
+{
+    esp_bd_addr_t addr = { 2, 0, 0, 0, 0, 0x43 };
+    const uint16_t n = 40;
+    char path[64], slot_path[64], num[24];
+
+    phonebook_delete(addr);
+    phonebook_file_path(addr, ".pb", path, sizeof(path));
+    phonebook_file_path(addr, ".pb1", slot_path, sizeof(slot_path));
+    FILE *f = fopen(path, "wb");
+    CHECK(f != NULL);
+    fwrite(&n, sizeof(n), 1, f);
+    for (uint16_t i = 0; i < n; i++) {
+        contact_t c = { .phone_count = 1, .active = true };
+        sprintf(c.full_name, "%s %05u", s_first[i % FIRST_NAMES], (unsigned)i);
+        number_of(i, c.phones[0].number);
+        strcpy(c.phones[0].type, "CELL");
+        fwrite(&c, sizeof(c), 1, f);
+    }
+    fclose(f);
+
+    // a conversion cut short before its generation was stamped is done again
+    f = fopen(slot_path, "wb");
+    pb_book_header_t partial = { .magic = PB_BOOK_MAGIC, .version = PB_BOOK_VERSION, .contact_count = 3 };
+    fwrite(&partial, sizeof(partial), 1, f);
+    fclose(f);
+
+    CHECK(pb_book_migrate(path, slot_path) == ESP_OK);
+    pb_book_header_t hdr;
+    CHECK(pb_book_read_header(slot_path, &hdr) == ESP_OK);
+    CHECK(hdr.generation == 1 && hdr.contact_count == n);
+    CHECK(fopen(path, "rb") == NULL);
+
+    phonebook_t *pb = phonebook_get_or_create(addr);
+    CHECK(phonebook_get_count(pb) == n);
+    number_of(17, num);
+    contact_t *c = phonebook_search_by_number(pb, num);
+    CHECK(c != NULL && strncmp(c->full_name, s_first[17 % FIRST_NAMES], strlen(s_first[17 % FIRST_NAMES])) == 0);
+    free(c);
+    phonebook_delete(addr);
+}
+
+int main(void)
+{
+    phonebook_init();
+    test_number_index(1);
+    test_number_index(5000);
+    test_number_index_damaged();
+    test_name_keys();
+    test_name_index(1);
+    test_name_index(5000);
+    test_phonebook(2000);
+    test_page_retry();
+    test_migrate();
+    return CHECK_RESULT();
+}
@@ -0,0 +1,115 @@
+/*
+ * test_pb_sort.c - external merge sort: in RAM, spilled to runs, stopped early
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <string.h>
+#include "pb_sort.h"
+#include "test_check.h"
+
+typedef struct {
+    uint32_t key;
+    uint32_t seq;           // insertion order, to check every record comes out once
+} rec_t;
+
+typedef struct {
+    uint32_t n;
+    uint32_t stop_after;
+    rec_t last;
+    uint32_t out_of_order;
+    uint8_t *seen;
+} sink_t;
+
+static int cmp_rec(const void *a, const void *b)
+{
+    const rec_t *x = a, *y = b;
+    if (x->key != y->key) {
+        return x->key < y->key ? -1 : 1;
+    }
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+static esp_err_t emit(const void *r, void *ctx)
+{
+    sink_t *s = ctx;
+    const rec_t *rec = r;
+    if (s->n > 0 && cmp_rec(&s->last, rec) > 0) {
+        s->out_of_order++;
+    }
+    s->seen[rec->seq]++;
+    s->last = *rec;
+    if (++s->n == s->stop_after) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    return ESP_OK;
+}
+
+// Run files left in the sort directory
+static int run_files(void)
+{
+    DIR *d = opendir(PB_SORT_DIR);
+    struct dirent *de;
+    int n = 0;
+    while (d != NULL && (de = readdir(d)) != NULL) {
+        n += strstr(de->d_name, ".srt") != NULL;
+    }
+    if (d != NULL) {
+        closedir(d);
+    }
+    return n;
+}
+
+static void test_sort(uint32_t count, uint32_t stop_after)
+{
+    pb_sort_t s;
+    sink_t sink = { .stop_after = stop_after, .seen = calloc(count, 1) };
+    uint32_t rng = count;
+
+    CHECK(pb_sort_begin(&s, "t", sizeof(rec_t), cmp_rec) == ESP_OK);
+    for (uint32_t i = 0; i < count; i++) {
+        rng = rng * 1103515245u + 12345u;
+        rec_t r = { .key = (rng >> 8) % (count / 4 + 1), .seq = i };
+        CHECK(pb_sort_add(&s, &r) == ESP_OK);
+    }
+    esp_err_t err = pb_sort_finish(&s, emit, &sink);
+    if (stop_after) {
+        CHECK(err == ESP_ERR_INVALID_STATE);
+        CHECK(sink.n == stop_after);
+    } else {
+        CHECK(err == ESP_OK);
+        CHECK(sink.n == count);
+        for (uint32_t i = 0; i < count; i++) {
+            CHECK(sink.seen[i] == 1);
+        }
+    }
+    CHECK(sink.out_of_order == 0);
+    CHECK(run_files() == 0);
+    free(sink.seen);
+}
+
+static void test_abort(void)
+{
+    pb_sort_t s;
+    CHECK(pb_sort_begin(&s, "t", sizeof(rec_t), cmp_rec) == ESP_OK);
+    for (uint32_t i = 0; i < 5000; i++) {
+        rec_t r = { .key = 5000 - i, .seq = i };
+        pb_sort_add(&s, &r);
+    }
+    CHECK(run_files() > 0);
+    pb_sort_abort(&s);
+    CHECK(run_files() == 0);
+}
+
+int main(void)
+{
+    uint32_t in_ram = PB_SORT_RAM / sizeof(rec_t);
+    test_sort(0, 0);
+    test_sort(in_ram, 0);                               // fits, never touches flash
+    test_sort(in_ram * PB_SORT_MAX_WAYS, 0);            // one merge pass
+    test_sort(in_ram * 20 + 17, 0);                     // several passes
+    test_sort(in_ram * 10, in_ram * 3);                 // emit stops it
+    test_abort();
+    return CHECK_RESULT();
+}
@@ -0,0 +1,120 @@
+/*
+ * test_pb_vcard.c - streaming vCard parser, fed in pieces of every size
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "pb_vcard.h"
+#include "test_check.h"
+
+#define MAX_CARDS   8
+
+static contact_t s_cards[MAX_CARDS];
+static int s_count;
+
+static void on_card(contact_t *c, void *ctx)
+{
+    (void)ctx;
+    if (s_count < MAX_CARDS) {
+        s_cards[s_count] = *c;
+    }
+    s_count++;
+}
+
+static void parse(const char *s, size_t len, size_t step)
+{
+    pb_vcard_t p;
+    pb_vcard_init(&p, on_card, NULL);
+    s_count = 0;
+    for (size_t i = 0; i < len; i += step) {
+        pb_vcard_feed(&p, s + i, len - i < step ? len - i : step);
+    }
+    pb_vcard_finish(&p);
+}
+
+static const char s_stream[] =
+    "BEGIN:VCARD\r\nVERSION:2.1\r\nN;CHARSET=UTF-8;ENCODING=QUOTED-PRINTABLE:M=C3=BCller;J=C3=BCrgen;;;\r\n"
+    "TEL;CELL;VOICE:+31 (0)6-1234 5678\r\nTEL;WORK:020 555\r\n 0100\r\n"
+    "PHOTO;ENCODING=BASE64;TYPE=JPEG:/9j/4AAQSkZJRgABAQ\r\n AAAQABAAD/2wBDAAMCAgMCAgMDAwMEAwMEBQgFBQQE\r\n\r\n"
+    "END:VCARD\r\n"
+    "BEGIN:VCARD\r\nVERSION:3.0\r\nFN:Smith\\, John\r\nN:Smith;John;;;\r\nitem1.TEL;TYPE=\"home,voice\":0611111111\r\nEND:VCARD\r\n"
+    "BEGIN:VCARD\r\nVERSION:2.1\r\nFN;CHARSET=ISO-8859-1;ENCODING=QUOTED-PRINTABLE:=C9mile Z=\r\nola\r\nTEL:0622222222\r\n"
+    "AGENT:\r\nBEGIN:VCARD\r\nFN:Agent\r\nTEL:999\r\nEND:VCARD\r\nEND:VCARD\r\n"
+    "BEGIN:VCARD\nFN:Unix Lines\nTEL:0633\nEND:VCARD";
+
+static void test_stream(void)
+{
+    static const size_t steps[] = { 1, 2, 3, 7, 64, sizeof(s_stream) };
+    for (size_t s = 0; s < sizeof(steps) / sizeof(steps[0]); s++) {
+        parse(s_stream, strlen(s_stream), steps[s]);
+        CHECK(s_count == 4);
+        CHECK(strcmp(s_cards[0].full_name, "J\xc3\xbcrgen M\xc3\xbcller") == 0);
+        CHECK(s_cards[0].phone_count == 2);
+        CHECK(strcmp(s_cards[0].phones[0].number, "+310612345678") == 0);
+        CHECK(strcmp(s_cards[0].phones[0].type, "CELL,VOICE") == 0);
+        CHECK(strcmp(s_cards[0].phones[1].number, "0205550100") == 0);
+        CHECK(strcmp(s_cards[0].phones[1].type, "WORK") == 0);
+        CHECK(strcmp(s_cards[1].full_name, "Smith, John") == 0);
+        CHECK(strcmp(s_cards[1].phones[0].type, "home,voice") == 0);
+        CHECK(strcmp(s_cards[2].full_name, "\xc3\x89mile Zola") == 0);
+        CHECK(s_cards[2].phone_count == 1);
+        CHECK(strcmp(s_cards[3].full_name, "Unix Lines") == 0);
+    }
+}
+
+// A 70 KB photo streams past without growing the parser
+static void test_big_card(void)
+{
+    size_t photo = 70000;
+    char *b = malloc(photo * 2 + 128);
+    size_t len = (size_t)sprintf(b, "BEGIN:VCARD\r\nFN:Big\r\nPHOTO;ENCODING=b:");
+    for (size_t i = 0; i < photo; i++) {
+        if (i % 76 == 75) {
+            b[len++] = '\r';
+            b[len++] = '\n';
+            b[len++] = ' ';
+        } else {
+            b[len++] = 'A';
+        }
+    }
+    len += (size_t)sprintf(b + len, "\r\nTEL:0644\r\nEND:VCARD\r\n");
+    parse(b, len, 1000);
+    CHECK(s_count == 1);
+    CHECK(strcmp(s_cards[0].full_name, "Big") == 0);
+    CHECK(s_cards[0].phone_count == 1);
+    free(b);
+}
+
+// An unfinished vCard at the end of the stream is dropped
+static void test_truncated(void)
+{
+    const char *s = "BEGIN:VCARD\r\nFN:Whole\r\nEND:VCARD\r\nBEGIN:VCARD\r\nFN:Cut";
+    parse(s, strlen(s), 5);
+    CHECK(s_count == 1);
+    CHECK(strcmp(s_cards[0].full_name, "Whole") == 0);
+}
+
+// WINDOWS-1252 has its own characters in 0x80..0x9F; ISO-8859-1 does not
+static void test_charsets(void)
+{
+    const char *s =
+        "BEGIN:VCARD\r\nFN;CHARSET=WINDOWS-1252:\x8A" "koda \x80\x8C\x9F \xE9\r\nEND:VCARD\r\n"
+        "BEGIN:VCARD\r\nFN;CHARSET=WINDOWS-1252;ENCODING=QUOTED-PRINTABLE:=93Bob=94=85\r\nEND:VCARD\r\n"
+        "BEGIN:VCARD\r\nFN;CHARSET=ISO-8859-1:Jos\xE9 \x8A\r\nEND:VCARD\r\n"
+        "BEGIN:VCARD\r\nFN:Stra\xc3\x9f" "e\r\nEND:VCARD\r\n";
+    parse(s, strlen(s), 3);
+    CHECK(s_count == 4);
+    CHECK(strcmp(s_cards[0].full_name, "\xc5\xa0koda \xe2\x82\xac\xc5\x92\xc5\xb8 \xc3\xa9") == 0);  // Škoda €ŒŸ é
+    CHECK(strcmp(s_cards[1].full_name, "\xe2\x80\x9c" "Bob\xe2\x80\x9d\xe2\x80\xa6") == 0);       // “Bob”…
+    CHECK(strcmp(s_cards[2].full_name, "Jos\xc3\xa9 \xc2\x8a") == 0);                             // C1 control kept
+    CHECK(strcmp(s_cards[3].full_name, "Stra\xc3\x9f" "e") == 0);                                  // charset is per line
+}
+
+int main(void)
+{
+    test_stream();
+    test_big_card();
+    test_truncated();
+    test_charsets();
+    return CHECK_RESULT();
+}
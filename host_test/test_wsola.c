@@ -0,0 +1,86 @@
+/*
+ * test_wsola.c - WSOLA time-stretching on synthetic speech-band audio
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+#include "wsola.h"
+#include "test_check.h"
+
+#define FS                  16000
+#define CHUNK               WSOLA_HOP       // one mSBC frame per call, as on the device
+
+static uint32_t s_rng = 1;
+
+// Two drifting tones and a little noise: never periodic, so a wrong splice shows
+static int16_t next_sample(uint32_t n)
+{
+    double t = (double)n / FS;
+    s_rng = s_rng * 1103515245u + 12345u;
+    double v = 6000.0 * sin(2 * M_PI * (180.0 + 40.0 * sin(t * 0.7)) * t) +
+               3000.0 * sin(2 * M_PI * 1130.0 * t) + (double)((int)(s_rng >> 20) - 2048);
+    return (int16_t)v;
+}
+
+// At 100% the output is the input, sample for sample; it only lags by the WSOLA_SEARCH samples buffered
+static void test_unity(uint32_t seconds)
+{
+    static wsola_t w;
+    int16_t in[CHUNK], out[WSOLA_OUT_MAX];
+    int16_t *hist = malloc((size_t)FS * seconds * sizeof(int16_t));
+    uint32_t n_in = 0, n_out = 0, mismatch = 0;
+
+    wsola_init(&w);
+    s_rng = 1;
+    while (n_in + CHUNK <= (uint32_t)FS * seconds) {
+        for (int i = 0; i < CHUNK; i++) {
+            in[i] = hist[n_in + i] = next_sample(n_in + i);
+        }
+        n_in += CHUNK;
+        size_t n = wsola_process(&w, in, CHUNK, out, WSOLA_OUT_MAX);
+        for (size_t i = 0; i < n; i++, n_out++) {
+            if ((n_out >= n_in || out[i] != hist[n_out]) && mismatch++ == 0) {
+                printf("unity: first mismatch at output sample %u (%.3f s)\n", n_out, (double)n_out / FS);
+            }
+        }
+    }
+    CHECK(mismatch == 0);
+    CHECK(n_out + WSOLA_HOP + WSOLA_SEARCH >= n_in);
+    CHECK(w.overflows == 0);
+    free(hist);
+}
+
+// Off 100% the input is consumed at the set speed, so the buffer neither fills nor runs dry
+static void test_speed(uint16_t speed, uint32_t seconds)
+{
+    static wsola_t w;
+    int16_t in[CHUNK], out[WSOLA_OUT_MAX];
+    uint32_t n_in = 0, n_out = 0;
+
+    wsola_init(&w);
+    wsola_set_speed(&w, speed);
+    s_rng = 7;
+    while (n_in < (uint32_t)FS * seconds) {
+        for (int i = 0; i < CHUNK; i++) {
+            in[i] = next_sample(n_in + i);
+        }
+        n_in += CHUNK;
+        n_out += wsola_process(&w, in, CHUNK, out, WSOLA_OUT_MAX);
+    }
+    double expect = (double)n_in * 1000.0 / speed;
+    printf("speed %u: %u in, %u out (%.0f expected), splice quality %.3f\n",
+           speed, n_in, n_out, expect, wsola_quality(&w));
+    CHECK(fabs(n_out - expect) <= 2 * WSOLA_HOP + WSOLA_SEARCH);
+    CHECK(w.overflows == 0);
+    CHECK(w.stretched_steps == w.steps);
+    CHECK(wsola_quality(&w) > 0.5f);
+}
+
+int main(void)
+{
+    test_unity(15 * 60);                    // a step that is off by a fraction drifts into a splice within minutes
+    test_speed(WSOLA_SPEED_MIN, 60);
+    test_speed(WSOLA_SPEED_MAX, 60);
+    return CHECK_RESULT();
+}
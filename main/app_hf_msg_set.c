@@ -5,12 +5,37 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <math.h>
 #include "esp_hf_client_api.h"
 #include "app_hf_msg_set.h"
 #include "esp_console.h"
 #include "argtable3/argtable3.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_cpu.h"
+#include "sdkconfig.h"
+#include "bt_i2s.h"
+#include "bt_app_pbac.h"
+#include "i2s_cal.h"
+#include "bt_app_av.h"
+#include "wsola.h"
+#include "audio_loopback.h"
+#include "latency_trace.h"
+#include "cycle_prof.h"
+#include "metrics.h"
+#include "bt_app_hf.h"
+#include "phonebook.h"
+#include "pb_vcard.h"
+#include "esp_spiffs.h"
+#include "flash_sched.h"
+#include "app_task_config.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
 
 extern esp_bd_addr_t peer_addr;
 
@@ -31,6 +56,22 @@ typedef struct {
     struct arg_end *end;
 } bat_args_t;
 
+#define FLASH_STRESS_FILE       "/spiffs/fstress.tmp"
+#define FLASH_STRESS_CHUNK      4096
+#define FLASH_STRESS_SETTLE_MS  300     // loopback rings fill before the writes start
+#define FLASH_STRESS_SNR_DROP_DB 3.0f   // allowed SNR loss against the measurement before the writes
+#define STRETCH_BENCH_MS        2000    // synthetic speech per speed
+#define STRETCH_BENCH_PITCH_HZ  140
+#define STRETCH_BENCH_WINDOW    1024    // samples compared for the pitch check
+#define STATS_PKT_WAIT_MS       50      // for the controller's packet counts to come back
+#define STATS_SNAPSHOT_MAX      1024
+#define PB_BENCH_CONTACTS       5000
+#define PB_BENCH_LOOKUPS        100
+#define PB_BENCH_SCANS          5       // full scans take long; a few give the average
+#define PB_BENCH_CHUNK          1024    // vCard bytes per chunk, about one PBAP response packet
+#define PB_BENCH_FLASH_PER_CONTACT 192  // book, indexes and sort runs, with margin
+#define PB_LIST_PAGE_SIZE       10
+
 static vu_args_t vu_args;
 static rh_args_t rh_args;
 static bat_args_t bat_args;
@@ -261,6 +302,830 @@ HF_CMD_HANDLER(iphoneaccev)
     return 0;
 }
 
+/* write to SPIFFS while audio streams, and report what it did to the audio path */
+typedef struct {
+    int kb;
+    bool direct;                        // bypass the flash scheduler
+    int written_kb;
+    int64_t max_stall_us;
+    SemaphoreHandle_t done;
+} flash_stress_t;
+
+static void flash_stress_task(void *arg)
+{
+    flash_stress_t *fs = (flash_stress_t *)arg;
+    uint8_t *chunk = malloc(FLASH_STRESS_CHUNK);
+    FILE *f = NULL;
+
+    if (chunk != NULL && fs->direct) {
+        f = fopen(FLASH_STRESS_FILE, "wb");
+    }
+    if (chunk != NULL && (f != NULL || !fs->direct)) {
+        for (int i = 0; i < FLASH_STRESS_CHUNK; i++) {
+            chunk[i] = (uint8_t)(i * 7);
+        }
+        while (fs->written_kb < fs->kb) {
+            int64_t t0 = esp_timer_get_time();
+            bool ok;
+            if (fs->direct) {
+                ok = fwrite(chunk, 1, FLASH_STRESS_CHUNK, f) == FLASH_STRESS_CHUNK && fflush(f) == 0;
+            } else {
+                ok = (fs->written_kb == 0 ? flash_sched_create(FLASH_STRESS_FILE, chunk, FLASH_STRESS_CHUNK) :
+                      flash_sched_append(FLASH_STRESS_FILE, chunk, FLASH_STRESS_CHUNK)) == ESP_OK;
+            }
+            if (!ok) {
+                break;
+            }
+            int64_t stall_us = esp_timer_get_time() - t0;
+            if (stall_us > fs->max_stall_us) {
+                fs->max_stall_us = stall_us;
+            }
+            fs->written_kb += FLASH_STRESS_CHUNK / 1024;
+        }
+    }
+    if (f != NULL) {
+        fclose(f);
+    }
+    free(chunk);
+    xSemaphoreGive(fs->done);
+    vTaskDelete(NULL);
+}
+
+HF_CMD_HANDLER(flash_stress)
+{
+    flash_stress_t fs = { .kb = 64 };
+    for (int i = 1; i < argn; i++) {
+        if (strcmp(argv[i], "direct") == 0) {
+            fs.direct = true;
+        } else if (sscanf(argv[i], "%d", &fs.kb) != 1 || fs.kb <= 0) {
+            printf("Invalid argument %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    // Without a call, stream the loopback so there is audio to disturb and a measurement of it
+    bool own_loopback = false;
+    if (!bt_app_hf_audio_connected() && !audio_loopback_running()) {
+        if (audio_loopback_start(0, 0) != ESP_OK) {
+            printf("No call audio and the loopback did not start\n");
+            return 1;
+        }
+        own_loopback = true;
+        vTaskDelay(pdMS_TO_TICKS(FLASH_STRESS_SETTLE_MS));
+    }
+    audio_loopback_result_t res;
+    float base_snr = 0.0f;
+    if (audio_loopback_running()) {
+        if (audio_loopback_measure(&res) != ESP_OK) {
+            printf("Loopback measurement failed before the writes\n");
+            if (own_loopback) {
+                audio_loopback_stop();
+            }
+            return 1;
+        }
+        base_snr = res.snr_db;
+    }
+
+    fs.done = xSemaphoreCreateBinary();
+    if (fs.done == NULL) {
+        printf("Out of memory\n");
+        return 1;
+    }
+
+    bt_i2s_sched_stats_t before, after;
+    bt_i2s_hfp_get_sched_stats(&before);
+    uint32_t underruns_before = bt_i2s_hfp_get_tx_underruns();
+    uint32_t concealed_before = bt_i2s_hfp_get_concealed_ms();
+    bt_i2s_rx_capture_stats_t mic_before, mic_after;
+    bt_i2s_hfp_get_rx_capture_stats(&mic_before);
+    int64_t start_us = esp_timer_get_time();
+
+    printf("Writing %d KB to flash%s\n", fs.kb, fs.direct ? " directly" : " through the flash scheduler");
+    if (xTaskCreatePinnedToCore(flash_stress_task, "FlashStress", APP_PBAC_TASK_STACK, &fs,
+                                APP_PBAC_TASK_PRIO, NULL, APP_BT_CORE) != pdPASS) {
+        printf("Failed to start the writer\n");
+        vSemaphoreDelete(fs.done);
+        if (own_loopback) {
+            audio_loopback_stop();
+        }
+        return 1;
+    }
+
+    // Measure the loopback back to back until the writer is through
+    uint32_t measurements = 0, glitches = 0;
+    float worst_snr = 0.0f;
+    bool writing = true;
+    while (writing) {
+        if (audio_loopback_running() && audio_loopback_measure(&res) == ESP_OK) {
+            glitches += res.glitches;
+            worst_snr = (measurements == 0 || res.snr_db < worst_snr) ? res.snr_db : worst_snr;
+            measurements++;
+        }
+        writing = xSemaphoreTake(fs.done, measurements > 0 ? 0 : portMAX_DELAY) != pdTRUE;
+    }
+    vSemaphoreDelete(fs.done);
+    int64_t total_us = esp_timer_get_time() - start_us;
+
+    bt_i2s_hfp_get_sched_stats(&after);
+    bt_i2s_hfp_get_rx_capture_stats(&mic_after);
+    uint32_t underruns = bt_i2s_hfp_get_tx_underruns() - underruns_before;
+    uint32_t overruns = mic_after.overruns - mic_before.overruns;
+    if (own_loopback) {
+        audio_loopback_stop();
+    }
+    if (fs.direct) {
+        remove(FLASH_STRESS_FILE);
+    } else {
+        flash_sched_remove(FLASH_STRESS_FILE);
+    }
+
+    printf("Wrote %d KB in %"PRId64" ms, longest write %"PRId64" ms\n", fs.written_kb, total_us / 1000, fs.max_stall_us / 1000);
+    printf("Audio: %"PRIu32" frames, %"PRIu32" late, max wake-up latency %"PRIu32" us, %"PRIu32" tx underruns (%"PRIu32" ms concealed), %"PRIu32" mic overruns\n",
+           after.frames - before.frames, after.late_frames - before.late_frames, after.max_late_us,
+           underruns, bt_i2s_hfp_get_concealed_ms() - concealed_before, overruns);
+    if (measurements > 0) {
+        printf("Loopback: %"PRIu32" measurements, %"PRIu32" glitches, worst SNR %.1f dB (%.1f dB before the writes)\n",
+               measurements, glitches, (double)worst_snr, (double)base_snr);
+    }
+
+    bool pass = fs.written_kb == fs.kb && after.frames != before.frames && underruns == 0 && overruns == 0 &&
+                glitches == 0 && (measurements == 0 || worst_snr >= base_snr - FLASH_STRESS_SNR_DROP_DB);
+    printf("fstress: %s\n", pass ? "PASS" : "FAIL");
+    return pass ? 0 : 1;
+}
+
+HF_CMD_HANDLER(pb_sync)
+{
+    if (argn == 2) {
+        if (strcmp(argv[1], "pause") == 0) {
+            bt_app_pbac_pause(true);
+        } else if (strcmp(argv[1], "resume") == 0) {
+            bt_app_pbac_pause(false);
+        } else {
+            printf("Invalid argument %s\n", argv[1]);
+            return 1;
+        }
+    }
+
+    bt_app_pbac_sync_status_t st;
+    bt_app_pbac_get_sync_status(&st);
+    printf("Phonebook sync %s: %d of %d downloaded, %d contacts stored\n",
+           bt_app_pbac_sync_state_str(st.state), st.offset, st.total, st.contacts);
+    printf("Rate %s (%s%s)%s\n", bt_app_pbac_rate_str(st.rate),
+           st.user_paused ? "paused by user, " : "",
+           st.call_setup ? "call setup" : (st.call_active ? "call active" : "no call"),
+           st.connect_deferred ? ", connection deferred until call ends" : "");
+    return 0;
+}
+
+HF_CMD_HANDLER(pb_list)
+{
+    phonebook_t *pb = bt_app_pbac_get_current_phonebook();
+    if (argn != 2) {
+        printf("Give a letter or a page number\n");
+        return 1;
+    }
+    if (pb == NULL) {
+        printf("No phonebook available\n");
+        return 1;
+    }
+
+    phonebook_query_t q = { .type = PHONEBOOK_QUERY_LETTER, .letter = argv[1][0] };
+    if (isdigit((unsigned char)argv[1][0])) {
+        int page = atoi(argv[1]);
+        q.type = PHONEBOOK_QUERY_ALL;
+        q.offset = page * PB_LIST_PAGE_SIZE;
+        q.limit = PB_LIST_PAGE_SIZE;
+        printf("Page %d of %u contacts:\n", page, phonebook_get_count(pb));
+    } else {
+        printf("Contacts under '%c':\n", toupper((unsigned char)argv[1][0]));
+    }
+
+    phonebook_cursor_t cur;
+    contact_t c;
+    if (phonebook_query_open(pb, &q, &cur) != ESP_OK) {
+        printf("Phonebook not readable\n");
+        return 1;
+    }
+    while (phonebook_query_next(&cur, &c)) {
+        printf("  %-32s %s\n", c.full_name, c.phone_count ? c.phones[0].number : "");
+    }
+    printf("%u listed\n", cur.returned);
+    phonebook_query_close(&cur);
+    return 0;
+}
+
+HF_CMD_HANDLER(pb_fuzzy)
+{
+    phonebook_t *pb = bt_app_pbac_get_current_phonebook();
+    if (argn < 2) {
+        printf("Give a name to search for\n");
+        return 1;
+    }
+    if (pb == NULL) {
+        printf("No phonebook available\n");
+        return 1;
+    }
+
+    char text[MAX_NAME_LEN] = "";
+    for (int i = 1; i < argn; i++) {
+        snprintf(text + strlen(text), sizeof(text) - strlen(text), "%s%s", i > 1 ? " " : "", argv[i]);
+    }
+    phonebook_match_t *m = malloc(sizeof(phonebook_match_t) * PB_LIST_PAGE_SIZE);
+    if (m == NULL) {
+        printf("Out of memory\n");
+        return 1;
+    }
+    int64_t t0 = esp_timer_get_time();
+    uint16_t n = phonebook_fuzzy_search(pb, text, m, PB_LIST_PAGE_SIZE, PHONEBOOK_FUZZY_BUDGET_US);
+    int64_t us = esp_timer_get_time() - t0;
+    for (int i = 0; i < n; i++) {
+        printf("  %-32s %-16s %u typo%s\n", m[i].contact.full_name,
+               m[i].contact.phone_count ? m[i].contact.phones[0].number : "",
+               m[i].distance, m[i].distance == 1 ? "" : "s");
+    }
+    printf("%u found in %"PRId64" us\n", n, us);
+    free(m);
+    return 0;
+}
+
+/* synthetic book for the phonebook benchmark; a locally administered address no phone uses */
+static esp_bd_addr_t s_pb_bench_addr = {0x02, 0x00, 0x00, 0x00, 0xbe, 0x4c};
+
+static const char *s_pb_bench_names[] = {
+    "Anna", "Bram", "Carla", "Daan", "Eva", "Finn", "Gijs", "Hanna", "Ilse", "Jesse",
+    "Kees", "Lotte", "Milan", "Noor", "Olaf", "Puck", "Quinten", "Roos", "Sem", "Tess",
+    "Ugo", "Vera", "Wout", "Xander", "Yara", "Zoe",
+};
+
+/* first names cycle through the alphabet, so the book order is not alphabetical */
+static void pb_bench_name(uint32_t i, char *out, size_t len)
+{
+    snprintf(out, len, "%s %05u", s_pb_bench_names[i % 26], (unsigned)i);
+}
+
+static void pb_bench_number(uint32_t i, char *out, size_t len)
+{
+    uint32_t h = i * 2654435761u;
+    snprintf(out, len, "06 %04u %04u", (unsigned)(i % 10000), (unsigned)((h >> 16) % 10000));
+}
+
+/* with the properties a phone sends that the parser skips, one of them folded */
+static size_t pb_bench_vcard(uint32_t i, char *out, size_t len)
+{
+    char number[MAX_PHONE_LEN], name[MAX_NAME_LEN];
+    pb_bench_number(i, number, sizeof(number));
+    pb_bench_name(i, name, sizeof(name));
+    return snprintf(out, len,
+                    "BEGIN:VCARD\r\nVERSION:3.0\r\nFN:%s\r\nTEL;TYPE=CELL:%s\r\n%s"
+                    "EMAIL;TYPE=INTERNET:contact%05u@example.com\r\n"
+                    "NOTE:Met at the conference in Utrecht\\, follow up about the\r\n  quote in spring\r\n"
+                    "END:VCARD\r\n",
+                    name, number, (i % 3 == 0) ? "TEL;TYPE=WORK:+31 20 555 0100\r\n" : "", (unsigned)i);
+}
+
+static esp_err_t pb_bench_build(phonebook_t *pb, uint32_t contacts)
+{
+    static char chunk[PB_BENCH_CHUNK + 256];
+    size_t len = 0;
+    esp_err_t err = phonebook_begin_sync(pb);
+    if (err != ESP_OK) {
+        return err;
+    }
+    for (uint32_t i = 0; i < contacts; i++) {
+        len += pb_bench_vcard(i, chunk + len, sizeof(chunk) - len);
+        if (len >= PB_BENCH_CHUNK || i == contacts - 1) {
+            err = phonebook_process_chunk(pb, chunk, len);
+            if (err != ESP_OK) {
+                return err;
+            }
+            len = 0;
+        }
+    }
+    return phonebook_finalize_sync(pb);
+}
+
+static void pb_bench_parsed(contact_t *contact, void *ctx)
+{
+    (*(uint32_t *)ctx)++;
+}
+
+/* parser alone, without flash writes: the same vCards in the same chunks */
+static void pb_bench_parse(uint32_t contacts)
+{
+    static char chunk[PB_BENCH_CHUNK + 256];
+    pb_vcard_t *p = malloc(sizeof(pb_vcard_t));
+    if (p == NULL) {
+        return;
+    }
+    uint32_t parsed = 0;
+    size_t len = 0, bytes = 0;
+    int64_t us = 0;
+    pb_vcard_init(p, pb_bench_parsed, &parsed);
+    for (uint32_t i = 0; i < contacts; i++) {
+        len += pb_bench_vcard(i, chunk + len, sizeof(chunk) - len);
+        if (len >= PB_BENCH_CHUNK || i == contacts - 1) {
+            int64_t t0 = esp_timer_get_time();
+            pb_vcard_feed(p, chunk, len);
+            us += esp_timer_get_time() - t0;
+            bytes += len;
+            len = 0;
+        }
+    }
+    pb_vcard_finish(p);
+    free(p);
+    int64_t centi = us ? (int64_t)bytes * 100 / us : 0;     // bytes per us is MB/s
+    printf("vCard parse    %u KB in %"PRId64" ms, %"PRId64".%02d MB/s, %"PRIu32" of %"PRIu32" vCards\n",
+           (unsigned)(bytes / 1024), us / 1000, centi / 100, (int)(centi % 100), parsed, contacts);
+}
+
+static int64_t pb_bench_bytes_read(void)
+{
+    const metric_t *book = metrics_find("pb.book_read_bytes");
+    const metric_t *index = metrics_find("pb.index_read_bytes");
+    return (book ? metrics_value(book) : 0) + (index ? metrics_value(index) : 0);
+}
+
+/* time the lookup of every step-th contact's number through fn */
+static void pb_bench_lookups(phonebook_t *pb, uint32_t contacts, uint32_t lookups,
+                             contact_t *(*fn)(phonebook_t *, const char *), const char *label)
+{
+    uint32_t found = 0;
+    int64_t bytes0 = pb_bench_bytes_read();
+    int64_t t0 = esp_timer_get_time();
+    for (uint32_t k = 0; k < lookups; k++) {
+        char number[MAX_PHONE_LEN], name[MAX_NAME_LEN];
+        uint32_t i = (k * 7919u) % contacts;
+        pb_bench_number(i, number, sizeof(number));
+        pb_bench_name(i, name, sizeof(name));
+        contact_t *c = fn(pb, number);
+        if (c != NULL && strcmp(c->full_name, name) == 0) {
+            found++;
+        }
+        free(c);
+    }
+    int64_t us = esp_timer_get_time() - t0;
+    printf("%-14s %6"PRId64" us %8"PRId64" bytes read per lookup, %"PRIu32" of %"PRIu32" found\n",
+           label, us / lookups, (pb_bench_bytes_read() - bytes0) / lookups, found, lookups);
+}
+
+typedef struct {
+    char first[MAX_NAME_LEN];
+    char prev[MAX_NAME_LEN];
+    bool sorted;
+} pb_bench_browse_ctx_t;
+
+static bool pb_bench_browse_cb(const contact_t *c, void *arg)
+{
+    pb_bench_browse_ctx_t *ctx = arg;
+    if (ctx->first[0] == '\0') {
+        strcpy(ctx->first, c->full_name);
+    } else if (strcasecmp(ctx->prev, c->full_name) > 0) {
+        ctx->sorted = false;
+    }
+    strcpy(ctx->prev, c->full_name);
+    return true;
+}
+
+/* the same known and unknown caller over and over, as while a phone rings */
+static void pb_bench_repeat(phonebook_t *pb)
+{
+    const char *labels[] = { "repeat caller", "repeat unknown" };
+    char numbers[2][MAX_PHONE_LEN];
+    pb_bench_number(0, numbers[0], sizeof(numbers[0]));
+    strcpy(numbers[1], "+44 20 7946 0000");
+    for (int k = 0; k < 2; k++) {
+        int64_t bytes0 = pb_bench_bytes_read();
+        int64_t t0 = esp_timer_get_time();
+        for (int i = 0; i < PB_BENCH_LOOKUPS; i++) {
+            free(phonebook_search_by_number(pb, numbers[k]));
+        }
+        int64_t us = esp_timer_get_time() - t0;
+        printf("%-14s %6"PRId64" us %8"PRId64" bytes read per lookup\n",
+               labels[k], us / PB_BENCH_LOOKUPS, (pb_bench_bytes_read() - bytes0) / PB_BENCH_LOOKUPS);
+    }
+    const metric_t *hit_pct = metrics_find("pb.cache_hit_pct");
+    printf("Caller-ID cache hit rate since boot: %"PRId64"%%\n", hit_pct ? metrics_value(hit_pct) : 0);
+}
+
+/* one letter and one page from the middle of the book, through the name index */
+static void pb_bench_browse(phonebook_t *pb, uint32_t contacts)
+{
+    pb_bench_browse_ctx_t ctx = { .sorted = true };
+    phonebook_query_t q = { .type = PHONEBOOK_QUERY_LETTER, .letter = 'M' };
+    int64_t bytes0 = pb_bench_bytes_read();
+    int64_t t0 = esp_timer_get_time();
+    uint16_t count = phonebook_query(pb, &q, pb_bench_browse_cb, &ctx);
+    int64_t us = esp_timer_get_time() - t0;
+    printf("letter M       %6"PRId64" us %8"PRId64" bytes read, %u contacts%s\n",
+           us, pb_bench_bytes_read() - bytes0, count, ctx.sorted ? "" : ", NOT SORTED");
+
+    uint16_t page = contacts / PB_LIST_PAGE_SIZE / 2;
+    q = (phonebook_query_t){
+        .type = PHONEBOOK_QUERY_ALL,
+        .offset = page * PB_LIST_PAGE_SIZE,
+        .limit = PB_LIST_PAGE_SIZE,
+    };
+    ctx = (pb_bench_browse_ctx_t){ .sorted = true };
+    bytes0 = pb_bench_bytes_read();
+    t0 = esp_timer_get_time();
+    count = phonebook_query(pb, &q, pb_bench_browse_cb, &ctx);
+    us = esp_timer_get_time() - t0;
+    printf("page %-9u %6"PRId64" us %8"PRId64" bytes read, starts at %s\n",
+           page, us, pb_bench_bytes_read() - bytes0, count ? ctx.first : "-");
+}
+
+/* names with a typo in them, as typed on a keypad; the contact they were made from should come first */
+static void pb_bench_fuzzy(phonebook_t *pb, uint32_t contacts)
+{
+    phonebook_match_t *m = malloc(sizeof(phonebook_match_t) * PB_LIST_PAGE_SIZE);
+    if (m == NULL) {
+        return;
+    }
+    uint32_t found = 0;
+    int64_t worst = 0;
+    int64_t bytes0 = pb_bench_bytes_read();
+    int64_t t0 = esp_timer_get_time();
+    for (uint32_t k = 0; k < PB_BENCH_LOOKUPS; k++) {
+        uint32_t i = (k * 2654435761u) % contacts;
+        char name[MAX_NAME_LEN], typo[MAX_NAME_LEN];
+        pb_bench_name(i, name, sizeof(name));
+        strcpy(typo, name);
+        typo[1] = (typo[1] == 'x') ? 'y' : 'x';
+        int64_t t1 = esp_timer_get_time();
+        uint16_t n = phonebook_fuzzy_search(pb, typo, m, PB_LIST_PAGE_SIZE, PHONEBOOK_FUZZY_BUDGET_US);
+        int64_t us = esp_timer_get_time() - t1;
+        if (us > worst) {
+            worst = us;
+        }
+        if (n > 0 && strcmp(m[0].contact.full_name, name) == 0) {
+            found++;
+        }
+    }
+    int64_t us = esp_timer_get_time() - t0;
+    printf("fuzzy name     %6"PRId64" us %8"PRId64" bytes read per search, worst %"PRId64" us, %"PRIu32" of %d first\n",
+           us / PB_BENCH_LOOKUPS, (pb_bench_bytes_read() - bytes0) / PB_BENCH_LOOKUPS, worst, found,
+           PB_BENCH_LOOKUPS);
+    free(m);
+}
+
+HF_CMD_HANDLER(pb_bench)
+{
+    int contacts = (argn >= 2) ? atoi(argv[1]) : PB_BENCH_CONTACTS;
+    if (argn > 2 || contacts <= 0 || contacts > UINT16_MAX) {
+        printf("Contacts must be 1..%d\n", UINT16_MAX);
+        return 1;
+    }
+    if (bt_app_hf_audio_connected()) {
+        printf("Not during a call: the benchmark writes the whole book to flash\n");
+        return 1;
+    }
+    size_t total = 0, used = 0;
+    size_t need = (size_t)contacts * PB_BENCH_FLASH_PER_CONTACT;
+    if (esp_spiffs_info("storage", &total, &used) != ESP_OK || total - used < need) {
+        printf("Needs %u KB of free flash, %u KB available\n", (unsigned)(need / 1024), (unsigned)((total - used) / 1024));
+        return 1;
+    }
+
+    phonebook_t *pb = phonebook_get_or_create(s_pb_bench_addr);
+    if (pb == NULL) {
+        printf("Failed to create the benchmark phonebook\n");
+        return 1;
+    }
+    pb_bench_parse(contacts);
+    int64_t t0 = esp_timer_get_time();
+    esp_err_t err = pb_bench_build(pb, contacts);
+    printf("Synthetic book: %u contacts stored in %"PRId64" ms, including the index build\n",
+           phonebook_get_count(pb), (esp_timer_get_time() - t0) / 1000);
+    size_t used_after = used;
+    esp_spiffs_info("storage", &total, &used_after);
+    printf("Flash used by book and indexes: %u KB\n", (unsigned)((used_after - used) / 1024));
+    if (err == ESP_OK) {
+        pb_bench_lookups(pb, contacts, PB_BENCH_LOOKUPS, phonebook_search_by_number, "indexed");
+        pb_bench_lookups(pb, contacts, PB_BENCH_SCANS, phonebook_scan_by_number, "full scan");
+        pb_bench_repeat(pb);
+        pb_bench_browse(pb, contacts);
+        pb_bench_fuzzy(pb, contacts);
+    } else {
+        printf("Sync failed: %s\n", esp_err_to_name(err));
+    }
+    phonebook_delete(s_pb_bench_addr);
+    return err == ESP_OK ? 0 : 1;
+}
+
+static bool i2s_cal_parse_mode(const char *arg, i2s_cal_mode_t *mode)
+{
+    for (int m = 0; m < I2S_CAL_MODE_MAX; m++) {
+        if (strcmp(arg, i2s_cal_mode_str((i2s_cal_mode_t)m)) == 0) {
+            *mode = (i2s_cal_mode_t)m;
+            return true;
+        }
+    }
+    return false;
+}
+
+HF_CMD_HANDLER(i2s_cal)
+{
+    i2s_cal_mode_t mode;
+    if (argn == 2 && i2s_cal_parse_mode(argv[1], &mode)) {
+        i2s_cal_start(mode);
+        printf("Calibrating %s DMA depth; each following %s session tests one candidate\n", argv[1], argv[1]);
+    } else if (argn == 3 && strcmp(argv[1], "reset") == 0 && i2s_cal_parse_mode(argv[2], &mode)) {
+        i2s_cal_reset(mode);
+        printf("%s DMA depth back to default\n", argv[2]);
+    } else if (argn != 1) {
+        printf("Invalid argument\n");
+        return 1;
+    }
+    i2s_cal_print_status();
+    return 0;
+}
+
+HF_CMD_HANDLER(a2dp_volume)
+{
+    if (argn == 2) {
+        int volume = atoi(argv[1]);
+        if (volume < 0 || volume > 127) {
+            printf("Volume must be 0..127\n");
+            return 1;
+        }
+        bt_app_av_set_volume((uint8_t)volume);
+    } else if (argn != 1) {
+        printf("Invalid argument\n");
+        return 1;
+    }
+    printf("Music volume %d/127, %s\n", bt_app_av_get_volume(),
+           bt_app_av_is_streaming() ? "streaming" : "not streaming");
+    return 0;
+}
+
+HF_CMD_HANDLER(a2dp_flow)
+{
+    bt_i2s_a2dp_flow_stats_t st;
+    bt_i2s_a2dp_get_flow_stats(&st);
+    printf("Music buffer: %"PRIu32" of %"PRIu32" bytes target, level min %"PRIu32" avg %"PRIu32" max %"PRIu32"\n",
+           st.level_target, st.capacity, st.level_min, st.level_avg, st.level_max);
+    printf("%"PRIu32" underruns, %"PRIu32" bytes dropped, %"PRIu32" frames skipped, %"PRIu32" frames repeated\n",
+           st.underruns, st.dropped_bytes, st.skipped_frames, st.repeated_frames);
+    return 0;
+}
+
+/* voiced-speech stand-in: a harmonic series with a slow vibrato and a little noise */
+static void stretch_bench_frame(int16_t *buf, uint32_t first, uint32_t *seed)
+{
+    for (int i = 0; i < WSOLA_HOP; i++) {
+        float t = (float)(first + i) / 16000.0f;
+        float phase = 2.0f * (float)M_PI * STRETCH_BENCH_PITCH_HZ * t + 0.3f * sinf(2.0f * (float)M_PI * 3.0f * t);
+        float v = 0.0f;
+        for (int h = 1; h <= 8; h++) {
+            v += sinf(h * phase) / h;
+        }
+        *seed = *seed * 1664525u + 1013904223u;
+        buf[i] = (int16_t)(5000.0f * v) + (int16_t)((int32_t)(*seed >> 16) - 32768) / 256;
+    }
+}
+
+/* pitch period in samples: the first autocorrelation peak above half the energy, refined by a parabolic fit */
+static float stretch_bench_period(const int16_t *buf, int n)
+{
+    const int lag_min = 16000 / 400, lag_max = 16000 / 70;
+    float r[16000 / 70 + 2];
+    for (int lag = 0; lag <= lag_max + 1; lag++) {
+        float acc = 0.0f;
+        for (int i = 0; i + lag < n; i++) {
+            acc += (float)buf[i] * buf[i + lag];
+        }
+        r[lag] = acc / (n - lag);
+    }
+    for (int lag = lag_min; lag <= lag_max; lag++) {
+        if (r[lag] > 0.5f * r[0] && r[lag] >= r[lag - 1] && r[lag] >= r[lag + 1]) {
+            float den = r[lag - 1] - 2.0f * r[lag] + r[lag + 1];
+            return lag + (den != 0.0f ? 0.5f * (r[lag - 1] - r[lag + 1]) / den : 0.0f);
+        }
+    }
+    return 0.0f;
+}
+
+/*
+    run the call time-stretcher over synthetic speech at its slowest, unity
+    and fastest speed; report the cost per 7.5 ms frame and how audible the
+    stretching is: splice quality, and pitch drift against the input
+ */
+static int stretch_bench(void)
+{
+    wsola_t *w = malloc(sizeof(wsola_t));
+    int16_t *in = malloc(WSOLA_HOP * sizeof(int16_t));
+    int16_t *out = malloc(WSOLA_OUT_MAX * sizeof(int16_t));
+    int16_t *tail = malloc(STRETCH_BENCH_WINDOW * sizeof(int16_t));
+    int16_t *ref = malloc(STRETCH_BENCH_WINDOW * sizeof(int16_t));
+    if (w == NULL || in == NULL || out == NULL || tail == NULL || ref == NULL) {
+        printf("Failed to allocate benchmark buffers\n");
+        free(w); free(in); free(out); free(tail); free(ref);
+        return 1;
+    }
+
+    const uint16_t speeds[] = {WSOLA_SPEED_MIN, 1000, WSOLA_SPEED_MAX};
+    const uint32_t frames = STRETCH_BENCH_MS * 16 / WSOLA_HOP;
+    const uint32_t budget_cycles = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ * 7500;
+    for (size_t s = 0; s < sizeof(speeds) / sizeof(speeds[0]); s++) {
+        uint32_t seed = 1;
+        uint64_t cycles_sum = 0;
+        uint32_t cycles_max = 0;
+        size_t tail_len = 0;
+        wsola_init(w);
+        wsola_set_speed(w, speeds[s]);
+        for (uint32_t f = 0; f < frames; f++) {
+            stretch_bench_frame(in, f * WSOLA_HOP, &seed);
+            if (f >= frames - STRETCH_BENCH_WINDOW / WSOLA_HOP) {
+                memcpy(&ref[(f - (frames - STRETCH_BENCH_WINDOW / WSOLA_HOP)) * WSOLA_HOP], in, WSOLA_HOP * sizeof(int16_t));
+            }
+            uint32_t t0 = esp_cpu_get_cycle_count();
+            size_t n = wsola_process(w, in, WSOLA_HOP, out, WSOLA_OUT_MAX);
+            uint32_t dt = esp_cpu_get_cycle_count() - t0;
+            cycles_sum += dt;
+            if (dt > cycles_max) {
+                cycles_max = dt;
+            }
+            /* keep the last window of output for the pitch check */
+            for (size_t i = 0; i < n; i++) {
+                if (tail_len == STRETCH_BENCH_WINDOW) {
+                    memmove(tail, tail + 1, (STRETCH_BENCH_WINDOW - 1) * sizeof(int16_t));
+                    tail_len--;
+                }
+                tail[tail_len++] = out[i];
+            }
+        }
+        uint32_t cycles_avg = (uint32_t)(cycles_sum / frames);
+        int ref_len = (STRETCH_BENCH_WINDOW / WSOLA_HOP) * WSOLA_HOP;
+        float p_in = stretch_bench_period(ref, ref_len);
+        float p_out = stretch_bench_period(tail, (int)tail_len);
+        float cents = (p_in > 0.0f && p_out > 0.0f) ? 1200.0f * log2f(p_out / p_in) : 0.0f;
+        printf("%3u%%: %"PRIu32" samples in, %"PRIu32" out (x%.3f), %"PRIu32" cycles/frame avg (%.2f%% of 7.5 ms), %"PRIu32" max, "
+               "splice quality %.3f, pitch drift %+.1f cents\n",
+               speeds[s] / 10, w->samples_in, w->samples_out, (double)w->samples_in / w->samples_out,
+               cycles_avg, 100.0 * cycles_avg / budget_cycles, cycles_max,
+               (double)wsola_quality(w), (double)cents);
+    }
+    free(w); free(in); free(out); free(tail); free(ref);
+    return 0;
+}
+
+HF_CMD_HANDLER(hfp_stretch)
+{
+    if (argn == 2 && strcmp(argv[1], "bench") == 0) {
+        return stretch_bench();
+    } else if (argn != 1) {
+        printf("Invalid argument %s\n", argv[1]);
+        return 1;
+    }
+    bt_i2s_hfp_stretch_stats_t st;
+    bt_i2s_hfp_get_stretch_stats(&st);
+    printf("Call speaker buffer: %"PRIu32" bytes target, level min %"PRIu32" avg %"PRIu32" max %"PRIu32"\n",
+           st.level_target, st.level_min, st.level_avg, st.level_max);
+    printf("Speed %u%%, %"PRIu32" of %"PRIu32" frames time-stretched, splice quality %u/1000\n",
+           st.speed / 10, st.stretched_frames, st.frames, st.quality);
+    return 0;
+}
+
+HF_CMD_HANDLER(loopback)
+{
+    if (argn >= 2 && strcmp(argv[1], "start") == 0 && argn <= 4) {
+        int delay_ms = (argn >= 3) ? atoi(argv[2]) : 0;
+        int loss_pct = (argn >= 4) ? atoi(argv[3]) : 0;
+        if (delay_ms < 0 || delay_ms > AUDIO_LOOPBACK_MAX_DELAY_MS || loss_pct < 0 || loss_pct > 100) {
+            printf("Delay must be 0..%d ms, loss 0..100%%\n", AUDIO_LOOPBACK_MAX_DELAY_MS);
+            return 1;
+        }
+        esp_err_t err = audio_loopback_start((uint32_t)delay_ms, (uint32_t)loss_pct);
+        if (err != ESP_OK) {
+            printf("Loopback not started: %s\n", err == ESP_ERR_INVALID_STATE ? "already running or call audio connected" : esp_err_to_name(err));
+            return 1;
+        }
+    } else if (argn == 2 && strcmp(argv[1], "stop") == 0) {
+        audio_loopback_stop();
+    } else if (argn == 2 && strcmp(argv[1], "measure") == 0) {
+        audio_loopback_result_t res;
+        esp_err_t err = audio_loopback_measure(&res);
+        if (err != ESP_OK) {
+            printf("Measurement failed: %s\n", err == ESP_ERR_INVALID_STATE ? "loopback not running" :
+                   err == ESP_ERR_TIMEOUT ? "no audio reached the speaker" : esp_err_to_name(err));
+            return 1;
+        }
+        printf("Latency %"PRIu32".%"PRIu32" ms (mic capture to speaker output), SNR %.1f dB, %"PRIu32" glitches in %"PRIu32" frames, correlation %.2f\n",
+               res.latency_us / 1000, (res.latency_us % 1000) / 100, (double)res.snr_db,
+               res.glitches, res.frames, (double)res.peak);
+        return 0;
+    } else if (argn != 1) {
+        printf("Invalid argument\n");
+        return 1;
+    }
+    audio_loopback_status_t st;
+    audio_loopback_get_status(&st);
+    printf("Loopback %s: delay %"PRIu32" ms, loss %"PRIu32"%%, %"PRIu32" frames, %"PRIu32" lost, %"PRIu32" empty\n",
+           st.running ? "running" : "stopped", st.delay_ms, st.loss_pct, st.frames, st.frames_lost, st.frames_empty);
+    return 0;
+}
+
+HF_CMD_HANDLER(latency)
+{
+    if (argn == 2 && strcmp(argv[1], "reset") == 0) {
+        latency_trace_reset();
+        printf("Latency histograms cleared\n");
+        return 0;
+    } else if (argn != 1) {
+        printf("Invalid argument %s\n", argv[1]);
+        return 1;
+    }
+    printf("%-14s %8s %8s %8s %8s %8s\n", "stage (us)", "frames", "p50", "p95", "p99", "max");
+    for (int s = 0; s < LT_STAGE_MAX; s++) {
+        lt_summary_t sum;
+        latency_trace_summary((lt_stage_t)s, &sum);
+        printf("%-14s %8"PRIu32" %8"PRIu32" %8"PRIu32" %8"PRIu32" %8"PRIu32"\n", latency_trace_stage_str((lt_stage_t)s),
+               sum.count, sum.p50_us, sum.p95_us, sum.p99_us, sum.max_us);
+    }
+    return 0;
+}
+
+HF_CMD_HANDLER(cycle_prof)
+{
+    if (argn == 2 && strcmp(argv[1], "reset") == 0) {
+        cycle_prof_reset();
+        printf("Cycle profile cleared\n");
+        return 0;
+    } else if (argn != 1) {
+        printf("Invalid argument %s\n", argv[1]);
+        return 1;
+    }
+    printf("%-14s %8s %8s %8s %7s %7s\n", "stage", "calls", "avg", "max", "avg%", "max%");
+    uint32_t frames = 0;
+    for (int s = 0; s < PROF_STAGE_MAX; s++) {
+        prof_summary_t sum;
+        cycle_prof_summary((prof_stage_t)s, &sum);
+        frames = sum.frames;
+        if (sum.calls == 0) {
+            continue;
+        }
+        /* avg% spreads the stage over the frames of the call, so a stage run twice per frame counts twice */
+        float avg_pct = frames ? 100.0f * sum.avg_cycles * sum.calls / frames / CYCLE_PROF_FRAME_CYCLES : 0.0f;
+        float max_pct = 100.0f * sum.max_cycles / CYCLE_PROF_FRAME_CYCLES;
+        printf("%-14s %8"PRIu32" %8"PRIu32" %8"PRIu32" %6.2f%% %6.2f%%\n", cycle_prof_stage_str((prof_stage_t)s),
+               sum.calls, sum.avg_cycles, sum.max_cycles, (double)avg_pct, (double)max_pct);
+    }
+    uint32_t load = cycle_prof_load_permille();
+    printf("%"PRIu32" frames of %d cycles, %"PRIu32".%"PRIu32"%% used on average%s\n", frames, CYCLE_PROF_FRAME_CYCLES,
+           load / 10, load % 10,
+           load > (100 - CYCLE_PROF_HEADROOM_WARN_PCT) * 10 ? ", below the headroom threshold" : "");
+    printf("%"PRIu32" frames left less than %d%% headroom\n", cycle_prof_tight_frames(), CYCLE_PROF_HEADROOM_WARN_PCT);
+    return 0;
+}
+
+static int stats_print_snapshot(void)
+{
+    static uint8_t buf[STATS_SNAPSHOT_MAX];
+    size_t len = 0;
+    esp_err_t err = metrics_snapshot(buf, sizeof(buf), &len);
+    if (err != ESP_OK) {
+        printf("Snapshot failed: %s\n", esp_err_to_name(err));
+        return 1;
+    }
+    printf("%u bytes\n", (unsigned)len);
+    for (size_t i = 0; i < len; i++) {
+        printf("%02x%s", buf[i], (i % 32 == 31 || i == len - 1) ? "\n" : "");
+    }
+    return 0;
+}
+
+HF_CMD_HANDLER(stats)
+{
+    if (argn == 2 && strcmp(argv[1], "reset") == 0) {
+        metrics_reset();
+        printf("Counters and histograms cleared\n");
+        return 0;
+    } else if (argn == 2 && strcmp(argv[1], "bin") == 0) {
+        return stats_print_snapshot();
+    } else if (argn != 1) {
+        printf("Invalid argument %s\n", argv[1]);
+        return 1;
+    }
+    if (bt_app_hf_request_pkt_stats() == ESP_OK) {
+        vTaskDelay(pdMS_TO_TICKS(STATS_PKT_WAIT_MS));
+    }
+    printf("%3s %-22s %-7s %10s\n", "#", "name", "type", "value");
+    size_t n = metrics_count();
+    for (size_t i = 0; i < n; i++) {
+        const metric_t *m = metrics_get(i);
+        if (m->type != METRIC_HIST) {
+            printf("%3u %-22s %-7s %10"PRId64"\n", (unsigned)i, m->name, metrics_type_str(m->type), metrics_value(m));
+            continue;
+        }
+        const metric_hist_t *h = m->hist;
+        printf("%3u %-22s %-7s %10"PRIu32" avg %"PRIu32" p50 %"PRIu32" p99 %"PRIu32" max %"PRIu32"\n",
+               (unsigned)i, m->name, metrics_type_str(m->type), h->count,
+               h->count ? (uint32_t)(h->sum / h->count) : 0,
+               metrics_hist_percentile(m, 50), metrics_hist_percentile(m, 99), h->max);
+    }
+    return 0;
+}
 
 static hf_msg_hdl_t hf_cmd_tbl[] = {
     {"con",          hf_conn_handler},
@@ -283,6 +1148,19 @@ static hf_msg_hdl_t hf_cmd_tbl[] = {
     {"k",            hf_dtmf_handler},
     {"xp",           hf_xapl_handler},
     {"bat",          hf_iphoneaccev_handler},
+    {"fstress",      hf_flash_stress_handler},
+    {"pbs",          hf_pb_sync_handler},
+    {"i2scal",       hf_i2s_cal_handler},
+    {"avol",         hf_a2dp_volume_handler},
+    {"aflow",        hf_a2dp_flow_handler},
+    {"hstretch",     hf_hfp_stretch_handler},
+    {"loop",         hf_loopback_handler},
+    {"lat",          hf_latency_handler},
+    {"prof",         hf_cycle_prof_handler},
+    {"stats",        hf_stats_handler},
+    {"pbbench",      hf_pb_bench_handler},
+    {"pbl",          hf_pb_list_handler},
+    {"pbf",          hf_pb_fuzzy_handler},
 };
 
 #define HF_ORDER(name)   name##_cmd
@@ -307,6 +1185,19 @@ enum hf_cmd_idx {
     HF_CMD_IDX_K,          /*send dtmf code*/
     HF_CMD_IDX_XP,         /*send XAPL feature enable command to indicate battery level*/
     HF_CMD_IDX_BAT,        /*send battery level and docker status*/
+    HF_CMD_IDX_FSTRESS,    /*write to flash while audio is streaming*/
+    HF_CMD_IDX_PBS,        /*phonebook sync status, pause or resume*/
+    HF_CMD_IDX_I2SCAL,     /*calibrate I2S tx DMA depth per audio mode*/
+    HF_CMD_IDX_AVOL,       /*A2DP music volume*/
+    HF_CMD_IDX_AFLOW,      /*A2DP ringbuffer level and flow control*/
+    HF_CMD_IDX_HSTRETCH,   /*call speaker time-stretching, and its benchmark*/
+    HF_CMD_IDX_LOOP,       /*call audio loopback without a phone, latency measurement*/
+    HF_CMD_IDX_LAT,        /*per-stage latency histograms of the call audio path*/
+    HF_CMD_IDX_PROF,       /*per-stage CPU cycles of the call audio path*/
+    HF_CMD_IDX_STATS,      /*runtime metrics registry*/
+    HF_CMD_IDX_PBBENCH,    /*phonebook lookup benchmark on a synthetic book*/
+    HF_CMD_IDX_PBL,        /*list phonebook contacts by letter or page*/
+    HF_CMD_IDX_PBF,        /*typo-tolerant phonebook name search*/
 };
 
 static char *hf_cmd_explain[] = {
@@ -330,6 +1221,19 @@ static char *hf_cmd_explain[] = {
     "send dtmf code.\n        <dtmf>  single character in set 0-9, *, #, A-D",
     "send XAPL feature enable command to indicate battery level",
     "send battery level and docker status",
+    "write <kb> (default 64) to flash while audio streams; PASS if the audio was undisturbed",
+    "phonebook sync progress and rate; 'pause' or 'resume' to control it",
+    "show I2S tx DMA depth per mode; 'a2dp' or 'hfp' to calibrate, 'reset <mode>' to go back to default",
+    "show or set the music volume (0..127), reported to the phone over AVRCP",
+    "music buffer level and flow control corrections for the current or last stream",
+    "call speaker buffer level and time-stretching for the current or last call; 'bench' to measure the stretcher",
+    "loop call audio mic -> mSBC -> simulated SCO -> speaker without a phone; 'measure' for latency, SNR and glitches",
+    "per-stage latency of the call audio path (p50/p95/p99/max) for the current or last call; 'reset' to clear",
+    "CPU cycles per stage of the call audio path against the 7.5 ms frame budget; 'reset' to clear",
+    "runtime counters, gauges and histograms; 'reset' to clear counters and histograms, 'bin' for a binary snapshot in hex",
+    "build a synthetic phonebook of <contacts> (default 5000) and time number lookups with and without the index",
+    "list the contacts under a letter, or page <n> of the book in alphabetical order",
+    "search names allowing for typos, best matches first",
 };
 
 void register_hfp_hf(void)
@@ -505,4 +1409,108 @@ void register_hfp_hf(void)
             .argtable = &bat_args,
         };
         ESP_ERROR_CHECK(esp_console_cmd_register(&bat_cmd));
+
+        const esp_console_cmd_t fstress_cmd = {
+            .command = "fstress",
+            .help = hf_cmd_explain[HF_CMD_IDX_FSTRESS],
+            .hint = "[kb] [direct]",
+            .func = hf_cmd_tbl[HF_CMD_IDX_FSTRESS].handler,
+        };
+        ESP_ERROR_CHECK(esp_console_cmd_register(&fstress_cmd));
+
+        const esp_console_cmd_t pbs_cmd = {
+            .command = "pbs",
+            .help = hf_cmd_explain[HF_CMD_IDX_PBS],
+            .hint = "[pause|resume]",
+            .func = hf_cmd_tbl[HF_CMD_IDX_PBS].handler,
+        };
+        ESP_ERROR_CHECK(esp_console_cmd_register(&pbs_cmd));
+
+        const esp_console_cmd_t i2scal_cmd = {
+            .command = "i2scal",
+            .help = hf_cmd_explain[HF_CMD_IDX_I2SCAL],
+            .hint = "[a2dp|hfp|reset <mode>]",
+            .func = hf_cmd_tbl[HF_CMD_IDX_I2SCAL].handler,
+        };
+        ESP_ERROR_CHECK(esp_console_cmd_register(&i2scal_cmd));
+
+        const esp_console_cmd_t avol_cmd = {
+            .command = "avol",
+            .help = hf_cmd_explain[HF_CMD_IDX_AVOL],
+            .hint = "[volume]",
+            .func = hf_cmd_tbl[HF_CMD_IDX_AVOL].handler,
+        };
+        ESP_ERROR_CHECK(esp_console_cmd_register(&avol_cmd));
+
+        const esp_console_cmd_t aflow_cmd = {
+            .command = "aflow",
+            .help = hf_cmd_explain[HF_CMD_IDX_AFLOW],
+            .hint = NULL,
+            .func = hf_cmd_tbl[HF_CMD_IDX_AFLOW].handler,
+        };
+        ESP_ERROR_CHECK(esp_console_cmd_register(&aflow_cmd));
+
+        const esp_console_cmd_t hstretch_cmd = {
+            .command = "hstretch",
+            .help = hf_cmd_explain[HF_CMD_IDX_HSTRETCH],
+            .hint = "[bench]",
+            .func = hf_cmd_tbl[HF_CMD_IDX_HSTRETCH].handler,
+        };
+        ESP_ERROR_CHECK(esp_console_cmd_register(&hstretch_cmd));
+
+        const esp_console_cmd_t loop_cmd = {
+            .command = "loop",
+            .help = hf_cmd_explain[HF_CMD_IDX_LOOP],
+            .hint = "[start [delay_ms [loss_pct]]|stop|measure]",
+            .func = hf_cmd_tbl[HF_CMD_IDX_LOOP].handler,
+        };
+        ESP_ERROR_CHECK(esp_console_cmd_register(&loop_cmd));
+
+        const esp_console_cmd_t lat_cmd = {
+            .command = "lat",
+            .help = hf_cmd_explain[HF_CMD_IDX_LAT],
+            .hint = "[reset]",
+            .func = hf_cmd_tbl[HF_CMD_IDX_LAT].handler,
+        };
+        ESP_ERROR_CHECK(esp_console_cmd_register(&lat_cmd));
+
+        const esp_console_cmd_t prof_cmd = {
+            .command = "prof",
+            .help = hf_cmd_explain[HF_CMD_IDX_PROF],
+            .hint = "[reset]",
+            .func = hf_cmd_tbl[HF_CMD_IDX_PROF].handler,
+        };
+        ESP_ERROR_CHECK(esp_console_cmd_register(&prof_cmd));
+
+        const esp_console_cmd_t stats_cmd = {
+            .command = "stats",
+            .help = hf_cmd_explain[HF_CMD_IDX_STATS],
+            .hint = "[reset|bin]",
+            .func = hf_cmd_tbl[HF_CMD_IDX_STATS].handler,
+        };
+        ESP_ERROR_CHECK(esp_console_cmd_register(&stats_cmd));
+
+        const esp_console_cmd_t pbbench_cmd = {
+            .command = "pbbench",
+            .help = hf_cmd_explain[HF_CMD_IDX_PBBENCH],
+            .hint = "[contacts]",
+            .func = hf_cmd_tbl[HF_CMD_IDX_PBBENCH].handler,
+        };
+        ESP_ERROR_CHECK(esp_console_cmd_register(&pbbench_cmd));
+
+        const esp_console_cmd_t pbl_cmd = {
+            .command = "pbl",
+            .help = hf_cmd_explain[HF_CMD_IDX_PBL],
+            .hint = "<letter|page>",
+            .func = hf_cmd_tbl[HF_CMD_IDX_PBL].handler,
+        };
+        ESP_ERROR_CHECK(esp_console_cmd_register(&pbl_cmd));
+
+        const esp_console_cmd_t pbf_cmd = {
+            .command = "pbf",
+            .help = hf_cmd_explain[HF_CMD_IDX_PBF],
+            .hint = "<name>",
+            .func = hf_cmd_tbl[HF_CMD_IDX_PBF].handler,
+        };
+        ESP_ERROR_CHECK(esp_console_cmd_register(&pbf_cmd));
 }
@@ -0,0 +1,57 @@
+/*
+ * app_task_config.h - core affinity, priority and stack size of every task
+ *
+ * The ESP32 has two cores. The Bluetooth controller and the Bluedroid host
+ * run on one of them (CONFIG_BTDM_CTRL_PINNED_TO_CORE and
+ * CONFIG_BT_BLUEDROID_PINNED_TO_CORE), together with everything that talks
+ * to the stack or to flash. The other core is left to the real-time audio
+ * engine (CONFIG_APP_AUDIO_CORE), so an mSBC frame never waits behind
+ * Bluedroid or a SPIFFS write.
+ */
+
+#ifndef __APP_TASK_CONFIG_H__
+#define __APP_TASK_CONFIG_H__
+
+#include "sdkconfig.h"
+
+#if CONFIG_FREERTOS_UNICORE
+#define APP_BT_CORE                     0
+#define APP_AUDIO_CORE                  0
+#else
+#define APP_BT_CORE                     CONFIG_BT_BLUEDROID_PINNED_TO_CORE
+#define APP_AUDIO_CORE                  CONFIG_APP_AUDIO_CORE
+#if CONFIG_BTDM_CTRL_PINNED_TO_CORE != CONFIG_BT_BLUEDROID_PINNED_TO_CORE
+#warning "BT controller and Bluedroid host are pinned to different cores; the audio core is no longer exclusive"
+#endif
+#if CONFIG_APP_AUDIO_CORE == CONFIG_BT_BLUEDROID_PINNED_TO_CORE
+#warning "Audio tasks share the Bluedroid core; calls may glitch behind stack and flash work"
+#endif
+#endif
+
+/* Priorities and stack sizes are set under "Task placement" in menuconfig */
+
+/* BT core: stack glue and control */
+#define APP_BT_TASK_PRIO                CONFIG_APP_BT_TASK_PRIO             /* BtAppT work dispatcher */
+#define APP_BT_TASK_STACK               CONFIG_APP_BT_TASK_STACK
+#define APP_HFP_CTRL_TASK_PRIO          CONFIG_APP_HFP_CTRL_TASK_PRIO       /* one-shot audio teardown */
+#define APP_HFP_CTRL_TASK_STACK         CONFIG_APP_HFP_CTRL_TASK_STACK
+
+/* BT core: bulk work, always below the stack */
+#define APP_PBAC_TASK_PRIO              CONFIG_APP_PBAC_TASK_PRIO           /* vCard parsing and SPIFFS writes */
+#define APP_PBAC_TASK_STACK             CONFIG_APP_PBAC_TASK_STACK
+#define APP_FLASH_SCHED_TASK_PRIO       CONFIG_APP_FLASH_SCHED_TASK_PRIO    /* drains queued SPIFFS writes ahead of parsing */
+#define APP_FLASH_SCHED_TASK_STACK      CONFIG_APP_FLASH_SCHED_TASK_STACK
+
+/* audio core: nothing else is pinned here */
+#define APP_HFP_TX_TASK_PRIO            CONFIG_APP_HFP_TX_TASK_PRIO         /* speaker: ringbuffer -> I2S */
+#define APP_HFP_TX_TASK_STACK           CONFIG_APP_HFP_TX_TASK_STACK
+#define APP_HFP_RX_TASK_PRIO            CONFIG_APP_HFP_RX_TASK_PRIO         /* mic: I2S -> mSBC -> ringbuffer */
+#define APP_HFP_RX_TASK_STACK           CONFIG_APP_HFP_RX_TASK_STACK
+#define APP_A2DP_TX_TASK_PRIO           CONFIG_APP_A2DP_TX_TASK_PRIO        /* music: below the call audio */
+#define APP_A2DP_TX_TASK_STACK          CONFIG_APP_A2DP_TX_TASK_STACK
+#define APP_RINGTONE_TASK_PRIO          CONFIG_APP_RINGTONE_TASK_PRIO
+#define APP_RINGTONE_TASK_STACK         CONFIG_APP_RINGTONE_TASK_STACK
+#define APP_LOOPBACK_TASK_PRIO          CONFIG_APP_LOOPBACK_TASK_PRIO       /* stands in for the SCO data callback */
+#define APP_LOOPBACK_TASK_STACK         CONFIG_APP_LOOPBACK_TASK_STACK
+
+#endif /* __APP_TASK_CONFIG_H__ */
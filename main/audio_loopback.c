@@ -0,0 +1,384 @@
+/*
+ * audio_loopback.c - call audio loopback and latency measurement, no phone needed
+ */
+
+#include "audio_loopback.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <inttypes.h>
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_hf_client_api.h"
+#include "app_task_config.h"
+#include "bt_app_hf.h"
+#include "bt_i2s.h"
+#include "codec.h"
+#include "flash_sched.h"
+#include "latency_trace.h"
+#include "cycle_prof.h"
+
+#define TAG "LOOPBACK"
+
+#define LOOP_SAMPLE_RATE        16000
+#define LOOP_FRAME_US           (MSBC_FRAME_SAMPLES * 1000000 / LOOP_SAMPLE_RATE)  // one SCO interval
+#define LOOP_LINE_FRAMES        (AUDIO_LOOPBACK_MAX_DELAY_MS * 1000 / LOOP_FRAME_US + 1)
+#define LOOP_CHIRP_LEN          (AUDIO_LOOPBACK_CHIRP_MS * LOOP_SAMPLE_RATE / 1000)
+#define LOOP_CHIRP_F0           300.0f
+#define LOOP_CHIRP_F1           6000.0f
+#define LOOP_CHIRP_AMPLITUDE    8000.0f     // -12 dBFS
+#define LOOP_CHIRP_RAMP         (LOOP_SAMPLE_RATE / 200)   // 5 ms raised-cosine ends
+#define LOOP_REC_LEN            (AUDIO_LOOPBACK_RECORD_MS * LOOP_SAMPLE_RATE / 1000)
+#define LOOP_REC_FRAMES         (LOOP_REC_LEN / MSBC_FRAME_SAMPLES + 1)
+#define LOOP_MEASURE_TIMEOUT_MS (3 * AUDIO_LOOPBACK_RECORD_MS)
+
+enum {
+    LOOP_MEAS_IDLE = 0,
+    LOOP_MEAS_ARMED,        // inject from the next mic frame on
+    LOOP_MEAS_RUNNING,      // injecting and recording
+    LOOP_MEAS_DONE,         // recording full
+};
+
+// a frame handed to the speaker output stage while recording
+typedef struct {
+    uint32_t start;         // index of its first sample in the recording
+    int64_t t_us;
+} loop_rec_frame_t;
+
+static TaskHandle_t s_loop_task = NULL;
+static esp_timer_handle_t s_loop_timer = NULL;
+static SemaphoreHandle_t s_loop_done = NULL;
+static volatile bool s_loop_running = false;
+static audio_loopback_status_t s_status;
+static uint32_t s_delay_frames;
+static uint32_t s_loss_seed;
+
+/* simulated SCO link: encoded frames wait here for the configured delay */
+static uint8_t s_sco_line[LOOP_LINE_FRAMES][ESP_HF_MSBC_ENCODED_FRAME_SIZE];
+static bool s_sco_valid[LOOP_LINE_FRAMES];
+static uint32_t s_sco_head;
+static uint8_t s_decoded_frame[MSBC_FRAME_SAMPLES * 2];
+
+static volatile int s_meas_state = LOOP_MEAS_IDLE;
+static uint32_t s_taps_busy;            // taps between their state check and their last buffer access
+static int16_t *s_chirp = NULL;
+static uint32_t s_chirp_pos;
+static int64_t s_inject_us;             // capture time of the first chirp sample
+static int16_t *s_rec = NULL;
+static uint32_t s_rec_len;
+static loop_rec_frame_t *s_rec_frames = NULL;
+static uint32_t s_rec_frame_count;
+
+/*
+    one SCO interval: what the Bluetooth stack does in the audio data
+    callback, with the air link replaced by a delay line
+ */
+static IRAM_ATTR void audio_loopback_sco_frame(void)
+{
+    uint32_t slot = s_sco_head % LOOP_LINE_FRAMES;
+    bool valid = bt_i2s_hfp_read_rx_ringbuf(s_sco_line[slot]) == ESP_HF_MSBC_ENCODED_FRAME_SIZE;
+    if (!valid) {
+        s_status.frames_empty++;
+    } else if (s_status.loss_pct > 0) {
+        s_loss_seed = s_loss_seed * 1664525u + 1013904223u;
+        if ((s_loss_seed >> 16) % 100 < s_status.loss_pct) {
+            valid = false;
+            s_status.frames_lost++;
+        }
+    }
+    s_sco_valid[slot] = valid;
+    s_sco_head++;
+    s_status.frames++;
+
+    if (s_sco_head <= s_delay_frames) {
+        return;
+    }
+    uint32_t out = (s_sco_head - 1 - s_delay_frames) % LOOP_LINE_FRAMES;
+    if (s_sco_valid[out]) {
+        size_t decoded_len;
+        int64_t dec_start_us = esp_timer_get_time();
+        uint32_t prof = cycle_prof_begin();
+        int dec_ret = msbc_dec_data(s_sco_line[out], ESP_HF_MSBC_ENCODED_FRAME_SIZE, s_decoded_frame, &decoded_len);
+        cycle_prof_end(PROF_SPK_DECODE, prof);
+        latency_trace_record(LT_SPK_DECODE, (uint32_t)(esp_timer_get_time() - dec_start_us));
+        if (dec_ret == 0) {
+            bt_i2s_hfp_write_tx_ringbuf(s_decoded_frame, decoded_len);
+        }
+    }
+}
+
+static void audio_loopback_tick(void *arg)
+{
+    (void)arg;
+    xTaskNotifyGive(s_loop_task);
+}
+
+static void audio_loopback_task(void *arg)
+{
+    (void)arg;
+    while (s_loop_running) {
+        if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100)) == 0) {
+            continue;
+        }
+        audio_loopback_sco_frame();
+    }
+    xSemaphoreGive(s_loop_done);
+    vTaskDelete(NULL);
+}
+
+esp_err_t audio_loopback_start(uint32_t delay_ms, uint32_t loss_pct)
+{
+    if (s_loop_running || bt_app_hf_audio_connected()) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (delay_ms > AUDIO_LOOPBACK_MAX_DELAY_MS || loss_pct > 100) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (s_loop_done == NULL && (s_loop_done = xSemaphoreCreateBinary()) == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    if (s_loop_timer == NULL) {
+        const esp_timer_create_args_t args = {
+            .callback = audio_loopback_tick,
+            .name = "loopback",
+        };
+        esp_err_t err = esp_timer_create(&args, &s_loop_timer);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+
+    memset(&s_status, 0, sizeof(s_status));
+    s_status.running = true;
+    s_status.delay_ms = delay_ms;
+    s_status.loss_pct = loss_pct;
+    s_delay_frames = delay_ms * 1000 / LOOP_FRAME_US;
+    s_loss_seed = 0x2545f491;
+    s_sco_head = 0;
+
+    ESP_LOGI(TAG, "%s - delay %"PRIu32" ms, loss %"PRIu32"%%", __func__, delay_ms, loss_pct);
+    flash_sched_set_audio_active(true);
+    bt_i2s_hfp_start();
+    s_loop_running = true;
+    if (xTaskCreatePinnedToCore(audio_loopback_task, "LoopbackSco", APP_LOOPBACK_TASK_STACK, NULL,
+                                APP_LOOPBACK_TASK_PRIO, &s_loop_task, APP_BT_CORE) != pdPASS) {
+        s_loop_running = false;
+        s_status.running = false;
+        bt_i2s_hfp_stop();
+        flash_sched_set_audio_active(false);
+        return ESP_ERR_NO_MEM;
+    }
+    esp_timer_start_periodic(s_loop_timer, LOOP_FRAME_US);
+    return ESP_OK;
+}
+
+void audio_loopback_stop(void)
+{
+    if (!s_loop_running) {
+        return;
+    }
+    esp_timer_stop(s_loop_timer);
+    s_loop_running = false;
+    xSemaphoreTake(s_loop_done, portMAX_DELAY);
+    s_loop_task = NULL;
+    s_status.running = false;
+    bt_i2s_hfp_stop();
+    flash_sched_set_audio_active(false);
+    ESP_LOGI(TAG, "%s - %"PRIu32" frames, %"PRIu32" lost, %"PRIu32" empty",
+             __func__, s_status.frames, s_status.frames_lost, s_status.frames_empty);
+}
+
+bool audio_loopback_running(void)
+{
+    return s_loop_running;
+}
+
+void audio_loopback_get_status(audio_loopback_status_t *status)
+{
+    *status = s_status;
+}
+
+/*
+    A tap counts itself busy before it looks at the state, so once the state
+    is back to idle and the count is zero no tap can still reach the buffers
+ */
+static IRAM_ATTR void loop_tap_enter(void)
+{
+    __atomic_add_fetch(&s_taps_busy, 1, __ATOMIC_SEQ_CST);
+}
+
+static IRAM_ATTR void loop_tap_leave(void)
+{
+    __atomic_sub_fetch(&s_taps_busy, 1, __ATOMIC_SEQ_CST);
+}
+
+IRAM_ATTR void audio_loopback_mic_tap(int16_t *pcm, size_t samples, int64_t capture_us)
+{
+    loop_tap_enter();
+    if (s_meas_state == LOOP_MEAS_ARMED) {
+        s_inject_us = capture_us - (int64_t)samples * 1000000 / LOOP_SAMPLE_RATE;
+        s_chirp_pos = 0;
+        s_meas_state = LOOP_MEAS_RUNNING;
+    }
+    if (s_meas_state == LOOP_MEAS_RUNNING) {
+        /* the chirp, then silence until the recording is complete */
+        for (size_t i = 0; i < samples; i++) {
+            pcm[i] = (s_chirp_pos < LOOP_CHIRP_LEN) ? s_chirp[s_chirp_pos++] : 0;
+        }
+    }
+    loop_tap_leave();
+}
+
+IRAM_ATTR void audio_loopback_spk_tap(const int16_t *pcm, size_t samples)
+{
+    loop_tap_enter();
+    if (s_meas_state != LOOP_MEAS_RUNNING) {
+        loop_tap_leave();
+        return;
+    }
+    if (s_rec_frame_count < LOOP_REC_FRAMES) {
+        s_rec_frames[s_rec_frame_count].start = s_rec_len;
+        s_rec_frames[s_rec_frame_count].t_us = esp_timer_get_time();
+        s_rec_frame_count++;
+    }
+    size_t n = LOOP_REC_LEN - s_rec_len;
+    if (n > samples) {
+        n = samples;
+    }
+    memcpy(&s_rec[s_rec_len], pcm, n * sizeof(int16_t));
+    s_rec_len += n;
+    if (s_rec_len == LOOP_REC_LEN) {
+        s_meas_state = LOOP_MEAS_DONE;
+    }
+    loop_tap_leave();
+}
+
+static void audio_loopback_make_chirp(int16_t *chirp)
+{
+    const float duration = (float)LOOP_CHIRP_LEN / LOOP_SAMPLE_RATE;
+    for (int i = 0; i < LOOP_CHIRP_LEN; i++) {
+        float t = (float)i / LOOP_SAMPLE_RATE;
+        float phase = 2.0f * (float)M_PI * (LOOP_CHIRP_F0 * t + (LOOP_CHIRP_F1 - LOOP_CHIRP_F0) * t * t / (2.0f * duration));
+        float gain = 1.0f;
+        int edge = (i < LOOP_CHIRP_LEN / 2) ? i : LOOP_CHIRP_LEN - 1 - i;
+        if (edge < LOOP_CHIRP_RAMP) {
+            gain = 0.5f - 0.5f * cosf((float)M_PI * edge / LOOP_CHIRP_RAMP);
+        }
+        chirp[i] = (int16_t)(LOOP_CHIRP_AMPLITUDE * gain * sinf(phase));
+    }
+}
+
+/*
+    find the chirp in the recording by cross-correlation, then compare it
+    with the reference sample by sample: gain-matched residual gives the
+    SNR, and 7.5 ms frames whose own SNR falls well below the overall one
+    are counted as glitches (a lost packet, concealment, a bad splice)
+ */
+static void audio_loopback_analyse(audio_loopback_result_t *result)
+{
+    float ref_energy = 0.0f;
+    for (int i = 0; i < LOOP_CHIRP_LEN; i++) {
+        ref_energy += (float)s_chirp[i] * s_chirp[i];
+    }
+
+    uint32_t best_lag = 0;
+    float best = 0.0f;
+    for (uint32_t lag = 0; lag + LOOP_CHIRP_LEN <= s_rec_len; lag++) {
+        float acc = 0.0f;
+        for (int i = 0; i < LOOP_CHIRP_LEN; i++) {
+            acc += (float)s_chirp[i] * s_rec[lag + i];
+        }
+        if (acc > best) {
+            best = acc;
+            best_lag = lag;
+        }
+    }
+
+    const int16_t *rec = &s_rec[best_lag];
+    float rec_energy = 0.0f;
+    for (int i = 0; i < LOOP_CHIRP_LEN; i++) {
+        rec_energy += (float)rec[i] * rec[i];
+    }
+    result->peak = (rec_energy > 0.0f) ? best / sqrtf(ref_energy * rec_energy) : 0.0f;
+
+    float g = best / ref_energy;
+    float sig_sum = 0.0f, err_sum = 0.0f;
+    float frame_sig[LOOP_CHIRP_LEN / MSBC_FRAME_SAMPLES] = {0};
+    float frame_err[LOOP_CHIRP_LEN / MSBC_FRAME_SAMPLES] = {0};
+    const int frames = LOOP_CHIRP_LEN / MSBC_FRAME_SAMPLES;
+    for (int i = 0; i < frames * MSBC_FRAME_SAMPLES; i++) {
+        float s = g * s_chirp[i];
+        float e = rec[i] - s;
+        frame_sig[i / MSBC_FRAME_SAMPLES] += s * s;
+        frame_err[i / MSBC_FRAME_SAMPLES] += e * e;
+        sig_sum += s * s;
+        err_sum += e * e;
+    }
+    result->snr_db = (err_sum > 0.0f) ? 10.0f * log10f(sig_sum / err_sum) : 99.0f;
+    result->frames = frames;
+    result->glitches = 0;
+    for (int f = 0; f < frames; f++) {
+        float snr = (frame_err[f] > 0.0f) ? 10.0f * log10f(frame_sig[f] / frame_err[f]) : 99.0f;
+        if (snr < result->snr_db - AUDIO_LOOPBACK_GLITCH_DB) {
+            result->glitches++;
+        }
+    }
+
+    /* time the chirp start was handed to the output stage */
+    uint32_t k = 0;
+    while (k + 1 < s_rec_frame_count && s_rec_frames[k + 1].start <= best_lag) {
+        k++;
+    }
+    int64_t t_us = s_rec_frames[k].t_us +
+                   (int64_t)(best_lag - s_rec_frames[k].start) * 1000000 / LOOP_SAMPLE_RATE;
+    result->latency_us = (t_us > s_inject_us) ? (uint32_t)(t_us - s_inject_us) : 0;
+}
+
+esp_err_t audio_loopback_measure(audio_loopback_result_t *result)
+{
+    if (!s_loop_running || s_meas_state != LOOP_MEAS_IDLE) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    s_chirp = malloc(LOOP_CHIRP_LEN * sizeof(int16_t));
+    s_rec = malloc(LOOP_REC_LEN * sizeof(int16_t));
+    s_rec_frames = malloc(LOOP_REC_FRAMES * sizeof(loop_rec_frame_t));
+    esp_err_t err = ESP_OK;
+    if (s_chirp == NULL || s_rec == NULL || s_rec_frames == NULL) {
+        err = ESP_ERR_NO_MEM;
+        goto out;
+    }
+    audio_loopback_make_chirp(s_chirp);
+    s_rec_len = 0;
+    s_rec_frame_count = 0;
+    s_meas_state = LOOP_MEAS_ARMED;
+
+    int waited_ms = 0;
+    while (s_meas_state != LOOP_MEAS_DONE && waited_ms < LOOP_MEASURE_TIMEOUT_MS) {
+        vTaskDelay(pdMS_TO_TICKS(50));
+        waited_ms += 50;
+    }
+    bool done = (s_meas_state == LOOP_MEAS_DONE);
+    /* take the buffers back from the taps: none starts on them from here, wait out one mid-frame */
+    __atomic_store_n(&s_meas_state, LOOP_MEAS_IDLE, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&s_taps_busy, __ATOMIC_SEQ_CST) != 0) {
+        vTaskDelay(1);
+    }
+    if (!done) {
+        err = ESP_ERR_TIMEOUT;
+        goto out;
+    }
+    audio_loopback_analyse(result);
+
+out:
+    free(s_chirp);
+    free(s_rec);
+    free(s_rec_frames);
+    s_chirp = NULL;
+    s_rec = NULL;
+    s_rec_frames = NULL;
+    return err;
+}
@@ -0,0 +1,69 @@
+/*
+ * audio_loopback.h - call audio loopback and latency measurement, no phone needed
+ *
+ * Runs the HFP audio path against itself: mic -> i2s_32bit_to_16bit_pcm ->
+ * msbc_enc_data -> mic ringbuffer -> simulated SCO link (fixed delay, random
+ * packet loss) -> msbc_dec_data -> speaker ringbuffer -> speaker. A task
+ * paced at the SCO interval plays the part of the Bluetooth stack.
+ *
+ * audio_loopback_measure() replaces the mic input with a chirp, records
+ * what reaches the speaker output stage and cross-correlates the two, which
+ * gives the latency from mic capture to speaker output, the SNR of the
+ * path and the number of frames damaged on the way.
+ */
+
+#ifndef AUDIO_LOOPBACK_H
+#define AUDIO_LOOPBACK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AUDIO_LOOPBACK_MAX_DELAY_MS     200     // simulated SCO link delay
+#define AUDIO_LOOPBACK_CHIRP_MS         100     // 300 Hz -> 6 kHz linear sweep
+#define AUDIO_LOOPBACK_RECORD_MS        1000    // speaker output captured per measurement
+#define AUDIO_LOOPBACK_GLITCH_DB        10      // a frame this far below the overall SNR is a glitch
+
+typedef struct {
+    bool running;
+    uint32_t delay_ms;
+    uint32_t loss_pct;
+    uint32_t frames;            // SCO intervals since start
+    uint32_t frames_lost;       // dropped by the loss simulation
+    uint32_t frames_empty;      // nothing from the mic ringbuffer yet
+} audio_loopback_status_t;
+
+typedef struct {
+    uint32_t latency_us;        // mic capture to speaker output stage
+    float snr_db;
+    float peak;                 // correlation peak, normalized; low means the chirp was not found
+    uint32_t frames;            // 7.5 ms frames of the chirp compared
+    uint32_t glitches;
+} audio_loopback_result_t;
+
+// Start the loop; fails if call audio is connected
+esp_err_t audio_loopback_start(uint32_t delay_ms, uint32_t loss_pct);
+
+void audio_loopback_stop(void);
+
+bool audio_loopback_running(void);
+
+void audio_loopback_get_status(audio_loopback_status_t *status);
+
+// Inject a chirp and analyse it; blocks for about AUDIO_LOOPBACK_RECORD_MS
+esp_err_t audio_loopback_measure(audio_loopback_result_t *result);
+
+// Taps in the HFP audio tasks
+void audio_loopback_mic_tap(int16_t *pcm, size_t samples, int64_t capture_us);
+void audio_loopback_spk_tap(const int16_t *pcm, size_t samples);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // AUDIO_LOOPBACK_H
@@ -0,0 +1,216 @@
+/*
+ * bt_app_av.c - A2DP sink and AVRCP absolute volume
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_bt_defs.h"
+#include "esp_a2dp_api.h"
+#include "esp_avrc_api.h"
+
+#include "bt_app_core.h"
+#include "bt_app_av.h"
+#include "bt_i2s.h"
+
+/* A2DP event strings, indexed by esp_a2d_connection_state_t / esp_a2d_audio_state_t */
+static const char *s_a2d_conn_state_str[] = {"disconnected", "connecting", "connected", "disconnecting"};
+static const char *s_a2d_audio_state_str[] = {"suspended", "started"};
+
+static bool s_a2d_streaming = false;
+static uint8_t s_volume = BT_APP_AV_DEFAULT_VOLUME;
+static bool s_volume_notify = false;   /* phone registered for volume change notifications */
+
+static void bt_av_hdl_a2d_evt(uint16_t event, void *p_param);
+static void bt_av_hdl_avrc_tg_evt(uint16_t event, void *p_param);
+
+/*
+    decoded PCM from the stack's SBC decoder, copied once into the I2S
+    ringbuffer; runs in the BTC task
+ */
+static IRAM_ATTR void bt_app_a2d_data_cb(const uint8_t *data, uint32_t len)
+{
+    bt_i2s_a2dp_write_tx_ringbuf(data, len);
+}
+
+static void bt_app_a2d_cb(esp_a2d_cb_event_t event, esp_a2d_cb_param_t *param)
+{
+    switch (event) {
+    case ESP_A2D_CONNECTION_STATE_EVT:
+    case ESP_A2D_AUDIO_STATE_EVT:
+    case ESP_A2D_AUDIO_CFG_EVT:
+    case ESP_A2D_PROF_STATE_EVT:
+        bt_app_work_dispatch(bt_av_hdl_a2d_evt, event, param, sizeof(esp_a2d_cb_param_t), NULL);
+        break;
+    default:
+        ESP_LOGD(BT_AV_TAG, "%s unhandled event: %d", __func__, event);
+        break;
+    }
+}
+
+static void bt_app_rc_ct_cb(esp_avrc_ct_cb_event_t event, esp_avrc_ct_cb_param_t *param)
+{
+    if (event == ESP_AVRC_CT_CONNECTION_STATE_EVT) {
+        ESP_LOGI(BT_RC_CT_TAG, "AVRC controller %s", param->conn_stat.connected ? "connected" : "disconnected");
+    }
+}
+
+static void bt_app_rc_tg_cb(esp_avrc_tg_cb_event_t event, esp_avrc_tg_cb_param_t *param)
+{
+    switch (event) {
+    case ESP_AVRC_TG_CONNECTION_STATE_EVT:
+    case ESP_AVRC_TG_SET_ABSOLUTE_VOLUME_CMD_EVT:
+    case ESP_AVRC_TG_REGISTER_NOTIFICATION_EVT:
+        bt_app_work_dispatch(bt_av_hdl_avrc_tg_evt, event, param, sizeof(esp_avrc_tg_cb_param_t), NULL);
+        break;
+    default:
+        ESP_LOGD(BT_RC_TG_TAG, "%s unhandled event: %d", __func__, event);
+        break;
+    }
+}
+
+static int bt_av_sbc_sample_rate(const esp_a2d_mcc_t *mcc)
+{
+    uint8_t samp_freq = mcc->cie.sbc_info.samp_freq;
+    if (samp_freq & ESP_A2D_SBC_CIE_SF_48K) {
+        return 48000;
+    } else if (samp_freq & ESP_A2D_SBC_CIE_SF_44K) {
+        return 44100;
+    } else if (samp_freq & ESP_A2D_SBC_CIE_SF_32K) {
+        return 32000;
+    }
+    return 16000;
+}
+
+static void bt_av_hdl_a2d_evt(uint16_t event, void *p_param)
+{
+    esp_a2d_cb_param_t *a2d = (esp_a2d_cb_param_t *)p_param;
+
+    switch (event) {
+    case ESP_A2D_CONNECTION_STATE_EVT: {
+        uint8_t *bda = a2d->conn_stat.remote_bda;
+        ESP_LOGI(BT_AV_TAG, "A2DP connection state: %s, [%02x:%02x:%02x:%02x:%02x:%02x]",
+                 s_a2d_conn_state_str[a2d->conn_stat.state], bda[0], bda[1], bda[2], bda[3], bda[4], bda[5]);
+        if (a2d->conn_stat.state == ESP_A2D_CONNECTION_STATE_DISCONNECTED && s_a2d_streaming) {
+            s_a2d_streaming = false;
+            bt_i2s_a2dp_task_shut_down();
+        }
+        break;
+    }
+    case ESP_A2D_AUDIO_STATE_EVT: {
+        bool started = (a2d->audio_stat.state == ESP_A2D_AUDIO_STATE_STARTED);
+        ESP_LOGI(BT_AV_TAG, "A2DP audio state: %s", s_a2d_audio_state_str[started ? 1 : 0]);
+        if (started && !s_a2d_streaming) {
+            s_a2d_streaming = true;
+            bt_i2s_a2dp_task_start_up();
+        } else if (!started && s_a2d_streaming) {
+            s_a2d_streaming = false;
+            bt_i2s_a2dp_task_shut_down();
+        }
+        break;
+    }
+    case ESP_A2D_AUDIO_CFG_EVT: {
+        if (a2d->audio_cfg.mcc.type == ESP_A2D_MCT_SBC) {
+            int sample_rate = bt_av_sbc_sample_rate(&a2d->audio_cfg.mcc);
+            int ch_count = (a2d->audio_cfg.mcc.cie.sbc_info.ch_mode & ESP_A2D_SBC_CIE_CH_MODE_MONO) ? 1 : 2;
+            ESP_LOGI(BT_AV_TAG, "A2DP audio config: SBC, %d Hz, %d channel(s)", sample_rate, ch_count);
+            bt_i2s_tx_channel_reconfig_clock_slot(sample_rate, ch_count);
+        } else {
+            ESP_LOGW(BT_AV_TAG, "A2DP audio config: unsupported codec type %d", a2d->audio_cfg.mcc.type);
+        }
+        break;
+    }
+    case ESP_A2D_PROF_STATE_EVT:
+        if (a2d->a2d_prof_stat.init_state == ESP_A2D_INIT_SUCCESS) {
+            ESP_LOGI(BT_AV_TAG, "A2DP sink initialized");
+        } else {
+            ESP_LOGI(BT_AV_TAG, "A2DP sink deinitialized");
+        }
+        break;
+    default:
+        ESP_LOGE(BT_AV_TAG, "%s unhandled event: %d", __func__, event);
+        break;
+    }
+}
+
+static void bt_av_hdl_avrc_tg_evt(uint16_t event, void *p_param)
+{
+    esp_avrc_tg_cb_param_t *rc = (esp_avrc_tg_cb_param_t *)p_param;
+
+    switch (event) {
+    case ESP_AVRC_TG_CONNECTION_STATE_EVT:
+        ESP_LOGI(BT_RC_TG_TAG, "AVRC target %s", rc->conn_stat.connected ? "connected" : "disconnected");
+        if (!rc->conn_stat.connected) {
+            s_volume_notify = false;
+        }
+        break;
+    case ESP_AVRC_TG_SET_ABSOLUTE_VOLUME_CMD_EVT:
+        ESP_LOGI(BT_RC_TG_TAG, "volume set by phone: %d%%", (int)rc->set_abs_vol.volume * 100 / 0x7f);
+        s_volume = rc->set_abs_vol.volume;
+        bt_i2s_a2dp_set_volume(s_volume);
+        break;
+    case ESP_AVRC_TG_REGISTER_NOTIFICATION_EVT:
+        if (rc->reg_ntf.event_id == ESP_AVRC_RN_VOLUME_CHANGE) {
+            esp_avrc_rn_param_t rn_param = { .volume = s_volume };
+            s_volume_notify = true;
+            esp_avrc_tg_send_rn_rsp(ESP_AVRC_RN_VOLUME_CHANGE, ESP_AVRC_RN_RSP_INTERIM, &rn_param);
+        }
+        break;
+    default:
+        ESP_LOGE(BT_RC_TG_TAG, "%s unhandled event: %d", __func__, event);
+        break;
+    }
+}
+
+void bt_app_av_init(void)
+{
+    esp_err_t ret;
+
+    esp_avrc_ct_register_callback(bt_app_rc_ct_cb);
+    if ((ret = esp_avrc_ct_init()) != ESP_OK) {
+        ESP_LOGE(BT_RC_CT_TAG, "%s AVRC controller init failed: %s", __func__, esp_err_to_name(ret));
+    }
+    if ((ret = esp_avrc_tg_init()) != ESP_OK) {
+        ESP_LOGE(BT_RC_TG_TAG, "%s AVRC target init failed: %s", __func__, esp_err_to_name(ret));
+    }
+    esp_avrc_tg_register_callback(bt_app_rc_tg_cb);
+
+    /* only volume change notifications are offered to the phone */
+    esp_avrc_rn_evt_cap_mask_t evt_set = {0};
+    esp_avrc_rn_evt_bit_mask_operation(ESP_AVRC_BIT_MASK_OP_SET, &evt_set, ESP_AVRC_RN_VOLUME_CHANGE);
+    esp_avrc_tg_set_rn_evt_cap(&evt_set);
+
+    bt_i2s_a2dp_set_volume(s_volume);
+    esp_a2d_register_callback(bt_app_a2d_cb);
+    esp_a2d_sink_register_data_callback(bt_app_a2d_data_cb);
+    if ((ret = esp_a2d_sink_init()) != ESP_OK) {
+        ESP_LOGE(BT_AV_TAG, "%s A2DP sink init failed: %s", __func__, esp_err_to_name(ret));
+    }
+}
+
+void bt_app_av_set_volume(uint8_t volume)
+{
+    if (volume > 0x7f) {
+        volume = 0x7f;
+    }
+    s_volume = volume;
+    bt_i2s_a2dp_set_volume(volume);
+    if (s_volume_notify) {
+        /* a CHANGED response ends the registration; the phone registers again */
+        esp_avrc_rn_param_t rn_param = { .volume = volume };
+        s_volume_notify = false;
+        esp_avrc_tg_send_rn_rsp(ESP_AVRC_RN_VOLUME_CHANGE, ESP_AVRC_RN_RSP_CHANGED, &rn_param);
+    }
+}
+
+uint8_t bt_app_av_get_volume(void)
+{
+    return s_volume;
+}
+
+bool bt_app_av_is_streaming(void)
+{
+    return s_a2d_streaming;
+}
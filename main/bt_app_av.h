@@ -0,0 +1,33 @@
+/*
+ * bt_app_av.h - A2DP sink and AVRCP absolute volume
+ *
+ * Decoded A2DP audio goes straight into the I2S A2DP ringbuffer
+ * (bt_i2s_a2dp_write_tx_ringbuf). The ringbuffer and its tx task are
+ * created once at boot; stream start/suspend only switches the tx channel
+ * between modes, so calls and music share it without reallocating.
+ */
+
+#ifndef __BT_APP_AV_H__
+#define __BT_APP_AV_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_a2dp_api.h"
+#include "esp_avrc_api.h"
+
+#define BT_AV_TAG               "BT_AV"
+#define BT_RC_TG_TAG            "RC_TG"
+#define BT_RC_CT_TAG            "RC_CT"
+
+#define BT_APP_AV_DEFAULT_VOLUME    100     // AVRCP scale, 0..127
+
+/* register the A2DP sink and AVRCP controller/target; call once the stack is up */
+void bt_app_av_init(void);
+
+/* set the local volume (0..127) and tell the phone, if it asked to be notified */
+void bt_app_av_set_volume(uint8_t volume);
+uint8_t bt_app_av_get_volume(void);
+
+bool bt_app_av_is_streaming(void);
+
+#endif /* __BT_APP_AV_H__ */
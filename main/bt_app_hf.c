@@ -10,9 +10,12 @@
 #include <string.h>
 #include <inttypes.h>
 #include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_timer.h"
 
 #include "bt_app_core.h"
 #include "bt_app_hf.h"
+#include "flash_sched.h"
 #include "esp_bt_main.h"
 #include "esp_bt_device.h"
 #include "esp_gap_bt_api.h"
@@ -31,6 +34,11 @@
 #include "codec.h"
 #include "bt_app_pbac.h"
 #include "ringtone.h"
+#include "audio_loopback.h"
+#include "latency_trace.h"
+#include "cycle_prof.h"
+#include "metrics.h"
+#include "app_task_config.h"
 
 const char *c_hf_evt_str[] = {
     "CONNECTION_STATE_EVT",              /*!< connection state changed event */
@@ -175,6 +183,8 @@ const char *c_inband_ring_state_str[] = {
     "Provided",
 };
 
+static void kill_hfp_audio_task(void *pvParameters);
+
 extern esp_bd_addr_t peer_addr;
 // If you want to connect a specific device, add it's address here
 // esp_bd_addr_t peer_addr = {0xac, 0x67, 0xb2, 0x53, 0x77, 0xbe};
@@ -186,7 +196,11 @@ static bool s_msbc_air_mode = false;
 QueueHandle_t s_audio_buff_queue = NULL;
 static int s_audio_buff_cnt = 0;
 
-static int s_audio_callback_cnt = 0;
+static int64_t s_last_callback_us;
+static metric_t *s_m_sco_frames;
+static metric_t *s_m_sco_bad_frames;
+static metric_t *s_m_sco_send_failed;
+static metric_t *s_m_sco_interval;
 
 extern i2s_chan_handle_t tx_chan;
 extern i2s_chan_handle_t rx_chan;
@@ -206,52 +220,110 @@ void on_incoming_call(const char *caller_number)
     }
 }
 
-static void bt_app_hf_client_audio_data_cb(esp_hf_sync_conn_hdl_t sync_conn_hdl, esp_hf_audio_buff_t *audio_buf, bool is_bad_frame)
+/* decoded speaker frame; static so the per-frame path never touches the heap */
+static uint8_t s_decoded_frame[MSBC_FRAME_SAMPLES * 2];
+
+static IRAM_ATTR void bt_app_hf_client_audio_data_cb(esp_hf_sync_conn_hdl_t sync_conn_hdl, esp_hf_audio_buff_t *audio_buf, bool is_bad_frame)
 {
     if (!s_hfp_audio_connected) {
         esp_hf_client_audio_buff_free(audio_buf);
         return;
     }
     
-    if (!is_bad_frame) {
+    int64_t cb_start_us = esp_timer_get_time();
+    if (s_last_callback_us) {
+        metrics_observe(s_m_sco_interval, (uint32_t)(cb_start_us - s_last_callback_us));
+    }
+    s_last_callback_us = cb_start_us;
+    metrics_inc(s_m_sco_frames);
+    if (is_bad_frame) {
+        metrics_inc(s_m_sco_bad_frames);
+    } else {
         /* decode our incoming data and send it to i2s tx ringbuffer */
-        uint8_t *decoded_buffer = malloc(MSBC_FRAME_SAMPLES * 2);
         size_t decoded_len;
-        if (msbc_dec_data(audio_buf->data, audio_buf->data_len, 
-                            decoded_buffer, &decoded_len) == 0) {
-            bt_i2s_hfp_write_tx_ringbuf(decoded_buffer, decoded_len);
+        uint32_t prof = cycle_prof_begin();
+        int dec_ret = msbc_dec_data(audio_buf->data, audio_buf->data_len, s_decoded_frame, &decoded_len);
+        cycle_prof_end(PROF_SPK_DECODE, prof);
+        latency_trace_record(LT_SPK_DECODE, (uint32_t)(esp_timer_get_time() - cb_start_us));
+        if (dec_ret == 0) {
+            bt_i2s_hfp_write_tx_ringbuf(s_decoded_frame, decoded_len);
         }
-        free(decoded_buffer);
     }
     esp_hf_client_audio_buff_free(audio_buf);
     
     /* fetch our msbc encoded mic data and send it to the ag */
-    uint8_t *mic_data = malloc(ESP_HF_MSBC_ENCODED_FRAME_SIZE);
-    // uint8_t *mic_data = (uint8_t *) malloc (ESP_HF_MSBC_ENCODED_FRAME_SIZE);
-    size_t mic_data_len = bt_i2s_hfp_read_rx_ringbuf(mic_data);
-    // if (mic_data_len == 0) {
-    //     free(mic_data);
-    //     return;
-    // }
     esp_hf_audio_buff_t *audio_data_to_send = esp_hf_client_audio_buff_alloc((uint16_t) ESP_HF_MSBC_ENCODED_FRAME_SIZE);
-    memcpy (audio_data_to_send->data, mic_data, ESP_HF_MSBC_ENCODED_FRAME_SIZE);
+    if (audio_data_to_send == NULL) {
+        return;
+    }
+    size_t mic_data_len = bt_i2s_hfp_read_rx_ringbuf(audio_data_to_send->data);
+    if (mic_data_len < ESP_HF_MSBC_ENCODED_FRAME_SIZE) {
+        // still prefetching: zero-fill rather than sending stale buffer contents
+        memset(audio_data_to_send->data + mic_data_len, 0, ESP_HF_MSBC_ENCODED_FRAME_SIZE - mic_data_len);
+    }
     audio_data_to_send->data_len = ESP_HF_MSBC_ENCODED_FRAME_SIZE;
-    free (mic_data);
     // if (s_msbc_air_mode && audio_data_to_send->data_len > ESP_HF_MSBC_ENCODED_FRAME_SIZE) {
     //     audio_data_to_send->data_len = ESP_HF_MSBC_ENCODED_FRAME_SIZE;
     // }
+    int64_t send_start_us = esp_timer_get_time();
     if (esp_hf_client_audio_data_send(s_sync_conn_hdl, audio_data_to_send) != ESP_OK) {
         esp_hf_client_audio_buff_free(audio_data_to_send);
-        ESP_LOGW(BT_HF_TAG, "%s failed to send audio data", __func__);
-    }
-    if (s_audio_callback_cnt % 1000 == 0) {
-        esp_hf_client_pkt_stat_nums_get(sync_conn_hdl);
+        metrics_inc(s_m_sco_send_failed);
     }
-    s_audio_callback_cnt++;
+    int64_t end_us = esp_timer_get_time();
+    latency_trace_record(LT_MIC_SEND, (uint32_t)(end_us - send_start_us));
+    latency_trace_record(LT_SCO_CALLBACK, (uint32_t)(end_us - cb_start_us));
 }
 
 #endif /* #if CONFIG_BT_HFP_AUDIO_DATA_PATH_HCI && CONFIG_BT_HFP_USE_EXTERNAL_CODEC */
 
+/* controller packet counts, filled in by ESP_HF_CLIENT_PKT_STAT_NUMS_GET_EVT */
+static metric_t *s_m_pkt_rx_total;
+static metric_t *s_m_pkt_rx_ok;
+static metric_t *s_m_pkt_rx_err;
+static metric_t *s_m_pkt_rx_none;
+static metric_t *s_m_pkt_rx_lost;
+static metric_t *s_m_pkt_tx_total;
+static metric_t *s_m_pkt_tx_discarded;
+
+void bt_app_hf_metrics_init(void)
+{
+#if CONFIG_BT_HFP_AUDIO_DATA_PATH_HCI && CONFIG_BT_HFP_USE_EXTERNAL_CODEC
+    s_m_sco_frames = metrics_counter("hfp.sco.frames");
+    s_m_sco_bad_frames = metrics_counter("hfp.sco.bad_frames");
+    s_m_sco_send_failed = metrics_counter("hfp.sco.send_failed");
+    s_m_sco_interval = metrics_hist("hfp.sco.interval_us");
+#endif
+    s_m_pkt_rx_total = metrics_gauge("hfp.pkt.rx_total");
+    s_m_pkt_rx_ok = metrics_gauge("hfp.pkt.rx_ok");
+    s_m_pkt_rx_err = metrics_gauge("hfp.pkt.rx_err");
+    s_m_pkt_rx_none = metrics_gauge("hfp.pkt.rx_none");
+    s_m_pkt_rx_lost = metrics_gauge("hfp.pkt.rx_lost");
+    s_m_pkt_tx_total = metrics_gauge("hfp.pkt.tx_total");
+    s_m_pkt_tx_discarded = metrics_gauge("hfp.pkt.tx_discarded");
+}
+
+esp_err_t bt_app_hf_request_pkt_stats(void)
+{
+#if CONFIG_BT_HFP_AUDIO_DATA_PATH_HCI && CONFIG_BT_HFP_USE_EXTERNAL_CODEC
+    if (!s_hfp_audio_connected) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    return esp_hf_client_pkt_stat_nums_get(s_sync_conn_hdl);
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+bool bt_app_hf_audio_connected(void)
+{
+#if CONFIG_BT_HFP_AUDIO_DATA_PATH_HCI && CONFIG_BT_HFP_USE_EXTERNAL_CODEC
+    return s_hfp_audio_connected;
+#else
+    return false;
+#endif
+}
+
 /* callback for HF_CLIENT */
 void bt_app_hf_client_cb(esp_hf_client_cb_event_t event, esp_hf_client_cb_param_t *param)
 {
@@ -270,7 +342,11 @@ void bt_app_hf_client_cb(esp_hf_client_cb_event_t event, esp_hf_client_cb_param_
                     param->conn_stat.chld_feat);
             memcpy(peer_addr,param->conn_stat.remote_bda,ESP_BD_ADDR_LEN);
             if (param->conn_stat.state == ESP_HF_CLIENT_CONNECTION_STATE_SLC_CONNECTED) {
-                esp_pbac_connect(peer_addr);
+                bt_app_pbac_connect(peer_addr);
+            } else if (param->conn_stat.state == ESP_HF_CLIENT_CONNECTION_STATE_DISCONNECTED) {
+                bt_app_pbac_cancel_connect();
+                bt_app_pbac_set_call_active(false);
+                bt_app_pbac_set_call_setup(false);
             }
             break;
         }
@@ -293,8 +369,12 @@ void bt_app_hf_client_cb(esp_hf_client_cb_event_t event, esp_hf_client_cb_param_
                 param->audio_stat.state == ESP_HF_CLIENT_AUDIO_STATE_CONNECTED_MSBC) {
                 // Stop ringtone when phone audio connects
                 ringtone_stop();
+                // A real call takes the audio path over from a loopback test
+                audio_loopback_stop();
                 s_sync_conn_hdl = param->audio_stat.sync_conn_handle;
+                s_last_callback_us = 0;
                 s_hfp_audio_connected = true;
+                flash_sched_set_audio_active(true);
                 bt_i2s_hfp_start();
                 esp_hf_client_register_audio_data_callback(bt_app_hf_client_audio_data_cb);
             } else if (param->audio_stat.state == ESP_HF_CLIENT_AUDIO_STATE_DISCONNECTED) {
@@ -302,8 +382,10 @@ void bt_app_hf_client_cb(esp_hf_client_cb_event_t event, esp_hf_client_cb_param_
                 s_sync_conn_hdl = 0;
                 s_msbc_air_mode = false;
                 s_hfp_audio_connected = false;
+                flash_sched_set_audio_active(false);
                 static TaskHandle_t s_hfp_kill_audio_task_handle;
-                xTaskCreate(&kill_hfp_audio_task, "Kill HPF AUDIO", 4096, NULL, 5, &s_hfp_kill_audio_task_handle);
+                xTaskCreatePinnedToCore(&kill_hfp_audio_task, "Kill HPF AUDIO", APP_HFP_CTRL_TASK_STACK, NULL,
+                                        APP_HFP_CTRL_TASK_PRIO, &s_hfp_kill_audio_task_handle, APP_BT_CORE);
             }
     #endif /* #if CONFIG_BT_HFP_AUDIO_DATA_PATH_HCI && CONFIG_BT_HFP_USE_EXTERNAL_CODEC */
             break;
@@ -355,6 +437,7 @@ void bt_app_hf_client_cb(esp_hf_client_cb_event_t event, esp_hf_client_cb_param_
         {
             ESP_LOGI(BT_HF_TAG, "--Call indicator %s",
                     c_call_str[param->call.status]);
+            bt_app_pbac_set_call_active(param->call.status == ESP_HF_CALL_STATUS_CALL_IN_PROGRESS);
             break;
         }
 
@@ -362,6 +445,7 @@ void bt_app_hf_client_cb(esp_hf_client_cb_event_t event, esp_hf_client_cb_param_
         {
             ESP_LOGI(BT_HF_TAG, "--Call setup indicator %s",
                     c_call_setup_str[param->call_setup.status]);
+            bt_app_pbac_set_call_setup(param->call_setup.status != ESP_HF_CALL_SETUP_STATUS_IDLE);
             // Stop ringtone when call setup ends (rejected/answered/missed)
             if (param->call_setup.status == ESP_HF_CALL_SETUP_STATUS_IDLE) {
                 ringtone_stop();
@@ -460,9 +544,13 @@ void bt_app_hf_client_cb(esp_hf_client_cb_event_t event, esp_hf_client_cb_param_
 
         case ESP_HF_CLIENT_PKT_STAT_NUMS_GET_EVT:
         {
-            ESP_LOGI(BT_HF_TAG, "total packets: %d, received ok: %d, received err: %d, received none: %d, received lost: %d, sent: %d, sent lost: %d", 
-                param->pkt_nums.rx_total, param->pkt_nums.rx_correct, param->pkt_nums.rx_err, param->pkt_nums.rx_none, param->pkt_nums.rx_lost,
-                param->pkt_nums.tx_total, param->pkt_nums.tx_discarded);
+            metrics_set(s_m_pkt_rx_total, param->pkt_nums.rx_total);
+            metrics_set(s_m_pkt_rx_ok, param->pkt_nums.rx_correct);
+            metrics_set(s_m_pkt_rx_err, param->pkt_nums.rx_err);
+            metrics_set(s_m_pkt_rx_none, param->pkt_nums.rx_none);
+            metrics_set(s_m_pkt_rx_lost, param->pkt_nums.rx_lost);
+            metrics_set(s_m_pkt_tx_total, param->pkt_nums.tx_total);
+            metrics_set(s_m_pkt_tx_discarded, param->pkt_nums.tx_discarded);
             break;
         }
         case ESP_HF_CLIENT_PROF_STATE_EVT:
@@ -8,6 +8,7 @@
 #define __BT_APP_HF_H__
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "esp_hf_client_api.h"
 
 
@@ -18,5 +19,13 @@
  */
 void bt_app_hf_client_cb(esp_hf_client_cb_event_t event, esp_hf_client_cb_param_t *param);
 
-static void kill_hfp_audio_task(void *pvParameters);
+// Whether call audio (SCO) is connected
+bool bt_app_hf_audio_connected(void);
+
+// Register the HFP metrics; call once before the stack comes up
+void bt_app_hf_metrics_init(void);
+
+// Ask the controller for its SCO packet counts; they land in the hfp.pkt.* gauges
+esp_err_t bt_app_hf_request_pkt_stats(void);
+
 #endif /* __BT_APP_HF_H__*/
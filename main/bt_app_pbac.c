@@ -12,16 +12,25 @@
 #include "bt_app_core.h"
 #include "bt_app_pbac.h"
 #include "phonebook.h"
+#include "pb_sync.h"
+#include "app_task_config.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
 
 #define BT_PBAC_TAG "BT_PBAC"
 #define PBAC_QUEUE_SIZE 50
-#define PBAC_TASK_STACK_SIZE 8192
-#define PBAC_TASK_PRIORITY 5
 #define PHONEBOOK_PAGE_SIZE 50
 
+// While a call is up the download yields to the SCO link: it pauses while a
+// call is being set up (ringing, dialing) and continues in small, spaced out
+// pages while a call is active. Set PBAC_PAUSE_DURING_ACTIVE_CALL to pause
+// for the whole call instead.
+#define PBAC_PAUSE_DURING_ACTIVE_CALL   0
+#define PBAC_THROTTLED_PAGE_SIZE        10
+#define PBAC_THROTTLED_INTERVAL_MS      2000
+#define PBAC_PAGE_MAX_RETRIES           3
+
 esp_pbac_conn_hdl_t pba_conn_handle;
 
 static phonebook_t *current_phonebook = NULL;
@@ -30,22 +39,361 @@ static esp_bd_addr_t current_device_addr = {0};
 static QueueHandle_t pbac_data_queue = NULL;
 static TaskHandle_t pbac_task_handle = NULL;
 
-// Pagination state
+// Pagination state, owned by pbac_proc
 static uint16_t total_phonebook_size = 0;
 static uint16_t current_offset = 0;
-static bool pagination_in_progress = false;
+static uint16_t requested_page_size = 0;
+static bool page_outstanding = false;
+static uint8_t page_retries = 0;
+static TickType_t next_page_tick = 0;
+static bt_app_pbac_sync_state_t sync_state = BT_APP_PBAC_SYNC_IDLE;
+static bt_app_pbac_rate_t sync_rate = BT_APP_PBAC_RATE_FULL;
+
+// A connection with a stored sync state compares vCard listings and pulls
+// only the entries that changed; otherwise the book is downloaded in pages
+// and the listing pulled afterwards to tie handles to records (pb_sync.h)
+typedef enum {
+    PBAC_PHASE_PAGES = 0,   // full download, page by page
+    PBAC_PHASE_LISTING,     // vCard listing, to compare with the stored one
+    PBAC_PHASE_ENTRIES,     // changed entries, one by one
+    PBAC_PHASE_MAP,         // vCard listing after a full download
+} pbac_phase_t;
+
+static pbac_phase_t sync_phase = PBAC_PHASE_PAGES;
+static phonebook_t *sync_phonebook = NULL;
+static pb_sync_versions_t sync_versions;
+static pb_listing_t s_listing;
+static pb_sync_delta_t s_delta;
+static uint16_t entry_index = 0;        // next of s_delta.pull to fetch
+static bool in_pb_folder = false;
+
+// Set from other tasks; pbac_proc picks them up on its next pass
+static volatile bool s_call_active = false;
+static volatile bool s_call_setup = false;
+static volatile bool s_user_paused = false;
+static volatile bool s_connect_pending = false;
+static esp_bd_addr_t s_connect_addr;
+
+// Only touched in the BTC task
+static bool size_query_outstanding = false;
+static pb_sync_versions_t s_reported_versions;  // handed to pbac_proc with PBAC_MSG_SYNC_START
+static volatile bool s_entering_pb_folder = false;
 
 typedef enum {
-    PBAC_MSG_DATA_CHUNK,
-    PBAC_MSG_FINALIZE,
+    PBAC_MSG_DATA_CHUNK,    // vCards, from a page or an entry
+    PBAC_MSG_LISTING_CHUNK,
+    PBAC_MSG_RESET,         // connection opened or closed
+    PBAC_MSG_SYNC_START,    // value: phonebook size
+    PBAC_MSG_PAGE_DONE,     // a page, listing, entry or folder change; value: 1 if it succeeded
+    PBAC_MSG_KICK,          // call state, pause flag or pending connect changed
 } pbac_msg_type_t;
 
 typedef struct {
     pbac_msg_type_t type;
     uint16_t data_len;
+    uint16_t value;
     char *data;  // Pointer to malloc'd data
 } pbac_msg_t;
 
+static const char *sync_state_str[] = {"idle", "running", "paused", "done"};
+static const char *sync_rate_str[] = {"full", "throttled", "paused"};
+
+static void pbac_post(pbac_msg_type_t type, uint16_t value, TickType_t timeout)
+{
+    pbac_msg_t msg = {
+        .type = type,
+        .value = value,
+    };
+    if (pbac_data_queue == NULL || xQueueSend(pbac_data_queue, &msg, timeout) != pdTRUE) {
+        if (type != PBAC_MSG_KICK) {
+            ESP_LOGE(BT_PBAC_TAG, "Failed to post message %d", type);
+        }
+    }
+}
+
+static bt_app_pbac_rate_t pbac_current_rate(void)
+{
+    if (s_user_paused || s_call_setup) {
+        return BT_APP_PBAC_RATE_PAUSED;
+    }
+    if (s_call_active) {
+        return PBAC_PAUSE_DURING_ACTIVE_CALL ? BT_APP_PBAC_RATE_PAUSED : BT_APP_PBAC_RATE_THROTTLED;
+    }
+    return BT_APP_PBAC_RATE_FULL;
+}
+
+static void pbac_request_page(uint16_t page_size)
+{
+    esp_pbac_pull_phone_book_app_param_t app_param = {0};
+    app_param.include_property_selector = 1;
+    app_param.property_selector = 0xFFFFFFF7;  // Filter out photo
+    app_param.include_max_list_count = 1;
+    app_param.max_list_count = page_size;
+    app_param.include_list_start_offset = 1;
+    app_param.list_start_offset = current_offset;
+
+    ESP_LOGI(BT_PBAC_TAG, "Downloading contacts %d-%d of %d (%s)",
+            current_offset, current_offset + page_size - 1,
+            total_phonebook_size, sync_rate_str[sync_rate]);
+
+    requested_page_size = page_size;
+    page_outstanding = true;
+    esp_pbac_pull_phone_book(pba_conn_handle, "telecom/pb.vcf", &app_param);
+}
+
+static void pbac_finalize(void);
+
+static void pbac_request_listing(void)
+{
+    // no parameters: every entry, in indexed (handle) order
+    esp_pbac_pull_vcard_listing_app_param_t app_param = {0};
+
+    ESP_LOGI(BT_PBAC_TAG, "Downloading vCard listing (%s)", sync_rate_str[sync_rate]);
+    pb_listing_begin(&s_listing, sync_phonebook->device_addr);
+    page_outstanding = true;
+    esp_pbac_pull_vcard_listing(pba_conn_handle, "pb", &app_param);
+}
+
+static void pbac_request_entry(void)
+{
+    page_outstanding = true;
+    if (!in_pb_folder) {
+        // entries are named relative to the current folder
+        s_entering_pb_folder = true;
+        esp_pbac_set_phone_book(pba_conn_handle, ESP_PBAC_SET_PHONE_BOOK_FLAGS_DOWN, "pb");
+        return;
+    }
+
+    esp_pbac_pull_vcard_entry_app_param_t app_param = {0};
+    app_param.include_property_selector = 1;
+    app_param.property_selector = 0xFFFFFFF7;  // Filter out photo
+
+    char name[16];
+    snprintf(name, sizeof(name), "%lX.vcf", (unsigned long)s_delta.pull[entry_index]);
+    ESP_LOGI(BT_PBAC_TAG, "Downloading entry %s, %d of %d (%s)",
+            name, entry_index + 1, s_delta.pull_count, sync_rate_str[sync_rate]);
+    esp_pbac_pull_vcard_entry(pba_conn_handle, name, &app_param);
+}
+
+static void pbac_start_full(void)
+{
+    ESP_LOGI(BT_PBAC_TAG, "Phone Book Size: %d, starting paginated download", 
+            total_phonebook_size);
+    pb_sync_delta_free(&s_delta);
+    pb_sync_forget(sync_phonebook->device_addr);
+    phonebook_begin_sync(sync_phonebook);
+    sync_phase = PBAC_PHASE_PAGES;
+    current_offset = 0;
+    sync_state = BT_APP_PBAC_SYNC_RUNNING;
+    if (total_phonebook_size == 0) {
+        pbac_finalize();
+    }
+}
+
+static void pbac_start_sync(void)
+{
+    if (sync_phonebook == NULL) {
+        return;
+    }
+    switch (pb_sync_plan(sync_phonebook, &sync_versions)) {
+    case PB_SYNC_PLAN_NONE:
+        ESP_LOGI(BT_PBAC_TAG, "Phone Book Size: %d, unchanged since the last sync (%d contacts)",
+                total_phonebook_size, phonebook_get_count(sync_phonebook));
+        sync_state = BT_APP_PBAC_SYNC_DONE;
+        break;
+    case PB_SYNC_PLAN_LISTING:
+        ESP_LOGI(BT_PBAC_TAG, "Phone Book Size: %d, comparing vCard listings", total_phonebook_size);
+        sync_phase = PBAC_PHASE_LISTING;
+        sync_state = BT_APP_PBAC_SYNC_RUNNING;
+        break;
+    default:
+        pbac_start_full();
+        break;
+    }
+}
+
+static void pbac_finalize(void)
+{
+    ESP_LOGI(BT_PBAC_TAG, "Download complete, finalizing");
+
+    phonebook_finalize_sync(sync_phonebook);
+    ESP_LOGI(BT_PBAC_TAG, "Phonebook sync complete: %d contacts stored", 
+            phonebook_get_count(sync_phonebook));
+    
+    phonebook_query_t query = { .type = PHONEBOOK_QUERY_LETTER, .letter = 'A' };
+    ESP_LOGI(BT_PBAC_TAG, "Contacts starting with 'A': %d",
+             phonebook_query(sync_phonebook, &query, NULL, NULL));
+    
+    query.letter = 'D';
+    ESP_LOGI(BT_PBAC_TAG, "Contacts starting with 'D': %d",
+             phonebook_query(sync_phonebook, &query, NULL, NULL));
+
+    if (sync_phase == PBAC_PHASE_ENTRIES) {
+        pb_sync_save(sync_phonebook, &sync_versions, &s_delta);
+        pb_sync_delta_free(&s_delta);
+        sync_state = BT_APP_PBAC_SYNC_DONE;
+    } else {
+        // the book is usable already; the listing only feeds the next sync
+        sync_phase = PBAC_PHASE_MAP;
+    }
+}
+
+static void pbac_listing_done(void)
+{
+    esp_err_t err = pb_listing_end(&s_listing);
+    if (err == ESP_OK) {
+        err = pb_sync_diff(sync_phonebook, &s_delta);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGI(BT_PBAC_TAG, "Listings not comparable (%s)", esp_err_to_name(err));
+        pbac_start_full();
+        return;
+    }
+
+    if (s_delta.pull_count == 0 && s_delta.dropped == 0) {
+        if (sync_versions.flags & PB_SYNC_HAS_VERSION) {
+            // the folder version moved but every name is the same: a number changed somewhere
+            ESP_LOGI(BT_PBAC_TAG, "Folder version changed with the listing unchanged");
+            pbac_start_full();
+            return;
+        }
+        pb_sync_save(sync_phonebook, &sync_versions, &s_delta);
+        pb_sync_delta_free(&s_delta);
+        ESP_LOGI(BT_PBAC_TAG, "Listing unchanged, keeping %d contacts", phonebook_get_count(sync_phonebook));
+        sync_state = BT_APP_PBAC_SYNC_DONE;
+        return;
+    }
+
+    if (phonebook_begin_delta(sync_phonebook, s_delta.drop, s_delta.old_count) != ESP_OK) {
+        pbac_start_full();
+        return;
+    }
+    sync_phase = PBAC_PHASE_ENTRIES;
+    entry_index = 0;
+    in_pb_folder = false;
+    if (s_delta.pull_count == 0) {
+        pbac_finalize();
+    }
+}
+
+static void pbac_map_done(void)
+{
+    if (pb_listing_end(&s_listing) == ESP_OK) {
+        pb_sync_save(sync_phonebook, &sync_versions, NULL);
+    }
+    sync_state = BT_APP_PBAC_SYNC_DONE;
+}
+
+static void pbac_give_up(void)
+{
+    // the shadow slot is dropped, delta or full: the previous live book stays as it was
+    phonebook_abort_sync(sync_phonebook);
+    pb_sync_delta_free(&s_delta);
+    sync_state = BT_APP_PBAC_SYNC_IDLE;
+}
+
+// Issue whatever is due and return how long pbac_proc may sleep
+static TickType_t pbac_schedule(void)
+{
+    bool call_busy = s_call_active || s_call_setup;
+
+    if (s_connect_pending && !call_busy) {
+        s_connect_pending = false;
+        ESP_LOGI(BT_PBAC_TAG, "Connecting phonebook client");
+        esp_pbac_connect(s_connect_addr);
+    }
+
+    bt_app_pbac_rate_t rate = pbac_current_rate();
+    if (rate != sync_rate) {
+        ESP_LOGI(BT_PBAC_TAG, "Sync rate %s -> %s at contact %d of %d",
+                sync_rate_str[sync_rate], sync_rate_str[rate], current_offset, total_phonebook_size);
+        sync_rate = rate;
+    }
+
+    if (sync_state != BT_APP_PBAC_SYNC_RUNNING && sync_state != BT_APP_PBAC_SYNC_PAUSED) {
+        return portMAX_DELAY;
+    }
+    if (page_outstanding) {
+        // pausing takes effect once the page in flight has arrived
+        return portMAX_DELAY;
+    }
+
+    if (rate == BT_APP_PBAC_RATE_PAUSED) {
+        sync_state = BT_APP_PBAC_SYNC_PAUSED;
+        return portMAX_DELAY;
+    }
+    sync_state = BT_APP_PBAC_SYNC_RUNNING;
+
+    if (rate == BT_APP_PBAC_RATE_THROTTLED || page_retries > 0) {
+        TickType_t now = xTaskGetTickCount();
+        if ((int32_t)(next_page_tick - now) > 0) {
+            return next_page_tick - now;
+        }
+    }
+
+    if (sync_phase == PBAC_PHASE_LISTING || sync_phase == PBAC_PHASE_MAP) {
+        pbac_request_listing();
+    } else if (sync_phase == PBAC_PHASE_ENTRIES) {
+        pbac_request_entry();
+    } else {
+        uint16_t page_size = (rate == BT_APP_PBAC_RATE_THROTTLED) ? PBAC_THROTTLED_PAGE_SIZE : PHONEBOOK_PAGE_SIZE;
+        pbac_request_page(page_size);
+    }
+    return portMAX_DELAY;
+}
+
+static void pbac_page_done(bool received)
+{
+    page_outstanding = false;
+    next_page_tick = xTaskGetTickCount() + pdMS_TO_TICKS(PBAC_THROTTLED_INTERVAL_MS);
+
+    if (!received) {
+        if (++page_retries > PBAC_PAGE_MAX_RETRIES) {
+            ESP_LOGE(BT_PBAC_TAG, "Giving up sync at contact %d of %d", current_offset, total_phonebook_size);
+            pbac_give_up();
+        } else {
+            // what arrived of the page stays; the retry resends it from its start
+            if (sync_phase == PBAC_PHASE_PAGES) {
+                phonebook_resume_at(sync_phonebook, current_offset);
+            } else if (sync_phase == PBAC_PHASE_ENTRIES && in_pb_folder) {
+                phonebook_resume_at(sync_phonebook, entry_index);
+            }
+            ESP_LOGW(BT_PBAC_TAG, "Page at %d failed, retrying", current_offset);
+        }
+        return;
+    }
+
+    page_retries = 0;
+    if (sync_phase == PBAC_PHASE_LISTING) {
+        pbac_listing_done();
+        return;
+    }
+    if (sync_phase == PBAC_PHASE_MAP) {
+        pbac_map_done();
+        return;
+    }
+    if (sync_phase == PBAC_PHASE_ENTRIES) {
+        if (!in_pb_folder) {
+            in_pb_folder = true;
+            return;
+        }
+        // one vCard per entry; an entry deleted since the listing sends none
+        while (sync_phonebook->vcards_seen <= entry_index) {
+            phonebook_skip_vcard(sync_phonebook);
+        }
+        if (++entry_index >= s_delta.pull_count) {
+            pbac_finalize();
+        }
+        return;
+    }
+
+    current_offset += requested_page_size;
+    if (current_offset >= total_phonebook_size) {
+        current_offset = total_phonebook_size;
+        pbac_finalize();
+    }
+}
+
 static void pbac_processing_task(void *arg)
 {
     pbac_msg_t msg;
@@ -53,41 +401,69 @@ static void pbac_processing_task(void *arg)
     ESP_LOGI(BT_PBAC_TAG, "Phonebook processing task started");
     
     while (1) {
-        if (xQueueReceive(pbac_data_queue, &msg, portMAX_DELAY) == pdTRUE) {
-            
-            if (msg.type == PBAC_MSG_DATA_CHUNK) {
-                if (current_phonebook != NULL && msg.data != NULL) {
-                    esp_err_t err = phonebook_process_chunk(current_phonebook, msg.data, msg.data_len);
+        TickType_t wait = pbac_schedule();
+
+        if (xQueueReceive(pbac_data_queue, &msg, wait) != pdTRUE) {
+            continue;
+        }
+
+        switch (msg.type) {
+        case PBAC_MSG_DATA_CHUNK:
+            if (msg.data != NULL) {
+                if (sync_phonebook != NULL && sync_phonebook->sync_in_progress) {
+                    esp_err_t err = phonebook_process_chunk(sync_phonebook, msg.data, msg.data_len);
                     if (err != ESP_OK) {
                         ESP_LOGE(BT_PBAC_TAG, "Failed to process phonebook chunk: 0x%x", err);
                     }
-                    // Free malloc'd data
-                    free(msg.data);
-                }
-            } 
-            else if (msg.type == PBAC_MSG_FINALIZE) {
-                if (current_phonebook != NULL) {
-                    phonebook_finalize_sync(current_phonebook);
-                    ESP_LOGI(BT_PBAC_TAG, "Phonebook sync complete: %d contacts stored", 
-                            phonebook_get_count(current_phonebook));
-                    
-                    uint16_t count;
-                    contact_t *results;
-                    
-                    results = phonebook_search_by_letter(current_phonebook, 'A', &count);
-                    ESP_LOGI(BT_PBAC_TAG, "Contacts starting with 'A': %d", count);
-                    if (results) free(results);
-                    
-                    results = phonebook_search_by_letter(current_phonebook, 'D', &count);
-                    ESP_LOGI(BT_PBAC_TAG, "Contacts starting with 'D': %d", count);
-                    if (results) free(results);
                 }
+                // Free malloc'd data
+                free(msg.data);
             }
-            
-            // Only yield if queue is empty
-            if (uxQueueMessagesWaiting(pbac_data_queue) == 0) {
-                vTaskDelay(1);
+            break;
+
+        case PBAC_MSG_LISTING_CHUNK:
+            if (sync_phase == PBAC_PHASE_LISTING || sync_phase == PBAC_PHASE_MAP) {
+                pb_listing_feed(&s_listing, msg.data, msg.data_len);
+            }
+            free(msg.data);
+            break;
+
+        case PBAC_MSG_RESET:
+            if (sync_state == BT_APP_PBAC_SYNC_RUNNING || sync_state == BT_APP_PBAC_SYNC_PAUSED) {
+                pbac_give_up();
+            }
+            sync_phonebook = NULL;
+            total_phonebook_size = 0;
+            current_offset = 0;
+            page_outstanding = false;
+            page_retries = 0;
+            sync_state = BT_APP_PBAC_SYNC_IDLE;
+            break;
+
+        case PBAC_MSG_SYNC_START:
+            total_phonebook_size = msg.value;
+            current_offset = 0;
+            page_outstanding = false;
+            page_retries = 0;
+            sync_versions = s_reported_versions;
+            sync_phonebook = current_phonebook;
+            pbac_start_sync();
+            break;
+
+        case PBAC_MSG_PAGE_DONE:
+            if (page_outstanding) {
+                pbac_page_done(msg.value != 0);
             }
+            break;
+
+        case PBAC_MSG_KICK:
+        default:
+            break;
+        }
+        
+        // Only yield if queue is empty
+        if (uxQueueMessagesWaiting(pbac_data_queue) == 0) {
+            vTaskDelay(1);
         }
     }
 }
@@ -100,12 +476,13 @@ void bt_app_pbac_task_start(void)
         return;
     }
     
-    BaseType_t ret = xTaskCreate(pbac_processing_task, 
+    BaseType_t ret = xTaskCreatePinnedToCore(pbac_processing_task, 
                                   "pbac_proc", 
-                                  PBAC_TASK_STACK_SIZE, 
+                                  APP_PBAC_TASK_STACK, 
                                   NULL, 
-                                  PBAC_TASK_PRIORITY, 
-                                  &pbac_task_handle);
+                                  APP_PBAC_TASK_PRIO, 
+                                  &pbac_task_handle,
+                                  APP_BT_CORE);
     
     if (ret != pdPASS) {
         ESP_LOGE(BT_PBAC_TAG, "Failed to create pbac processing task");
@@ -116,6 +493,87 @@ void bt_app_pbac_task_start(void)
     }
 }
 
+void bt_app_pbac_connect(esp_bd_addr_t remote_addr)
+{
+    memcpy(s_connect_addr, remote_addr, ESP_BD_ADDR_LEN);
+    s_connect_pending = true;
+    if (s_call_active || s_call_setup) {
+        ESP_LOGI(BT_PBAC_TAG, "Call in progress, phonebook connection deferred");
+    }
+    pbac_post(PBAC_MSG_KICK, 0, 0);
+}
+
+void bt_app_pbac_cancel_connect(void)
+{
+    s_connect_pending = false;
+}
+
+void bt_app_pbac_set_call_active(bool active)
+{
+    s_call_active = active;
+    pbac_post(PBAC_MSG_KICK, 0, 0);
+}
+
+void bt_app_pbac_set_call_setup(bool in_setup)
+{
+    s_call_setup = in_setup;
+    pbac_post(PBAC_MSG_KICK, 0, 0);
+}
+
+void bt_app_pbac_pause(bool pause)
+{
+    s_user_paused = pause;
+    pbac_post(PBAC_MSG_KICK, 0, 0);
+}
+
+void bt_app_pbac_get_sync_status(bt_app_pbac_sync_status_t *status)
+{
+    if (status == NULL) {
+        return;
+    }
+    status->state = sync_state;
+    status->rate = pbac_current_rate();
+    status->offset = current_offset;
+    status->total = total_phonebook_size;
+    status->contacts = current_phonebook ? phonebook_get_count(current_phonebook) : 0;
+    status->user_paused = s_user_paused;
+    status->call_active = s_call_active;
+    status->call_setup = s_call_setup;
+    status->connect_deferred = s_connect_pending;
+}
+
+const char *bt_app_pbac_sync_state_str(bt_app_pbac_sync_state_t state)
+{
+    return state <= BT_APP_PBAC_SYNC_DONE ? sync_state_str[state] : "?";
+}
+
+const char *bt_app_pbac_rate_str(bt_app_pbac_rate_t rate)
+{
+    return rate <= BT_APP_PBAC_RATE_PAUSED ? sync_rate_str[rate] : "?";
+}
+
+// Copy a response body for pbac_proc, which frees it
+static void pbac_post_data(pbac_msg_type_t type, const char *data, uint16_t len)
+{
+    char *data_copy = (char*)malloc(len + 1);
+    if (data_copy == NULL) {
+        ESP_LOGE(BT_PBAC_TAG, "Failed to allocate memory for chunk (%d bytes)", len);
+        return;
+    }
+    memcpy(data_copy, data, len);
+    data_copy[len] = '\0';
+
+    pbac_msg_t msg = {
+        .type = type,
+        .data_len = len,
+        .data = data_copy,
+    };
+    if (xQueueSend(pbac_data_queue, &msg, pdMS_TO_TICKS(100)) != pdTRUE) {
+        ESP_LOGW(BT_PBAC_TAG, "Queue full, dropping chunk");
+        free(data_copy);
+    }
+}
+
 void bt_app_pbac_cb(esp_pbac_event_t event, esp_pbac_param_t *param)
 {
     switch (event)
@@ -145,108 +603,56 @@ void bt_app_pbac_cb(esp_pbac_event_t event, esp_pbac_param_t *param)
             }
             
             // Reset pagination state
-            total_phonebook_size = 0;
-            current_offset = 0;
-            pagination_in_progress = false;
+            size_query_outstanding = false;
+            s_entering_pb_folder = false;
+            pbac_post(PBAC_MSG_RESET, 0, portMAX_DELAY);
             
             esp_pbac_set_phone_book(pba_conn_handle, ESP_PBAC_SET_PHONE_BOOK_FLAGS_DOWN, "telecom");
         } else {
             ESP_LOGI(BT_PBAC_TAG, "Disconnected from device");
             current_phonebook = NULL;
             memset(current_device_addr, 0, ESP_BD_ADDR_LEN);
-            pagination_in_progress = false;
+            size_query_outstanding = false;
+            pbac_post(PBAC_MSG_RESET, 0, portMAX_DELAY);
         }
         break;
         
     case ESP_PBAC_PULL_PHONE_BOOK_RESPONSE_EVT:
         if (param->pull_phone_book_rsp.result == ESP_PBAC_SUCCESS && 
             param->pull_phone_book_rsp.data_len > 0) {
-            
-            // Malloc for each chunk (freed by processing task)
-            char *data_copy = (char*)malloc(param->pull_phone_book_rsp.data_len + 1);
-            if (data_copy != NULL) {
-                memcpy(data_copy, param->pull_phone_book_rsp.data, param->pull_phone_book_rsp.data_len);
-                data_copy[param->pull_phone_book_rsp.data_len] = '\0';
-                
-                pbac_msg_t msg;
-                msg.type = PBAC_MSG_DATA_CHUNK;
-                msg.data_len = param->pull_phone_book_rsp.data_len;
-                msg.data = data_copy;
-                
-                if (xQueueSend(pbac_data_queue, &msg, pdMS_TO_TICKS(100)) != pdTRUE) {
-                    ESP_LOGW(BT_PBAC_TAG, "Queue full, dropping chunk");
-                    free(data_copy);
-                }
-            } else {
-                ESP_LOGE(BT_PBAC_TAG, "Failed to allocate memory for chunk (%d bytes)", 
-                        param->pull_phone_book_rsp.data_len);
-            }
+            pbac_post_data(PBAC_MSG_DATA_CHUNK, param->pull_phone_book_rsp.data,
+                           param->pull_phone_book_rsp.data_len);
         }
         
         if (param->pull_phone_book_rsp.final) {
             ESP_LOGI(BT_PBAC_TAG, "PBA client pull phone book final response");
             
-            // Check if this is the initial size query
-            if (param->pull_phone_book_rsp.include_phone_book_size && !pagination_in_progress) {
-                total_phonebook_size = param->pull_phone_book_rsp.phone_book_size;
-                current_offset = 0;
-                pagination_in_progress = true;
-                
-                ESP_LOGI(BT_PBAC_TAG, "Phone Book Size: %d, starting paginated download", 
-                        total_phonebook_size);
-                
-                // Start downloading first page
-                esp_pbac_pull_phone_book_app_param_t app_param = {0};
-                app_param.include_property_selector = 1;
-                app_param.property_selector = 0xFFFFFFF7;  // Filter out photo
-                app_param.include_max_list_count = 1;
-                app_param.max_list_count = PHONEBOOK_PAGE_SIZE;
-                app_param.include_list_start_offset = 1;
-                app_param.list_start_offset = current_offset;
-                
-                esp_pbac_pull_phone_book(pba_conn_handle, "telecom/pb.vcf", &app_param);
-            }
-            // Check if we need to download more pages
-            else if (pagination_in_progress) {
-                // Wait for queue to drain before requesting next page
-                int wait_count = 0;
-                while (uxQueueMessagesWaiting(pbac_data_queue) > 0 && wait_count < 100) {
-                    vTaskDelay(pdMS_TO_TICKS(50));
-                    wait_count++;
-                }
-                
-                ESP_LOGI(BT_PBAC_TAG, "Queue drained (waited %d ms)", wait_count * 50);
-                
-                // Move to next page
-                current_offset += PHONEBOOK_PAGE_SIZE;
-                
-                if (current_offset < total_phonebook_size) {
-                    ESP_LOGI(BT_PBAC_TAG, "Downloading contacts %d-%d of %d", 
-                            current_offset, 
-                            current_offset + PHONEBOOK_PAGE_SIZE - 1,
-                            total_phonebook_size);
-                    
-                    // Request next page
-                    esp_pbac_pull_phone_book_app_param_t app_param = {0};
-                    app_param.include_property_selector = 1;
-                    app_param.property_selector = 0xFFFFFFF7;
-                    app_param.include_max_list_count = 1;
-                    app_param.max_list_count = PHONEBOOK_PAGE_SIZE;
-                    app_param.include_list_start_offset = 1;
-                    app_param.list_start_offset = current_offset;
-                    
-                    esp_pbac_pull_phone_book(pba_conn_handle, "telecom/pb.vcf", &app_param);
+            if (size_query_outstanding) {
+                size_query_outstanding = false;
+                if (param->pull_phone_book_rsp.include_phone_book_size) {
+                    // PBAP 1.2 phones say whether anything changed since the last sync
+                    pb_sync_versions_t *v = &s_reported_versions;
+                    memset(v, 0, sizeof(*v));
+                    v->size = param->pull_phone_book_rsp.phone_book_size;
+                    if (param->pull_phone_book_rsp.include_database_identifier &&
+                        param->pull_phone_book_rsp.database_identifier != NULL) {
+                        v->flags |= PB_SYNC_HAS_DB_ID;
+                        memcpy(v->db_id, param->pull_phone_book_rsp.database_identifier, PB_SYNC_ID_LEN);
+                    }
+                    if (param->pull_phone_book_rsp.include_primary_folder_version &&
+                        param->pull_phone_book_rsp.primary_folder_version != NULL) {
+                        v->flags |= PB_SYNC_HAS_VERSION;
+                        memcpy(v->version, param->pull_phone_book_rsp.primary_folder_version, PB_SYNC_ID_LEN);
+                    }
+                    pbac_post(PBAC_MSG_SYNC_START, v->size, portMAX_DELAY);
                 } else {
-                    // All pages downloaded - finalize
-                    ESP_LOGI(BT_PBAC_TAG, "All pages downloaded, finalizing");
-                    pagination_in_progress = false;
-                    
-                    pbac_msg_t msg;
-                    msg.type = PBAC_MSG_FINALIZE;
-                    msg.data_len = 0;
-                    msg.data = NULL;
-                    xQueueSend(pbac_data_queue, &msg, portMAX_DELAY);
+                    ESP_LOGW(BT_PBAC_TAG, "Phone book size not reported, sync skipped");
                 }
+            } else {
+                // Queued behind this page's chunks, so pbac_proc has parsed them
+                // by the time it asks for the next page
+                pbac_post(PBAC_MSG_PAGE_DONE,
+                          param->pull_phone_book_rsp.result == ESP_PBAC_SUCCESS, portMAX_DELAY);
             }
         }
         break;
@@ -255,24 +661,43 @@ void bt_app_pbac_cb(esp_pbac_event_t event, esp_pbac_param_t *param)
         ESP_LOGI(BT_PBAC_TAG, "PBA client set phone book response, handle:%d, result: 0x%x", 
                 param->set_phone_book_rsp.handle, 
                 param->set_phone_book_rsp.result);
-        if (param->set_phone_book_rsp.result == ESP_PBAC_SUCCESS) {
+        if (s_entering_pb_folder) {
+            // on the way to pulling single entries
+            s_entering_pb_folder = false;
+            pbac_post(PBAC_MSG_PAGE_DONE, param->set_phone_book_rsp.result == ESP_PBAC_SUCCESS, portMAX_DELAY);
+        } else if (param->set_phone_book_rsp.result == ESP_PBAC_SUCCESS) {
             // First, query the phonebook size
             esp_pbac_pull_phone_book_app_param_t app_param = {0};
             app_param.include_max_list_count = 1;
             app_param.max_list_count = 0;  // 0 = query size only
+            size_query_outstanding = true;
             esp_pbac_pull_phone_book(pba_conn_handle, "telecom/pb.vcf", &app_param);
         }
         break;
         
     case ESP_PBAC_PULL_VCARD_LISTING_RESPONSE_EVT:
+        if (param->pull_vcard_listing_rsp.result == ESP_PBAC_SUCCESS &&
+            param->pull_vcard_listing_rsp.data_len > 0) {
+            pbac_post_data(PBAC_MSG_LISTING_CHUNK, param->pull_vcard_listing_rsp.data,
+                           param->pull_vcard_listing_rsp.data_len);
+        }
         if (param->pull_vcard_listing_rsp.final) {
             ESP_LOGI(BT_PBAC_TAG, "PBA client pull vCard listing final response");
+            pbac_post(PBAC_MSG_PAGE_DONE,
+                      param->pull_vcard_listing_rsp.result == ESP_PBAC_SUCCESS, portMAX_DELAY);
         }
         break;
         
     case ESP_PBAC_PULL_VCARD_ENTRY_RESPONSE_EVT:
+        if (param->pull_vcard_entry_rsp.result == ESP_PBAC_SUCCESS &&
+            param->pull_vcard_entry_rsp.data_len > 0) {
+            pbac_post_data(PBAC_MSG_DATA_CHUNK, param->pull_vcard_entry_rsp.data,
+                           param->pull_vcard_entry_rsp.data_len);
+        }
         if (param->pull_vcard_entry_rsp.final) {
             ESP_LOGI(BT_PBAC_TAG, "PBA client pull vCard entry final response");
+            pbac_post(PBAC_MSG_PAGE_DONE,
+                      param->pull_vcard_entry_rsp.result == ESP_PBAC_SUCCESS, portMAX_DELAY);
         }
         break;
         
@@ -286,6 +711,12 @@ phonebook_t* bt_app_pbac_get_current_phonebook(void)
     return current_phonebook;
 }
 
+static bool pbac_print_contact(const contact_t *contact, void *ctx)
+{
+    phonebook_print_contact(contact);
+    return true;
+}
+
 void bt_app_pbac_search_contacts(const char *query)
 {
     if (current_phonebook == NULL) {
@@ -293,15 +724,10 @@ void bt_app_pbac_search_contacts(const char *query)
         return;
     }
     
-    uint16_t count;
-    contact_t *results = phonebook_search_by_name(current_phonebook, query, &count);
-    
-    ESP_LOGI(BT_PBAC_TAG, "Search for '%s' found %d contacts:", query, count);
-    for (int i = 0; i < count; i++) {
-        phonebook_print_contact(&results[i]);
-    }
-    
-    if (results) free(results);
+    ESP_LOGI(BT_PBAC_TAG, "Search for '%s':", query);
+    phonebook_query_t q = { .type = PHONEBOOK_QUERY_NAME, .text = query };
+    uint16_t count = phonebook_query(current_phonebook, &q, pbac_print_contact, NULL);
+    ESP_LOGI(BT_PBAC_TAG, "Search for '%s' found %d contacts", query, count);
 }
 
 void bt_app_pbac_list_contacts_by_letter(char letter)
@@ -311,15 +737,10 @@ void bt_app_pbac_list_contacts_by_letter(char letter)
         return;
     }
     
-    uint16_t count;
-    contact_t *results = phonebook_search_by_letter(current_phonebook, letter, &count);
-    
+    ESP_LOGI(BT_PBAC_TAG, "Contacts starting with '%c':", letter);
+    phonebook_query_t q = { .type = PHONEBOOK_QUERY_LETTER, .letter = letter };
+    uint16_t count = phonebook_query(current_phonebook, &q, pbac_print_contact, NULL);
     ESP_LOGI(BT_PBAC_TAG, "Contacts starting with '%c': %d", letter, count);
-    for (int i = 0; i < count; i++) {
-        phonebook_print_contact(&results[i]);
-    }
-    
-    if (results) free(results);
 }
 
 contact_t* bt_app_pbac_find_by_number(const char *number)
@@ -2,12 +2,49 @@
 #define __BT_APP_PBAC_H__
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "esp_pbac_api.h"
 #include "phonebook.h"
 
 void bt_app_pbac_cb(esp_pbac_event_t event, esp_pbac_param_t *param);
 void bt_app_pbac_task_start(void);  // New: start the phonebook processing task
 
+typedef enum {
+    BT_APP_PBAC_SYNC_IDLE = 0,
+    BT_APP_PBAC_SYNC_RUNNING,
+    BT_APP_PBAC_SYNC_PAUSED,
+    BT_APP_PBAC_SYNC_DONE,
+} bt_app_pbac_sync_state_t;
+
+typedef enum {
+    BT_APP_PBAC_RATE_FULL = 0,
+    BT_APP_PBAC_RATE_THROTTLED,     // small pages, spaced out (call active)
+    BT_APP_PBAC_RATE_PAUSED,        // call being set up, or paused by the user
+} bt_app_pbac_rate_t;
+
+typedef struct {
+    bt_app_pbac_sync_state_t state;
+    bt_app_pbac_rate_t rate;
+    uint16_t offset;                // next contact to download
+    uint16_t total;
+    uint16_t contacts;              // contacts parsed so far
+    bool user_paused;
+    bool call_active;
+    bool call_setup;
+    bool connect_deferred;
+} bt_app_pbac_sync_status_t;
+
+// Sync scheduling; the download slows down or pauses around calls and
+// continues from the same offset afterwards
+void bt_app_pbac_connect(esp_bd_addr_t remote_addr);  // deferred while a call is up
+void bt_app_pbac_cancel_connect(void);
+void bt_app_pbac_set_call_active(bool active);
+void bt_app_pbac_set_call_setup(bool in_setup);
+void bt_app_pbac_pause(bool pause);
+void bt_app_pbac_get_sync_status(bt_app_pbac_sync_status_t *status);
+const char *bt_app_pbac_sync_state_str(bt_app_pbac_sync_state_t state);
+const char *bt_app_pbac_rate_str(bt_app_pbac_rate_t rate);
+
 // Public search functions
 phonebook_t* bt_app_pbac_get_current_phonebook(void);
 void bt_app_pbac_search_contacts(const char *query);
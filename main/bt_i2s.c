@@ -15,7 +15,17 @@
 #include "bt_i2s.h"
 #include "bt_app_hf.h"
 #include "codec.h"
+#include "app_task_config.h"
 #include "esp_timer.h"
+#include "esp_attr.h"
+#include "i2s_cal.h"
+#include "resampler.h"
+#include "conceal.h"
+#include "wsola.h"
+#include "audio_loopback.h"
+#include "latency_trace.h"
+#include "cycle_prof.h"
+#include "metrics.h"
 
 #define BT_I2S_TAG "BT_I2S"
 // esp_log_level_set(BT_I2S_TAG, ESP_LOG_DEBUG);
@@ -25,11 +35,37 @@
 #define A2DP_STANDARD_SAMPLE_RATE               44100
 #define A2DP_I2S_DATA_BIT_WIDTH                 I2S_DATA_BIT_WIDTH_16BIT
 #define RINGBUF_HIGHEST_WATER_LEVEL             (32 * 1024)
-#define RINGBUF_PREFETCH_WATER_LEVEL            (20 * 1024)
+/* A2DP flow control: playback starts at the target level, and the tx task
+   keeps the level between LOW and HIGH by skipping or repeating single
+   frames instead of letting it run full (drops) or dry (re-prefetch) */
+#define A2DP_RING_TARGET_LEVEL                  (16 * 1024)
+#define A2DP_RING_LOW_LEVEL                     (8 * 1024)
+#define A2DP_RING_HIGH_LEVEL                    (24 * 1024)
+#define A2DP_FRAME_BYTES                        (2 * sizeof(int16_t))   /* 16-bit stereo */
+#define A2DP_RX_WAIT_MS                         20   /* ride out short gaps in the Bluetooth stream */
+#define A2DP_VOLUME_MAX                         127  /* AVRCP absolute volume range */
+#define A2DP_GAIN_UNITY                         32768
 #define RINGBUF_HFP_TX_HIGHEST_WATER_LEVEL      (32 * MSBC_FRAME_SAMPLES * 2)
 #define RINGBUF_HFP_TX_PREFETCH_WATER_LEVEL     (20 * MSBC_FRAME_SAMPLES * 2)
 #define RINGBUF_HFP_RX_HIGHEST_WATER_LEVEL      (32 * ESP_HF_MSBC_ENCODED_FRAME_SIZE)
 #define RINGBUF_HFP_RX_PREFETCH_WATER_LEVEL     (20 * ESP_HF_MSBC_ENCODED_FRAME_SIZE)
+/* HFP speaker: the tx task time-stretches playback (wsola.c) to hold the
+   ringbuffer near the level playback started at, so network jitter is
+   absorbed by playing slightly faster or slower instead of by dropping
+   whole packets or pausing to re-prefetch */
+#define HFP_TX_TARGET_LEVEL                     RINGBUF_HFP_TX_PREFETCH_WATER_LEVEL
+#define HFP_TX_LOW_LEVEL                        (HFP_TX_TARGET_LEVEL - 4 * MSBC_FRAME_SAMPLES * 2)
+#define HFP_TX_HIGH_LEVEL                       (HFP_TX_TARGET_LEVEL + 4 * MSBC_FRAME_SAMPLES * 2)
+#define HFP_FRAME_PERIOD_US                     (MSBC_FRAME_SAMPLES * 1000000 / HFP_SAMPLE_RATE)  /* 7500 us */
+/* mic capture: one DMA buffer per mSBC frame, handed to the rx task by reference */
+#define HFP_RX_DMA_DESC_NUM                     6
+#define HFP_RX_DMA_FRAME_NUM                    MSBC_FRAME_SAMPLES
+#define HFP_RX_BLOCK_QUEUE_LEN                  (HFP_RX_DMA_DESC_NUM - 2)  /* older blocks may already be refilled */
+#define HFP_RX_BLOCK_WAIT_MS                    100
+/* output stage: converted audio is written in chunks of this many frames */
+#define TX_OUT_CHUNK_FRAMES                     480
+#define TX_OUT_MAX_CH                           2
+#define TX_FADE_GAIN_ONE                        32768
 
 
 enum {
@@ -38,6 +74,14 @@ enum {
     RINGBUFFER_MODE_DROPPING       /* ringbuffer is not buffering (dropping) incoming audio data, I2S is working */
 };
 
+/* a completed mic DMA buffer, valid until the DMA wraps around to it again */
+typedef struct {
+    const int32_t *buf;
+    uint32_t size;
+    uint32_t seq;           /* running DMA buffer count */
+    int64_t capture_us;     /* when the last sample of the buffer was captured */
+} bt_i2s_rx_block_t;
+
 enum {
     I2S_TX_MODE_NONE,   /* i2s tx isn't being used by a2dp or hfp */
     I2S_TX_MODE_A2DP,   /* i2s tx is being used by a2dp */
@@ -68,6 +112,52 @@ static uint16_t s_i2s_tx_mode = I2S_TX_MODE_NONE;
 static uint16_t s_i2s_rx_mode = I2S_RX_MODE_NONE;
 static SemaphoreHandle_t s_i2s_tx_semaphore = NULL;
 static SemaphoreHandle_t s_i2s_rx_semaphore = NULL;
+static bt_i2s_sched_stats_t s_hfp_sched_stats;                                  /* audio task wake-up latency, per call */
+static uint64_t s_hfp_sched_late_sum_us = 0;
+static uint32_t s_hfp_tx_underruns = 0;                                         /* speaker ringbuffer underflows, per call; survives a metrics reset */
+static conceal_t s_hfp_conceal;                                                 /* speaker underrun concealment, per call */
+static DRAM_ATTR int16_t s_hfp_conceal_buf[MSBC_FRAME_SAMPLES];
+static wsola_t s_hfp_wsola;                                                     /* speaker time-stretching, per call */
+static DRAM_ATTR int16_t s_hfp_wsola_out[WSOLA_OUT_MAX];
+static uint16_t s_hfp_tx_speed = 1000;                                          /* permille */
+static bt_i2s_hfp_stretch_stats_t s_hfp_stretch;                                /* speaker ringbuffer level, per call */
+static uint64_t s_hfp_level_sum = 0;
+static metric_t *s_m_spk_level;                                                 /* speaker ringbuffer bytes, last frame taken */
+static metric_t *s_m_spk_dropped;                                               /* decoded frames dropped, speaker ringbuffer full */
+static metric_t *s_m_spk_underruns;                                             /* speaker ringbuffer found empty */
+static metric_t *s_m_mic_frames;                                                /* encoded mic frames offered to the rx ringbuffer */
+static metric_t *s_m_mic_sent;
+static metric_t *s_m_mic_dropped;
+static lt_fifo_t s_lt_spk_ring;                                                 /* frame timestamps through the speaker ringbuffer */
+static lt_fifo_t s_lt_spk_dma;                                                  /* ... through the I2S tx DMA queue */
+static lt_fifo_t s_lt_mic_ring;                                                 /* ... through the mic ringbuffer */
+static QueueHandle_t s_i2s_hfp_rx_block_queue = NULL;                           /* completed mic DMA buffers, filled from the I2S ISR */
+static volatile uint32_t s_hfp_rx_dma_seq = 0;                                  /* DMA buffers completed */
+static volatile uint32_t s_hfp_rx_queue_overruns = 0;                           /* blocks pushed out of a full queue by the ISR */
+static bt_i2s_rx_capture_stats_t s_hfp_rx_capture_stats;                        /* mic capture, per call */
+static SemaphoreHandle_t s_tx_chan_lock = NULL;                                 /* held while writing to or recreating tx_chan */
+static i2s_dma_geometry_t s_tx_geometry;                                        /* DMA geometry tx_chan was created with */
+static int s_tx_session_mode = -1;                                              /* i2s_cal_mode_t being measured, -1 if none */
+static int64_t s_tx_session_start_us = 0;
+static volatile bool s_tx_measuring = false;                                    /* set by the first write of a session */
+static volatile uint32_t s_tx_dma_sent = 0;                                     /* DMA buffers sent, per session */
+static volatile uint32_t s_tx_dma_underruns = 0;                                /* DMA buffers sent with no new data, per session */
+static uint32_t s_tx_writes = 0;
+static uint64_t s_tx_write_block_sum_us = 0;
+static uint32_t s_tx_write_block_max_us = 0;
+static bool s_a2dp_streaming = false;                                           /* A2DP stream started, may be paused by a call */
+static volatile int32_t s_a2dp_gain_q15 = A2DP_GAIN_UNITY;                      /* software volume from AVRCP */
+static bt_i2s_a2dp_flow_stats_t s_a2dp_flow;                                    /* ringbuffer level and corrections, per stream */
+static uint64_t s_a2dp_level_sum = 0;
+static int s_a2dp_stretch = 0;                                                  /* -1 skipping, +1 repeating, 0 neither */
+static uint32_t s_tx_out_rate = A2DP_STANDARD_SAMPLE_RATE;                      /* format tx_chan is running at */
+static uint8_t s_tx_out_ch = 2;
+static resampler_t s_tx_rs[BT_I2S_TX_SRC_MAX];                                  /* per source conversion to the tx format */
+static int s_tx_out_src = -1;                                                   /* bt_i2s_tx_src_t that wrote last, -1 after a release */
+static bool s_tx_out_live = false;                                              /* last output not yet faded to silence */
+static int16_t s_tx_out_last[TX_OUT_MAX_CH];                                    /* last frame written, where a fade-out starts */
+static uint32_t s_tx_fade_pos = 0;                                              /* frames into the current fade-in */
+static DRAM_ATTR int16_t s_tx_out_buf[TX_OUT_CHUNK_FRAMES * TX_OUT_MAX_CH];     /* converted output, used under s_tx_chan_lock */
 
 /*  
     we initialize with default values here
@@ -121,8 +211,28 @@ void bt_i2s_init() {
         ESP_LOGE(BT_I2S_TAG, "%s, s_i2s_hfp_rx_ringbuf_delete Semaphore create failed", __func__);
         return;
     }
+    if ((s_i2s_hfp_rx_block_queue = xQueueCreate(HFP_RX_BLOCK_QUEUE_LEN, sizeof(bt_i2s_rx_block_t))) == NULL) {
+        ESP_LOGE(BT_I2S_TAG, "%s, s_i2s_hfp_rx_block_queue create failed", __func__);
+        return;
+    }
+    if ((s_tx_chan_lock = xSemaphoreCreateMutex()) == NULL) {
+        ESP_LOGE(BT_I2S_TAG, "%s, s_tx_chan_lock create failed", __func__);
+        return;
+    }
+    s_m_spk_level = metrics_gauge("hfp.spk.level");
+    s_m_spk_dropped = metrics_counter("hfp.spk.dropped");
+    s_m_spk_underruns = metrics_counter("hfp.spk.underruns");
+    s_m_mic_frames = metrics_counter("hfp.mic.frames");
+    s_m_mic_sent = metrics_counter("hfp.mic.sent");
+    s_m_mic_dropped = metrics_counter("hfp.mic.dropped");
+    i2s_cal_init();
+    resampler_design_tables();
     bt_i2s_init_tx_chan();
     bt_i2s_init_rx_chan();
+#if BT_I2S_TX_FIXED_RATE
+    /* the tx clock runs from here on; idle time is silence from auto_clear */
+    bt_i2s_tx_channel_enable();
+#endif
 }
 
 
@@ -159,14 +269,43 @@ i2s_std_slot_config_t bt_i2s_get_adp_slot_cfg(void)
     return adp_slot_cfg;
 }
 
-// This is our tx channel (used for both ad2p sink and hfp tx)
-void bt_i2s_init_tx_chan()
+/*
+    tx DMA interrupts, counted while a session is being measured.
+    on_send_q_ovf fires when a DMA buffer completes while every buffer is
+    already free, i.e. the writer has not queued anything new. Only count
+    it while the source ringbuffer has data, so a starved Bluetooth link
+    is not blamed on DMA depth.
+ */
+static IRAM_ATTR bool bt_i2s_tx_sent_isr(i2s_chan_handle_t handle, i2s_event_data_t *event, void *user_ctx)
+{
+    if (s_tx_measuring) {
+        s_tx_dma_sent++;
+    }
+    if (s_i2s_tx_mode == I2S_TX_MODE_HFP) {
+        lt_fifo_out(&s_lt_spk_dma, event->size, LT_SPK_DMA, esp_timer_get_time());
+    }
+    return false;
+}
+
+static IRAM_ATTR bool bt_i2s_tx_underrun_isr(i2s_chan_handle_t handle, i2s_event_data_t *event, void *user_ctx)
+{
+    uint16_t source_mode = (s_i2s_tx_mode == I2S_TX_MODE_HFP) ? s_i2s_hfp_tx_ringbuffer_mode : s_i2s_a2dp_tx_ringbuffer_mode;
+    if (s_tx_measuring && source_mode == RINGBUFFER_MODE_PROCESSING) {
+        s_tx_dma_underruns++;
+    }
+    return false;
+}
+
+static void bt_i2s_tx_chan_create(i2s_dma_geometry_t geometry, i2s_std_clk_config_t clk_cfg, i2s_std_slot_config_t slot_cfg)
 {
     i2s_chan_config_t tx_chan_cfg = I2S_CHANNEL_DEFAULT_CONFIG(I2S_NUM_0, I2S_ROLE_MASTER);
-    i2s_new_channel(&tx_chan_cfg, &tx_chan, NULL);
+    tx_chan_cfg.dma_desc_num = geometry.desc_num;
+    tx_chan_cfg.dma_frame_num = geometry.frame_num;
+    tx_chan_cfg.auto_clear = true;  /* send silence, not stale buffers, while the channel idles between streams */
+    ESP_ERROR_CHECK(i2s_new_channel(&tx_chan_cfg, &tx_chan, NULL));
     i2s_std_config_t std_tx_cfg = {
-        .clk_cfg = bt_i2s_get_adp_clk_cfg(),
-        .slot_cfg = bt_i2s_get_adp_slot_cfg(),
+        .clk_cfg = clk_cfg,
+        .slot_cfg = slot_cfg,
         .gpio_cfg = {
                 .mclk = I2S_GPIO_UNUSED,
                 .bclk = i2sTxPinConfig.bck,
@@ -181,6 +320,266 @@ void bt_i2s_init_tx_chan()
         },
     };
     ESP_ERROR_CHECK(i2s_channel_init_std_mode(tx_chan, &std_tx_cfg));
+
+    i2s_event_callbacks_t tx_cbs = {
+        .on_sent = bt_i2s_tx_sent_isr,
+        .on_send_q_ovf = bt_i2s_tx_underrun_isr,
+    };
+    ESP_ERROR_CHECK(i2s_channel_register_event_callback(tx_chan, &tx_cbs, NULL));
+    s_tx_geometry = geometry;
+    ESP_LOGI(BT_I2S_TAG, "tx channel: %d DMA buffers of %d frames", geometry.desc_num, geometry.frame_num);
+}
+
+#if BT_I2S_TX_FIXED_RATE
+static i2s_std_clk_config_t bt_i2s_get_fixed_clk_cfg(void)
+{
+    i2s_std_clk_config_t fixed_clk_cfg = I2S_STD_CLK_DEFAULT_CONFIG(BT_I2S_TX_FIXED_RATE);
+    return fixed_clk_cfg;
+}
+#endif
+
+// This is our tx channel (used for both ad2p sink and hfp tx)
+void bt_i2s_init_tx_chan()
+{
+#if BT_I2S_TX_FIXED_RATE
+    bt_i2s_tx_chan_create(i2s_cal_get_geometry(I2S_CAL_MODE_A2DP, BT_I2S_TX_FIXED_RATE), bt_i2s_get_fixed_clk_cfg(), bt_i2s_get_adp_slot_cfg());
+    s_tx_out_rate = BT_I2S_TX_FIXED_RATE;
+#else
+    bt_i2s_tx_chan_create(i2s_cal_get_geometry(I2S_CAL_MODE_A2DP, A2DP_SAMPLE_RATE), bt_i2s_get_adp_clk_cfg(), bt_i2s_get_adp_slot_cfg());
+    s_tx_out_rate = A2DP_SAMPLE_RATE;
+#endif
+    s_tx_out_ch = 2;
+}
+
+/*
+    DMA depth is fixed when a channel is created, so a mode whose
+    calibrated geometry differs gets a new channel. Called with tx disabled.
+    Returns false if the existing channel can be kept and just reconfigured.
+ */
+static bool bt_i2s_tx_chan_apply_geometry(i2s_cal_mode_t mode, uint32_t out_rate, i2s_std_clk_config_t clk_cfg, i2s_std_slot_config_t slot_cfg)
+{
+    i2s_dma_geometry_t geometry = i2s_cal_get_geometry(mode, out_rate);
+    if (geometry.desc_num == s_tx_geometry.desc_num && geometry.frame_num == s_tx_geometry.frame_num) {
+        return false;
+    }
+    xSemaphoreTake(s_tx_chan_lock, portMAX_DELAY);
+    ESP_ERROR_CHECK(i2s_del_channel(tx_chan));
+    bt_i2s_tx_chan_create(geometry, clk_cfg, slot_cfg);
+    xSemaphoreGive(s_tx_chan_lock);
+    return true;
+}
+
+/*
+    every write to tx_chan goes through here, so the channel can be
+    recreated safely and write-blocking time is measured in one place
+ */
+static IRAM_ATTR esp_err_t bt_i2s_tx_write_locked(const void *src, size_t size, size_t *bytes_written, TickType_t timeout)
+{
+    int64_t t0 = esp_timer_get_time();
+    esp_err_t ret = i2s_channel_write(tx_chan, src, size, bytes_written, timeout);
+    int64_t t1 = esp_timer_get_time();
+    uint32_t blocked_us = (uint32_t)(t1 - t0);
+
+    if (ret == ESP_OK && s_i2s_tx_mode == I2S_TX_MODE_HFP) {
+        lt_fifo_in(&s_lt_spk_dma, *bytes_written, t1);
+    }
+
+    if (s_tx_session_mode >= 0 && ret == ESP_OK) {
+        if (s_tx_measuring) {
+            s_tx_writes++;
+            s_tx_write_block_sum_us += blocked_us;
+            if (blocked_us > s_tx_write_block_max_us) {
+                s_tx_write_block_max_us = blocked_us;
+            }
+        } else {
+            s_tx_measuring = true;
+            s_tx_session_start_us = esp_timer_get_time();
+        }
+    }
+    return ret;
+}
+
+IRAM_ATTR esp_err_t bt_i2s_tx_write(const void *src, size_t size, size_t *bytes_written, TickType_t timeout)
+{
+    xSemaphoreTake(s_tx_chan_lock, portMAX_DELAY);
+    esp_err_t ret = bt_i2s_tx_write_locked(src, size, bytes_written, timeout);
+    xSemaphoreGive(s_tx_chan_lock);
+    return ret;
+}
+
+/*
+    output stage. Every source writes its native format here; it is
+    converted to whatever tx_chan runs at (always the same format with
+    BT_I2S_TX_FIXED_RATE). A source that takes over fades in over
+    BT_I2S_TX_FADE_MS; one that stops, or is cut off by another, is ramped
+    from its last sample down to silence first, so no switch leaves a step
+    in the output.
+ */
+static IRAM_ATTR void bt_i2s_tx_swap_mono_pairs(int16_t *buf, size_t samples)
+{
+    /* 16-bit mono slots go out pairwise swapped, see
+       https://docs.espressif.com/projects/esp-idf/en/stable/esp32/api-reference/peripherals/i2s.html#std-tx-mode */
+    for (size_t i = 0; i + 1 < samples; i += 2) {
+        int16_t temp = buf[i];
+        buf[i] = buf[i + 1];
+        buf[i + 1] = temp;
+    }
+}
+
+static IRAM_ATTR void bt_i2s_tx_release_locked(void)
+{
+    if (!s_tx_out_live) {
+        return;
+    }
+    const uint8_t ch = s_tx_out_ch;
+    size_t fade_frames = s_tx_out_rate * BT_I2S_TX_FADE_MS / 1000;
+    if (fade_frames > TX_OUT_CHUNK_FRAMES) {
+        fade_frames = TX_OUT_CHUNK_FRAMES;
+    }
+    for (size_t i = 0; i < fade_frames; i++) {
+        int32_t gain = (int32_t)((fade_frames - 1 - i) * TX_FADE_GAIN_ONE / fade_frames);
+        for (int c = 0; c < ch; c++) {
+            s_tx_out_buf[i * ch + c] = (int16_t)((s_tx_out_last[c] * gain) >> 15);
+        }
+    }
+    if (ch == 1) {
+        bt_i2s_tx_swap_mono_pairs(s_tx_out_buf, fade_frames);
+    }
+    size_t bytes_written = 0;
+    bt_i2s_tx_write_locked(s_tx_out_buf, fade_frames * ch * sizeof(int16_t), &bytes_written,
+                           pdMS_TO_TICKS(4 * BT_I2S_TX_FADE_MS));
+    s_tx_out_live = false;
+}
+
+void bt_i2s_tx_release(bt_i2s_tx_src_t src)
+{
+    xSemaphoreTake(s_tx_chan_lock, portMAX_DELAY);
+    if (s_tx_out_src == (int)src) {
+        bt_i2s_tx_release_locked();
+        s_tx_out_src = -1;
+    }
+    xSemaphoreGive(s_tx_chan_lock);
+}
+
+static void bt_i2s_tx_release_any(void)
+{
+    xSemaphoreTake(s_tx_chan_lock, portMAX_DELAY);
+    bt_i2s_tx_release_locked();
+    s_tx_out_src = -1;
+    xSemaphoreGive(s_tx_chan_lock);
+}
+
+IRAM_ATTR esp_err_t bt_i2s_tx_write_pcm(bt_i2s_tx_src_t src, const int16_t *pcm, size_t frames,
+                                        uint32_t rate, uint8_t channels, TickType_t timeout)
+{
+    esp_err_t ret = ESP_OK;
+    resampler_t *rs = &s_tx_rs[src];
+
+    xSemaphoreTake(s_tx_chan_lock, portMAX_DELAY);
+    const uint8_t out_ch = s_tx_out_ch;
+    const uint32_t fade_frames = s_tx_out_rate * BT_I2S_TX_FADE_MS / 1000;
+    if (!resampler_matches(rs, rate, channels, s_tx_out_rate, out_ch)) {
+        resampler_init(rs, rate, channels, s_tx_out_rate, out_ch);
+    }
+    if (s_tx_out_src != (int)src) {
+        /* another source takes over: ramp out what it was playing, then fade in */
+        bt_i2s_tx_release_locked();
+        resampler_reset(rs);
+        s_tx_out_src = src;
+        s_tx_fade_pos = 0;
+    }
+
+    size_t used = 0;
+    while (used < frames && ret == ESP_OK) {
+        size_t in_used = 0;
+        uint32_t prof = cycle_prof_begin();
+        size_t n = resampler_process(rs, &pcm[used * channels], frames - used, &in_used,
+                                     s_tx_out_buf, TX_OUT_CHUNK_FRAMES);
+        cycle_prof_end(PROF_SPK_RESAMPLE, prof);
+        used += in_used;
+        if (n == 0) {
+            continue;
+        }
+        for (size_t i = 0; i < n && s_tx_fade_pos < fade_frames; i++, s_tx_fade_pos++) {
+            int32_t gain = (int32_t)(s_tx_fade_pos * TX_FADE_GAIN_ONE / fade_frames);
+            for (int c = 0; c < out_ch; c++) {
+                s_tx_out_buf[i * out_ch + c] = (int16_t)((s_tx_out_buf[i * out_ch + c] * gain) >> 15);
+            }
+        }
+        for (int c = 0; c < out_ch; c++) {
+            s_tx_out_last[c] = s_tx_out_buf[(n - 1) * out_ch + c];
+        }
+        if (out_ch == 1) {
+            prof = cycle_prof_begin();
+            bt_i2s_tx_swap_mono_pairs(s_tx_out_buf, n);
+            cycle_prof_end(PROF_SPK_PAIR_SWAP, prof);
+        }
+        s_tx_out_live = true;
+        size_t bytes_written = 0;
+        ret = bt_i2s_tx_write_locked(s_tx_out_buf, n * out_ch * sizeof(int16_t), &bytes_written, timeout);
+    }
+    xSemaphoreGive(s_tx_chan_lock);
+    return ret;
+}
+
+static void bt_i2s_tx_session_begin(i2s_cal_mode_t mode)
+{
+    s_tx_measuring = false;
+    s_tx_dma_sent = 0;
+    s_tx_dma_underruns = 0;
+    s_tx_writes = 0;
+    s_tx_write_block_sum_us = 0;
+    s_tx_write_block_max_us = 0;
+    s_tx_session_mode = mode;
+}
+
+static void bt_i2s_tx_session_end(void)
+{
+    if (s_tx_session_mode < 0) {
+        return;
+    }
+    i2s_cal_mode_t mode = (i2s_cal_mode_t)s_tx_session_mode;
+    s_tx_session_mode = -1;
+    bool measured = s_tx_measuring;
+    s_tx_measuring = false;
+    if (!measured) {
+        return;
+    }
+
+    i2s_cal_session_t session = {
+        .duration_ms = (uint32_t)((esp_timer_get_time() - s_tx_session_start_us) / 1000),
+        .buffers_sent = s_tx_dma_sent,
+        .underruns = s_tx_dma_underruns,
+        .writes = s_tx_writes,
+        .write_block_avg_us = s_tx_writes ? (uint32_t)(s_tx_write_block_sum_us / s_tx_writes) : 0,
+        .write_block_max_us = s_tx_write_block_max_us,
+    };
+    i2s_cal_session_end(mode, &session);
+}
+
+/*
+    I2S rx ISR: a DMA buffer of exactly one mSBC frame of mic samples is complete.
+    The driver also queues it for i2s_channel_read, which we never call, so its
+    own queue is permanently full and on_recv_q_ovf says nothing about us; an
+    overrun is when our queue is full because the rx task fell behind.
+ */
+static IRAM_ATTR bool bt_i2s_hfp_rx_dma_isr(i2s_chan_handle_t handle, i2s_event_data_t *event, void *user_ctx)
+{
+    BaseType_t woken = pdFALSE;
+    bt_i2s_rx_block_t block = {
+        .buf = (const int32_t *)event->dma_buf,
+        .size = event->size,
+        .seq = s_hfp_rx_dma_seq++,
+        .capture_us = esp_timer_get_time(),
+    };
+
+    if (xQueueIsQueueFullFromISR(s_i2s_hfp_rx_block_queue)) {
+        bt_i2s_rx_block_t stale;
+        xQueueReceiveFromISR(s_i2s_hfp_rx_block_queue, &stale, &woken);
+        s_hfp_rx_queue_overruns++;
+    }
+    xQueueSendFromISR(s_i2s_hfp_rx_block_queue, &block, &woken);
+    return woken == pdTRUE;
 }
 
 // This is our INMP441 mems microphone. left channel, so pin is low.
@@ -188,6 +587,8 @@ void bt_i2s_init_rx_chan()
 {
     /* RX channel will be registered on our second I2S */
     i2s_chan_config_t rx_chan_cfg = I2S_CHANNEL_DEFAULT_CONFIG(I2S_NUM_1, I2S_ROLE_MASTER);
+    rx_chan_cfg.dma_desc_num = HFP_RX_DMA_DESC_NUM;
+    rx_chan_cfg.dma_frame_num = HFP_RX_DMA_FRAME_NUM;
     i2s_new_channel(&rx_chan_cfg, NULL, &rx_chan);
     // PHILIPS mode with MONO and 32-bit
     i2s_std_config_t std_rx_cfg = {
@@ -207,6 +608,11 @@ void bt_i2s_init_rx_chan()
         },
     };
     ESP_ERROR_CHECK(i2s_channel_init_std_mode(rx_chan, &std_rx_cfg));
+
+    i2s_event_callbacks_t rx_cbs = {
+        .on_recv = bt_i2s_hfp_rx_dma_isr,
+    };
+    ESP_ERROR_CHECK(i2s_channel_register_event_callback(rx_chan, &rx_cbs, NULL));
 }
 
 void bt_i2s_driver_install(void)
@@ -283,10 +689,18 @@ void bt_i2s_rx_channel_disable(void)
     rx_chan_running = false;
 }
 
+/*
+    a new a2dp stream config; the channel is only reclocked while a2dp owns
+    it, otherwise the config is kept and bt_i2s_a2dp_task_start_up applies
+    it when a2dp takes the channel (back)
+ */
 void bt_i2s_tx_channel_reconfig_clock_slot(int sample_rate, int ch_count)
 {
     A2DP_SAMPLE_RATE = sample_rate;
     A2DP_CH_COUNT = ch_count;
+    if (s_i2s_tx_mode != I2S_TX_MODE_A2DP) {
+        return;
+    }
     bt_i2s_channels_config_adp();
 }
 
@@ -301,31 +715,66 @@ void bt_i2s_audio_disable_adp(void)
     bt_i2s_tx_channel_disable();
 }
 
+#if BT_I2S_TX_FIXED_RATE
+/*
+    the clock never changes in fixed rate mode; a new calibrated DMA depth
+    is only applied while nothing is audible
+ */
+static void bt_i2s_tx_chan_apply_geometry_idle(i2s_cal_mode_t mode)
+{
+    if (s_tx_out_live) {
+        return;
+    }
+    bool _isrunning = tx_chan_running;
+    bt_i2s_tx_channel_disable();
+    bt_i2s_tx_chan_apply_geometry(mode, BT_I2S_TX_FIXED_RATE, bt_i2s_get_fixed_clk_cfg(), bt_i2s_get_adp_slot_cfg());
+    if (_isrunning) {
+        bt_i2s_tx_channel_enable();
+    }
+}
+#endif
+
 void bt_i2s_channels_config_adp(void)
 {
+#if BT_I2S_TX_FIXED_RATE
+    bt_i2s_tx_chan_apply_geometry_idle(I2S_CAL_MODE_A2DP);
+#else
     bool _isrunning = tx_chan_running; 
     i2s_std_clk_config_t clk_cfg = bt_i2s_get_adp_clk_cfg();
     i2s_std_slot_config_t slot_cfg = bt_i2s_get_adp_slot_cfg();
     bt_i2s_tx_channel_disable();
-    ESP_ERROR_CHECK(i2s_channel_reconfig_std_clock(tx_chan, &clk_cfg));
-    ESP_ERROR_CHECK(i2s_channel_reconfig_std_slot(tx_chan, &slot_cfg));
+    if (!bt_i2s_tx_chan_apply_geometry(I2S_CAL_MODE_A2DP, A2DP_SAMPLE_RATE, clk_cfg, slot_cfg)) {
+        ESP_ERROR_CHECK(i2s_channel_reconfig_std_clock(tx_chan, &clk_cfg));
+        ESP_ERROR_CHECK(i2s_channel_reconfig_std_slot(tx_chan, &slot_cfg));
+    }
+    s_tx_out_rate = A2DP_SAMPLE_RATE;
+    s_tx_out_ch = 2;
     if (_isrunning) {
         bt_i2s_tx_channel_enable();
     }
+#endif
 }
 
 void bt_i2s_channels_config_hfp(void)
 {
+#if BT_I2S_TX_FIXED_RATE
+    bt_i2s_tx_chan_apply_geometry_idle(I2S_CAL_MODE_HFP);
+#else
     bool _tx_is_running = tx_chan_running;
 
     i2s_std_clk_config_t clk_cfg = bt_i2s_get_hfp_clk_cfg();
     i2s_std_slot_config_t slot_cfg = bt_i2s_get_hfp_tx_slot_cfg();
     bt_i2s_tx_channel_disable();
-    ESP_ERROR_CHECK(i2s_channel_reconfig_std_clock(tx_chan, &clk_cfg));
-    ESP_ERROR_CHECK(i2s_channel_reconfig_std_slot(tx_chan, &slot_cfg));
+    if (!bt_i2s_tx_chan_apply_geometry(I2S_CAL_MODE_HFP, HFP_SAMPLE_RATE, clk_cfg, slot_cfg)) {
+        ESP_ERROR_CHECK(i2s_channel_reconfig_std_clock(tx_chan, &clk_cfg));
+        ESP_ERROR_CHECK(i2s_channel_reconfig_std_slot(tx_chan, &slot_cfg));
+    }
+    s_tx_out_rate = HFP_SAMPLE_RATE;
+    s_tx_out_ch = 1;
     if (_tx_is_running) {
         bt_i2s_tx_channel_enable();
     }
+#endif
 }
 
 /*  
@@ -337,34 +786,123 @@ A2DP
 */
 
 
+/*
+    AVRCP absolute volume is applied in software, in place on the ringbuffer
+    item just before it is written. Squared so the steps are roughly even in
+    loudness rather than in amplitude.
+ */
+void bt_i2s_a2dp_set_volume(uint8_t volume)
+{
+    if (volume > A2DP_VOLUME_MAX) {
+        volume = A2DP_VOLUME_MAX;
+    }
+    s_a2dp_gain_q15 = (int32_t)volume * volume * A2DP_GAIN_UNITY / (A2DP_VOLUME_MAX * A2DP_VOLUME_MAX);
+}
+
+static IRAM_ATTR void bt_i2s_a2dp_apply_gain(int16_t *samples, size_t count)
+{
+    int32_t gain = s_a2dp_gain_q15;
+    if (gain >= A2DP_GAIN_UNITY) {
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        samples[i] = (int16_t)((samples[i] * gain) >> 15);
+    }
+}
+
+/*
+    ringbuffer level, sampled once per DMA buffer written; decides whether
+    the next buffer is shortened or lengthened by one frame. Hysteresis:
+    a correction starts past LOW/HIGH and runs until the level is back at
+    the target, so a steady stream sees no corrections at all.
+ */
+static IRAM_ATTR int bt_i2s_a2dp_flow_update(uint32_t level)
+{
+    if (level < s_a2dp_flow.level_min || s_a2dp_flow.samples == 0) {
+        s_a2dp_flow.level_min = level;
+    }
+    if (level > s_a2dp_flow.level_max) {
+        s_a2dp_flow.level_max = level;
+    }
+    s_a2dp_flow.samples++;
+    s_a2dp_level_sum += level;
+
+    if (level > A2DP_RING_HIGH_LEVEL) {
+        s_a2dp_stretch = -1;
+    } else if (level < A2DP_RING_LOW_LEVEL) {
+        s_a2dp_stretch = 1;
+    } else if ((s_a2dp_stretch < 0 && level <= A2DP_RING_TARGET_LEVEL) ||
+               (s_a2dp_stretch > 0 && level >= A2DP_RING_TARGET_LEVEL)) {
+        s_a2dp_stretch = 0;
+    }
+    return s_a2dp_stretch;
+}
+
+/*
+    write one buffer, dropping (stretch < 0) or doubling (stretch > 0) the
+    frame where the signal changes least, so the splice is inaudible
+ */
+static IRAM_ATTR void bt_i2s_a2dp_write_stretched(const int16_t *pcm, size_t frames, int stretch)
+{
+    if (stretch == 0 || frames < 3) {
+        bt_i2s_tx_write_pcm(BT_I2S_TX_SRC_A2DP, pcm, frames, A2DP_SAMPLE_RATE, 2, portMAX_DELAY);
+        return;
+    }
+    size_t splice = 1;
+    int32_t best = INT32_MAX;
+    for (size_t i = 1; i < frames - 1; i++) {
+        int32_t d = abs(pcm[i * 2] - pcm[(i - 1) * 2]) + abs(pcm[i * 2 + 1] - pcm[(i - 1) * 2 + 1]);
+        if (d < best) {
+            best = d;
+            splice = i;
+        }
+    }
+    if (stretch < 0) {
+        /* frames [0, splice) then (splice, frames) */
+        bt_i2s_tx_write_pcm(BT_I2S_TX_SRC_A2DP, pcm, splice, A2DP_SAMPLE_RATE, 2, portMAX_DELAY);
+        bt_i2s_tx_write_pcm(BT_I2S_TX_SRC_A2DP, &pcm[(splice + 1) * 2], frames - splice - 1,
+                            A2DP_SAMPLE_RATE, 2, portMAX_DELAY);
+        s_a2dp_flow.skipped_frames++;
+    } else {
+        /* frames [0, splice] then [splice, frames) */
+        bt_i2s_tx_write_pcm(BT_I2S_TX_SRC_A2DP, pcm, splice + 1, A2DP_SAMPLE_RATE, 2, portMAX_DELAY);
+        bt_i2s_tx_write_pcm(BT_I2S_TX_SRC_A2DP, &pcm[splice * 2], frames - splice,
+                            A2DP_SAMPLE_RATE, 2, portMAX_DELAY);
+        s_a2dp_flow.repeated_frames++;
+    }
+}
+
 /* 
     fetch audio data from the a2dp ringbuffer and write to i2s
  */
-void bt_i2s_a2dp_tx_task_handler(void *arg)
+IRAM_ATTR void bt_i2s_a2dp_tx_task_handler(void *arg)
 {
     uint8_t *data = NULL;
     size_t item_size = 0;
-    /**
-     * The total length of DMA buffer of I2S is:
-     * `dma_frame_num * dma_desc_num * i2s_channel_num * i2s_data_bit_width / 8`.
-     * Transmit `dma_frame_num * dma_desc_num` bytes to DMA is trade-off.
-     */
-    const size_t item_size_upto = 240 * 6;
-    size_t bytes_written = 0;
+    UBaseType_t waiting = 0;
     for (;;) {
         if (pdTRUE == xSemaphoreTake(s_i2s_tx_semaphore, portMAX_DELAY)) {
             for (;;) {
+                /* one DMA buffer (16-bit stereo) per write, whatever the current geometry */
+                const size_t item_size_upto = s_tx_geometry.frame_num * A2DP_FRAME_BYTES;
                 item_size = 0;
-                /* receive data from ringbuffer and write it to I2S DMA transmit buffer */
-                /* note: write_ringbuf always writes 4096 bytes to our ringbuffer */
-                data = (uint8_t *)xRingbufferReceiveUpTo(s_i2s_a2dp_tx_ringbuf, &item_size, 0, item_size_upto);
+                /* receive data from ringbuffer and write it to I2S DMA transmit buffer; wait a
+                   little so a short gap in the stream doesn't end in a full re-prefetch */
+                data = (uint8_t *)xRingbufferReceiveUpTo(s_i2s_a2dp_tx_ringbuf, &item_size,
+                                                         pdMS_TO_TICKS(A2DP_RX_WAIT_MS), item_size_upto);
                 if (item_size == 0) {
-                    ESP_LOGI(BT_I2S_TAG, "%s - tx ringbuffer underflowed! mode changed: RINGBUFFER_MODE_PREFETCHING", __func__);
+                    if (s_i2s_tx_mode == I2S_TX_MODE_A2DP) {
+                        s_a2dp_flow.underruns++;
+                    }
                     s_i2s_a2dp_tx_ringbuffer_mode = RINGBUFFER_MODE_PREFETCHING;
+                    s_a2dp_stretch = 0;
                     break;
                 }
                 if (s_i2s_tx_mode == I2S_TX_MODE_A2DP) { // we discard the data if we are not in a2dp mode
-                    i2s_channel_write(tx_chan, data, item_size, &bytes_written, portMAX_DELAY);
+                    vRingbufferGetInfo(s_i2s_a2dp_tx_ringbuf, NULL, NULL, NULL, NULL, &waiting);
+                    int stretch = bt_i2s_a2dp_flow_update(waiting + item_size);
+                    bt_i2s_a2dp_apply_gain((int16_t *)data, item_size / sizeof(int16_t));
+                    bt_i2s_a2dp_write_stretched((const int16_t *)data, item_size / A2DP_FRAME_BYTES, stretch);
                 }
                 vRingbufferReturnItem(s_i2s_a2dp_tx_ringbuf, (void *)data);
             }
@@ -373,7 +911,9 @@ void bt_i2s_a2dp_tx_task_handler(void *arg)
 }
 
 /* 
-    this sets up our a2dp ringbuffer, and creates the a2dp tx task handler
+    this sets up our a2dp ringbuffer, and creates the a2dp tx task handler.
+    called once at boot; the ringbuffer and task then live for the whole
+    run, across every music/call switch
  */
 void bt_i2s_a2dp_task_init(void)
 {
@@ -383,7 +923,8 @@ void bt_i2s_a2dp_task_init(void)
         ESP_LOGE(BT_I2S_TAG, "%s, ringbuffer create failed", __func__);
         return;
     }
-    xTaskCreate(bt_i2s_a2dp_tx_task_handler, "BtI2Sa2dpTask", 2048, NULL, configMAX_PRIORITIES - 4, &s_bt_i2s_a2dp_tx_task_handle);
+    xTaskCreatePinnedToCore(bt_i2s_a2dp_tx_task_handler, "BtI2Sa2dpTask", APP_A2DP_TX_TASK_STACK, NULL,
+                            APP_A2DP_TX_TASK_PRIO, &s_bt_i2s_a2dp_tx_task_handle, APP_AUDIO_CORE);
 }
 
 /* 
@@ -407,20 +948,53 @@ void bt_i2s_a2dp_task_deinit(void)
  */
 void bt_i2s_a2dp_task_start_up(void) // change my name!!!
 {
-    
+    if (!s_a2dp_streaming) {
+        memset(&s_a2dp_flow, 0, sizeof(s_a2dp_flow));
+        s_a2dp_level_sum = 0;
+        s_a2dp_stretch = 0;
+    }
+    s_a2dp_streaming = true;
+    if (s_i2s_tx_mode == I2S_TX_MODE_HFP) {
+        /* a call owns the channel; bt_i2s_hfp_stop hands it back to us */
+        return;
+    }
     bt_i2s_channels_config_adp();
+    bt_i2s_tx_session_begin(I2S_CAL_MODE_A2DP);
     bt_i2s_tx_channel_enable();
     s_i2s_tx_mode = I2S_TX_MODE_A2DP;
 }
 
 /* 
     stop our a2dp tx task.
-    this should be called before bt_i2s_task_deinit
+    the tx channel is left running (auto_clear sends silence) so a call
+    that follows only has to reconfigure it; whatever is left in the
+    ringbuffer is drained and discarded by the tx task
  */
 void bt_i2s_a2dp_task_shut_down(void) // change my name!!!
 {
+    s_a2dp_streaming = false;
+    if (s_i2s_tx_mode != I2S_TX_MODE_A2DP) {
+        return;
+    }
     s_i2s_tx_mode = I2S_TX_MODE_NONE;
-    bt_i2s_tx_channel_disable();
+    bt_i2s_tx_release(BT_I2S_TX_SRC_A2DP);
+    bt_i2s_tx_session_end();
+    xSemaphoreGive(s_i2s_tx_semaphore);
+
+    bt_i2s_a2dp_flow_stats_t flow;
+    bt_i2s_a2dp_get_flow_stats(&flow);
+    ESP_LOGI(BT_I2S_TAG, "%s - ringbuffer level min %"PRIu32" avg %"PRIu32" max %"PRIu32" (target %"PRIu32"), "
+             "%"PRIu32" underruns, %"PRIu32" bytes dropped, %"PRIu32" frames skipped, %"PRIu32" repeated",
+             __func__, flow.level_min, flow.level_avg, flow.level_max, flow.level_target, flow.underruns,
+             flow.dropped_bytes, flow.skipped_frames, flow.repeated_frames);
+}
+
+void bt_i2s_a2dp_get_flow_stats(bt_i2s_a2dp_flow_stats_t *stats)
+{
+    *stats = s_a2dp_flow;
+    stats->level_avg = s_a2dp_flow.samples ? (uint32_t)(s_a2dp_level_sum / s_a2dp_flow.samples) : 0;
+    stats->level_target = A2DP_RING_TARGET_LEVEL;
+    stats->capacity = RINGBUF_HIGHEST_WATER_LEVEL;
 }
 
 
@@ -428,40 +1002,31 @@ void bt_i2s_a2dp_task_shut_down(void) // change my name!!!
     this is our callback function that recieves the a2dp sink data
     and puts it in the tx ringbuffer
  */
-void bt_i2s_a2dp_write_tx_ringbuf(const uint8_t *data, uint32_t size)
+IRAM_ATTR void bt_i2s_a2dp_write_tx_ringbuf(const uint8_t *data, uint32_t size)
 {
-    size_t item_size = 0;
-    BaseType_t done = pdFALSE;
+    UBaseType_t waiting = 0;
 
-    if (s_i2s_a2dp_tx_ringbuffer_mode == RINGBUFFER_MODE_DROPPING) {
-        ESP_LOGW(BT_I2S_TAG, "%s - ringbuffer is full, drop this packet!", __func__);
-        vRingbufferGetInfo(s_i2s_a2dp_tx_ringbuf, NULL, NULL, NULL, NULL, &item_size);
-        if (item_size <= RINGBUF_PREFETCH_WATER_LEVEL) {
-            ESP_LOGI(BT_I2S_TAG, "%s - ringbuffer data decreased! mode changed: RINGBUFFER_MODE_PROCESSING", __func__);
-            s_i2s_a2dp_tx_ringbuffer_mode = RINGBUFFER_MODE_PROCESSING;
-        }
-        return;
+    /* keep as much of the packet as fits, in whole frames; the tx task is
+       already skipping frames to bring the level back down */
+    size_t free_bytes = xRingbufferGetCurFreeSize(s_i2s_a2dp_tx_ringbuf);
+    if (size > free_bytes) {
+        uint32_t keep = free_bytes - free_bytes % A2DP_FRAME_BYTES;
+        s_a2dp_flow.dropped_bytes += size - keep;
+        size = keep;
     }
-    // ESP_LOGI(BT_I2S_TAG, "%s - sending tx size %lu to the ringbuffer", __func__, size);
-    done = xRingbufferSend(s_i2s_a2dp_tx_ringbuf, (void *)data, size, (TickType_t)0);
-
-    if (!done) {
-        ESP_LOGW(BT_I2S_TAG, "%s - ringbuffer overflowed, ready to decrease data! mode changed: RINGBUFFER_MODE_DROPPING", __func__);
-        s_i2s_a2dp_tx_ringbuffer_mode = RINGBUFFER_MODE_DROPPING;
+    if (size > 0 && xRingbufferSend(s_i2s_a2dp_tx_ringbuf, (void *)data, size, (TickType_t)0) != pdTRUE) {
+        s_a2dp_flow.dropped_bytes += size;
     }
 
     if (s_i2s_a2dp_tx_ringbuffer_mode == RINGBUFFER_MODE_PREFETCHING) {
-        vRingbufferGetInfo(s_i2s_a2dp_tx_ringbuf, NULL, NULL, NULL, NULL, &item_size);
-        if (item_size >= RINGBUF_PREFETCH_WATER_LEVEL) {
-            ESP_LOGI(BT_I2S_TAG, "%s - ringbuffer data increased! mode changed: RINGBUFFER_MODE_PROCESSING", __func__);
+        vRingbufferGetInfo(s_i2s_a2dp_tx_ringbuf, NULL, NULL, NULL, NULL, &waiting);
+        if (waiting >= A2DP_RING_TARGET_LEVEL) {
             s_i2s_a2dp_tx_ringbuffer_mode = RINGBUFFER_MODE_PROCESSING;
             if (pdFALSE == xSemaphoreGive(s_i2s_tx_semaphore)) {// we have taken the semaphore in our tx task(?)
-                ESP_LOGE(BT_I2S_TAG, "%s - semphore give failed", __func__);
+                ESP_DRAM_LOGE(DRAM_STR(BT_I2S_TAG), "a2dp tx semaphore give failed");
             }
         }
     }
-
-    // return done ? size : 0;
 }
 
 /* 
@@ -476,7 +1041,8 @@ void bt_i2s_hfp_task_init(void)
         return;
     }
     s_bt_i2s_hfp_tx_task_running = true;
-    xTaskCreate(bt_i2s_hfp_tx_task_handler, "BtI2ShfpTxTask", 4096, NULL, configMAX_PRIORITIES - 3, &s_bt_i2s_hfp_tx_task_handle);
+    xTaskCreatePinnedToCore(bt_i2s_hfp_tx_task_handler, "BtI2ShfpTxTask", APP_HFP_TX_TASK_STACK, NULL,
+                            APP_HFP_TX_TASK_PRIO, &s_bt_i2s_hfp_tx_task_handle, APP_AUDIO_CORE);
     
     s_i2s_hfp_rx_ringbuffer_mode = RINGBUFFER_MODE_PREFETCHING;
     s_i2s_rx_mode = I2S_RX_MODE_HFP;
@@ -485,7 +1051,8 @@ void bt_i2s_hfp_task_init(void)
         return;
     }
     s_bt_i2s_hfp_rx_task_running = true;
-    xTaskCreate(bt_i2s_hfp_rx_task_handler, "BtI2ShfpRxTask", 4096, NULL, configMAX_PRIORITIES - 3, &s_bt_i2s_hfp_rx_task_handle);
+    xTaskCreatePinnedToCore(bt_i2s_hfp_rx_task_handler, "BtI2ShfpRxTask", APP_HFP_RX_TASK_STACK, NULL,
+                            APP_HFP_RX_TASK_PRIO, &s_bt_i2s_hfp_rx_task_handle, APP_AUDIO_CORE);
 }
 
 void bt_i2s_hfp_task_deinit(void)
@@ -518,89 +1085,206 @@ void bt_i2s_hfp_task_deinit(void)
     }
 }
 
+/*
+    speaker ringbuffer level, sampled once per frame taken; picks the
+    playback speed for it. Same hysteresis as the A2DP flow control: a
+    correction starts past LOW/HIGH and runs until the level is back at
+    the target.
+ */
+static IRAM_ATTR uint16_t bt_i2s_hfp_speed_update(uint32_t level)
+{
+    metrics_set(s_m_spk_level, level);
+    if (level < s_hfp_stretch.level_min || s_hfp_stretch.samples == 0) {
+        s_hfp_stretch.level_min = level;
+    }
+    if (level > s_hfp_stretch.level_max) {
+        s_hfp_stretch.level_max = level;
+    }
+    s_hfp_stretch.samples++;
+    s_hfp_level_sum += level;
+
+    if (level > HFP_TX_HIGH_LEVEL) {
+        s_hfp_tx_speed = WSOLA_SPEED_MAX;
+    } else if (level < HFP_TX_LOW_LEVEL) {
+        s_hfp_tx_speed = WSOLA_SPEED_MIN;
+    } else if ((s_hfp_tx_speed > 1000 && level <= HFP_TX_TARGET_LEVEL) ||
+               (s_hfp_tx_speed < 1000 && level >= HFP_TX_TARGET_LEVEL)) {
+        s_hfp_tx_speed = 1000;
+    }
+    return s_hfp_tx_speed;
+}
+
 /* 
     fetch audio data from the hfp tx ringbuffer and write to i2s
  */
-void bt_i2s_hfp_tx_task_handler(void *arg)
+IRAM_ATTR void bt_i2s_hfp_tx_task_handler(void *arg)
 {
     uint8_t *data = NULL;
     size_t item_size = 0;
     const size_t item_size_upto = MSBC_FRAME_SAMPLES * 2;
-    size_t bytes_written = 0;
     for (;;) {
         if (s_bt_i2s_hfp_tx_task_running) {
             if (s_i2s_hfp_tx_ringbuffer_mode != RINGBUFFER_MODE_PREFETCHING) {
                 item_size = 0;
                 /* receive data from ringbuffer and write it to I2S DMA transmit buffer */
+                uint32_t prof = cycle_prof_begin();
                 data = (uint8_t *)xRingbufferReceiveUpTo(s_i2s_hfp_tx_ringbuf, &item_size, 0, item_size_upto);
+                cycle_prof_end(PROF_SPK_RING_READ, prof);
                 if (item_size == 0) {
-                    ESP_LOGI(BT_I2S_TAG, "%s - tx ringbuffer underflowed! mode changed: RINGBUFFER_MODE_PREFETCHING", __func__);
+                    metrics_inc(s_m_spk_underruns);
+                    s_hfp_tx_underruns++;
                     s_i2s_hfp_tx_ringbuffer_mode = RINGBUFFER_MODE_PREFETCHING;
-                    goto Delay;
+                    continue;
                 }
+                size_t out_len = 0;
+                int64_t taken_us = esp_timer_get_time();
+                lt_fifo_out(&s_lt_spk_ring, item_size, LT_SPK_RING, taken_us);
                 if (s_i2s_tx_mode == I2S_TX_MODE_HFP) { // we discard the data if we are not in hfp mode
-                    // swap every pair of uint16_t as per:
-                    // https://docs.espressif.com/projects/esp-idf/en/stable/esp32/api-reference/peripherals/i2s.html#std-tx-mode
-                    int16_t *send_data = (int16_t*) data;
-                    // Swap every pair of samples
-                    for(int i = 0; i < item_size/2; i += 2) {
-                        int16_t temp = send_data[i];
-                        send_data[i] = send_data[i + 1];
-                        send_data[i + 1] = temp;
-                    }
-                    i2s_channel_write(tx_chan, send_data, item_size, &bytes_written, portMAX_DELAY);
+                    size_t waiting = 0;
+                    vRingbufferGetInfo(s_i2s_hfp_tx_ringbuf, NULL, NULL, NULL, NULL, &waiting);
+                    wsola_set_speed(&s_hfp_wsola, bt_i2s_hfp_speed_update(waiting + item_size));
+                    prof = cycle_prof_begin();
+                    out_len = wsola_process(&s_hfp_wsola, (const int16_t *)data, item_size / sizeof(int16_t),
+                                            s_hfp_wsola_out, WSOLA_OUT_MAX);
+                    cycle_prof_end(PROF_SPK_STRETCH, prof);
                 }
                 vRingbufferReturnItem(s_i2s_hfp_tx_ringbuf, (void *)data);
+                if (out_len > 0) {
+                    conceal_real(&s_hfp_conceal, s_hfp_wsola_out, out_len);
+                    audio_loopback_spk_tap(s_hfp_wsola_out, out_len);
+                    bt_i2s_tx_write_pcm(BT_I2S_TX_SRC_HFP, s_hfp_wsola_out, out_len,
+                                        HFP_SAMPLE_RATE, 1, portMAX_DELAY);
+                    latency_trace_record(LT_SPK_OUTPUT, (uint32_t)(esp_timer_get_time() - taken_us));
+                }
+            } else if (s_i2s_tx_mode == I2S_TX_MODE_HFP && conceal_ready(&s_hfp_conceal)) {
+                /* the ringbuffer is refilling after audio has played: every pass until it is
+                   done writes a concealment frame, whatever the DMA still holds, so the output
+                   fades to comfort noise instead of auto_clear silence. The blocking write
+                   paces this at one frame per 7.5 ms */
+                conceal_fill(&s_hfp_conceal, s_hfp_conceal_buf, MSBC_FRAME_SAMPLES);
+                audio_loopback_spk_tap(s_hfp_conceal_buf, MSBC_FRAME_SAMPLES);
+                bt_i2s_tx_write_pcm(BT_I2S_TX_SRC_HFP, s_hfp_conceal_buf, MSBC_FRAME_SAMPLES,
+                                    HFP_SAMPLE_RATE, 1, portMAX_DELAY);
             } else {
-                Delay:
-                    vTaskDelay(pdMS_TO_TICKS(40)); // give ringbuffer some time to prefetch. 40 ticks is arbitrary. should we change this?
+                /* nothing played yet this call, the DMA sends silence (auto_clear) */
+                vTaskDelay(pdMS_TO_TICKS(HFP_FRAME_PERIOD_US / 1000));
             }
         } else { /* if (s_bt_i2s_hfp_tx_task_running) */
             // give semaphore so s_i2s_hfp_tx_ringbuf can be safely deleted
             xSemaphoreGive(s_i2s_hfp_tx_ringbuf_delete);
-            ESP_LOGI(BT_I2S_TAG, "%s, deleting myself",__func__); 
+            ESP_DRAM_LOGI(DRAM_STR(BT_I2S_TAG), "hfp tx task deleting itself");
             vTaskDelete(NULL);
         }
     }
 }
 
+/*
+    scheduling latency of the audio core, sampled once per mic frame:
+    the time from the DMA buffer completing in the ISR to the rx task
+    picking it up.
+ */
+static IRAM_ATTR void bt_i2s_hfp_sched_sample(int64_t capture_us)
+{
+    int64_t late = esp_timer_get_time() - capture_us;
+    if (late < 0) {
+        late = 0;
+    }
+    latency_trace_record(LT_MIC_CAPTURE, (uint32_t)late);
+    s_hfp_sched_stats.frames++;
+    s_hfp_sched_late_sum_us += late;
+    s_hfp_sched_stats.avg_late_us = s_hfp_sched_late_sum_us / s_hfp_sched_stats.frames;
+    if (late > s_hfp_sched_stats.max_late_us) {
+        s_hfp_sched_stats.max_late_us = late;
+    }
+    if (late > HFP_FRAME_PERIOD_US) {
+        s_hfp_sched_stats.late_frames++;
+    }
+}
+
+void bt_i2s_hfp_get_sched_stats(bt_i2s_sched_stats_t *stats)
+{
+    *stats = s_hfp_sched_stats;
+}
+
+void bt_i2s_hfp_get_stretch_stats(bt_i2s_hfp_stretch_stats_t *stats)
+{
+    *stats = s_hfp_stretch;
+    stats->level_avg = stats->samples ? (uint32_t)(s_hfp_level_sum / stats->samples) : 0;
+    stats->level_target = HFP_TX_TARGET_LEVEL;
+    stats->frames = s_hfp_wsola.steps;
+    stats->stretched_frames = s_hfp_wsola.stretched_steps;
+    stats->speed = s_hfp_tx_speed;
+    stats->quality = (uint16_t)(wsola_quality(&s_hfp_wsola) * 1000.0f);
+}
+
+uint32_t bt_i2s_hfp_get_concealed_ms(void)
+{
+    return conceal_ms(&s_hfp_conceal);
+}
+
+uint32_t bt_i2s_hfp_get_tx_underruns(void)
+{
+    return s_hfp_tx_underruns;
+}
+
+void bt_i2s_hfp_get_rx_capture_stats(bt_i2s_rx_capture_stats_t *stats)
+{
+    *stats = s_hfp_rx_capture_stats;
+    stats->overruns += s_hfp_rx_queue_overruns;
+}
+
 /* 
-    fetch audio (mic) data from i2s and put it in the rx ringbuffer
+    take completed mic DMA buffers from the ISR, encode them in place and put them in the rx ringbuffer
  */
-void bt_i2s_hfp_rx_task_handler(void *arg)
+IRAM_ATTR void bt_i2s_hfp_rx_task_handler(void *arg)
 {
-    int32_t *i2s_buffer = malloc(MSBC_FRAME_SAMPLES * sizeof(int32_t));
     uint8_t *pcm_buffer = malloc(MSBC_FRAME_SAMPLES * 2);
     uint8_t *encoded_buffer = malloc(ESP_HF_MSBC_ENCODED_FRAME_SIZE);
     
-    if (!i2s_buffer || !pcm_buffer || !encoded_buffer) {
-        ESP_LOGE(BT_I2S_TAG, "Failed to allocate buffers");
+    if (!pcm_buffer || !encoded_buffer) {
+        ESP_DRAM_LOGE(DRAM_STR(BT_I2S_TAG), "hfp rx task failed to allocate buffers");
     }
     
-    size_t bytes_read;    
+    bt_i2s_rx_block_t block;
     
     while (1) {
         if (s_bt_i2s_hfp_rx_task_running) {
-            esp_err_t ret = i2s_channel_read(rx_chan, i2s_buffer, 
-                                            MSBC_FRAME_SAMPLES * sizeof(int32_t), 
-                                            &bytes_read, portMAX_DELAY);
+            if (xQueueReceive(s_i2s_hfp_rx_block_queue, &block, pdMS_TO_TICKS(HFP_RX_BLOCK_WAIT_MS)) != pdTRUE) {
+                continue;
+            }
+            bt_i2s_hfp_sched_sample(block.capture_us);
+            cycle_prof_frame();
+            if (block.size != MSBC_FRAME_SAMPLES * sizeof(int32_t)) {
+                continue;
+            }
+            uint32_t prof = cycle_prof_begin();
+            i2s_32bit_to_16bit_pcm((int32_t *)block.buf, pcm_buffer, MSBC_FRAME_SAMPLES);
+            cycle_prof_end(PROF_MIC_CONVERT, prof);
+            audio_loopback_mic_tap((int16_t *)pcm_buffer, MSBC_FRAME_SAMPLES, block.capture_us);
+            // the DMA engine may have come round to this buffer while we converted it
+            if (s_hfp_rx_dma_seq - block.seq >= HFP_RX_DMA_DESC_NUM - 1) {
+                s_hfp_rx_capture_stats.overruns++;
+                continue;
+            }
+            s_hfp_rx_capture_stats.blocks++;
+            s_hfp_rx_capture_stats.last_seq = block.seq;
+            s_hfp_rx_capture_stats.last_capture_us = block.capture_us;
             
-            if (ret == ESP_OK && bytes_read > 0) {
-                i2s_32bit_to_16bit_pcm(i2s_buffer, pcm_buffer, MSBC_FRAME_SAMPLES);
-                
-                size_t encoded_len;
-                if (msbc_enc_data(pcm_buffer, MSBC_FRAME_SAMPLES * 2, 
-                                encoded_buffer, &encoded_len) == 0) {
-                    bt_i2s_hfp_write_rx_ringbuf(encoded_buffer, ESP_HF_MSBC_ENCODED_FRAME_SIZE);
-                }
+            size_t encoded_len;
+            int64_t enc_start_us = esp_timer_get_time();
+            prof = cycle_prof_begin();
+            int enc_ret = msbc_enc_data(pcm_buffer, MSBC_FRAME_SAMPLES * 2, encoded_buffer, &encoded_len);
+            cycle_prof_end(PROF_MIC_ENCODE, prof);
+            latency_trace_record(LT_MIC_ENCODE, (uint32_t)(esp_timer_get_time() - enc_start_us));
+            if (enc_ret == 0) {
+                bt_i2s_hfp_write_rx_ringbuf(encoded_buffer, ESP_HF_MSBC_ENCODED_FRAME_SIZE);
             }
         } else { /* if (s_bt_i2s_hfp_rx_task_running) */
-            free(i2s_buffer);
             free(pcm_buffer);
             free(encoded_buffer);
             // give semaphore so s_i2s_hfp_rx_ringbuf can be safely deleted
             xSemaphoreGive(s_i2s_hfp_rx_ringbuf_delete);
-            ESP_LOGI(BT_I2S_TAG, "%s, deleting myself",__func__); 
+            ESP_DRAM_LOGI(DRAM_STR(BT_I2S_TAG), "hfp rx task deleting itself");
             vTaskDelete(NULL);
         } /* if (s_bt_i2s_hfp_rx_task_running) */
     }
@@ -610,7 +1294,7 @@ void bt_i2s_hfp_rx_task_handler(void *arg)
     this is called from hfp and recieves the decoded audio data
     and puts it in the tx ringbuffer
  */
-void bt_i2s_hfp_write_tx_ringbuf(const uint8_t *data, uint32_t size)
+IRAM_ATTR void bt_i2s_hfp_write_tx_ringbuf(const uint8_t *data, uint32_t size)
 {
     if (s_i2s_hfp_tx_ringbuf == NULL) {// ringbuffer hasn't been set up yet
         return;
@@ -620,31 +1304,30 @@ void bt_i2s_hfp_write_tx_ringbuf(const uint8_t *data, uint32_t size)
     BaseType_t done = pdFALSE;
 
     if (s_i2s_hfp_tx_ringbuffer_mode == RINGBUFFER_MODE_DROPPING) {
-        ESP_LOGW(BT_I2S_TAG, "%s - hfp tx ringbuffer is full, drop this packet!", __func__);
+        metrics_inc(s_m_spk_dropped);
         vRingbufferGetInfo(s_i2s_hfp_tx_ringbuf, NULL, NULL, NULL, NULL, &item_size);
 
         if (item_size <= RINGBUF_HFP_TX_PREFETCH_WATER_LEVEL) {
-            ESP_LOGI(BT_I2S_TAG, "%s - hfp tx ringbuffer data decreased! (%d) mode changed: RINGBUFFER_MODE_PROCESSING", __func__, item_size);
             s_i2s_hfp_tx_ringbuffer_mode = RINGBUFFER_MODE_PROCESSING;
         }
         return;
     }
 
+    uint32_t prof = cycle_prof_begin();
     done = xRingbufferSend(s_i2s_hfp_tx_ringbuf, (void *)data, size, (TickType_t)0);
-    // ESP_LOGI(BT_I2S_TAG, "%s - hfp tx ringbuffer size: %d", __func__, item_size);
+    cycle_prof_end(PROF_SPK_RING_WRITE, prof);
+    if (done) {
+        lt_fifo_in(&s_lt_spk_ring, size, esp_timer_get_time());
+    }
 
     if (!done) {
-        ESP_LOGW(BT_I2S_TAG, "%s - hfp tx ringbuffer overflowed, ready to decrease data! mode changed: RINGBUFFER_MODE_DROPPING", __func__);
         s_i2s_hfp_tx_ringbuffer_mode = RINGBUFFER_MODE_DROPPING;
     }
 
     if (s_i2s_hfp_tx_ringbuffer_mode == RINGBUFFER_MODE_PREFETCHING) {
         vRingbufferGetInfo(s_i2s_hfp_tx_ringbuf, NULL, NULL, NULL, NULL, &item_size);
         if (item_size >= RINGBUF_HFP_TX_PREFETCH_WATER_LEVEL) {
-            ESP_LOGI(BT_I2S_TAG, "%s - hfp tx ringbuffer data increased! (%d) mode changed: RINGBUFFER_MODE_PROCESSING", __func__, item_size);
             s_i2s_hfp_tx_ringbuffer_mode = RINGBUFFER_MODE_PROCESSING;
-        } else {
-            // ESP_LOGI(BT_I2S_TAG, "%s - hfp tx ringbuffer size (%d) mode still: RINGBUFFER_MODE_PREFETCHING", __func__, item_size);
         }
     }
 }
@@ -654,15 +1337,12 @@ void bt_i2s_hfp_write_tx_ringbuf(const uint8_t *data, uint32_t size)
     this is called from our i2s hfp rx task and recieves the (mic) audio data
     and puts it in the rx ringbuffer
  */
-size_t i2s_hfp_rx_ringbuffer_total = 0;
-size_t i2s_hfp_rx_ringbuffer_dropped = 0;
-size_t i2s_hfp_rx_ringbuffer_sent = 0;
-void bt_i2s_hfp_write_rx_ringbuf(unsigned char *data, uint32_t size)
+IRAM_ATTR void bt_i2s_hfp_write_rx_ringbuf(unsigned char *data, uint32_t size)
 {
     if (!s_i2s_hfp_rx_ringbuf) {
         return;
     }
-    i2s_hfp_rx_ringbuffer_total += 1;
+    metrics_inc(s_m_mic_frames);
     size_t item_size = 0;
     BaseType_t done = pdFALSE;
 
@@ -673,17 +1353,20 @@ void bt_i2s_hfp_write_rx_ringbuf(unsigned char *data, uint32_t size)
             // ESP_LOGI(BT_I2S_TAG, "%s - hfp rx ringbuffer data decreased! mode changed: RINGBUFFER_MODE_PROCESSING", __func__);
             s_i2s_hfp_rx_ringbuffer_mode = RINGBUFFER_MODE_PROCESSING;
         }
-        i2s_hfp_rx_ringbuffer_dropped += 1;
+        metrics_inc(s_m_mic_dropped);
         return;
     }
+    uint32_t prof = cycle_prof_begin();
     done = xRingbufferSend(s_i2s_hfp_rx_ringbuf, (const char*)data, size, (TickType_t)0);
+    cycle_prof_end(PROF_MIC_RING_WRITE, prof);
 
     if (!done) {
         // ESP_LOGW(BT_I2S_TAG, "%s - hfp rx ringbuffer overflowed, ready to decrease data! mode changed: RINGBUFFER_MODE_DROPPING", __func__);
         s_i2s_hfp_rx_ringbuffer_mode = RINGBUFFER_MODE_DROPPING;
-        i2s_hfp_rx_ringbuffer_dropped += 1;
+        metrics_inc(s_m_mic_dropped);
     } else {
-        i2s_hfp_rx_ringbuffer_sent += 1;
+        metrics_inc(s_m_mic_sent);
+        lt_fifo_in(&s_lt_mic_ring, size, esp_timer_get_time());
     }
 
     if (s_i2s_hfp_rx_ringbuffer_mode == RINGBUFFER_MODE_PREFETCHING) {
@@ -693,17 +1376,12 @@ void bt_i2s_hfp_write_rx_ringbuf(unsigned char *data, uint32_t size)
             s_i2s_hfp_rx_ringbuffer_mode = RINGBUFFER_MODE_PROCESSING;
         }
     }
-    // Log every 1000 calls
-    if (i2s_hfp_rx_ringbuffer_total % 1000 == 0) {
-        ESP_LOGI(BT_I2S_TAG, "%s - calls: %d sent: %d dropped: %d", 
-            __func__, i2s_hfp_rx_ringbuffer_total, i2s_hfp_rx_ringbuffer_sent, i2s_hfp_rx_ringbuffer_dropped);
-    }
 }
 
 /* 
     this is called from hfp client for getting the (mic) audio data from the rx ringbuffer
  */
-size_t bt_i2s_hfp_read_rx_ringbuf(uint8_t *mic_data)
+IRAM_ATTR size_t bt_i2s_hfp_read_rx_ringbuf(uint8_t *mic_data)
 {
     // ringbuffer needs to exist
     if (!s_i2s_hfp_rx_ringbuf) {
@@ -713,19 +1391,43 @@ size_t bt_i2s_hfp_read_rx_ringbuf(uint8_t *mic_data)
     if (s_i2s_hfp_rx_ringbuffer_mode != RINGBUFFER_MODE_PREFETCHING) {
         uint8_t *ringbuf_data = xRingbufferReceiveUpTo(s_i2s_hfp_rx_ringbuf, &item_size, 10000, ESP_HF_MSBC_ENCODED_FRAME_SIZE);
         // ESP_LOGI(BT_I2S_TAG, "%s - read %d bytes from ringbuffer, expected %d", __func__, item_size, ESP_HF_MSBC_ENCODED_FRAME_SIZE);
-        
+        if (ringbuf_data == NULL) {
+            return 0;
+        }
+        uint32_t prof = cycle_prof_begin();
         memcpy(mic_data, ringbuf_data, item_size);
         vRingbufferReturnItem(s_i2s_hfp_rx_ringbuf, (void *)ringbuf_data);
+        cycle_prof_end(PROF_MIC_RING_READ, prof);
+        lt_fifo_out(&s_lt_mic_ring, item_size, LT_MIC_RING, esp_timer_get_time());
     }
     return item_size;
 }
 
 void bt_i2s_hfp_start()
 {
+    memset(&s_hfp_sched_stats, 0, sizeof(s_hfp_sched_stats));
+    s_hfp_sched_late_sum_us = 0;
+    s_hfp_tx_underruns = 0;
+    conceal_reset(&s_hfp_conceal, HFP_SAMPLE_RATE);
+    wsola_init(&s_hfp_wsola);
+    s_hfp_tx_speed = 1000;
+    memset(&s_hfp_stretch, 0, sizeof(s_hfp_stretch));
+    s_hfp_level_sum = 0;
+    latency_trace_reset();
+    cycle_prof_reset();
+    lt_fifo_reset(&s_lt_spk_ring);
+    lt_fifo_reset(&s_lt_spk_dma);
+    lt_fifo_reset(&s_lt_mic_ring);
+    memset(&s_hfp_rx_capture_stats, 0, sizeof(s_hfp_rx_capture_stats));
+    s_hfp_rx_queue_overruns = 0;
+    xQueueReset(s_i2s_hfp_rx_block_queue);
+    bt_i2s_tx_session_end();    /* music session, if the phone didn't suspend the stream first */
     s_i2s_tx_mode = I2S_TX_MODE_HFP;
+    bt_i2s_tx_release_any();
     msbc_dec_open();
     msbc_enc_open();
     bt_i2s_channels_config_hfp();
+    bt_i2s_tx_session_begin(I2S_CAL_MODE_HFP);
     bt_i2s_tx_channel_enable();
     bt_i2s_rx_channel_enable();
     bt_i2s_hfp_task_init();
@@ -734,8 +1436,29 @@ void bt_i2s_hfp_start()
 void bt_i2s_hfp_stop()
 {
     bt_i2s_hfp_task_deinit();
-    bt_i2s_channels_disable();
+    ESP_LOGI(BT_I2S_TAG, "%s - audio core %d: %"PRIu32" frames, wake-up latency avg %"PRIu32" us max %"PRIu32" us, %"PRIu32" frames late, %"PRIu32" tx underruns",
+             __func__, APP_AUDIO_CORE, s_hfp_sched_stats.frames, s_hfp_sched_stats.avg_late_us,
+             s_hfp_sched_stats.max_late_us, s_hfp_sched_stats.late_frames, bt_i2s_hfp_get_tx_underruns());
+    ESP_LOGI(BT_I2S_TAG, "%s - speaker: %"PRIu32" ms concealed in %"PRIu32" underruns",
+             __func__, conceal_ms(&s_hfp_conceal), s_hfp_conceal.events);
+    bt_i2s_hfp_stretch_stats_t st;
+    bt_i2s_hfp_get_stretch_stats(&st);
+    ESP_LOGI(BT_I2S_TAG, "%s - speaker: level avg %"PRIu32" (target %"PRIu32") bytes, %"PRIu32" of %"PRIu32" frames time-stretched, splice quality %u/1000",
+             __func__, st.level_avg, st.level_target, st.stretched_frames, st.frames, st.quality);
+    cycle_prof_log();
+    ESP_LOGI(BT_I2S_TAG, "%s - mic: %"PRIu32" blocks captured, %"PRIu32" overruns",
+             __func__, s_hfp_rx_capture_stats.blocks,
+             s_hfp_rx_capture_stats.overruns + s_hfp_rx_queue_overruns);
+    bt_i2s_tx_release(BT_I2S_TX_SRC_HFP);
+    bt_i2s_rx_channel_disable();
+    bt_i2s_tx_session_end();
     msbc_dec_close();
     msbc_enc_close();
     s_i2s_tx_mode = I2S_TX_MODE_NONE;
+    if (s_a2dp_streaming) {
+        /* music was started during the call, switch straight back to it */
+        bt_i2s_a2dp_task_start_up();
+    } else if (!BT_I2S_TX_FIXED_RATE) {
+        bt_i2s_tx_channel_disable();
+    }
 }
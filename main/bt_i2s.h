@@ -7,12 +7,28 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include "freertos/FreeRTOS.h"
 #include "driver/i2s_std.h"
 #include "esp_audio_dec.h"
 #include "esp_audio_enc.h"
 #include "esp_hf_defs.h"
 
 
+/* Run the I2S tx clock at one fixed rate and convert every source (music,
+   call audio, ringtone) to it in software, so switching between them is a
+   short fade instead of a channel reconfiguration. 0 reconfigures the tx
+   clock for each mode instead. */
+#define BT_I2S_TX_FIXED_RATE        48000
+#define BT_I2S_TX_FADE_MS           10
+
+/* sources writing to the tx channel */
+typedef enum {
+    BT_I2S_TX_SRC_A2DP = 0,
+    BT_I2S_TX_SRC_HFP,
+    BT_I2S_TX_SRC_RINGTONE,
+    BT_I2S_TX_SRC_MAX,
+} bt_i2s_tx_src_t;
+
 typedef struct I2S_pin_config
 {
     int bck; // GPIO number to use for I2S BCK Driver.
@@ -21,6 +37,50 @@ typedef struct I2S_pin_config
     int din;  // GPIO number to use for I2S Data in.
 } I2S_pin_config;
 
+/* wake-up latency of the audio tasks, measured once per 7.5 ms HFP frame
+   from mic DMA completion to the rx task running */
+typedef struct {
+    uint32_t frames;        /* frames measured since bt_i2s_hfp_start */
+    uint32_t late_frames;   /* frames picked up more than one frame period late */
+    uint32_t avg_late_us;
+    uint32_t max_late_us;
+} bt_i2s_sched_stats_t;
+
+/* mic capture from the I2S receive-done interrupt */
+typedef struct {
+    uint32_t blocks;            /* DMA buffers encoded since bt_i2s_hfp_start */
+    uint32_t overruns;          /* DMA buffers lost because the rx task fell behind */
+    uint32_t last_seq;          /* DMA sequence number of the last encoded buffer */
+    int64_t last_capture_us;    /* esp_timer time its last sample was captured */
+} bt_i2s_rx_capture_stats_t;
+
+/* A2DP ringbuffer flow control, per stream */
+typedef struct {
+    uint32_t level_min;         /* bytes queued, sampled once per DMA buffer written */
+    uint32_t level_avg;
+    uint32_t level_max;
+    uint32_t level_target;
+    uint32_t capacity;
+    uint32_t samples;
+    uint32_t underruns;         /* ringbuffer ran dry, playback paused to refill */
+    uint32_t dropped_bytes;     /* incoming audio that did not fit */
+    uint32_t skipped_frames;    /* frames dropped to bring a high level down */
+    uint32_t repeated_frames;   /* frames doubled to bring a low level up */
+} bt_i2s_a2dp_flow_stats_t;
+
+/* HFP speaker ringbuffer level and time-stretching, per call */
+typedef struct {
+    uint32_t level_min;         /* bytes queued, sampled once per frame taken */
+    uint32_t level_avg;
+    uint32_t level_max;
+    uint32_t level_target;
+    uint32_t samples;
+    uint32_t frames;            /* frames played */
+    uint32_t stretched_frames;  /* frames played faster or slower than real time */
+    uint16_t speed;             /* current playback speed, permille */
+    uint16_t quality;           /* splice quality, permille; 1000 is seamless */
+} bt_i2s_hfp_stretch_stats_t;
+
 // our channel handles
 // i2s_chan_handle_t tx_chan = NULL;
 // i2s_chan_handle_t rx_chan = NULL;
@@ -42,6 +102,12 @@ void bt_i2s_tx_channel_reconfig_clock_slot(int sample_rate, int ch_count);
 void bt_i2s_tx_channel_reconfig_clock_slot_default(void);
 void bt_i2s_channels_config_adp(void);
 void bt_i2s_channels_config_hfp(void);
+esp_err_t bt_i2s_tx_write(const void *src, size_t size, size_t *bytes_written, TickType_t timeout);
+/* write 16-bit interleaved PCM in the source's own rate and channel count */
+esp_err_t bt_i2s_tx_write_pcm(bt_i2s_tx_src_t src, const int16_t *pcm, size_t frames,
+                              uint32_t rate, uint8_t channels, TickType_t timeout);
+/* fade the source out if it is the one playing; the next write fades in */
+void bt_i2s_tx_release(bt_i2s_tx_src_t src);
 
 void bt_i2s_a2dp_tx_task_handler(void *arg);
 void bt_i2s_a2dp_task_init(void);
@@ -49,6 +115,8 @@ void bt_i2s_a2dp_task_deinit(void);
 void bt_i2s_a2dp_task_start_up(void);
 void bt_i2s_a2dp_task_shut_down(void);
 void bt_i2s_a2dp_write_tx_ringbuf(const uint8_t *data, uint32_t size);
+void bt_i2s_a2dp_set_volume(uint8_t volume);    /* AVRCP absolute volume, 0..127 */
+void bt_i2s_a2dp_get_flow_stats(bt_i2s_a2dp_flow_stats_t *stats);
 
 void bt_i2s_hfp_tx_task_handler(void *arg);
 void bt_i2s_hfp_rx_task_handler(void *arg);
@@ -58,6 +126,11 @@ void bt_i2s_hfp_write_rx_ringbuf(unsigned char *data, uint32_t size);
 size_t bt_i2s_hfp_read_rx_ringbuf(uint8_t *mic_data);
 void bt_i2s_hfp_start(void);
 void bt_i2s_hfp_stop(void);
+void bt_i2s_hfp_get_sched_stats(bt_i2s_sched_stats_t *stats);
+uint32_t bt_i2s_hfp_get_tx_underruns(void);        /* speaker ringbuffer underflows, this call */
+uint32_t bt_i2s_hfp_get_concealed_ms(void);     /* speaker audio replaced by concealment, this call */
+void bt_i2s_hfp_get_stretch_stats(bt_i2s_hfp_stretch_stats_t *stats);
+void bt_i2s_hfp_get_rx_capture_stats(bt_i2s_rx_capture_stats_t *stats);
 
 #ifdef __cplusplus
 }
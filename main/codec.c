@@ -1,10 +1,13 @@
 #include "codec.h"
 #include "esp_log.h"
+#include "esp_attr.h"
 #include "esp_sbc_enc.h"
 #include "esp_sbc_dec.h"
 #include <string.h>
 
 static const char *TAG = "CODEC";
+/* the per-frame paths run from IRAM and log through ROM printf, which needs its strings in DRAM */
+#define DRAM_TAG DRAM_STR("CODEC")
 
 // mSBC Configuration Constants
 #define MSBC_SAMPLE_RATE        16000
@@ -96,22 +99,22 @@ void msbc_dec_close(void)
     }
 }
 
-int msbc_enc_data(const uint8_t *in_data, size_t in_data_len, 
+IRAM_ATTR int msbc_enc_data(const uint8_t *in_data, size_t in_data_len, 
                   uint8_t *out_data, size_t *out_data_len)
 {
     if (in_data == NULL || out_data == NULL || out_data_len == NULL) {
-        ESP_LOGE(TAG, "Invalid parameters for encoding");
+        ESP_DRAM_LOGE(DRAM_TAG, "Invalid parameters for encoding");
         return -1;
     }
 
     if (encoder_handle == NULL) {
-        ESP_LOGE(TAG, "Encoder not initialized. Call msbc_enc_open() first");
+        ESP_DRAM_LOGE(DRAM_TAG, "Encoder not initialized. Call msbc_enc_open() first");
         return -1;
     }
 
     if (in_data_len != MSBC_FRAME_SIZE_BYTES) {
-        ESP_LOGW(TAG, "Input data length %zu is not optimal for mSBC (expected %d)", 
-                 in_data_len, MSBC_FRAME_SIZE_BYTES);
+        ESP_DRAM_LOGW(DRAM_TAG, "Input data length %zu is not optimal for mSBC (expected %d)", 
+                      in_data_len, MSBC_FRAME_SIZE_BYTES);
     }
 
     // Prepare input frame
@@ -130,25 +133,24 @@ int msbc_enc_data(const uint8_t *in_data, size_t in_data_len,
     int ret = esp_sbc_enc_process(encoder_handle, &in_frame, &out_frame);
     
     if (ret != 0) {
-        ESP_LOGE(TAG, "Encoding failed, error: %d", ret);
+        ESP_DRAM_LOGE(DRAM_TAG, "Encoding failed, error: %d", ret);
         return -1;
     }
 
     *out_data_len = out_frame.len;
-    ESP_LOGD(TAG, "Encoded %zu bytes to %d bytes", in_data_len, out_frame.len);
     return 0;
 }
 
-int msbc_dec_data(const uint8_t *in_data, size_t in_data_len, 
+IRAM_ATTR int msbc_dec_data(const uint8_t *in_data, size_t in_data_len, 
                   uint8_t *out_data, size_t *out_data_len)
 {
     if (in_data == NULL || out_data == NULL || out_data_len == NULL) {
-        ESP_LOGE(TAG, "Invalid parameters for decoding");
+        ESP_DRAM_LOGE(DRAM_TAG, "Invalid parameters for decoding");
         return -1;
     }
 
     if (decoder_handle == NULL) {
-        ESP_LOGE(TAG, "Decoder not initialized. Call msbc_dec_open() first");
+        ESP_DRAM_LOGE(DRAM_TAG, "Decoder not initialized. Call msbc_dec_open() first");
         return -1;
     }
 
@@ -172,16 +174,15 @@ int msbc_dec_data(const uint8_t *in_data, size_t in_data_len,
     int ret = esp_sbc_dec_decode(decoder_handle, &in_frame, &out_frame, &dec_info);
     
     if (ret != 0) {
-        ESP_LOGE(TAG, "Decoding failed, error: %d", ret);
+        ESP_DRAM_LOGE(DRAM_TAG, "Decoding failed, error: %d", ret);
         return -1;
     }
 
     *out_data_len = out_frame.decoded_size;
-    ESP_LOGD(TAG, "Decoded %zu bytes to %d bytes", in_data_len, out_frame.decoded_size);
     return 0;
 }
 
-void i2s_32bit_to_16bit_pcm(const int32_t *i2s_data, uint8_t *pcm_data, size_t num_samples)
+IRAM_ATTR void i2s_32bit_to_16bit_pcm(const int32_t *i2s_data, uint8_t *pcm_data, size_t num_samples)
 {
     uint8_t *input_bytes = (uint8_t *)i2s_data;
     
@@ -0,0 +1,108 @@
+/*
+ * conceal.c - speaker underrun concealment for call audio
+ */
+
+#include "conceal.h"
+#include <string.h>
+#include <stdlib.h>
+#include "esp_attr.h"
+
+#define CONCEAL_GAIN_ONE        32768
+
+void conceal_reset(conceal_t *c, uint32_t sample_rate)
+{
+    memset(c, 0, sizeof(*c));
+    c->sample_rate = sample_rate;
+    c->noise_floor = CONCEAL_NOISE_MIN;
+    c->seed = 0x2545f491;
+}
+
+/* lowpassed white noise at the tracked background level */
+static IRAM_ATTR int32_t conceal_noise(conceal_t *c)
+{
+    c->seed = c->seed * 1664525u + 1013904223u;
+    int32_t white = (int32_t)(c->seed >> 16) - 32768;      // -32768..32767
+    c->noise_lp += (white - c->noise_lp) >> 2;
+    return (c->noise_lp * c->noise_floor) >> 14;            // ~2x floor peak
+}
+
+static IRAM_ATTR void conceal_track_floor(conceal_t *c, const int16_t *buf, size_t n)
+{
+    int32_t sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        sum += abs(buf[i]);
+    }
+    int32_t level = sum / (int32_t)n;
+    /* follow quiet frames down immediately, loud ones up only slowly */
+    if (level < c->noise_floor) {
+        c->noise_floor = level;
+    } else {
+        c->noise_floor += (level - c->noise_floor) >> 6;
+    }
+    if (c->noise_floor < CONCEAL_NOISE_MIN) {
+        c->noise_floor = CONCEAL_NOISE_MIN;
+    } else if (c->noise_floor > CONCEAL_NOISE_MAX) {
+        c->noise_floor = CONCEAL_NOISE_MAX;
+    }
+}
+
+IRAM_ATTR void conceal_real(conceal_t *c, int16_t *buf, size_t n)
+{
+    if (n == 0) {
+        return;
+    }
+    if (c->active) {
+        c->active = false;
+        c->resuming = true;
+        c->fade_pos = 0;
+    }
+    if (c->resuming) {
+        const uint32_t fade = c->sample_rate * CONCEAL_FADE_IN_MS / 1000;
+        for (size_t i = 0; i < n && c->fade_pos < fade; i++, c->fade_pos++) {
+            int32_t g = (int32_t)(c->fade_pos * CONCEAL_GAIN_ONE / fade);
+            buf[i] = (int16_t)((buf[i] * g + conceal_noise(c) * (CONCEAL_GAIN_ONE - g)) >> 15);
+        }
+        if (c->fade_pos >= fade) {
+            c->resuming = false;
+        }
+    }
+    conceal_track_floor(c, buf, n);
+    size_t keep = (n > CONCEAL_FRAME_MAX) ? CONCEAL_FRAME_MAX : n;
+    memcpy(c->last, &buf[n - keep], keep * sizeof(int16_t));
+    c->last_len = keep;
+}
+
+IRAM_ATTR void conceal_fill(conceal_t *c, int16_t *buf, size_t n)
+{
+    if (!c->active) {
+        c->active = true;
+        c->resuming = false;
+        c->fade_pos = 0;
+        c->events++;
+    }
+    const uint32_t fade = c->sample_rate * CONCEAL_FADE_OUT_MS / 1000;
+    const size_t len = c->last_len;
+    for (size_t i = 0; i < n; i++, c->fade_pos++) {
+        int32_t noise = conceal_noise(c);
+        if (c->fade_pos >= fade || len == 0) {
+            buf[i] = (int16_t)noise;
+            continue;
+        }
+        /* replay the last frame backwards, then forwards, ..., so its ends join without a step */
+        size_t k = c->fade_pos % (2 * len);
+        int32_t s = c->last[(k < len) ? (len - 1 - k) : (k - len)];
+        int32_t g = (int32_t)((fade - c->fade_pos) * CONCEAL_GAIN_ONE / fade);
+        buf[i] = (int16_t)((s * g + noise * (CONCEAL_GAIN_ONE - g)) >> 15);
+    }
+    c->concealed_samples += n;
+}
+
+IRAM_ATTR bool conceal_ready(const conceal_t *c)
+{
+    return c->last_len > 0;
+}
+
+uint32_t conceal_ms(const conceal_t *c)
+{
+    return c->sample_rate ? (uint32_t)((uint64_t)c->concealed_samples * 1000 / c->sample_rate) : 0;
+}
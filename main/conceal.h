@@ -0,0 +1,59 @@
+/*
+ * conceal.h - speaker underrun concealment for call audio
+ *
+ * When the speaker ringbuffer runs dry the tx task keeps the DMA fed with
+ * concealment frames instead of letting it fall silent on a hard step:
+ * the last real frame is replayed back and forth while it fades out into
+ * comfort noise at the call's background level. When real audio returns
+ * it is crossfaded in from the noise.
+ */
+
+#ifndef CONCEAL_H
+#define CONCEAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CONCEAL_FRAME_MAX       120     // one mSBC frame
+#define CONCEAL_FADE_OUT_MS     20      // last frame -> comfort noise
+#define CONCEAL_FADE_IN_MS      10      // comfort noise -> real audio
+#define CONCEAL_NOISE_MIN       4       // comfort noise amplitude bounds
+#define CONCEAL_NOISE_MAX       200
+
+typedef struct {
+    uint32_t sample_rate;
+    int16_t last[CONCEAL_FRAME_MAX];    // last real frame
+    size_t last_len;
+    bool active;                        // concealment frames being played
+    uint32_t fade_pos;                  // samples into the current fade-out or fade-in
+    bool resuming;                      // crossfading from noise back to real audio
+    int32_t noise_floor;                // tracked background level of the call
+    int32_t noise_lp;                   // comfort noise lowpass state
+    uint32_t seed;
+    uint32_t concealed_samples;         // since conceal_reset
+    uint32_t events;                    // times concealment started
+} conceal_t;
+
+void conceal_reset(conceal_t *c, uint32_t sample_rate);
+
+// Pass every real frame through here before it is played
+void conceal_real(conceal_t *c, int16_t *buf, size_t n);
+
+// Produce n samples of concealment to play in place of missing audio
+void conceal_fill(conceal_t *c, int16_t *buf, size_t n);
+
+// Whether there has been real audio to conceal yet
+bool conceal_ready(const conceal_t *c);
+
+uint32_t conceal_ms(const conceal_t *c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CONCEAL_H
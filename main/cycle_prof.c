@@ -0,0 +1,139 @@
+/*
+ * cycle_prof.c - CPU cycle budget of the call audio path, per stage
+ */
+
+#include "cycle_prof.h"
+#include <string.h>
+#include <inttypes.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+
+#define TAG "CYCLE_PROF"
+#define DRAM_TAG DRAM_STR("CYCLE_PROF")
+
+#define WARN_FRAME_CYCLES   ((uint32_t)((uint64_t)CYCLE_PROF_FRAME_CYCLES * (100 - CYCLE_PROF_HEADROOM_WARN_PCT) / 100))
+#define WARN_INTERVAL_FRAMES (CYCLE_PROF_WARN_INTERVAL_MS * 1000 / CYCLE_PROF_FRAME_US)
+
+typedef struct {
+    uint32_t calls;
+    uint64_t sum;
+    uint32_t max;
+} prof_stage_stats_t;
+
+static prof_stage_stats_t s_stages[PROF_STAGE_MAX];
+static uint32_t s_frames;
+static uint32_t s_frame_cycles;     // stage cycles since the last frame
+static uint32_t s_tight_frames;
+static uint32_t s_warn_frame;       // s_frames at the last warning, 0 for none this call
+
+static const char *s_stage_str[PROF_STAGE_MAX] = {
+    [PROF_SPK_DECODE]     = "spk decode",
+    [PROF_SPK_RING_WRITE] = "spk ring write",
+    [PROF_SPK_RING_READ]  = "spk ring read",
+    [PROF_SPK_STRETCH]    = "spk stretch",
+    [PROF_SPK_RESAMPLE]   = "spk resample",
+    [PROF_SPK_PAIR_SWAP]  = "spk pair swap",
+    [PROF_MIC_CONVERT]    = "mic convert",
+    [PROF_MIC_ENCODE]     = "mic encode",
+    [PROF_MIC_RING_WRITE] = "mic ring write",
+    [PROF_MIC_RING_READ]  = "mic ring read",
+};
+
+IRAM_ATTR void cycle_prof_end(prof_stage_t stage, uint32_t start)
+{
+    uint32_t cycles = esp_cpu_get_cycle_count() - start;
+    prof_stage_stats_t *s = &s_stages[stage];
+    s->calls++;
+    s->sum += cycles;
+    s_frame_cycles += cycles;
+    if (cycles > s->max) {
+        s->max = cycles;
+    }
+}
+
+IRAM_ATTR void cycle_prof_frame(void)
+{
+    uint32_t used = s_frame_cycles;
+    s_frame_cycles = 0;
+    s_frames++;
+    if (used <= WARN_FRAME_CYCLES) {
+        return;
+    }
+    s_tight_frames++;
+    if (s_warn_frame != 0 && s_frames - s_warn_frame < WARN_INTERVAL_FRAMES) {
+        return;
+    }
+    s_warn_frame = s_frames;
+    ESP_DRAM_LOGW(DRAM_TAG, "frame %u used %u of %u cycles, less than %d%% headroom (%u such frames)",
+                  (unsigned)s_frames, (unsigned)used, (unsigned)CYCLE_PROF_FRAME_CYCLES,
+                  CYCLE_PROF_HEADROOM_WARN_PCT, (unsigned)s_tight_frames);
+}
+
+void cycle_prof_reset(void)
+{
+    memset(s_stages, 0, sizeof(s_stages));
+    s_frames = 0;
+    s_frame_cycles = 0;
+    s_tight_frames = 0;
+    s_warn_frame = 0;
+}
+
+void cycle_prof_summary(prof_stage_t stage, prof_summary_t *summary)
+{
+    const prof_stage_stats_t *s = &s_stages[stage];
+    summary->calls = s->calls;
+    summary->avg_cycles = s->calls ? (uint32_t)(s->sum / s->calls) : 0;
+    summary->max_cycles = s->max;
+    summary->frames = s_frames;
+}
+
+const char *cycle_prof_stage_str(prof_stage_t stage)
+{
+    return (stage < PROF_STAGE_MAX) ? s_stage_str[stage] : "?";
+}
+
+uint32_t cycle_prof_load_permille(void)
+{
+    if (s_frames == 0) {
+        return 0;
+    }
+    uint64_t sum = 0;
+    for (int i = 0; i < PROF_STAGE_MAX; i++) {
+        sum += s_stages[i].sum;
+    }
+    return (uint32_t)(sum * 1000 / s_frames / CYCLE_PROF_FRAME_CYCLES);
+}
+
+uint32_t cycle_prof_tight_frames(void)
+{
+    return s_tight_frames;
+}
+
+void cycle_prof_log(void)
+{
+    if (s_frames == 0) {
+        return;
+    }
+    for (int i = 0; i < PROF_STAGE_MAX; i++) {
+        prof_summary_t sum;
+        cycle_prof_summary((prof_stage_t)i, &sum);
+        if (sum.calls == 0) {
+            continue;
+        }
+        ESP_LOGI(TAG, "%-14s avg %6"PRIu32" max %7"PRIu32" cycles, %3"PRIu32".%"PRIu32"%% of a frame",
+                 s_stage_str[i], sum.avg_cycles, sum.max_cycles,
+                 (uint32_t)(s_stages[i].sum * 100 / s_frames / CYCLE_PROF_FRAME_CYCLES),
+                 (uint32_t)(s_stages[i].sum * 1000 / s_frames / CYCLE_PROF_FRAME_CYCLES % 10));
+    }
+    uint32_t load = cycle_prof_load_permille();
+    if (load > (100 - CYCLE_PROF_HEADROOM_WARN_PCT) * 10) {
+        ESP_LOGW(TAG, "audio path uses %"PRIu32".%"PRIu32"%% of each frame, less than %d%% headroom left",
+                 load / 10, load % 10, CYCLE_PROF_HEADROOM_WARN_PCT);
+    } else {
+        ESP_LOGI(TAG, "audio path uses %"PRIu32".%"PRIu32"%% of each frame", load / 10, load % 10);
+    }
+    if (s_tight_frames > 0) {
+        ESP_LOGW(TAG, "%"PRIu32" of %"PRIu32" frames left less than %d%% headroom",
+                 s_tight_frames, s_frames, CYCLE_PROF_HEADROOM_WARN_PCT);
+    }
+}
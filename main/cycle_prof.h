@@ -0,0 +1,89 @@
+/*
+ * cycle_prof.h - CPU cycle budget of the call audio path, per stage
+ *
+ * Each stage of the per-frame path is bracketed with cycle_prof_begin() /
+ * cycle_prof_end(), which read the Xtensa CCOUNT register: two register
+ * reads and a few adds per stage. Averages and worst cases are kept per
+ * call and reported against the CPU time of one 7.5 ms mSBC frame, so it
+ * shows how much room is left for AEC or noise suppression. Worst cases
+ * include any preemption that hit the stage.
+ *
+ * The stages are also summed per frame, and a frame that leaves less than
+ * CYCLE_PROF_HEADROOM_WARN_PCT of its cycles is counted. The first such
+ * frame of a call logs a warning, and after that at most one warning is
+ * logged every CYCLE_PROF_WARN_INTERVAL_MS.
+ */
+
+#ifndef CYCLE_PROF_H
+#define CYCLE_PROF_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_cpu.h"
+#include "sdkconfig.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CYCLE_PROF_FRAME_US             7500    // one mSBC frame
+#define CYCLE_PROF_FRAME_CYCLES         (CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ * CYCLE_PROF_FRAME_US)
+#ifdef CONFIG_CYCLE_PROF_HEADROOM_WARN_PCT
+#define CYCLE_PROF_HEADROOM_WARN_PCT    CONFIG_CYCLE_PROF_HEADROOM_WARN_PCT
+#else
+#define CYCLE_PROF_HEADROOM_WARN_PCT    50      // warn when less than this share of a frame is left
+#endif
+#define CYCLE_PROF_WARN_INTERVAL_MS     10000   // least time between two tight frame warnings
+
+typedef enum {
+    PROF_SPK_DECODE = 0,    // msbc_dec_data
+    PROF_SPK_RING_WRITE,    // xRingbufferSend into the speaker ring
+    PROF_SPK_RING_READ,     // taking a frame from the speaker ring
+    PROF_SPK_STRETCH,       // wsola_process
+    PROF_SPK_RESAMPLE,      // resampler_process
+    PROF_SPK_PAIR_SWAP,     // mono slot pair swap
+    PROF_MIC_CONVERT,       // i2s_32bit_to_16bit_pcm
+    PROF_MIC_ENCODE,        // msbc_enc_data
+    PROF_MIC_RING_WRITE,
+    PROF_MIC_RING_READ,     // copy out of the mic ring, not the wait for data
+    PROF_STAGE_MAX,
+} prof_stage_t;
+
+typedef struct {
+    uint32_t calls;
+    uint32_t avg_cycles;
+    uint32_t max_cycles;
+    uint32_t frames;        // 7.5 ms frames the stage ran for, to spread its cost over
+} prof_summary_t;
+
+static inline uint32_t cycle_prof_begin(void)
+{
+    return esp_cpu_get_cycle_count();
+}
+
+void cycle_prof_end(prof_stage_t stage, uint32_t start);
+
+// Count one frame period of the call; stages are averaged over these
+void cycle_prof_frame(void);
+
+// Clear all stages; done at the start of every call
+void cycle_prof_reset(void);
+
+void cycle_prof_summary(prof_stage_t stage, prof_summary_t *summary);
+
+const char *cycle_prof_stage_str(prof_stage_t stage);
+
+// Share of a frame's cycles the stages use on average, in permille
+uint32_t cycle_prof_load_permille(void);
+
+// Frames of the call that left less than CYCLE_PROF_HEADROOM_WARN_PCT of their cycles
+uint32_t cycle_prof_tight_frames(void);
+
+// Log the per-stage budget; warns if the headroom is below CYCLE_PROF_HEADROOM_WARN_PCT
+void cycle_prof_log(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CYCLE_PROF_H
@@ -0,0 +1,347 @@
+/*
+ * flash_sched.c - deferred SPIFFS writes that stay out of the way of SCO audio
+ *
+ * Writers enqueue file operations (with a private copy of the data) on a
+ * FIFO. A low priority task on the BT core executes them in order. While HFP
+ * audio is active the task holds back, and only performs a slice of at most
+ * FLASH_SCHED_SLICE_BYTES every FLASH_SCHED_SLICE_INTERVAL_MS once the spill
+ * is past its high water mark or a writer is blocked on it. A slice is small
+ * enough that the cache-disabled window fits in the speaker jitter buffer.
+ */
+
+#include "flash_sched.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "app_task_config.h"
+
+#define FLASH_SCHED_PATH_LEN    64
+#define FLASH_SCHED_WAIT_MS     100
+
+static const char *TAG = "FLASH_SCHED";
+
+typedef enum {
+    FLASH_OP_CREATE = 0,
+    FLASH_OP_APPEND,
+    FLASH_OP_WRITE_AT,
+    FLASH_OP_REMOVE,
+    FLASH_OP_RENAME,                    // data holds the new path
+} flash_op_type_t;
+
+typedef struct flash_op {
+    struct flash_op *next;
+    flash_op_type_t type;
+    char path[FLASH_SCHED_PATH_LEN];
+    long offset;
+    size_t len;
+    size_t done;                        // bytes already written by earlier slices
+    uint8_t data[];
+} flash_op_t;
+
+static SemaphoreHandle_t s_lock = NULL;
+static SemaphoreHandle_t s_work = NULL;     // queue changed or audio state changed
+static SemaphoreHandle_t s_space = NULL;    // spill shrank
+static TaskHandle_t s_task = NULL;
+
+static flash_op_t *s_head = NULL;
+static flash_op_t *s_tail = NULL;
+static volatile bool s_audio_active = false;
+static volatile bool s_busy = false;
+static uint32_t s_waiters = 0;
+static uint32_t s_call_deferred = 0;
+static flash_sched_stats_t s_stats;
+
+static bool flash_op_exec(flash_op_t *op, size_t limit)
+{
+    size_t n = op->len - op->done;
+    if (n > limit) {
+        n = limit;
+    }
+
+    int64_t t0 = esp_timer_get_time();
+    bool ok = true;
+
+    if (op->type == FLASH_OP_REMOVE) {
+        remove(op->path);
+    } else if (op->type == FLASH_OP_RENAME) {
+        // SPIFFS rename fails if the target exists
+        n = op->len - op->done;
+        remove((const char *)op->data);
+        ok = rename(op->path, (const char *)op->data) == 0;
+    } else {
+        const char *mode = "ab";
+        if (op->type == FLASH_OP_CREATE && op->done == 0) {
+            remove(op->path);
+            mode = "wb";
+        } else if (op->type == FLASH_OP_WRITE_AT) {
+            mode = "r+b";
+        }
+
+        FILE *f = fopen(op->path, mode);
+        if (f == NULL) {
+            ok = false;
+        } else {
+            if (op->type == FLASH_OP_WRITE_AT && fseek(f, op->offset + (long)op->done, SEEK_SET) != 0) {
+                ok = false;
+            } else if (n > 0 && fwrite(op->data + op->done, 1, n, f) != n) {
+                ok = false;
+            }
+            fclose(f);
+        }
+    }
+
+    uint32_t stall_us = (uint32_t)(esp_timer_get_time() - t0);
+    op->done += n;
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    s_stats.pending_bytes -= n;
+    if (stall_us > s_stats.max_stall_us) {
+        s_stats.max_stall_us = stall_us;
+    }
+    if (!ok) {
+        s_stats.errors++;
+    }
+    bool finished = !ok || op->done >= op->len;
+    if (finished) {
+        // a failed op is dropped whole; later ops on the same file still run
+        s_stats.pending_bytes -= op->len - op->done;
+        s_head = op->next;
+        if (s_head == NULL) {
+            s_tail = NULL;
+        }
+        s_stats.ops++;
+    }
+    xSemaphoreGive(s_lock);
+
+    if (!ok) {
+        ESP_LOGE(TAG, "write to %s failed", op->path);
+    }
+    if (finished) {
+        free(op);
+    }
+    xSemaphoreGive(s_space);
+    return ok;
+}
+
+static void flash_sched_task(void *arg)
+{
+    (void)arg;
+    int64_t last_slice_us = 0;
+
+    for (;;) {
+        xSemaphoreTake(s_work, pdMS_TO_TICKS(FLASH_SCHED_SLICE_INTERVAL_MS));
+
+        for (;;) {
+            xSemaphoreTake(s_lock, portMAX_DELAY);
+            flash_op_t *op = s_head;
+            bool pressure = s_stats.pending_bytes >= FLASH_SCHED_SLICE_HIGH_WATER || s_waiters > 0;
+            s_busy = (op != NULL);
+            xSemaphoreGive(s_lock);
+
+            if (op == NULL) {
+                break;
+            }
+
+            if (!s_audio_active) {
+                flash_op_exec(op, SIZE_MAX);
+                continue;
+            }
+
+            int64_t now = esp_timer_get_time();
+            if (!pressure || now - last_slice_us < FLASH_SCHED_SLICE_INTERVAL_MS * 1000LL) {
+                break;
+            }
+            flash_op_exec(op, FLASH_SCHED_SLICE_BYTES);
+            last_slice_us = esp_timer_get_time();
+            xSemaphoreTake(s_lock, portMAX_DELAY);
+            s_stats.slices++;
+            xSemaphoreGive(s_lock);
+            break;
+        }
+        s_busy = false;
+    }
+}
+
+static esp_err_t flash_sched_enqueue(flash_op_type_t type, const char *path, long offset,
+                                     const void *data, size_t len)
+{
+    if (s_lock == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (path == NULL || strlen(path) >= FLASH_SCHED_PATH_LEN || (len > 0 && data == NULL)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    flash_op_t *op = (flash_op_t *)malloc(sizeof(flash_op_t) + len);
+    if (op == NULL) {
+        ESP_LOGE(TAG, "no memory for %u byte write", (unsigned)len);
+        return ESP_ERR_NO_MEM;
+    }
+    op->next = NULL;
+    op->type = type;
+    strcpy(op->path, path);
+    op->offset = offset;
+    op->len = len;
+    op->done = 0;
+    if (len > 0) {
+        memcpy(op->data, data, len);
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    // Block while the spill is full; an oversized write is still accepted into an empty queue
+    while (s_head != NULL && s_stats.pending_bytes + len > FLASH_SCHED_MAX_PENDING) {
+        s_waiters++;
+        xSemaphoreGive(s_lock);
+        xSemaphoreGive(s_work);
+        xSemaphoreTake(s_space, pdMS_TO_TICKS(FLASH_SCHED_WAIT_MS));
+        xSemaphoreTake(s_lock, portMAX_DELAY);
+        s_waiters--;
+    }
+
+    if (s_tail != NULL) {
+        s_tail->next = op;
+    } else {
+        s_head = op;
+    }
+    s_tail = op;
+    s_stats.pending_bytes += len;
+    if (s_stats.pending_bytes > s_stats.peak_pending) {
+        s_stats.peak_pending = s_stats.pending_bytes;
+    }
+    if (s_audio_active) {
+        s_stats.deferred_bytes += len;
+        s_call_deferred += len;
+    }
+    xSemaphoreGive(s_lock);
+
+    xSemaphoreGive(s_work);
+    return ESP_OK;
+}
+
+esp_err_t flash_sched_init(void)
+{
+    if (s_task != NULL) {
+        return ESP_OK;
+    }
+
+    s_lock = xSemaphoreCreateMutex();
+    s_work = xSemaphoreCreateBinary();
+    s_space = xSemaphoreCreateBinary();
+    if (s_lock == NULL || s_work == NULL || s_space == NULL) {
+        ESP_LOGE(TAG, "Failed to create semaphores");
+        return ESP_ERR_NO_MEM;
+    }
+
+    if (xTaskCreatePinnedToCore(flash_sched_task, "FlashSched", APP_FLASH_SCHED_TASK_STACK, NULL,
+                                APP_FLASH_SCHED_TASK_PRIO, &s_task, APP_BT_CORE) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create flash scheduler task");
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+void flash_sched_set_audio_active(bool active)
+{
+    if (s_audio_active == active) {
+        return;
+    }
+    s_audio_active = active;
+
+    if (active) {
+        s_call_deferred = 0;
+    } else {
+        ESP_LOGI(TAG, "call ended: %" PRIu32 " bytes deferred, %" PRIu32 " pending, max write stall %" PRIu32 " us",
+                 s_call_deferred, s_stats.pending_bytes, s_stats.max_stall_us);
+    }
+
+    if (s_work != NULL) {
+        xSemaphoreGive(s_work);
+    }
+}
+
+esp_err_t flash_sched_create(const char *path, const void *data, size_t len)
+{
+    return flash_sched_enqueue(FLASH_OP_CREATE, path, 0, data, len);
+}
+
+esp_err_t flash_sched_append(const char *path, const void *data, size_t len)
+{
+    return flash_sched_enqueue(FLASH_OP_APPEND, path, 0, data, len);
+}
+
+esp_err_t flash_sched_write_at(const char *path, long offset, const void *data, size_t len)
+{
+    return flash_sched_enqueue(FLASH_OP_WRITE_AT, path, offset, data, len);
+}
+
+esp_err_t flash_sched_remove(const char *path)
+{
+    return flash_sched_enqueue(FLASH_OP_REMOVE, path, 0, NULL, 0);
+}
+
+esp_err_t flash_sched_rename(const char *path, const char *new_path)
+{
+    if (new_path == NULL || strlen(new_path) >= FLASH_SCHED_PATH_LEN) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return flash_sched_enqueue(FLASH_OP_RENAME, path, 0, new_path, strlen(new_path) + 1);
+}
+
+esp_err_t flash_sched_flush(TickType_t timeout)
+{
+    if (s_lock == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    TickType_t start = xTaskGetTickCount();
+    for (;;) {
+        xSemaphoreTake(s_lock, portMAX_DELAY);
+        bool idle = (s_head == NULL);
+        if (!idle) {
+            // make the worker treat the caller like a blocked writer
+            s_waiters++;
+        }
+        xSemaphoreGive(s_lock);
+
+        if (idle && !s_busy) {
+            return ESP_OK;
+        }
+
+        xSemaphoreGive(s_work);
+        TickType_t elapsed = xTaskGetTickCount() - start;
+        bool expired = elapsed >= timeout;
+        if (!expired) {
+            TickType_t wait = timeout - elapsed;
+            xSemaphoreTake(s_space, wait < pdMS_TO_TICKS(FLASH_SCHED_WAIT_MS) ? wait : pdMS_TO_TICKS(FLASH_SCHED_WAIT_MS));
+        }
+
+        if (!idle) {
+            xSemaphoreTake(s_lock, portMAX_DELAY);
+            s_waiters--;
+            xSemaphoreGive(s_lock);
+        }
+        if (expired) {
+            return ESP_ERR_TIMEOUT;
+        }
+    }
+}
+
+void flash_sched_get_stats(flash_sched_stats_t *stats)
+{
+    if (stats == NULL) {
+        return;
+    }
+    if (s_lock == NULL) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    *stats = s_stats;
+    xSemaphoreGive(s_lock);
+}
@@ -0,0 +1,71 @@
+/*
+ * flash_sched.h - deferred SPIFFS writes that stay out of the way of SCO audio
+ *
+ * Every SPIFFS write disables the flash cache and halts both cores; garbage
+ * collection can keep it disabled for hundreds of milliseconds. Writers hand
+ * their data to this scheduler instead of calling stdio directly. While HFP
+ * audio is connected the writes are held in a bounded RAM spill, and only
+ * drained in small slices when the spill runs full. Between calls the queue
+ * is written out immediately, in order.
+ */
+
+#ifndef FLASH_SCHED_H
+#define FLASH_SCHED_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FLASH_SCHED_MAX_PENDING         (32 * 1024)  // RAM spill limit; writers block beyond this
+#define FLASH_SCHED_SLICE_BYTES         1024         // largest write allowed during a call
+#define FLASH_SCHED_SLICE_INTERVAL_MS   250          // minimum gap between in-call slices
+#define FLASH_SCHED_SLICE_HIGH_WATER    (FLASH_SCHED_MAX_PENDING * 3 / 4)  // in-call slices start here
+
+typedef struct {
+    uint32_t pending_bytes;     // queued, not yet on flash
+    uint32_t peak_pending;      // high water mark of pending_bytes
+    uint32_t deferred_bytes;    // total bytes queued while audio was active
+    uint32_t slices;            // writes performed during a call
+    uint32_t ops;               // file operations completed
+    uint32_t errors;            // file operations that failed
+    uint32_t max_stall_us;      // longest single file operation
+} flash_sched_stats_t;
+
+// Start the scheduler task. SPIFFS must be mounted.
+esp_err_t flash_sched_init(void);
+
+// Tell the scheduler whether SCO audio is streaming
+void flash_sched_set_audio_active(bool active);
+
+// Create or truncate a file with the given initial content (may be empty)
+esp_err_t flash_sched_create(const char *path, const void *data, size_t len);
+
+// Append data to the end of a file
+esp_err_t flash_sched_append(const char *path, const void *data, size_t len);
+
+// Overwrite data at a byte offset in an existing file
+esp_err_t flash_sched_write_at(const char *path, long offset, const void *data, size_t len);
+
+// Remove a file
+esp_err_t flash_sched_remove(const char *path);
+
+// Rename a file, replacing new_path if it exists. Not atomic: new_path is removed first,
+// so power lost in between leaves neither; only for files that can be rebuilt
+esp_err_t flash_sched_rename(const char *path, const char *new_path);
+
+// Wait until everything queued so far is on flash
+esp_err_t flash_sched_flush(TickType_t timeout);
+
+void flash_sched_get_stats(flash_sched_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FLASH_SCHED_H
@@ -0,0 +1,204 @@
+/*
+ * i2s_cal.c - per-mode I2S TX DMA sizing, calibrated on the running system
+ */
+
+#include "i2s_cal.h"
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include "esp_log.h"
+#include "nvs.h"
+
+#define TAG "I2S_CAL"
+#define I2S_CAL_NVS_NAMESPACE   "i2s_cal_ref"   // geometries at the reference rate; "i2s_cal" held output frames
+#define I2S_CAL_A2DP_REF_RATE   44100
+#define I2S_CAL_HFP_REF_RATE    16000
+
+// driver default (I2S_CHANNEL_DEFAULT_CONFIG), used until a mode is calibrated
+static const i2s_dma_geometry_t s_default_geometry = { 6, 240 };
+
+// shallow to deep, in frames at the mode's reference rate and scaled to the output rate,
+// so a candidate is the same length of audio with and without the fixed output rate;
+// HFP buffers are multiples of one 7.5 ms mSBC frame
+static const i2s_dma_geometry_t s_a2dp_candidates[] = {
+    { 4, 240 }, { 6, 240 }, { 8, 240 }, { 6, 480 }, { 8, 480 },
+};
+static const i2s_dma_geometry_t s_hfp_candidates[] = {
+    { 3, 120 }, { 4, 120 }, { 6, 120 }, { 8, 120 }, { 6, 240 }, { 8, 240 },
+};
+
+typedef struct {
+    const char *name;
+    uint32_t ref_rate;              // candidates and the stored geometry count frames at this rate
+    const i2s_dma_geometry_t *candidates;
+    uint8_t candidate_count;
+    bool stored;                    // geometry below came from NVS or a calibration
+    i2s_dma_geometry_t geometry;
+    bool calibrating;
+    uint8_t step;                   // candidate under test
+} i2s_cal_state_t;
+
+static i2s_cal_state_t s_cal[I2S_CAL_MODE_MAX] = {
+    [I2S_CAL_MODE_A2DP] = { "a2dp", I2S_CAL_A2DP_REF_RATE, s_a2dp_candidates, sizeof(s_a2dp_candidates) / sizeof(s_a2dp_candidates[0]) },
+    [I2S_CAL_MODE_HFP]  = { "hfp",  I2S_CAL_HFP_REF_RATE,  s_hfp_candidates,  sizeof(s_hfp_candidates) / sizeof(s_hfp_candidates[0]) },
+};
+
+// Length of one DMA buffer of a reference-rate geometry
+static uint32_t buffer_us(const i2s_cal_state_t *cal, i2s_dma_geometry_t geometry)
+{
+    return (uint32_t)((uint64_t)geometry.frame_num * 1000000 / cal->ref_rate);
+}
+
+// Reference-rate geometry under test or stored, or false for the driver default
+static bool i2s_cal_ref_geometry(const i2s_cal_state_t *cal, i2s_dma_geometry_t *geometry)
+{
+    if (cal->calibrating) {
+        *geometry = cal->candidates[cal->step];
+    } else if (cal->stored) {
+        *geometry = cal->geometry;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static void i2s_cal_save(i2s_cal_mode_t mode)
+{
+    nvs_handle_t nvs;
+    if (nvs_open(I2S_CAL_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open NVS");
+        return;
+    }
+    esp_err_t err;
+    if (s_cal[mode].stored) {
+        err = nvs_set_blob(nvs, s_cal[mode].name, &s_cal[mode].geometry, sizeof(i2s_dma_geometry_t));
+    } else {
+        err = nvs_erase_key(nvs, s_cal[mode].name);
+        if (err == ESP_ERR_NVS_NOT_FOUND) {
+            err = ESP_OK;
+        }
+    }
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to store %s result (%s)", s_cal[mode].name, esp_err_to_name(err));
+    }
+    nvs_close(nvs);
+}
+
+void i2s_cal_init(void)
+{
+    nvs_handle_t nvs;
+    if (nvs_open(I2S_CAL_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        return;  // nothing stored yet
+    }
+    for (int mode = 0; mode < I2S_CAL_MODE_MAX; mode++) {
+        i2s_dma_geometry_t geometry;
+        size_t len = sizeof(geometry);
+        if (nvs_get_blob(nvs, s_cal[mode].name, &geometry, &len) == ESP_OK &&
+            len == sizeof(geometry) && geometry.desc_num >= 2 && geometry.frame_num > 0) {
+            s_cal[mode].geometry = geometry;
+            s_cal[mode].stored = true;
+            ESP_LOGI(TAG, "%s: %d x %"PRIu32" us (calibrated)", s_cal[mode].name,
+                     geometry.desc_num, buffer_us(&s_cal[mode], geometry));
+        }
+    }
+    nvs_close(nvs);
+}
+
+i2s_dma_geometry_t i2s_cal_get_geometry(i2s_cal_mode_t mode, uint32_t out_rate)
+{
+    const i2s_cal_state_t *cal = &s_cal[mode];
+    i2s_dma_geometry_t geometry;
+    if (!i2s_cal_ref_geometry(cal, &geometry)) {
+        return s_default_geometry;
+    }
+    geometry.frame_num = (uint16_t)(((uint64_t)geometry.frame_num * out_rate + cal->ref_rate / 2) / cal->ref_rate);
+    return geometry;
+}
+
+esp_err_t i2s_cal_start(i2s_cal_mode_t mode)
+{
+    if (mode >= I2S_CAL_MODE_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    s_cal[mode].calibrating = true;
+    s_cal[mode].step = 0;
+    ESP_LOGI(TAG, "%s: calibrating over the next sessions, starting at %d x %"PRIu32" us",
+             s_cal[mode].name, s_cal[mode].candidates[0].desc_num, buffer_us(&s_cal[mode], s_cal[mode].candidates[0]));
+    return ESP_OK;
+}
+
+void i2s_cal_reset(i2s_cal_mode_t mode)
+{
+    s_cal[mode].calibrating = false;
+    s_cal[mode].stored = false;
+    i2s_cal_save(mode);
+}
+
+void i2s_cal_session_end(i2s_cal_mode_t mode, const i2s_cal_session_t *session)
+{
+    i2s_cal_state_t *cal = &s_cal[mode];
+    i2s_dma_geometry_t geometry;
+    bool calibrated = i2s_cal_ref_geometry(cal, &geometry);
+    uint32_t per_10k = session->buffers_sent ? session->underruns * 10000 / session->buffers_sent : 0;
+
+    if (calibrated) {
+        ESP_LOGI(TAG, "%s session, %d x %"PRIu32" us: %"PRIu32" ms, %"PRIu32" buffers, %"PRIu32" underruns (%"PRIu32"/10k), "
+                 "write blocked avg %"PRIu32" us max %"PRIu32" us",
+                 cal->name, geometry.desc_num, buffer_us(cal, geometry), session->duration_ms, session->buffers_sent,
+                 session->underruns, per_10k, session->write_block_avg_us, session->write_block_max_us);
+    } else {
+        ESP_LOGI(TAG, "%s session, driver default: %"PRIu32" ms, %"PRIu32" buffers, %"PRIu32" underruns (%"PRIu32"/10k), "
+                 "write blocked avg %"PRIu32" us max %"PRIu32" us",
+                 cal->name, session->duration_ms, session->buffers_sent,
+                 session->underruns, per_10k, session->write_block_avg_us, session->write_block_max_us);
+    }
+
+    if (!cal->calibrating) {
+        return;
+    }
+    if (session->duration_ms < I2S_CAL_MIN_SESSION_MS) {
+        ESP_LOGI(TAG, "%s: session too short, candidate will be tried again", cal->name);
+        return;
+    }
+
+    if (per_10k <= I2S_CAL_MAX_UNDERRUNS_PER_10K) {
+        ESP_LOGI(TAG, "%s: calibrated to %d x %"PRIu32" us", cal->name, geometry.desc_num, buffer_us(cal, geometry));
+    } else if (cal->step + 1 < cal->candidate_count) {
+        cal->step++;
+        ESP_LOGI(TAG, "%s: underrun target missed, next session tries %d x %"PRIu32" us", cal->name,
+                 cal->candidates[cal->step].desc_num, buffer_us(cal, cal->candidates[cal->step]));
+        return;
+    } else {
+        ESP_LOGW(TAG, "%s: no candidate met the underrun target, keeping the deepest", cal->name);
+    }
+
+    cal->calibrating = false;
+    cal->stored = true;
+    cal->geometry = geometry;
+    i2s_cal_save(mode);
+}
+
+void i2s_cal_print_status(void)
+{
+    for (int mode = 0; mode < I2S_CAL_MODE_MAX; mode++) {
+        i2s_cal_state_t *cal = &s_cal[mode];
+        i2s_dma_geometry_t geometry;
+        if (i2s_cal_ref_geometry(cal, &geometry)) {
+            printf("%-5s %d x %"PRIu32" us, %s\n", cal->name, geometry.desc_num, buffer_us(cal, geometry),
+                   cal->calibrating ? "calibrating" : "calibrated");
+        } else {
+            printf("%-5s %d x %d frames, driver default\n", cal->name, s_default_geometry.desc_num, s_default_geometry.frame_num);
+        }
+        if (cal->calibrating) {
+            printf("      testing candidate %d of %d\n", cal->step + 1, cal->candidate_count);
+        }
+    }
+}
+
+const char *i2s_cal_mode_str(i2s_cal_mode_t mode)
+{
+    return mode < I2S_CAL_MODE_MAX ? s_cal[mode].name : "?";
+}
@@ -0,0 +1,72 @@
+/*
+ * i2s_cal.h - per-mode I2S TX DMA sizing, calibrated on the running system
+ *
+ * The TX channel is shared by A2DP (44.1/48 kHz stereo) and HFP (16 kHz
+ * mono), which need very different DMA depth. A calibration run walks a
+ * list of candidate geometries from shallow to deep, one audio session per
+ * candidate, and keeps the first one whose DMA underrun rate stays within
+ * I2S_CAL_MAX_UNDERRUNS_PER_10K. Results are stored in NVS and applied when
+ * the TX channel is next switched to that mode. Buffer lengths are kept as
+ * durations and converted to frames at the rate the channel runs at, which
+ * is 48 kHz for both modes with the fixed output rate.
+ */
+
+#ifndef I2S_CAL_H
+#define I2S_CAL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define I2S_CAL_MAX_UNDERRUNS_PER_10K   1       // per 10000 DMA buffers sent
+#define I2S_CAL_MIN_SESSION_MS          20000   // shorter sessions don't count
+
+typedef enum {
+    I2S_CAL_MODE_A2DP = 0,
+    I2S_CAL_MODE_HFP,
+    I2S_CAL_MODE_MAX,
+} i2s_cal_mode_t;
+
+typedef struct {
+    uint16_t desc_num;
+    uint16_t frame_num;
+} i2s_dma_geometry_t;
+
+// What the TX path measured over one audio session
+typedef struct {
+    uint32_t duration_ms;
+    uint32_t buffers_sent;          // DMA buffers completed
+    uint32_t underruns;             // DMA buffers completed with no new data queued
+    uint32_t writes;
+    uint32_t write_block_avg_us;    // time spent inside i2s_channel_write
+    uint32_t write_block_max_us;
+} i2s_cal_session_t;
+
+// Load stored results from NVS
+void i2s_cal_init(void);
+
+// DMA geometry to use the next time the TX channel enters this mode, in frames at out_rate
+i2s_dma_geometry_t i2s_cal_get_geometry(i2s_cal_mode_t mode, uint32_t out_rate);
+
+// Start calibrating a mode; takes effect at the next session in that mode
+esp_err_t i2s_cal_start(i2s_cal_mode_t mode);
+
+// Forget the stored result and any calibration in progress
+void i2s_cal_reset(i2s_cal_mode_t mode);
+
+// Report a finished session; advances a calibration in progress
+void i2s_cal_session_end(i2s_cal_mode_t mode, const i2s_cal_session_t *session);
+
+void i2s_cal_print_status(void);
+
+const char *i2s_cal_mode_str(i2s_cal_mode_t mode);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // I2S_CAL_H
@@ -0,0 +1,135 @@
+/*
+ * latency_trace.c - per-stage latency histograms for the HFP audio path
+ */
+
+#include "latency_trace.h"
+#include <string.h>
+#include "esp_attr.h"
+
+#define LT_SUB_BITS             3
+#define LT_SUB                  (1 << LT_SUB_BITS)
+#define LT_MAX_US               ((1u << 21) - 1)    // ~2 s
+#define LT_BUCKETS              ((21 - LT_SUB_BITS + 1) * LT_SUB)
+
+typedef struct {
+    uint32_t buckets[LT_BUCKETS];
+    uint32_t count;
+    uint32_t max_us;
+} lt_hist_t;
+
+static lt_hist_t s_hist[LT_STAGE_MAX];
+
+static const char *s_stage_str[LT_STAGE_MAX] = {
+    [LT_SCO_CALLBACK] = "sco callback",
+    [LT_SPK_DECODE]   = "spk decode",
+    [LT_SPK_RING]     = "spk ring",
+    [LT_SPK_OUTPUT]   = "spk output",
+    [LT_SPK_DMA]      = "spk dma",
+    [LT_MIC_CAPTURE]  = "mic capture",
+    [LT_MIC_ENCODE]   = "mic encode",
+    [LT_MIC_RING]     = "mic ring",
+    [LT_MIC_SEND]     = "mic send",
+};
+
+/* values below LT_SUB get a bucket each; above, LT_SUB buckets per power of two */
+static IRAM_ATTR uint32_t lt_bucket(uint32_t us)
+{
+    if (us < LT_SUB) {
+        return us;
+    }
+    uint32_t msb = 31 - __builtin_clz(us);
+    return (msb - LT_SUB_BITS + 1) * LT_SUB + ((us >> (msb - LT_SUB_BITS)) & (LT_SUB - 1));
+}
+
+/* largest value that falls in bucket b */
+static uint32_t lt_bucket_upper(uint32_t b)
+{
+    if (b < LT_SUB) {
+        return b;
+    }
+    uint32_t msb = b / LT_SUB + LT_SUB_BITS - 1;
+    uint32_t sub = b % LT_SUB;
+    return ((LT_SUB + sub + 1) << (msb - LT_SUB_BITS)) - 1;
+}
+
+void latency_trace_reset(void)
+{
+    memset(s_hist, 0, sizeof(s_hist));
+}
+
+IRAM_ATTR void latency_trace_record(lt_stage_t stage, uint32_t us)
+{
+    lt_hist_t *h = &s_hist[stage];
+    if (us > h->max_us) {
+        h->max_us = us;
+    }
+    h->buckets[lt_bucket(us > LT_MAX_US ? LT_MAX_US : us)]++;
+    h->count++;
+}
+
+static uint32_t lt_percentile(const lt_hist_t *h, uint32_t pct)
+{
+    uint32_t rank = (uint32_t)(((uint64_t)h->count * pct + 99) / 100);
+    uint32_t seen = 0;
+    for (uint32_t b = 0; b < LT_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= rank) {
+            uint32_t upper = lt_bucket_upper(b);
+            return upper < h->max_us ? upper : h->max_us;
+        }
+    }
+    return h->max_us;
+}
+
+void latency_trace_summary(lt_stage_t stage, lt_summary_t *summary)
+{
+    const lt_hist_t *h = &s_hist[stage];
+    summary->count = h->count;
+    summary->max_us = h->max_us;
+    if (h->count == 0) {
+        summary->p50_us = summary->p95_us = summary->p99_us = 0;
+        return;
+    }
+    summary->p50_us = lt_percentile(h, 50);
+    summary->p95_us = lt_percentile(h, 95);
+    summary->p99_us = lt_percentile(h, 99);
+}
+
+const char *latency_trace_stage_str(lt_stage_t stage)
+{
+    return (stage < LT_STAGE_MAX) ? s_stage_str[stage] : "?";
+}
+
+void lt_fifo_reset(lt_fifo_t *f)
+{
+    memset(f, 0, sizeof(*f));
+}
+
+IRAM_ATTR void lt_fifo_in(lt_fifo_t *f, uint32_t bytes, int64_t t_us)
+{
+    uint32_t in = f->bytes_in + bytes;
+    if (f->head - f->tail < LT_FIFO_TAGS) {
+        f->end[f->head % LT_FIFO_TAGS] = in;
+        f->t_us[f->head % LT_FIFO_TAGS] = t_us;
+        f->bytes_in = in;
+        f->head++;
+    } else {
+        f->bytes_in = in;      // too many writes in flight: this one goes untimed
+    }
+}
+
+IRAM_ATTR void lt_fifo_out(lt_fifo_t *f, uint32_t bytes, lt_stage_t stage, int64_t now_us)
+{
+    uint32_t out = f->bytes_out + bytes;
+    uint32_t in = f->bytes_in;
+    /* more out than in: the reader was fed something untagged (DMA silence), nothing was queued */
+    if ((int32_t)(out - in) > 0) {
+        out = in;
+    }
+    f->bytes_out = out;
+    while (f->tail != f->head && (int32_t)(f->end[f->tail % LT_FIFO_TAGS] - out) <= 0) {
+        int64_t dt = now_us - f->t_us[f->tail % LT_FIFO_TAGS];
+        latency_trace_record(stage, dt > 0 ? (uint32_t)dt : 0);
+        f->tail++;
+    }
+}
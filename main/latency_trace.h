@@ -0,0 +1,80 @@
+/*
+ * latency_trace.h - per-stage latency histograms for the HFP audio path
+ *
+ * Every hop a frame makes between the SCO link and the I2S pins records
+ * how long the frame spent there. Stages a frame crosses in one call
+ * (decode, encode, send) are timed directly; for the ringbuffers and the
+ * I2S DMA queue, which carry bytes rather than frames, the writer tags the
+ * end of each write with its timestamp in an lt_fifo_t and the reader
+ * retires the tags as it consumes the bytes.
+ *
+ * Histograms are log-linear (8 buckets per octave, so percentiles are
+ * within 12.5%) and cover 0..2 s; longer times count in the last bucket.
+ * Each stage has a single writer, so recording takes no lock.
+ */
+
+#ifndef LATENCY_TRACE_H
+#define LATENCY_TRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LT_FIFO_TAGS            64      // writes in flight per FIFO
+
+typedef enum {
+    LT_SCO_CALLBACK = 0,    // the whole SCO data callback
+    LT_SPK_DECODE,          // msbc_dec_data
+    LT_SPK_RING,            // speaker ringbuffer, written -> taken by the tx task
+    LT_SPK_OUTPUT,          // taken -> accepted by the I2S driver (stretch, convert, wait for DMA space)
+    LT_SPK_DMA,             // accepted by the driver -> DMA buffer sent
+    LT_MIC_CAPTURE,         // mic DMA buffer complete -> rx task
+    LT_MIC_ENCODE,          // msbc_enc_data
+    LT_MIC_RING,            // mic ringbuffer, written -> read by the SCO callback
+    LT_MIC_SEND,            // esp_hf_client_audio_data_send
+    LT_STAGE_MAX,
+} lt_stage_t;
+
+typedef struct {
+    uint32_t count;
+    uint32_t p50_us;
+    uint32_t p95_us;
+    uint32_t p99_us;
+    uint32_t max_us;
+} lt_summary_t;
+
+// Writer tags for one byte FIFO; one producer and one consumer
+typedef struct {
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    volatile uint32_t bytes_in;
+    uint32_t bytes_out;
+    uint32_t end[LT_FIFO_TAGS];     // bytes_in after the tagged write
+    int64_t t_us[LT_FIFO_TAGS];
+} lt_fifo_t;
+
+// Clear all histograms; done at the start of every call
+void latency_trace_reset(void);
+
+void latency_trace_record(lt_stage_t stage, uint32_t us);
+
+void latency_trace_summary(lt_stage_t stage, lt_summary_t *summary);
+
+const char *latency_trace_stage_str(lt_stage_t stage);
+
+void lt_fifo_reset(lt_fifo_t *f);
+
+// Producer: bytes were written at t_us
+void lt_fifo_in(lt_fifo_t *f, uint32_t bytes, int64_t t_us);
+
+// Consumer: bytes were taken at now_us; writes now fully consumed are recorded under stage
+void lt_fifo_out(lt_fifo_t *f, uint32_t bytes, lt_stage_t stage, int64_t now_us);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LATENCY_TRACE_H
@@ -27,40 +27,37 @@
 #include "esp_console.h"
 #include "app_hf_msg_set.h"
 #include "bt_app_pbac.h"
+#include "bt_app_av.h"
 #include "bt_i2s.h"
 #include "esp_heap_caps.h"
+#include "app_task_config.h"
+#include "metrics.h"
 #include "esp_system.h"
 
 esp_bd_addr_t peer_addr = {0};
 static char peer_bdname[ESP_BT_GAP_MAX_BDNAME_LEN + 1];
 static uint8_t peer_bdname_len;
 static const char remote_device_name[] = "hfp_hf";
-#define HEAP_MONITOR_PERIOD_MS 5000  // Report every 5 seconds
 
-static void heap_monitor_task(void *arg)
+/* heap figures, sampled when the metrics are read */
+static int32_t heap_free(void)
 {
-    while (1) {
-        // Get heap information
-        size_t free_heap = esp_get_free_heap_size();
-        size_t min_free_heap = esp_get_minimum_free_heap_size();
-        size_t largest_free_block = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
-        
-        // Get internal DRAM info
-        size_t free_internal = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
-        size_t total_internal = heap_caps_get_total_size(MALLOC_CAP_INTERNAL);
-        size_t used_internal = total_internal - free_internal;
-        
-        ESP_LOGI("HEAP_MONITOR", 
-                "Free: %d bytes | Min Free: %d bytes | Largest Block: %d bytes | Used: %d/%d (%.1f%%)",
-                free_heap,
-                min_free_heap,
-                largest_free_block,
-                used_internal,
-                total_internal,
-                (used_internal * 100.0f) / total_internal);
-        
-        vTaskDelay(pdMS_TO_TICKS(HEAP_MONITOR_PERIOD_MS));
-    }
+    return esp_get_free_heap_size();
+}
+
+static int32_t heap_min_free(void)
+{
+    return esp_get_minimum_free_heap_size();
+}
+
+static int32_t heap_largest_block(void)
+{
+    return heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+}
+
+static int32_t heap_internal_used(void)
+{
+    return heap_caps_get_total_size(MALLOC_CAP_INTERNAL) - heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
 }
 
 static char *bda2str(esp_bd_addr_t bda, char *str, size_t size)
@@ -218,13 +215,18 @@ void app_main(void)
 
     ESP_LOGI(BT_HF_TAG, "Own address:[%s]", bda2str((uint8_t *)esp_bt_dev_get_address(), bda_str, sizeof(bda_str)));
     
-    // Start heap monitor task
-    xTaskCreate(heap_monitor_task, "heap_mon", 3072, NULL, 1, NULL);
+    metrics_gauge_fn("heap.free", heap_free);
+    metrics_gauge_fn("heap.min_free", heap_min_free);
+    metrics_gauge_fn("heap.largest_block", heap_largest_block);
+    metrics_gauge_fn("heap.internal_used", heap_internal_used);
+    bt_app_hf_metrics_init();
 
     /* init our I2S */
     bt_i2s_set_tx_I2S_pins( 26, 17, 25, 0 );
     bt_i2s_set_rx_I2S_pins( 16, 27, 0, 14 );
     bt_i2s_init();
+    /* the A2DP ringbuffer and tx task stay allocated for the whole run */
+    bt_i2s_a2dp_task_init();
     phonebook_init();
     phonebook_set_country_code("31");  // Netherlands - change as needed
 
@@ -284,6 +286,7 @@ static void bt_hf_client_hdl_stack_evt(uint16_t event, void *p_param)
         esp_hf_client_init();
         esp_pbac_register_callback(bt_app_pbac_cb);
         esp_pbac_init();
+        bt_app_av_init();
 
         esp_bt_pin_type_t pin_type = ESP_BT_PIN_TYPE_FIXED;
         esp_bt_pin_code_t pin_code;
@@ -0,0 +1,221 @@
+/*
+ * metrics.c - runtime metrics registry
+ */
+
+#include "metrics.h"
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#define TAG "METRICS"
+
+#define METRICS_HIST_MAX        8
+
+static metric_t s_metrics[METRICS_MAX];
+static volatile size_t s_count;
+static metric_hist_t s_hists[METRICS_HIST_MAX];
+static size_t s_hist_count;
+static metric_hist_t s_scratch_hist;
+static metric_t s_scratch = { .name = "scratch", .type = METRIC_COUNTER };
+static portMUX_TYPE s_register_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static const char *s_type_str[] = {
+    [METRIC_COUNTER] = "counter",
+    [METRIC_GAUGE]   = "gauge",
+    [METRIC_HIST]    = "hist",
+};
+
+/* entries are filled before the count is published, so readers need no lock */
+static metric_t *metrics_register(const char *name, metric_type_t type, metric_read_fn_t fn)
+{
+    metric_t *m = NULL;
+    portENTER_CRITICAL(&s_register_lock);
+    if (s_count < METRICS_MAX && (type != METRIC_HIST || s_hist_count < METRICS_HIST_MAX)) {
+        m = &s_metrics[s_count];
+        m->name = name;
+        m->type = type;
+        m->read = fn;
+        m->hist = (type == METRIC_HIST) ? &s_hists[s_hist_count++] : NULL;
+        __atomic_store_n(&s_count, s_count + 1, __ATOMIC_RELEASE);
+    }
+    portEXIT_CRITICAL(&s_register_lock);
+    if (m == NULL) {
+        ESP_LOGE(TAG, "%s - registry full, %s not recorded", __func__, name);
+        s_scratch.hist = &s_scratch_hist;
+        return &s_scratch;
+    }
+    return m;
+}
+
+metric_t *metrics_counter(const char *name)
+{
+    return metrics_register(name, METRIC_COUNTER, NULL);
+}
+
+metric_t *metrics_gauge(const char *name)
+{
+    return metrics_register(name, METRIC_GAUGE, NULL);
+}
+
+metric_t *metrics_gauge_fn(const char *name, metric_read_fn_t fn)
+{
+    return metrics_register(name, METRIC_GAUGE, fn);
+}
+
+metric_t *metrics_hist(const char *name)
+{
+    return metrics_register(name, METRIC_HIST, NULL);
+}
+
+IRAM_ATTR void metrics_observe(metric_t *m, uint32_t value)
+{
+    metric_hist_t *h = m->hist;
+    uint32_t b = value ? 32 - __builtin_clz(value) : 0;
+    if (b >= METRICS_HIST_BUCKETS) {
+        b = METRICS_HIST_BUCKETS - 1;
+    }
+    h->buckets[b]++;
+    h->sum += value;
+    if (value > h->max) {
+        h->max = value;
+    }
+    h->count++;
+}
+
+size_t metrics_count(void)
+{
+    return __atomic_load_n(&s_count, __ATOMIC_ACQUIRE);
+}
+
+const metric_t *metrics_get(size_t index)
+{
+    return (index < metrics_count()) ? &s_metrics[index] : NULL;
+}
+
+const metric_t *metrics_find(const char *name)
+{
+    size_t n = metrics_count();
+    for (size_t i = 0; i < n; i++) {
+        if (strcmp(s_metrics[i].name, name) == 0) {
+            return &s_metrics[i];
+        }
+    }
+    return NULL;
+}
+
+int64_t metrics_value(const metric_t *m)
+{
+    switch (m->type) {
+    case METRIC_COUNTER:
+        return m->counter;
+    case METRIC_GAUGE:
+        return m->read ? m->read() : m->gauge;
+    default:
+        return m->hist->count;
+    }
+}
+
+uint32_t metrics_hist_percentile(const metric_t *m, uint32_t pct)
+{
+    const metric_hist_t *h = m->hist;
+    uint32_t rank = (uint32_t)(((uint64_t)h->count * pct + 99) / 100);
+    uint32_t seen = 0;
+    for (uint32_t b = 0; b < METRICS_HIST_BUCKETS - 1; b++) {
+        seen += h->buckets[b];
+        if (seen >= rank) {
+            uint32_t upper = b ? (1u << b) - 1 : 0;
+            return upper < h->max ? upper : h->max;
+        }
+    }
+    return h->max;
+}
+
+const char *metrics_type_str(metric_type_t type)
+{
+    return (type <= METRIC_HIST) ? s_type_str[type] : "?";
+}
+
+void metrics_reset(void)
+{
+    size_t n = metrics_count();
+    for (size_t i = 0; i < n; i++) {
+        metric_t *m = &s_metrics[i];
+        if (m->type == METRIC_COUNTER) {
+            __atomic_store_n(&m->counter, 0, __ATOMIC_RELAXED);
+        } else if (m->type == METRIC_HIST) {
+            memset(m->hist, 0, sizeof(*m->hist));
+        }
+    }
+}
+
+static uint8_t *put_u32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+    return p + 4;
+}
+
+/* FNV-1a over every name and type, in index order */
+static uint32_t metrics_schema_hash(size_t n)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < n; i++) {
+        for (const char *c = s_metrics[i].name; *c; c++) {
+            h = (h ^ (uint8_t)*c) * 16777619u;
+        }
+        h = (h ^ (uint8_t)s_metrics[i].type) * 16777619u;
+    }
+    return h;
+}
+
+esp_err_t metrics_snapshot(uint8_t *buf, size_t len, size_t *out_len)
+{
+    size_t n = metrics_count();
+    uint8_t *p = buf;
+    uint8_t *end = buf + len;
+    if (len < 12) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    *p++ = METRICS_SNAPSHOT_MAGIC & 0xff;
+    *p++ = METRICS_SNAPSHOT_MAGIC >> 8;
+    *p++ = METRICS_SNAPSHOT_VERSION;
+    *p++ = (uint8_t)n;
+    p = put_u32(p, (uint32_t)(esp_timer_get_time() / 1000));
+    p = put_u32(p, metrics_schema_hash(n));
+
+    for (size_t i = 0; i < n; i++) {
+        const metric_t *m = &s_metrics[i];
+        if (m->type != METRIC_HIST) {
+            if (end - p < 4) {
+                return ESP_ERR_INVALID_SIZE;
+            }
+            p = put_u32(p, (uint32_t)metrics_value(m));
+            continue;
+        }
+        metric_hist_t h = *m->hist;
+        uint32_t mask = 0;
+        for (int b = 0; b < METRICS_HIST_BUCKETS; b++) {
+            if (h.buckets[b]) {
+                mask |= 1u << b;
+            }
+        }
+        if (end - p < 16 + 4 * __builtin_popcount(mask)) {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        p = put_u32(p, h.count);
+        p = put_u32(p, h.max);
+        p = put_u32(p, h.sum > UINT32_MAX ? UINT32_MAX : (uint32_t)h.sum);
+        p = put_u32(p, mask);
+        for (int b = 0; b < METRICS_HIST_BUCKETS; b++) {
+            if (mask & (1u << b)) {
+                p = put_u32(p, h.buckets[b]);
+            }
+        }
+    }
+    *out_len = p - buf;
+    return ESP_OK;
+}
@@ -0,0 +1,124 @@
+/*
+ * metrics.h - runtime metrics registry
+ *
+ * Subsystems register named counters, gauges and histograms once at init
+ * and keep the returned handle; updating one is a single atomic add or
+ * store, with no lock and no logging, so it is safe from the audio tasks
+ * and ISRs. Gauges may instead be given a read function that is sampled
+ * when the registry is read (heap figures, for instance).
+ *
+ * The registry is read on demand: the `stats` console command prints it
+ * and metrics_snapshot() packs it into a compact binary record.
+ *
+ * Names are dotted, subsystem first ("hfp.mic.dropped"). The registry is
+ * fixed size; once full, registration hands back a shared scratch metric
+ * so callers never need to check the handle.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define METRICS_MAX             48
+#define METRICS_HIST_BUCKETS    24      // power-of-two buckets: 0, 1, 2-3, 4-7, ... 2^22 and up
+
+#define METRICS_SNAPSHOT_MAGIC      0x534d      // "MS", little endian
+#define METRICS_SNAPSHOT_VERSION    1
+
+typedef enum {
+    METRIC_COUNTER = 0,     // monotonic, cleared by metrics_reset()
+    METRIC_GAUGE,           // last value set, or sampled from a read function
+    METRIC_HIST,            // distribution of observed values
+} metric_type_t;
+
+typedef int32_t (*metric_read_fn_t)(void);
+
+typedef struct {
+    uint32_t count;
+    uint32_t max;
+    uint64_t sum;
+    uint32_t buckets[METRICS_HIST_BUCKETS];
+} metric_hist_t;
+
+typedef struct {
+    const char *name;
+    metric_type_t type;
+    union {
+        volatile uint32_t counter;
+        volatile int32_t gauge;
+    };
+    metric_read_fn_t read;
+    metric_hist_t *hist;
+} metric_t;
+
+metric_t *metrics_counter(const char *name);
+
+metric_t *metrics_gauge(const char *name);
+
+// Gauge whose value is read from fn whenever the registry is read
+metric_t *metrics_gauge_fn(const char *name, metric_read_fn_t fn);
+
+metric_t *metrics_hist(const char *name);
+
+static inline void metrics_add(metric_t *m, uint32_t n)
+{
+    __atomic_fetch_add(&m->counter, n, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_inc(metric_t *m)
+{
+    metrics_add(m, 1);
+}
+
+static inline void metrics_set(metric_t *m, int32_t value)
+{
+    __atomic_store_n(&m->gauge, value, __ATOMIC_RELAXED);
+}
+
+// Record one value into a histogram; one writer per histogram
+void metrics_observe(metric_t *m, uint32_t value);
+
+// Number of registered metrics; metrics are indexed 0..count-1 in registration order
+size_t metrics_count(void);
+
+const metric_t *metrics_get(size_t index);
+
+// Look a metric up by name; NULL if it was never registered
+const metric_t *metrics_find(const char *name);
+
+// Current value of a counter or gauge, sampling the read function if it has one
+int64_t metrics_value(const metric_t *m);
+
+// Upper bound of the histogram bucket holding the given percentile
+uint32_t metrics_hist_percentile(const metric_t *m, uint32_t pct);
+
+const char *metrics_type_str(metric_type_t type);
+
+// Clear counters and histograms; gauges keep their value
+void metrics_reset(void);
+
+/*
+ * Pack all metrics into buf. Layout, little endian:
+ *   u16 magic, u8 version, u8 count, u32 uptime_ms, u32 schema hash
+ *   then per metric, in index order, by type:
+ *     counter: u32 value
+ *     gauge:   i32 value
+ *     hist:    u32 count, u32 max, u32 sum (saturated), u32 bucket mask,
+ *              u32 per set bit of the mask
+ * The schema hash covers names and types, so a reader knows whether the
+ * names it got from `stats` match the snapshot.
+ */
+esp_err_t metrics_snapshot(uint8_t *buf, size_t len, size_t *out_len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // METRICS_H
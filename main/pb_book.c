@@ -0,0 +1,328 @@
+/*
+ * pb_book.c - on-flash phonebook file format
+ */
+
+#include "pb_book.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include "esp_log.h"
+#include "flash_sched.h"
+#include "metrics.h"
+
+static const char *TAG = "PB_BOOK";
+
+static metric_t *s_m_read_bytes;
+
+/* nibble values 0xA.. in order; 0xF pads an odd digit count */
+static const char s_dial_chars[] = "+*#,;";
+
+static const char *s_phone_types[] = {
+    [PB_PHONE_OTHER] = "OTHER",
+    [PB_PHONE_CELL]  = "CELL",
+    [PB_PHONE_HOME]  = "HOME",
+    [PB_PHONE_WORK]  = "WORK",
+    [PB_PHONE_FAX]   = "FAX",
+    [PB_PHONE_PAGER] = "PAGER",
+    [PB_PHONE_MAIN]  = "MAIN",
+    [PB_PHONE_VOICE] = "VOICE",
+};
+
+void pb_book_init(void)
+{
+    s_m_read_bytes = metrics_counter("pb.book_read_bytes");
+}
+
+static size_t pb_book_fread(void *buf, size_t size, size_t n, FILE *f)
+{
+    size_t got = fread(buf, size, n, f);
+    metrics_add(s_m_read_bytes, got * size);
+    return got;
+}
+
+/* first known type named in a vCard TYPE list such as "CELL,VOICE"; VOICE only on its own */
+static pb_phone_type_t pb_phone_type(const char *type)
+{
+    for (int t = PB_PHONE_CELL; t <= PB_PHONE_MAIN; t++) {
+        if (strcasestr(type, s_phone_types[t]) != NULL) {
+            return (pb_phone_type_t)t;
+        }
+    }
+    return strcasestr(type, "VOICE") ? PB_PHONE_VOICE : PB_PHONE_OTHER;
+}
+
+static int pb_nibble(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    const char *d = strchr(s_dial_chars, c);
+    return (c != '\0' && d != NULL) ? 0xA + (d - s_dial_chars) : -1;
+}
+
+size_t pb_record_encode(const contact_t *c, uint8_t *out)
+{
+    uint8_t *p = out;
+    size_t name_len = strnlen(c->full_name, MAX_NAME_LEN - 1);
+    *p++ = name_len;
+    memcpy(p, c->full_name, name_len);
+    p += name_len;
+
+    uint8_t count = c->phone_count > MAX_PHONES_PER_CONTACT ? MAX_PHONES_PER_CONTACT : c->phone_count;
+    *p++ = count;
+    for (int i = 0; i < count; i++) {
+        uint8_t *head = p++;
+        uint8_t digits = 0;
+        for (const char *s = c->phones[i].number; *s && digits < MAX_PHONE_LEN - 1; s++) {
+            int v = pb_nibble(*s);
+            if (v < 0) {
+                continue;
+            }
+            if (digits % 2 == 0) {
+                *p = v << 4 | 0xF;
+            } else {
+                *p = (*p & 0xF0) | v;
+                p++;
+            }
+            digits++;
+        }
+        if (digits % 2) {
+            p++;
+        }
+        *head = pb_phone_type(c->phones[i].type) << 5 | digits;
+    }
+    return p - out;
+}
+
+size_t pb_record_decode(const uint8_t *p, size_t len, contact_t *c)
+{
+    const uint8_t *start = p;
+    const uint8_t *end = p + len;
+    memset(c, 0, sizeof(*c));
+
+    if (end - p < 1 || p[0] >= MAX_NAME_LEN || end - p < 2 + p[0]) {
+        return 0;
+    }
+    memcpy(c->full_name, p + 1, p[0]);
+    p += 1 + p[0];
+
+    uint8_t count = *p++;
+    if (count > MAX_PHONES_PER_CONTACT) {
+        return 0;
+    }
+    for (int i = 0; i < count; i++) {
+        if (end - p < 1) {
+            return 0;
+        }
+        uint8_t type = *p >> 5;
+        uint8_t digits = *p++ & 0x1F;
+        if (end - p < (digits + 1) / 2) {
+            return 0;
+        }
+        char *s = c->phones[i].number;
+        for (int d = 0; d < digits; d++) {
+            int v = (d % 2 == 0) ? p[d / 2] >> 4 : p[d / 2] & 0xF;
+            *s++ = v < 0xA ? '0' + v : (v < 0xF ? s_dial_chars[v - 0xA] : '\0');
+        }
+        p += (digits + 1) / 2;
+        strcpy(c->phones[i].type, s_phone_types[type]);
+    }
+    c->phone_count = count;
+    c->active = true;
+    return p - start;
+}
+
+bool pb_block_add(pb_block_t *b, const uint8_t *rec, size_t len)
+{
+    if (b->hdr.len + len > PB_BLOCK_MAX) {
+        return false;
+    }
+    memcpy(b->data + b->hdr.len, rec, len);
+    b->hdr.len += len;
+    b->hdr.records++;
+    return true;
+}
+
+/* version 2 headers stop before the generation */
+static esp_err_t pb_book_header(FILE *f, pb_book_header_t *hdr, size_t *hdr_len)
+{
+    memset(hdr, 0, sizeof(*hdr));
+    if (pb_book_fread(hdr, PB_BOOK_V2_HEADER_SIZE, 1, f) != 1 || hdr->magic != PB_BOOK_MAGIC) {
+        return ESP_ERR_INVALID_VERSION;
+    }
+    if (hdr->version == 2) {
+        hdr->generation = 1;
+        *hdr_len = PB_BOOK_V2_HEADER_SIZE;
+        return ESP_OK;
+    }
+    if (hdr->version != PB_BOOK_VERSION ||
+        pb_book_fread(&hdr->generation, sizeof(hdr->generation), 1, f) != 1) {
+        return ESP_ERR_INVALID_VERSION;
+    }
+    *hdr_len = sizeof(*hdr);
+    return ESP_OK;
+}
+
+esp_err_t pb_book_read_header(const char *path, pb_book_header_t *hdr)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    size_t hdr_len;
+    esp_err_t err = pb_book_header(f, hdr, &hdr_len);
+    fclose(f);
+    return err;
+}
+
+esp_err_t pb_book_open(pb_book_reader_t *r, const char *path, uint16_t *count)
+{
+    memset(r, 0, sizeof(*r));
+    r->f = fopen(path, "rb");
+    if (r->f == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    pb_book_header_t hdr;
+    size_t hdr_len;
+    if (pb_book_header(r->f, &hdr, &hdr_len) != ESP_OK) {
+        pb_book_close(r);
+        return ESP_ERR_INVALID_VERSION;
+    }
+    r->data = malloc(PB_BLOCK_MAX);
+    if (r->data == NULL) {
+        pb_book_close(r);
+        return ESP_ERR_NO_MEM;
+    }
+    r->block_offset = hdr_len;
+    if (count) {
+        *count = hdr.contact_count;
+    }
+    return ESP_OK;
+}
+
+bool pb_book_next(pb_book_reader_t *r, contact_t *c, uint32_t *offset)
+{
+    for (;;) {
+        if (r->pos < r->len) {
+            size_t used = pb_record_decode(r->data + r->pos, r->len - r->pos, c);
+            if (used == 0) {
+                ESP_LOGW(TAG, "malformed record at %u", (unsigned)(r->block_offset + r->pos));
+                return false;
+            }
+            if (offset) {
+                *offset = r->block_offset + r->pos;
+            }
+            r->pos += used;
+            return true;
+        }
+        pb_block_header_t hdr;
+        if (pb_book_fread(&hdr, sizeof(hdr), 1, r->f) != 1 || hdr.len > PB_BLOCK_MAX ||
+            pb_book_fread(r->data, 1, hdr.len, r->f) != hdr.len) {
+            return false;
+        }
+        r->block_offset += r->len + sizeof(hdr);
+        r->len = hdr.len;
+        r->pos = 0;
+    }
+}
+
+void pb_book_close(pb_book_reader_t *r)
+{
+    if (r->f) {
+        fclose(r->f);
+    }
+    free(r->data);
+    memset(r, 0, sizeof(*r));
+}
+
+esp_err_t pb_book_read_at(FILE *f, uint32_t offset, contact_t *c)
+{
+    uint8_t rec[PB_RECORD_MAX];
+    if (fseek(f, offset, SEEK_SET) != 0) {
+        return ESP_FAIL;
+    }
+    // the record may end the file, so a short read is fine
+    size_t got = pb_book_fread(rec, 1, sizeof(rec), f);
+    return pb_record_decode(rec, got, c) ? ESP_OK : ESP_ERR_INVALID_SIZE;
+}
+
+/*
+    write the converted book to new_path and stamp it complete before the
+    old one is removed, so power lost at any point leaves one of them whole.
+    Every op goes through the same FIFO, so the removal reaches flash last.
+ */
+esp_err_t pb_book_migrate(const char *path, const char *new_path)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    uint32_t magic = 0;
+    uint16_t count = 0;
+    if (fread(&magic, sizeof(magic), 1, f) == 1 && magic == PB_BOOK_MAGIC) {
+        fclose(f);
+        return ESP_OK;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (fread(&count, sizeof(count), 1, f) != 1 ||
+        size != (long)(sizeof(count) + count * sizeof(contact_t))) {
+        fclose(f);
+        ESP_LOGW(TAG, "%s: unknown format, %ld bytes", path, size);
+        return ESP_ERR_INVALID_VERSION;
+    }
+
+    pb_book_header_t hdr = {
+        .magic = PB_BOOK_MAGIC,
+        .version = PB_BOOK_VERSION,
+    };
+    contact_t *c = malloc(sizeof(contact_t));
+    pb_block_t *b = calloc(1, sizeof(pb_block_t));
+    esp_err_t err = (c && b) ? flash_sched_create(new_path, &hdr, sizeof(hdr)) : ESP_ERR_NO_MEM;
+    for (uint16_t i = 0; i < count && err == ESP_OK; i++) {
+        if (fread(c, sizeof(contact_t), 1, f) != 1) {
+            err = ESP_FAIL;
+            break;
+        }
+        if (!c->active) {
+            continue;
+        }
+        c->full_name[MAX_NAME_LEN - 1] = '\0';
+        for (int j = 0; j < MAX_PHONES_PER_CONTACT; j++) {
+            c->phones[j].number[MAX_PHONE_LEN - 1] = '\0';
+            c->phones[j].type[sizeof(c->phones[j].type) - 1] = '\0';
+        }
+        uint8_t rec[PB_RECORD_MAX];
+        size_t len = pb_record_encode(c, rec);
+        if (!pb_block_add(b, rec, len)) {
+            err = flash_sched_append(new_path, b, pb_block_size(b));
+            memset(&b->hdr, 0, sizeof(b->hdr));
+            pb_block_add(b, rec, len);
+        }
+        hdr.contact_count++;
+    }
+    fclose(f);
+    if (err == ESP_OK && b->hdr.records > 0) {
+        err = flash_sched_append(new_path, b, pb_block_size(b));
+    }
+    if (err == ESP_OK) {
+        hdr.generation = 1;
+        err = flash_sched_write_at(new_path, 0, &hdr, sizeof(hdr));
+    }
+    if (err == ESP_OK) {
+        err = flash_sched_remove(path);
+    } else if (c && b) {
+        flash_sched_remove(new_path);
+    }
+    free(c);
+    free(b);
+    if (err == ESP_OK) {
+        flash_sched_flush(portMAX_DELAY);
+        struct stat st;
+        ESP_LOGI(TAG, "%s: converted %u contacts to %s, %ld -> %ld bytes", path, hdr.contact_count,
+                 new_path, size, stat(new_path, &st) == 0 ? (long)st.st_size : -1L);
+    }
+    return err;
+}
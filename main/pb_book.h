@@ -0,0 +1,123 @@
+/*
+ * pb_book.h - on-flash phonebook file format
+ *
+ * A book file is a header followed by blocks of variable-length contact
+ * records. Each block starts with its payload length and record count and
+ * holds whole records only, so a scan reads one block per fread and never
+ * has to stitch a record together.
+ *
+ * Record, packed:
+ *   u8 name length, name bytes (UTF-8, no terminator)
+ *   u8 number count
+ *   per number: u8 type << 5 | digit count, then the digits as BCD
+ *               nibbles, high nibble first, 0xF pad
+ *
+ * Numbers are stored normalized, so the nibble alphabet only needs the
+ * digits and a few dial characters. Phone types are reduced to the enum
+ * below; anything unrecognized becomes OTHER.
+ *
+ * The header's generation is written last, once the book and its indexes
+ * are complete; a book with generation 0 was cut short. Version 2 headers
+ * had no generation and are read as generation 1.
+ *
+ * Books written before the header existed (version 1: a u16 count then
+ * fixed-size contact_t records) are converted into the other slot at mount.
+ */
+
+#ifndef PB_BOOK_H
+#define PB_BOOK_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "phonebook.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PB_BOOK_MAGIC           0x4b4f4250  // "PBOK"
+#define PB_BOOK_VERSION         3
+#define PB_BOOK_V2_HEADER_SIZE  8
+#define PB_BLOCK_MAX            1024        // record bytes per block
+#define PB_RECORD_MAX           (2 + MAX_NAME_LEN + MAX_PHONES_PER_CONTACT * (1 + MAX_PHONE_LEN / 2))
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t contact_count;
+    uint32_t generation;    // 0 until the book is complete
+} pb_book_header_t;
+
+typedef struct {
+    uint16_t len;           // record bytes that follow
+    uint16_t records;
+} pb_block_header_t;
+
+typedef enum {
+    PB_PHONE_OTHER = 0,
+    PB_PHONE_CELL,
+    PB_PHONE_HOME,
+    PB_PHONE_WORK,
+    PB_PHONE_FAX,
+    PB_PHONE_PAGER,
+    PB_PHONE_MAIN,
+    PB_PHONE_VOICE,
+} pb_phone_type_t;
+
+// Block under construction; records are added until the next one would not fit
+typedef struct pb_block {
+    pb_block_header_t hdr;
+    uint8_t data[PB_BLOCK_MAX];
+} pb_block_t;
+
+typedef struct pb_book_reader {
+    FILE *f;
+    uint8_t *data;          // current block, PB_BLOCK_MAX bytes
+    uint32_t block_offset;  // file offset of the current block's records
+    uint16_t len;
+    uint16_t pos;
+} pb_book_reader_t;
+
+// Register the book metrics; called from phonebook_init()
+void pb_book_init(void);
+
+// Encode a contact; returns the record length, at most PB_RECORD_MAX
+size_t pb_record_encode(const contact_t *c, uint8_t *out);
+
+// Decode one record of at most len bytes; returns bytes used, 0 if malformed
+size_t pb_record_decode(const uint8_t *p, size_t len, contact_t *c);
+
+// Append an encoded record; false if the block is full and must be written first
+bool pb_block_add(pb_block_t *b, const uint8_t *rec, size_t len);
+
+// Bytes to write for the block, header included
+static inline size_t pb_block_size(const pb_block_t *b)
+{
+    return sizeof(b->hdr) + b->hdr.len;
+}
+
+// Read a book's header; fails with ESP_ERR_INVALID_VERSION for an unknown format
+esp_err_t pb_book_read_header(const char *path, pb_book_header_t *hdr);
+
+// Open a book for a sequential scan; fails with ESP_ERR_INVALID_VERSION for an unknown format
+esp_err_t pb_book_open(pb_book_reader_t *r, const char *path, uint16_t *count);
+
+// Next record and its file offset; false at the end of the book
+bool pb_book_next(pb_book_reader_t *r, contact_t *c, uint32_t *offset);
+
+void pb_book_close(pb_book_reader_t *r);
+
+// Read the record at a file offset taken from pb_book_next() or an index
+esp_err_t pb_book_read_at(FILE *f, uint32_t offset, contact_t *c);
+
+// Convert a version 1 book to the current format in new_path, as generation 1, then remove it;
+// ESP_OK without change if it already is in the current format
+esp_err_t pb_book_migrate(const char *path, const char *new_path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PB_BOOK_H
@@ -0,0 +1,77 @@
+/*
+ * pb_cache.c - caller-ID cache
+ */
+
+#include "pb_cache.h"
+#include <string.h>
+#include "metrics.h"
+#include "pb_index.h"
+
+static metric_t *s_m_hits;
+static metric_t *s_m_misses;
+
+static int32_t pb_cache_hit_pct(void)
+{
+    uint32_t hits = s_m_hits->counter;
+    uint32_t total = hits + s_m_misses->counter;
+    return total ? (int32_t)((uint64_t)hits * 100 / total) : 0;
+}
+
+void pb_cache_init(void)
+{
+    s_m_hits = metrics_counter("pb.cache_hits");
+    s_m_misses = metrics_counter("pb.cache_misses");
+    metrics_gauge_fn("pb.cache_hit_pct", pb_cache_hit_pct);
+}
+
+static pb_cache_entry_t *pb_cache_find(pb_cache_t *cache, const char *number, uint32_t hash)
+{
+    for (int i = 0; i < PB_CACHE_ENTRIES; i++) {
+        pb_cache_entry_t *e = &cache->entries[i];
+        if (e->used && e->hash == hash && strcmp(e->number, number) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+pb_cache_result_t pb_cache_get(pb_cache_t *cache, const char *number, contact_t *out)
+{
+    pb_cache_entry_t *e = pb_cache_find(cache, number, pb_number_hash(number));
+    if (e == NULL) {
+        metrics_inc(s_m_misses);
+        return PB_CACHE_MISS;
+    }
+    metrics_inc(s_m_hits);
+    e->used = ++cache->clock;
+    if (e->len == 0) {
+        return PB_CACHE_HIT_UNKNOWN;
+    }
+    pb_record_decode(e->rec, e->len, out);
+    return PB_CACHE_HIT;
+}
+
+void pb_cache_put(pb_cache_t *cache, const char *number, const contact_t *contact)
+{
+    uint32_t hash = pb_number_hash(number);
+    pb_cache_entry_t *e = pb_cache_find(cache, number, hash);
+    if (e == NULL) {
+        /* a free entry, else the least recently used */
+        e = &cache->entries[0];
+        for (int i = 1; i < PB_CACHE_ENTRIES && e->used; i++) {
+            if (cache->entries[i].used < e->used) {
+                e = &cache->entries[i];
+            }
+        }
+    }
+    e->hash = hash;
+    e->used = ++cache->clock;
+    strncpy(e->number, number, MAX_PHONE_LEN - 1);
+    e->number[MAX_PHONE_LEN - 1] = '\0';
+    e->len = contact ? pb_record_encode(contact, e->rec) : 0;
+}
+
+void pb_cache_clear(pb_cache_t *cache)
+{
+    memset(cache, 0, sizeof(*cache));
+}
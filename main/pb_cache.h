@@ -0,0 +1,60 @@
+/*
+ * pb_cache.h - caller-ID cache
+ *
+ * A few numbers make most calls, and a phone repeats the caller ID on
+ * every ring. Each phonebook keeps its last PB_CACHE_ENTRIES number
+ * lookups in RAM, keyed by the normalized number, with the contact kept
+ * as an encoded book record. Numbers that matched nobody are cached too,
+ * so an unknown caller does not go to flash on every ring either.
+ *
+ * The cache is only filled from a complete book and is cleared whenever
+ * that book changes, so it never answers from stale data. Callers hold
+ * the phonebook index lock.
+ */
+
+#ifndef PB_CACHE_H
+#define PB_CACHE_H
+
+#include "pb_book.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PB_CACHE_ENTRIES        8
+
+typedef enum {
+    PB_CACHE_MISS = 0,
+    PB_CACHE_HIT,           // out holds the contact
+    PB_CACHE_HIT_UNKNOWN,   // the number is known to match no contact
+} pb_cache_result_t;
+
+typedef struct {
+    uint32_t hash;
+    uint32_t used;          // LRU clock value of the last hit; 0 for a free entry
+    char number[MAX_PHONE_LEN];
+    uint8_t len;            // record length; 0 for an unknown number
+    uint8_t rec[PB_RECORD_MAX];
+} pb_cache_entry_t;
+
+typedef struct pb_cache {
+    uint32_t clock;
+    pb_cache_entry_t entries[PB_CACHE_ENTRIES];
+} pb_cache_t;
+
+// Register the cache metrics; called from phonebook_init()
+void pb_cache_init(void);
+
+// number must already be normalized
+pb_cache_result_t pb_cache_get(pb_cache_t *cache, const char *number, contact_t *out);
+
+// Remember the contact for a number, or with contact NULL that it is unknown
+void pb_cache_put(pb_cache_t *cache, const char *number, const contact_t *contact);
+
+void pb_cache_clear(pb_cache_t *cache);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PB_CACHE_H
@@ -0,0 +1,131 @@
+/*
+ * pb_fold.c - search keys for contact names
+ */
+
+#include "pb_fold.h"
+#include <stdint.h>
+#include <string.h>
+
+/* U+00C0..U+00FF; '1' for æ, '2' for þ, '3' for ß, '.' for × and ÷, which stay */
+static const char s_latin1[] =
+    "aaaaaa1ceeeeiiiidnooooo.ouuuuy23"
+    "aaaaaa1ceeeeiiiidnooooo.ouuuuy2y";
+
+/* U+0100..U+017F; '4' for ĳ, '5' for œ */
+static const char s_latin_ext_a[] =
+    "aaaaaa" "cccccccc" "dddd" "eeeeeeeeee" "gggggggg" "hhhh" "iiiiiiiiii" "44" "jj"
+    "kkk" "llllllllll" "nnnnnnnnn" "oooooo" "55" "rrrrrr" "ssssssss" "tttttt"
+    "uuuuuuuuuuuu" "ww" "yyy" "zzzzzz" "s";
+
+static const char *s_spelt[] = { "ae", "th", "ss", "ij", "oe" };
+
+/* decode one UTF-8 character; a stray byte decodes as itself */
+static uint32_t pb_utf8_next(const uint8_t **p)
+{
+    const uint8_t *s = *p;
+    int n = s[0] >= 0xF0 ? 3 : s[0] >= 0xE0 ? 2 : s[0] >= 0xC0 ? 1 : 0;
+    uint32_t cp = n ? s[0] & (0x3F >> n) : s[0];
+    for (int i = 1; i <= n; i++) {
+        if ((s[i] & 0xC0) != 0x80) {
+            *p = s + 1;
+            return s[0];
+        }
+        cp = cp << 6 | (s[i] & 0x3F);
+    }
+    *p = s + 1 + n;
+    return cp;
+}
+
+static size_t pb_utf8_put(uint32_t cp, char *out)
+{
+    if (cp < 0x80) {
+        out[0] = cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        out[0] = 0xC0 | cp >> 6;
+        out[1] = 0x80 | (cp & 0x3F);
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = 0xE0 | cp >> 12;
+        out[1] = 0x80 | (cp >> 6 & 0x3F);
+        out[2] = 0x80 | (cp & 0x3F);
+        return 3;
+    }
+    out[0] = 0xF0 | cp >> 18;
+    out[1] = 0x80 | (cp >> 12 & 0x3F);
+    out[2] = 0x80 | (cp >> 6 & 0x3F);
+    out[3] = 0x80 | (cp & 0x3F);
+    return 4;
+}
+
+/* Greek and Cyrillic: lower case, without tonos */
+static uint32_t pb_fold_other(uint32_t cp)
+{
+    static const uint16_t tonos[][2] = {
+        { 0x0386, 0x03B1 }, { 0x0388, 0x03B5 }, { 0x0389, 0x03B7 }, { 0x038A, 0x03B9 },
+        { 0x038C, 0x03BF }, { 0x038E, 0x03C5 }, { 0x038F, 0x03C9 }, { 0x03AC, 0x03B1 },
+        { 0x03AD, 0x03B5 }, { 0x03AE, 0x03B7 }, { 0x03AF, 0x03B9 }, { 0x03CC, 0x03BF },
+        { 0x03CD, 0x03C5 }, { 0x03CE, 0x03C9 }, { 0x03C2, 0x03C3 },
+    };
+    if (cp >= 0x0391 && cp <= 0x03A9) {
+        return cp + 0x20;
+    }
+    if (cp >= 0x0410 && cp <= 0x042F) {
+        return cp + 0x20;
+    }
+    if (cp >= 0x0400 && cp <= 0x040F) {
+        return cp + 0x50;
+    }
+    for (size_t i = 0; i < sizeof(tonos) / sizeof(tonos[0]); i++) {
+        if (tonos[i][0] == cp) {
+            return tonos[i][1];
+        }
+    }
+    return cp;
+}
+
+size_t pb_fold(const char *s, char *out, size_t out_size)
+{
+    const uint8_t *p = (const uint8_t *)s;
+    size_t n = 0;
+    while (*p == ' ') {
+        p++;
+    }
+    while (*p) {
+        uint32_t cp = pb_utf8_next(&p);
+        char buf[4];
+        const char *add = buf;
+        size_t len = 1;
+        char c = 0;
+        if (cp < 0x80) {
+            buf[0] = (cp >= 'A' && cp <= 'Z') ? cp + 0x20 : cp;
+        } else if (cp >= 0x0300 && cp <= 0x036F) {
+            continue;       // combining marks, as in decomposed names
+        } else if (cp >= 0x00C0 && cp <= 0x00FF) {
+            c = s_latin1[cp - 0x00C0];
+        } else if (cp >= 0x0100 && cp <= 0x017F) {
+            c = s_latin_ext_a[cp - 0x0100];
+        } else {
+            len = pb_utf8_put(pb_fold_other(cp), buf);
+        }
+        if (c == '.') {
+            len = pb_utf8_put(cp, buf);
+        } else if (c >= '1' && c <= '5') {
+            add = s_spelt[c - '1'];
+            len = 2;
+        } else if (c) {
+            buf[0] = c;
+        }
+        if (n + len >= out_size) {
+            break;
+        }
+        memcpy(out + n, add, len);
+        n += len;
+    }
+    if (out_size > 0) {
+        out[n] = '\0';
+    }
+    return n;
+}
@@ -0,0 +1,35 @@
+/*
+ * pb_fold.h - search keys for contact names
+ *
+ * Names come from phones as UTF-8. A search key is the name folded so that
+ * names a user would call the same compare equal byte for byte: lower case,
+ * accents and other marks stripped from Latin letters (É and é become e),
+ * ligatures and sharp s spelt out (Æ as ae, ß as ss), and Greek and
+ * Cyrillic capitals lowered with their tonos marks removed. Other scripts
+ * are kept as they are. Leading spaces are dropped.
+ *
+ * Keys are made once per contact while the indexes are built. A query folds
+ * its text the same way and then compares plain bytes, and a name's bucket
+ * in the alphabetical index is that of its key's first byte, so Émile is
+ * listed under E and Øystein under O.
+ */
+
+#ifndef PB_FOLD_H
+#define PB_FOLD_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PB_FOLD_MAX             64      // key bytes with the NUL; longer keys are cut at a character
+
+// Fold a NUL-terminated UTF-8 string into out; returns the key length
+size_t pb_fold(const char *s, char *out, size_t out_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PB_FOLD_H
@@ -0,0 +1,447 @@
+/*
+ * pb_fuzzy.c - typo-tolerant name search over a trigram index
+ *
+ * File layout: header, search key position of every contact in book
+ * order, directory of where each bucket's list starts (one more entry
+ * than buckets), then the lists, 16-bit contact ordinals.
+ */
+
+#include "pb_fuzzy.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "flash_sched.h"
+#include "metrics.h"
+#include "pb_index.h"
+#include "pb_fold.h"
+
+#define PB_TRIGRAM_WRITE_POS    512     // key positions batched per flash write, 2 KB
+#define PB_TRIGRAM_WRITE_LIST   1024    // list entries batched per flash write, 2 KB
+#define PB_TRIGRAM_DIR_CHUNK    256     // directory entries written at once, 1 KB
+#define PB_TRIGRAM_READ_LIST    128     // list entries read per fread
+#define PB_TRIGRAM_READ_POS     64      // key positions read per fread, one page
+
+static const char *TAG = "PB_FUZZY";
+
+static metric_t *s_m_search_us;
+static metric_t *s_m_verified;
+
+typedef struct {
+    uint16_t bucket;
+    uint16_t ordinal;       // contact's place in the book
+} pb_trigram_entry_t;
+
+typedef struct {
+    const char *path;
+    long dir_pos;                   // file position of the directory
+    uint32_t *dir;                  // PB_TRIGRAM_DIR_CHUNK entries of it
+    uint32_t next_bucket;           // first bucket whose start is not known yet
+    uint16_t *out;                  // PB_TRIGRAM_WRITE_LIST entries
+    uint32_t n;                     // list entries emitted so far
+    uint32_t pending;
+} pb_trigram_emit_t;
+
+void pb_fuzzy_init(void)
+{
+    s_m_search_us = metrics_hist("pb.fuzzy_us");
+    s_m_verified = metrics_counter("pb.fuzzy_verified");
+}
+
+static uint16_t pb_trigram_bucket(const char *t)
+{
+    uint32_t v = (uint32_t)(uint8_t)t[0] << 16 | (uint32_t)(uint8_t)t[1] << 8 | (uint8_t)t[2];
+    return (v * 2654435761u >> 16) % PB_TRIGRAM_BUCKETS;
+}
+
+// Buckets of a key's trigrams, each once and in order; a stored key is padded at both ends, a query in front only
+static int pb_trigrams(const char *key, bool pad_end, uint16_t *out)
+{
+    char buf[PB_FOLD_MAX + 2];
+    size_t len = strnlen(key, PB_FOLD_MAX - 1);
+    buf[0] = ' ';
+    memcpy(buf + 1, key, len);
+    len++;
+    if (pad_end) {
+        buf[len++] = ' ';
+    }
+    int n = 0;
+    for (size_t i = 0; i + 3 <= len; i++) {
+        uint16_t g = pb_trigram_bucket(buf + i);
+        int j = n;
+        while (j > 0 && out[j - 1] > g) {
+            j--;
+        }
+        if (j > 0 && out[j - 1] == g) {
+            continue;
+        }
+        memmove(out + j + 1, out + j, (n - j) * sizeof(out[0]));
+        out[j] = g;
+        n++;
+    }
+    return n;
+}
+
+static int pb_trigram_entry_cmp(const void *a, const void *b)
+{
+    const pb_trigram_entry_t *x = a;
+    const pb_trigram_entry_t *y = b;
+    if (x->bucket != y->bucket) {
+        return x->bucket - y->bucket;
+    }
+    return x->ordinal - y->ordinal;
+}
+
+/* the header goes in last, once the counts are known */
+esp_err_t pb_fuzzy_index_begin(pb_fuzzy_builder_t *b, const char *path)
+{
+    memset(b, 0, sizeof(*b));
+    pb_index_header_t hdr = { 0 };
+    b->path = path;
+    b->key_pos = malloc(PB_TRIGRAM_WRITE_POS * sizeof(uint32_t));
+    if (b->key_pos == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    esp_err_t err = pb_sort_begin(&b->sort, "tri", sizeof(pb_trigram_entry_t), pb_trigram_entry_cmp);
+    if (err == ESP_OK) {
+        err = flash_sched_create(path, &hdr, sizeof(hdr));
+        if (err != ESP_OK) {
+            pb_sort_abort(&b->sort);
+        }
+    }
+    if (err != ESP_OK) {
+        free(b->key_pos);
+        b->key_pos = NULL;
+    }
+    return err;
+}
+
+esp_err_t pb_fuzzy_index_add(pb_fuzzy_builder_t *b, const char *key, uint32_t key_pos)
+{
+    if (b->entries > UINT16_MAX) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    esp_err_t err = ESP_OK;
+    uint16_t grams[PB_FOLD_MAX];
+    int n = pb_trigrams(key, true, grams);
+    for (int i = 0; i < n && err == ESP_OK; i++) {
+        pb_trigram_entry_t e = { .bucket = grams[i], .ordinal = b->entries };
+        err = pb_sort_add(&b->sort, &e);
+    }
+    if (err != ESP_OK) {
+        return err;
+    }
+    b->key_pos[b->pending++] = key_pos;
+    b->entries++;
+    if (b->pending == PB_TRIGRAM_WRITE_POS) {
+        b->pending = 0;
+        return flash_sched_append(b->path, b->key_pos, PB_TRIGRAM_WRITE_POS * sizeof(uint32_t));
+    }
+    return ESP_OK;
+}
+
+// Directory entries up to bucket start at the current list entry; each full chunk goes to flash
+static esp_err_t pb_trigram_dir_fill(pb_trigram_emit_t *em, uint32_t bucket)
+{
+    while (em->next_bucket <= bucket) {
+        em->dir[em->next_bucket % PB_TRIGRAM_DIR_CHUNK] = em->n;
+        em->next_bucket++;
+        if (em->next_bucket % PB_TRIGRAM_DIR_CHUNK == 0) {
+            long pos = em->dir_pos + (long)((em->next_bucket - PB_TRIGRAM_DIR_CHUNK) * sizeof(uint32_t));
+            esp_err_t err = flash_sched_write_at(em->path, pos, em->dir, PB_TRIGRAM_DIR_CHUNK * sizeof(uint32_t));
+            if (err != ESP_OK) {
+                return err;
+            }
+        }
+    }
+    return ESP_OK;
+}
+
+static esp_err_t pb_trigram_emit(const void *rec, void *ctx)
+{
+    pb_trigram_emit_t *em = (pb_trigram_emit_t *)ctx;
+    const pb_trigram_entry_t *e = rec;
+    esp_err_t err = pb_trigram_dir_fill(em, e->bucket);
+    if (err != ESP_OK) {
+        return err;
+    }
+    em->out[em->pending++] = e->ordinal;
+    em->n++;
+    if (em->pending == PB_TRIGRAM_WRITE_LIST) {
+        em->pending = 0;
+        return flash_sched_append(em->path, em->out, PB_TRIGRAM_WRITE_LIST * sizeof(uint16_t));
+    }
+    return ESP_OK;
+}
+
+esp_err_t pb_fuzzy_index_finish(pb_fuzzy_builder_t *b, uint32_t book_size)
+{
+    pb_trigram_emit_t em = {
+        .path = b->path,
+        .dir_pos = sizeof(pb_index_header_t) + b->entries * sizeof(uint32_t),
+        .dir = calloc(PB_TRIGRAM_DIR_CHUNK, sizeof(uint32_t)),
+        .out = malloc(PB_TRIGRAM_WRITE_LIST * sizeof(uint16_t)),
+    };
+    esp_err_t err = ESP_ERR_NO_MEM;
+    if (em.dir == NULL || em.out == NULL) {
+        pb_sort_abort(&b->sort);
+        flash_sched_remove(b->path);
+        goto out;
+    }
+
+    /* the last key positions and a directory placeholder, then the lists, filling in the directory */
+    err = b->pending ? flash_sched_append(b->path, b->key_pos, b->pending * sizeof(uint32_t)) : ESP_OK;
+    for (uint32_t i = 0; i <= PB_TRIGRAM_BUCKETS && err == ESP_OK; i += PB_TRIGRAM_DIR_CHUNK) {
+        uint32_t n = PB_TRIGRAM_BUCKETS + 1 - i < PB_TRIGRAM_DIR_CHUNK ? PB_TRIGRAM_BUCKETS + 1 - i : PB_TRIGRAM_DIR_CHUNK;
+        err = flash_sched_append(b->path, em.dir, n * sizeof(uint32_t));
+    }
+    if (err != ESP_OK) {
+        pb_sort_abort(&b->sort);
+        flash_sched_remove(b->path);
+        goto out;
+    }
+    err = pb_sort_finish(&b->sort, pb_trigram_emit, &em);
+    if (err == ESP_OK && em.pending > 0) {
+        err = flash_sched_append(b->path, em.out, em.pending * sizeof(uint16_t));
+    }
+    if (err == ESP_OK) {
+        err = pb_trigram_dir_fill(&em, PB_TRIGRAM_BUCKETS);
+    }
+    if (err == ESP_OK && em.next_bucket % PB_TRIGRAM_DIR_CHUNK != 0) {
+        uint32_t n = em.next_bucket % PB_TRIGRAM_DIR_CHUNK;
+        long pos = em.dir_pos + (long)((em.next_bucket - n) * sizeof(uint32_t));
+        err = flash_sched_write_at(b->path, pos, em.dir, n * sizeof(uint32_t));
+    }
+    pb_index_header_t hdr = {
+        .magic = PB_INDEX_MAGIC,
+        .version = PB_TRIGRAM_INDEX_VERSION,
+        .block_entries = PB_TRIGRAM_BUCKETS,
+        .entries = b->entries,
+        .blocks = em.n,
+        .book_size = book_size,
+    };
+    if (err == ESP_OK) {
+        err = flash_sched_write_at(b->path, 0, &hdr, sizeof(hdr));
+    }
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "trigram index: %u contacts, %u list entries", (unsigned)hdr.entries, (unsigned)hdr.blocks);
+    } else {
+        flash_sched_remove(b->path);
+    }
+
+out:
+    free(em.dir);
+    free(em.out);
+    free(b->key_pos);
+    b->key_pos = NULL;
+    return err;
+}
+
+void pb_fuzzy_index_abort(pb_fuzzy_builder_t *b)
+{
+    pb_sort_abort(&b->sort);
+    free(b->key_pos);
+    b->key_pos = NULL;
+    flash_sched_remove(b->path);
+}
+
+static bool pb_fuzzy_read_header(FILE *f, uint32_t book_size, pb_index_header_t *hdr)
+{
+    return fread(hdr, sizeof(*hdr), 1, f) == 1 && hdr->magic == PB_INDEX_MAGIC &&
+           hdr->version == PB_TRIGRAM_INDEX_VERSION && hdr->block_entries == PB_TRIGRAM_BUCKETS &&
+           hdr->book_size == book_size;
+}
+
+bool pb_fuzzy_index_current(const char *path, uint32_t book_size)
+{
+    pb_index_header_t hdr;
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return false;
+    }
+    bool current = pb_fuzzy_read_header(f, book_size, &hdr);
+    fclose(f);
+    return current;
+}
+
+// Edits between the query and the closest substring of the key, that is with the key's ends free;
+// swapping two neighbouring bytes counts as one edit
+static int pb_fuzzy_distance(const char *q, size_t m, const char *key)
+{
+    uint8_t cols[3][PB_FOLD_MAX];   // edits for the first i query bytes, ending two, one and no key bytes back
+    uint8_t *back2 = cols[0], *back = cols[1], *col = cols[2];
+    for (size_t i = 0; i <= m; i++) {
+        back[i] = i;
+    }
+    int best = m;
+    for (size_t j = 0; key[j]; j++) {
+        col[0] = 0;
+        for (size_t i = 1; i <= m; i++) {
+            uint8_t d = back[i - 1] + (q[i - 1] != key[j]);
+            if (back[i] + 1 < d) {
+                d = back[i] + 1;
+            }
+            if (col[i - 1] + 1 < d) {
+                d = col[i - 1] + 1;
+            }
+            if (i > 1 && j > 0 && q[i - 1] == key[j - 1] && q[i - 2] == key[j] && back2[i - 2] + 1 < d) {
+                d = back2[i - 2] + 1;
+            }
+            col[i] = d;
+        }
+        if (col[m] < best) {
+            best = col[m];
+        }
+        uint8_t *t = back2;
+        back2 = back;
+        back = col;
+        col = t;
+    }
+    return best;
+}
+
+// Whether a is ranked before b
+static bool pb_fuzzy_better(const pb_fuzzy_hit_t *a, uint8_t a_len, uint32_t a_ord,
+                            const pb_fuzzy_hit_t *b, uint8_t b_len, uint32_t b_ord)
+{
+    if (a->distance != b->distance) {
+        return a->distance < b->distance;
+    }
+    if (a->shared != b->shared) {
+        return a->shared > b->shared;
+    }
+    if (a_len != b_len) {
+        return a_len < b_len;
+    }
+    return a_ord < b_ord;
+}
+
+int pb_fuzzy_search(const char *path, const char *keys_path, uint32_t book_size, const char *query,
+                    pb_fuzzy_hit_t *hits, int max, uint32_t budget_us, bool *complete)
+{
+    int64_t t0 = esp_timer_get_time();
+    if (complete) {
+        *complete = true;
+    }
+    uint16_t grams[PB_FOLD_MAX];
+    size_t qlen = strnlen(query, PB_FOLD_MAX - 1);
+    int ng = pb_trigrams(query, false, grams);
+    if (ng == 0 || max <= 0) {
+        return 0;
+    }
+    if (max > PB_FUZZY_MAX_HITS) {
+        max = PB_FUZZY_MAX_HITS;
+    }
+    // a typo in every third byte at most, and none in the shortest queries
+    int allowed = qlen < 4 ? 0 : qlen < 7 ? 1 : PB_FUZZY_MAX_DISTANCE;
+    int need = ng - 3 * allowed > 1 ? ng - 3 * allowed : 1;
+
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return 0;
+    }
+    pb_index_header_t hdr;
+    pb_key_reader_t keys = { 0 };
+    uint8_t *shared = NULL;
+    uint8_t lens[PB_FUZZY_MAX_HITS];    // key lengths and ordinals of the hits, for ranking
+    uint32_t ords[PB_FUZZY_MAX_HITS];
+    char key[PB_FOLD_MAX];
+    uint32_t pos[PB_TRIGRAM_READ_POS];  // key positions of a run of contacts, read a page at a time
+    uint32_t pos_first = UINT32_MAX;
+    int found = 0;
+    if (!pb_fuzzy_read_header(f, book_size, &hdr) || hdr.entries == 0 ||
+        (shared = calloc(hdr.entries, 1)) == NULL ||
+        pb_key_index_open(&keys, keys_path, book_size) != ESP_OK) {
+        goto out;
+    }
+
+    /* count each contact's trigrams in common with the query, one list per trigram */
+    long dir_pos = sizeof(hdr) + hdr.entries * sizeof(uint32_t);
+    long list_pos = dir_pos + (PB_TRIGRAM_BUCKETS + 1) * sizeof(uint32_t);
+    uint16_t list[PB_TRIGRAM_READ_LIST];
+    uint8_t most = 0;
+    for (int g = 0; g < ng; g++) {
+        uint32_t range[2];
+        if (fseek(f, dir_pos + (long)(grams[g] * sizeof(uint32_t)), SEEK_SET) != 0 ||
+            fread(range, sizeof(range), 1, f) != 1 || range[0] > range[1] || range[1] > hdr.blocks ||
+            fseek(f, list_pos + (long)(range[0] * sizeof(uint16_t)), SEEK_SET) != 0) {
+            goto out;
+        }
+        for (uint32_t left = range[1] - range[0]; left > 0; ) {
+            uint32_t want = left < PB_TRIGRAM_READ_LIST ? left : PB_TRIGRAM_READ_LIST;
+            if (fread(list, sizeof(list[0]), want, f) != want) {
+                goto out;
+            }
+            for (uint32_t i = 0; i < want; i++) {
+                if (list[i] < hdr.entries && ++shared[list[i]] > most) {
+                    most = shared[list[i]];
+                }
+            }
+            left -= want;
+        }
+    }
+
+    /* verify the candidates, most trigrams in common first, until the budget runs out */
+    for (int level = most; level >= need; level--) {
+        // a typo costs four trigrams at most, so a name sharing level of them has this many at least;
+        // stop once none can displace the last hit
+        int fewest = (ng - level + 3) / 4;
+        if (found == max && (hits[max - 1].distance < fewest ||
+                             (hits[max - 1].distance == fewest && hits[max - 1].shared > level))) {
+            break;
+        }
+        for (uint32_t i = 0; i < hdr.entries; i++) {
+            if (shared[i] != level) {
+                continue;
+            }
+            if (budget_us && esp_timer_get_time() - t0 > budget_us) {
+                if (complete) {
+                    *complete = false;
+                }
+                goto out;
+            }
+            if (i < pos_first || i - pos_first >= PB_TRIGRAM_READ_POS) {
+                uint32_t want = hdr.entries - i < PB_TRIGRAM_READ_POS ? hdr.entries - i : PB_TRIGRAM_READ_POS;
+                pos_first = i;
+                if (fseek(f, sizeof(hdr) + i * sizeof(uint32_t), SEEK_SET) != 0 ||
+                    fread(pos, sizeof(pos[0]), want, f) != want) {
+                    goto out;
+                }
+            }
+            uint32_t offset;
+            if (!pb_key_index_read_at(&keys, pos[i - pos_first], key, &offset)) {
+                continue;
+            }
+            metrics_inc(s_m_verified);
+            pb_fuzzy_hit_t hit = {
+                .offset = offset,
+                .distance = pb_fuzzy_distance(query, qlen, key),
+                .shared = level,
+            };
+            uint8_t len = strlen(key);
+            if (hit.distance > allowed ||
+                (found == max && !pb_fuzzy_better(&hit, len, i, &hits[max - 1], lens[max - 1], ords[max - 1]))) {
+                continue;
+            }
+            int j = found < max ? found++ : max - 1;
+            for (; j > 0 && pb_fuzzy_better(&hit, len, i, &hits[j - 1], lens[j - 1], ords[j - 1]); j--) {
+                hits[j] = hits[j - 1];
+                lens[j] = lens[j - 1];
+                ords[j] = ords[j - 1];
+            }
+            hits[j] = hit;
+            lens[j] = len;
+            ords[j] = i;
+        }
+    }
+
+out:
+    if (keys.f) {
+        pb_key_index_close(&keys);
+    }
+    free(shared);
+    fclose(f);
+    metrics_observe(s_m_search_us, (uint32_t)(esp_timer_get_time() - t0));
+    return found;
+}
@@ -0,0 +1,87 @@
+/*
+ * pb_fuzzy.h - typo-tolerant name search over a trigram index
+ *
+ * Every search key (pb_fold.h) is cut into trigrams, three-byte windows
+ * over the key padded with a space at either end, so "ann lee" gives
+ * " an", "ann", "nn ", "n l", " le", "lee" and "ee ". A trigram is hashed
+ * to one of PB_TRIGRAM_BUCKETS buckets, and the index holds, per bucket,
+ * the sorted list of contacts (by book ordinal) with a trigram in it. It
+ * is built from the same pass as the other indexes and sorted with
+ * pb_sort, so RAM use does not grow with the book.
+ *
+ * A query is padded in front only, since the user may not have finished
+ * the word, and reads the lists of its own trigrams into one counter per
+ * contact. An insert, delete or change touches at most three of the
+ * query's trigrams, so a name within k of them shares all but 3k at least,
+ * and no other contact is looked at. The candidates are verified most
+ * shared trigrams first, by reading their key from the search keys file
+ * and computing the edit distance between the query and the closest part
+ * of the key. A swap of neighbouring bytes counts as one typo there; it
+ * touches four trigrams, so in a short query with another typo it can be
+ * missed. Matches within the allowed distance are kept in a top-K list
+ * ranked by distance, then shared trigrams, then shorter names, then book
+ * order.
+ *
+ * Reading the lists is bounded by the query length; verifying is where
+ * a vague query costs, so it stops once a time budget is spent and the
+ * best matches found so far are returned. That keeps a search run on
+ * every keystroke within a fixed latency.
+ */
+
+#ifndef PB_FUZZY_H
+#define PB_FUZZY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "pb_sort.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PB_TRIGRAM_INDEX_VERSION    1
+#define PB_TRIGRAM_BUCKETS          4096        // 16 KB directory; collisions only cost a verify
+#define PB_FUZZY_MAX_DISTANCE       2           // edits allowed in a query of 7 bytes or more
+#define PB_FUZZY_MAX_HITS           16          // most matches one search ranks
+
+typedef struct {
+    pb_sort_t sort;
+    const char *path;
+    uint32_t *key_pos;      // search key positions waiting to be written
+    uint16_t pending;
+    uint32_t entries;       // contacts added
+} pb_fuzzy_builder_t;
+
+typedef struct {
+    uint32_t offset;        // record offset in the book file
+    uint8_t distance;       // edits between the query and the closest part of the name
+    uint8_t shared;         // trigrams the name shares with the query
+} pb_fuzzy_hit_t;
+
+// Register the fuzzy search metrics; called from phonebook_init()
+void pb_fuzzy_init(void);
+
+// path must outlive the builder
+esp_err_t pb_fuzzy_index_begin(pb_fuzzy_builder_t *b, const char *path);
+
+// Add the next contact in book order: its search key and where the key sits in the search keys file
+esp_err_t pb_fuzzy_index_add(pb_fuzzy_builder_t *b, const char *key, uint32_t key_pos);
+
+esp_err_t pb_fuzzy_index_finish(pb_fuzzy_builder_t *b, uint32_t book_size);
+
+void pb_fuzzy_index_abort(pb_fuzzy_builder_t *b);
+
+// Whether the index matches the book; a quick check of its header
+bool pb_fuzzy_index_current(const char *path, uint32_t book_size);
+
+// Best matches for a folded query, best first, at most PB_FUZZY_MAX_HITS; returns how many were stored.
+// budget_us bounds the verifying, 0 for none; *complete is cleared when it ran out.
+int pb_fuzzy_search(const char *path, const char *keys_path, uint32_t book_size, const char *query,
+                    pb_fuzzy_hit_t *hits, int max, uint32_t budget_us, bool *complete);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PB_FUZZY_H
@@ -0,0 +1,542 @@
+/*
+ * pb_index.c - on-flash phonebook indexes
+ */
+
+#include "pb_index.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/stat.h>
+#include "esp_log.h"
+#include "flash_sched.h"
+#include "metrics.h"
+#include "pb_fold.h"
+
+#define PB_INDEX_WRITE_BLOCKS   8       // blocks batched per flash write while building
+#define PB_NAME_WRITE_ENTRIES   128     // name entries batched per flash write, 2 KB
+#define PB_NAME_READ_ENTRIES    16      // name entries read per fread, one page
+#define PB_KEY_WRITE_BYTES      2048    // search keys batched per flash write
+
+static const char *TAG = "PB_INDEX";
+
+static metric_t *s_m_read_bytes;
+
+typedef struct {
+    const char *path;
+    uint32_t *fence;
+    pb_number_entry_t *out;     // PB_INDEX_WRITE_BLOCKS blocks
+    uint32_t n;                 // entries emitted so far
+    uint32_t pending;           // entries in out
+} pb_number_emit_t;
+
+typedef struct {
+    const char *path;
+    uint32_t *jump;
+    pb_name_entry_t *out;       // PB_NAME_WRITE_ENTRIES entries
+    uint32_t n;
+    uint32_t pending;
+    int next_bucket;            // first bucket whose start is not known yet
+} pb_name_emit_t;
+
+void pb_index_init(void)
+{
+    s_m_read_bytes = metrics_counter("pb.index_read_bytes");
+}
+
+uint32_t pb_number_hash(const char *number)
+{
+    uint32_t h = 2166136261u;
+    for (const char *c = number; *c; c++) {
+        h = (h ^ (uint8_t)*c) * 16777619u;
+    }
+    return h;
+}
+
+static int pb_number_entry_cmp(const void *a, const void *b)
+{
+    const pb_number_entry_t *x = a;
+    const pb_number_entry_t *y = b;
+    if (x->hash != y->hash) {
+        return x->hash < y->hash ? -1 : 1;
+    }
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+static size_t pb_index_fread(void *buf, size_t size, size_t n, FILE *f)
+{
+    size_t got = fread(buf, size, n, f);
+    metrics_add(s_m_read_bytes, got * size);
+    return got;
+}
+
+esp_err_t pb_number_index_begin(pb_number_builder_t *b)
+{
+    return pb_sort_begin(&b->sort, "num", sizeof(pb_number_entry_t), pb_number_entry_cmp);
+}
+
+esp_err_t pb_number_index_add(pb_number_builder_t *b, const char *number, uint32_t offset)
+{
+    pb_number_entry_t e = {
+        .hash = pb_number_hash(number),
+        .offset = offset,
+    };
+    return pb_sort_add(&b->sort, &e);
+}
+
+static esp_err_t pb_number_emit(const void *rec, void *ctx)
+{
+    pb_number_emit_t *em = (pb_number_emit_t *)ctx;
+    const pb_number_entry_t *e = rec;
+    if (em->n % PB_NUMBER_BLOCK_ENTRIES == 0) {
+        em->fence[em->n / PB_NUMBER_BLOCK_ENTRIES] = e->hash;
+    }
+    em->out[em->pending++] = *e;
+    em->n++;
+    if (em->pending == PB_INDEX_WRITE_BLOCKS * PB_NUMBER_BLOCK_ENTRIES) {
+        em->pending = 0;
+        return flash_sched_append(em->path, em->out, sizeof(em->out[0]) * PB_INDEX_WRITE_BLOCKS * PB_NUMBER_BLOCK_ENTRIES);
+    }
+    return ESP_OK;
+}
+
+esp_err_t pb_number_index_finish(pb_number_builder_t *b, const char *path, uint32_t book_size)
+{
+    pb_index_header_t hdr = {
+        .magic = PB_INDEX_MAGIC,
+        .version = PB_NUMBER_INDEX_VERSION,
+        .block_entries = PB_NUMBER_BLOCK_ENTRIES,
+        .entries = b->sort.total,
+        .blocks = (b->sort.total + PB_NUMBER_BLOCK_ENTRIES - 1) / PB_NUMBER_BLOCK_ENTRIES,
+        .book_size = book_size,
+    };
+    pb_number_emit_t em = {
+        .path = path,
+        .fence = calloc(hdr.blocks ? hdr.blocks : 1, sizeof(uint32_t)),
+        .out = malloc(sizeof(pb_number_entry_t) * PB_INDEX_WRITE_BLOCKS * PB_NUMBER_BLOCK_ENTRIES),
+    };
+    esp_err_t err = ESP_ERR_NO_MEM;
+    if (em.fence == NULL || em.out == NULL) {
+        pb_sort_abort(&b->sort);
+        goto out;
+    }
+
+    /* header and a fence placeholder, then the sorted entries, then the real fence */
+    if ((err = flash_sched_create(path, &hdr, sizeof(hdr))) != ESP_OK ||
+        (err = flash_sched_append(path, em.fence, hdr.blocks * sizeof(uint32_t))) != ESP_OK) {
+        pb_sort_abort(&b->sort);
+        goto out;
+    }
+    err = pb_sort_finish(&b->sort, pb_number_emit, &em);
+    if (err == ESP_OK && em.pending > 0) {
+        err = flash_sched_append(path, em.out, sizeof(em.out[0]) * em.pending);
+    }
+    if (err == ESP_OK) {
+        err = flash_sched_write_at(path, sizeof(hdr), em.fence, hdr.blocks * sizeof(uint32_t));
+    }
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "number index: %u entries in %u blocks", (unsigned)hdr.entries, (unsigned)hdr.blocks);
+    } else {
+        flash_sched_remove(path);
+    }
+
+out:
+    free(em.fence);
+    free(em.out);
+    return err;
+}
+
+void pb_number_index_abort(pb_number_builder_t *b)
+{
+    pb_sort_abort(&b->sort);
+}
+
+esp_err_t pb_number_index_load(pb_number_index_t *idx, const char *path, uint32_t book_size)
+{
+    pb_number_index_unload(idx);
+
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    pb_index_header_t hdr;
+    esp_err_t err = ESP_ERR_INVALID_STATE;
+    if (pb_index_fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != PB_INDEX_MAGIC ||
+        hdr.version != PB_NUMBER_INDEX_VERSION || hdr.block_entries != PB_NUMBER_BLOCK_ENTRIES ||
+        hdr.book_size != book_size) {
+        goto out;
+    }
+    /* a damaged header must not size the allocation: the counts have to agree with each other and the file */
+    struct stat st;
+    if (hdr.blocks != (hdr.entries + (uint64_t)PB_NUMBER_BLOCK_ENTRIES - 1) / PB_NUMBER_BLOCK_ENTRIES ||
+        fstat(fileno(f), &st) != 0 ||
+        (uint64_t)st.st_size != sizeof(hdr) + (uint64_t)hdr.blocks * sizeof(uint32_t) +
+                                (uint64_t)hdr.entries * sizeof(pb_number_entry_t)) {
+        ESP_LOGW(TAG, "number index %s: header does not match the file, ignored", path);
+        goto out;
+    }
+    uint32_t *fence = malloc((hdr.blocks ? hdr.blocks : 1) * sizeof(uint32_t));
+    if (fence == NULL) {
+        err = ESP_ERR_NO_MEM;
+        goto out;
+    }
+    if (pb_index_fread(fence, sizeof(uint32_t), hdr.blocks, f) != hdr.blocks) {
+        free(fence);
+        goto out;
+    }
+    idx->fence = fence;
+    idx->entries = hdr.entries;
+    idx->blocks = hdr.blocks;
+    idx->loaded = true;
+    err = ESP_OK;
+
+out:
+    fclose(f);
+    return err;
+}
+
+void pb_number_index_unload(pb_number_index_t *idx)
+{
+    free(idx->fence);
+    memset(idx, 0, sizeof(*idx));
+}
+
+int pb_number_index_find(const pb_number_index_t *idx, const char *path, uint32_t hash,
+                         uint32_t *offsets, int max)
+{
+    if (!idx->loaded || idx->blocks == 0) {
+        return 0;
+    }
+
+    /* the first entry with this hash is in the last block whose fence is below it, or the next */
+    uint32_t lo = 0, hi = idx->blocks;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (idx->fence[mid] < hash) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0 && idx->fence[0] != hash) {
+        return 0;
+    }
+    uint32_t b = lo ? lo - 1 : 0;
+
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return 0;
+    }
+    int found = 0;
+    long base = sizeof(pb_index_header_t) + idx->blocks * sizeof(uint32_t);
+    pb_number_entry_t block[PB_NUMBER_BLOCK_ENTRIES];
+    for (; b < idx->blocks; b++) {
+        uint32_t n = idx->entries - b * PB_NUMBER_BLOCK_ENTRIES;
+        if (n > PB_NUMBER_BLOCK_ENTRIES) {
+            n = PB_NUMBER_BLOCK_ENTRIES;
+        }
+        if (fseek(f, base + (long)(b * sizeof(block)), SEEK_SET) != 0 ||
+            pb_index_fread(block, sizeof(block[0]), n, f) != n) {
+            break;
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            if (block[i].hash < hash) {
+                continue;
+            }
+            if (block[i].hash > hash) {
+                goto out;
+            }
+            if (found < max) {
+                offsets[found++] = block[i].offset;
+            }
+        }
+    }
+out:
+    fclose(f);
+    return found;
+}
+
+int pb_name_bucket(char c)
+{
+    c = toupper((unsigned char)c);
+    return (c >= 'A' && c <= 'Z') ? c - 'A' : PB_NAME_BUCKETS - 1;
+}
+
+static int pb_name_entry_cmp(const void *a, const void *b)
+{
+    const pb_name_entry_t *x = a;
+    const pb_name_entry_t *y = b;
+    int bx = pb_name_bucket(x->key[0]);
+    int by = pb_name_bucket(y->key[0]);
+    if (bx != by) {
+        return bx - by;
+    }
+    int c = memcmp(x->key, y->key, PB_NAME_KEY_LEN);
+    if (c != 0) {
+        return c;
+    }
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+esp_err_t pb_name_index_begin(pb_name_builder_t *b)
+{
+    return pb_sort_begin(&b->sort, "name", sizeof(pb_name_entry_t), pb_name_entry_cmp);
+}
+
+esp_err_t pb_name_index_add(pb_name_builder_t *b, const char *key, uint32_t offset)
+{
+    pb_name_entry_t e = { .offset = offset };
+    memcpy(e.key, key, strnlen(key, PB_NAME_KEY_LEN));     // the rest stays zero from the initializer
+    return pb_sort_add(&b->sort, &e);
+}
+
+static esp_err_t pb_name_emit(const void *rec, void *ctx)
+{
+    pb_name_emit_t *em = (pb_name_emit_t *)ctx;
+    const pb_name_entry_t *e = rec;
+    int bucket = pb_name_bucket(e->key[0]);
+    while (em->next_bucket <= bucket) {
+        em->jump[em->next_bucket++] = em->n;
+    }
+    em->out[em->pending++] = *e;
+    em->n++;
+    if (em->pending == PB_NAME_WRITE_ENTRIES) {
+        em->pending = 0;
+        return flash_sched_append(em->path, em->out, sizeof(em->out[0]) * PB_NAME_WRITE_ENTRIES);
+    }
+    return ESP_OK;
+}
+
+esp_err_t pb_name_index_finish(pb_name_builder_t *b, const char *path, uint32_t book_size)
+{
+    pb_index_header_t hdr = {
+        .magic = PB_INDEX_MAGIC,
+        .version = PB_NAME_INDEX_VERSION,
+        .block_entries = PB_NAME_KEY_LEN,
+        .entries = b->sort.total,
+        .blocks = PB_NAME_BUCKETS,
+        .book_size = book_size,
+    };
+    uint32_t jump[PB_NAME_BUCKETS + 1] = {0};
+    pb_name_emit_t em = {
+        .path = path,
+        .jump = jump,
+        .out = malloc(sizeof(pb_name_entry_t) * PB_NAME_WRITE_ENTRIES),
+    };
+    esp_err_t err = ESP_ERR_NO_MEM;
+    if (em.out == NULL) {
+        pb_sort_abort(&b->sort);
+        return err;
+    }
+
+    /* header and a jump table placeholder, then the sorted entries, then the real table */
+    if ((err = flash_sched_create(path, &hdr, sizeof(hdr))) != ESP_OK ||
+        (err = flash_sched_append(path, jump, sizeof(jump))) != ESP_OK) {
+        pb_sort_abort(&b->sort);
+        goto out;
+    }
+    err = pb_sort_finish(&b->sort, pb_name_emit, &em);
+    if (err == ESP_OK && em.pending > 0) {
+        err = flash_sched_append(path, em.out, sizeof(em.out[0]) * em.pending);
+    }
+    while (em.next_bucket <= PB_NAME_BUCKETS) {
+        jump[em.next_bucket++] = em.n;
+    }
+    if (err == ESP_OK) {
+        err = flash_sched_write_at(path, sizeof(hdr), jump, sizeof(jump));
+    }
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "name index: %u entries", (unsigned)hdr.entries);
+    } else {
+        flash_sched_remove(path);
+    }
+
+out:
+    free(em.out);
+    return err;
+}
+
+void pb_name_index_abort(pb_name_builder_t *b)
+{
+    pb_sort_abort(&b->sort);
+}
+
+esp_err_t pb_name_index_load(pb_name_index_t *idx, const char *path, uint32_t book_size)
+{
+    pb_name_index_unload(idx);
+
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    pb_index_header_t hdr;
+    esp_err_t err = ESP_ERR_INVALID_STATE;
+    if (pb_index_fread(&hdr, sizeof(hdr), 1, f) == 1 && hdr.magic == PB_INDEX_MAGIC &&
+        hdr.version == PB_NAME_INDEX_VERSION && hdr.block_entries == PB_NAME_KEY_LEN &&
+        hdr.blocks == PB_NAME_BUCKETS && hdr.book_size == book_size &&
+        pb_index_fread(idx->jump, sizeof(idx->jump), 1, f) == 1 &&
+        idx->jump[PB_NAME_BUCKETS] == hdr.entries) {
+        idx->entries = hdr.entries;
+        idx->loaded = true;
+        err = ESP_OK;
+    }
+    fclose(f);
+    return err;
+}
+
+void pb_name_index_unload(pb_name_index_t *idx)
+{
+    memset(idx, 0, sizeof(*idx));
+}
+
+uint32_t pb_name_index_read(const pb_name_index_t *idx, const char *path, uint32_t first,
+                            uint32_t n, uint32_t *offsets)
+{
+    if (!idx->loaded || first >= idx->entries) {
+        return 0;
+    }
+    if (n > idx->entries - first) {
+        n = idx->entries - first;
+    }
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return 0;
+    }
+    long base = sizeof(pb_index_header_t) + sizeof(idx->jump);
+    uint32_t got = 0;
+    pb_name_entry_t page[PB_NAME_READ_ENTRIES];
+    if (fseek(f, base + (long)(first * sizeof(pb_name_entry_t)), SEEK_SET) == 0) {
+        while (got < n) {
+            uint32_t want = n - got < PB_NAME_READ_ENTRIES ? n - got : PB_NAME_READ_ENTRIES;
+            uint32_t r = pb_index_fread(page, sizeof(page[0]), want, f);
+            for (uint32_t i = 0; i < r; i++) {
+                offsets[got++] = page[i].offset;
+            }
+            if (r != want) {
+                break;
+            }
+        }
+    }
+    fclose(f);
+    return got;
+}
+
+/* the header goes in last, once the entry count is known */
+esp_err_t pb_key_index_begin(pb_key_builder_t *b, const char *path)
+{
+    memset(b, 0, sizeof(*b));
+    pb_index_header_t hdr = { 0 };
+    b->path = path;
+    b->size = sizeof(hdr);
+    b->buf = malloc(PB_KEY_WRITE_BYTES);
+    if (b->buf == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    esp_err_t err = flash_sched_create(path, &hdr, sizeof(hdr));
+    if (err != ESP_OK) {
+        free(b->buf);
+        b->buf = NULL;
+    }
+    return err;
+}
+
+esp_err_t pb_key_index_add(pb_key_builder_t *b, const char *key, uint32_t offset)
+{
+    size_t len = strnlen(key, PB_FOLD_MAX - 1);
+    if (b->len + sizeof(offset) + 1 + len > PB_KEY_WRITE_BYTES) {
+        esp_err_t err = flash_sched_append(b->path, b->buf, b->len);
+        b->len = 0;
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+    memcpy(b->buf + b->len, &offset, sizeof(offset));
+    b->buf[b->len + sizeof(offset)] = len;
+    memcpy(b->buf + b->len + sizeof(offset) + 1, key, len);
+    b->len += sizeof(offset) + 1 + len;
+    b->size += sizeof(offset) + 1 + len;
+    b->entries++;
+    return ESP_OK;
+}
+
+uint32_t pb_key_index_tell(const pb_key_builder_t *b)
+{
+    return b->size;
+}
+
+esp_err_t pb_key_index_finish(pb_key_builder_t *b, uint32_t book_size)
+{
+    pb_index_header_t hdr = {
+        .magic = PB_INDEX_MAGIC,
+        .version = PB_KEY_INDEX_VERSION,
+        .entries = b->entries,
+        .book_size = book_size,
+    };
+    esp_err_t err = b->len ? flash_sched_append(b->path, b->buf, b->len) : ESP_OK;
+    if (err == ESP_OK) {
+        err = flash_sched_write_at(b->path, 0, &hdr, sizeof(hdr));
+    }
+    free(b->buf);
+    b->buf = NULL;
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "search keys: %u entries", (unsigned)hdr.entries);
+    } else {
+        flash_sched_remove(b->path);
+    }
+    return err;
+}
+
+void pb_key_index_abort(pb_key_builder_t *b)
+{
+    free(b->buf);
+    b->buf = NULL;
+    flash_sched_remove(b->path);
+}
+
+esp_err_t pb_key_index_open(pb_key_reader_t *r, const char *path, uint32_t book_size)
+{
+    memset(r, 0, sizeof(*r));
+    r->f = fopen(path, "rb");
+    if (r->f == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    pb_index_header_t hdr;
+    if (pb_index_fread(&hdr, sizeof(hdr), 1, r->f) != 1 || hdr.magic != PB_INDEX_MAGIC ||
+        hdr.version != PB_KEY_INDEX_VERSION || hdr.book_size != book_size) {
+        pb_key_index_close(r);
+        return ESP_ERR_INVALID_STATE;
+    }
+    r->left = hdr.entries;
+    return ESP_OK;
+}
+
+bool pb_key_index_next(pb_key_reader_t *r, char *key, uint32_t *offset)
+{
+    uint8_t head[sizeof(uint32_t) + 1];
+    if (r->left == 0 || pb_index_fread(head, sizeof(head), 1, r->f) != 1 ||
+        head[sizeof(uint32_t)] >= PB_FOLD_MAX ||
+        pb_index_fread(key, 1, head[sizeof(uint32_t)], r->f) != head[sizeof(uint32_t)]) {
+        return false;
+    }
+    memcpy(offset, head, sizeof(uint32_t));
+    key[head[sizeof(uint32_t)]] = '\0';
+    r->left--;
+    return true;
+}
+
+bool pb_key_index_read_at(pb_key_reader_t *r, uint32_t pos, char *key, uint32_t *offset)
+{
+    if (fseek(r->f, pos, SEEK_SET) != 0) {
+        return false;
+    }
+    r->left = 1;
+    return pb_key_index_next(r, key, offset);
+}
+
+void pb_key_index_close(pb_key_reader_t *r)
+{
+    if (r->f) {
+        fclose(r->f);
+    }
+    memset(r, 0, sizeof(*r));
+}
@@ -0,0 +1,175 @@
+/*
+ * pb_index.h - on-flash phonebook indexes
+ *
+ * Number index: one entry per stored number, (hash of the normalized
+ * number, byte offset of its contact record), sorted by hash and packed
+ * in blocks of one SPIFFS page. The first hash of every block (the fence)
+ * is kept in RAM once loaded, so a lookup reads a single block and then
+ * the candidate records; hash collisions are resolved by comparing the
+ * number in the record itself.
+ *
+ * Name index: one entry per contact, (collation key, record offset), in
+ * alphabetical order: A to Z, then names that do not start with a letter,
+ * as phones list them. A jump table of where each of the 27 first-letter
+ * buckets starts is kept in RAM, so listing a letter or the Nth page of
+ * the book is a seek to a known entry. Keys are the names' search keys
+ * (pb_fold.h) cut to PB_NAME_KEY_LEN bytes; names equal that far keep
+ * their book order.
+ *
+ * Search keys: the whole search key of every contact with its record
+ * offset, in book order, a length byte per key. A name search reads this
+ * file instead of decoding the book, compares bytes, and reads only the
+ * records that match.
+ *
+ * Indexes are built from a full pass over the book at the end of a sync,
+ * sorted externally with pb_sort, and written through the flash scheduler.
+ * Each records the size of the book it was built from and is ignored if
+ * the book no longer matches.
+ */
+
+#ifndef PB_INDEX_H
+#define PB_INDEX_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "pb_sort.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PB_INDEX_MAGIC              0x58444950  // "PIDX"
+#define PB_NUMBER_INDEX_VERSION     1
+#define PB_NUMBER_BLOCK_ENTRIES     32          // 256 bytes, one SPIFFS page
+#define PB_NAME_INDEX_VERSION       2           // 2: keys folded with pb_fold
+#define PB_KEY_INDEX_VERSION        1
+#define PB_NAME_KEY_LEN             12          // 16-byte entries, 16 per SPIFFS page
+#define PB_NAME_BUCKETS             27          // A..Z, then '#' for everything else
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t block_entries;
+    uint32_t entries;
+    uint32_t blocks;        // number index: fence length; name index: jump table buckets
+    uint32_t book_size;     // size of the book file the index was built from
+} pb_index_header_t;
+
+typedef struct {
+    uint32_t hash;
+    uint32_t offset;        // byte offset of the contact record in the book file
+} pb_number_entry_t;
+
+typedef struct {
+    bool loaded;
+    uint32_t entries;
+    uint32_t blocks;
+    uint32_t *fence;        // first hash of each block
+} pb_number_index_t;
+
+typedef struct {
+    pb_sort_t sort;
+} pb_number_builder_t;
+
+typedef struct {
+    char key[PB_NAME_KEY_LEN];  // not NUL terminated when the name fills it
+    uint32_t offset;
+} pb_name_entry_t;
+
+typedef struct {
+    bool loaded;
+    uint32_t entries;
+    uint32_t jump[PB_NAME_BUCKETS + 1];     // first entry of each bucket, then entries
+} pb_name_index_t;
+
+typedef struct {
+    pb_sort_t sort;
+} pb_name_builder_t;
+
+typedef struct {
+    const char *path;
+    uint8_t *buf;           // entries waiting to be written
+    uint16_t len;
+    uint32_t entries;
+    uint32_t size;          // of the file once buf is written, header included
+} pb_key_builder_t;
+
+typedef struct pb_key_reader {
+    FILE *f;
+    uint32_t left;          // entries not read yet
+} pb_key_reader_t;
+
+// Register the index metrics; called from phonebook_init()
+void pb_index_init(void);
+
+uint32_t pb_number_hash(const char *number);
+
+esp_err_t pb_number_index_begin(pb_number_builder_t *b);
+
+// number must already be normalized
+esp_err_t pb_number_index_add(pb_number_builder_t *b, const char *number, uint32_t offset);
+
+esp_err_t pb_number_index_finish(pb_number_builder_t *b, const char *path, uint32_t book_size);
+
+void pb_number_index_abort(pb_number_builder_t *b);
+
+// Load the fence; fails with ESP_ERR_INVALID_STATE if the index is stale or missing
+esp_err_t pb_number_index_load(pb_number_index_t *idx, const char *path, uint32_t book_size);
+
+void pb_number_index_unload(pb_number_index_t *idx);
+
+// Record offsets of the numbers with this hash; returns how many were stored in offsets
+int pb_number_index_find(const pb_number_index_t *idx, const char *path, uint32_t hash,
+                         uint32_t *offsets, int max);
+
+// Bucket of a first letter: 0..25 for A..Z in either case, 26 for anything else
+int pb_name_bucket(char c);
+
+esp_err_t pb_name_index_begin(pb_name_builder_t *b);
+
+// key is the name's search key
+esp_err_t pb_name_index_add(pb_name_builder_t *b, const char *key, uint32_t offset);
+
+esp_err_t pb_name_index_finish(pb_name_builder_t *b, const char *path, uint32_t book_size);
+
+void pb_name_index_abort(pb_name_builder_t *b);
+
+// Load the jump table; fails with ESP_ERR_INVALID_STATE if the index is stale or missing
+esp_err_t pb_name_index_load(pb_name_index_t *idx, const char *path, uint32_t book_size);
+
+void pb_name_index_unload(pb_name_index_t *idx);
+
+// Record offsets of entries first..first+n-1 in alphabetical order; returns how many were read
+uint32_t pb_name_index_read(const pb_name_index_t *idx, const char *path, uint32_t first,
+                            uint32_t n, uint32_t *offsets);
+
+// path must outlive the builder
+esp_err_t pb_key_index_begin(pb_key_builder_t *b, const char *path);
+
+esp_err_t pb_key_index_add(pb_key_builder_t *b, const char *key, uint32_t offset);
+
+// Position the next key added will be written at, for indexes that point into the keys
+uint32_t pb_key_index_tell(const pb_key_builder_t *b);
+
+esp_err_t pb_key_index_finish(pb_key_builder_t *b, uint32_t book_size);
+
+void pb_key_index_abort(pb_key_builder_t *b);
+
+// Fails with ESP_ERR_INVALID_STATE if the keys are stale or missing
+esp_err_t pb_key_index_open(pb_key_reader_t *r, const char *path, uint32_t book_size);
+
+// Next key in book order, NUL terminated; key must hold PB_FOLD_MAX bytes
+bool pb_key_index_next(pb_key_reader_t *r, char *key, uint32_t *offset);
+
+// The key at a position given by pb_key_index_tell(); the reader is no longer in book order
+bool pb_key_index_read_at(pb_key_reader_t *r, uint32_t pos, char *key, uint32_t *offset);
+
+void pb_key_index_close(pb_key_reader_t *r);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PB_INDEX_H
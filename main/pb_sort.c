@@ -0,0 +1,205 @@
+/*
+ * pb_sort.c - external merge sort of fixed-size records in bounded RAM
+ */
+
+#include "pb_sort.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "esp_log.h"
+#include "flash_sched.h"
+
+#ifndef PB_SORT_DIR
+#define PB_SORT_DIR             "/spiffs"
+#endif
+
+// "<dir>/<tag><run>.srt" with the longest tag and a 10-digit run number
+#define PB_SORT_PATH_LEN        (sizeof(PB_SORT_DIR) + sizeof(((pb_sort_t *)0)->tag) + 10 + sizeof(".srt"))
+
+static const char *TAG = "PB_SORT";
+
+typedef struct {
+    pb_sort_t *s;
+    char path[PB_SORT_PATH_LEN];
+    uint32_t n;             // records waiting in s->buf
+} pb_sort_out_t;
+
+static void pb_sort_run_path(const pb_sort_t *s, uint32_t run, char *path, size_t len)
+{
+    snprintf(path, len, "%s/%s%u.srt", PB_SORT_DIR, s->tag, (unsigned)run);
+}
+
+static esp_err_t pb_sort_write_run(pb_sort_t *s)
+{
+    char path[PB_SORT_PATH_LEN];
+    qsort(s->buf, s->n, s->rec_size, s->cmp);
+    pb_sort_run_path(s, s->run_hi, path, sizeof(path));
+    esp_err_t err = flash_sched_create(path, s->buf, s->n * s->rec_size);
+    if (err == ESP_OK) {
+        s->run_hi++;
+        s->n = 0;
+    }
+    return err;
+}
+
+esp_err_t pb_sort_begin(pb_sort_t *s, const char *tag, size_t rec_size, pb_sort_cmp_t cmp)
+{
+    memset(s, 0, sizeof(*s));
+    strncpy(s->tag, tag, sizeof(s->tag) - 1);
+    s->rec_size = rec_size;
+    s->cmp = cmp;
+    s->cap = PB_SORT_RAM / rec_size;
+    s->buf = malloc(s->cap * rec_size);
+    if (s->buf == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+esp_err_t pb_sort_add(pb_sort_t *s, const void *rec)
+{
+    if (s->n == s->cap) {
+        esp_err_t err = pb_sort_write_run(s);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+    memcpy(s->buf + s->n * s->rec_size, rec, s->rec_size);
+    s->n++;
+    s->total++;
+    return ESP_OK;
+}
+
+/* merge runs first..first+ways-1 into emit */
+static esp_err_t pb_sort_merge(pb_sort_t *s, uint32_t first, uint32_t ways, pb_sort_emit_t emit, void *ctx)
+{
+    FILE *f[PB_SORT_MAX_WAYS] = {0};
+    bool valid[PB_SORT_MAX_WAYS] = {0};
+    uint8_t *head = malloc(ways * s->rec_size);
+    esp_err_t err = ESP_OK;
+    if (head == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    for (uint32_t i = 0; i < ways; i++) {
+        char path[PB_SORT_PATH_LEN];
+        pb_sort_run_path(s, first + i, path, sizeof(path));
+        f[i] = fopen(path, "rb");
+        if (f[i] == NULL) {
+            ESP_LOGE(TAG, "cannot open run %s", path);
+            err = ESP_FAIL;
+            goto out;
+        }
+        valid[i] = fread(head + i * s->rec_size, s->rec_size, 1, f[i]) == 1;
+    }
+
+    for (;;) {
+        int min = -1;
+        for (uint32_t i = 0; i < ways; i++) {
+            if (valid[i] && (min < 0 || s->cmp(head + i * s->rec_size, head + min * s->rec_size) < 0)) {
+                min = i;
+            }
+        }
+        if (min < 0) {
+            break;
+        }
+        err = emit(head + min * s->rec_size, ctx);
+        if (err != ESP_OK) {
+            break;
+        }
+        valid[min] = fread(head + min * s->rec_size, s->rec_size, 1, f[min]) == 1;
+    }
+
+out:
+    for (uint32_t i = 0; i < ways; i++) {
+        if (f[i] != NULL) {
+            fclose(f[i]);
+        }
+    }
+    free(head);
+    return err;
+}
+
+/* emit for intermediate passes: batch records in the idle run buffer */
+static esp_err_t pb_sort_out_emit(const void *rec, void *ctx)
+{
+    pb_sort_out_t *out = (pb_sort_out_t *)ctx;
+    pb_sort_t *s = out->s;
+    memcpy(s->buf + out->n * s->rec_size, rec, s->rec_size);
+    if (++out->n == s->cap) {
+        esp_err_t err = flash_sched_append(out->path, s->buf, out->n * s->rec_size);
+        out->n = 0;
+        return err;
+    }
+    return ESP_OK;
+}
+
+static void pb_sort_release(pb_sort_t *s)
+{
+    for (uint32_t run = s->run_lo; run < s->run_hi; run++) {
+        char path[PB_SORT_PATH_LEN];
+        pb_sort_run_path(s, run, path, sizeof(path));
+        flash_sched_remove(path);
+    }
+    s->run_lo = s->run_hi = 0;
+    free(s->buf);
+    s->buf = NULL;
+}
+
+esp_err_t pb_sort_finish(pb_sort_t *s, pb_sort_emit_t emit, void *ctx)
+{
+    esp_err_t err = ESP_OK;
+
+    if (s->run_hi == 0) {
+        /* everything fit in RAM */
+        qsort(s->buf, s->n, s->rec_size, s->cmp);
+        for (uint32_t i = 0; i < s->n && err == ESP_OK; i++) {
+            err = emit(s->buf + i * s->rec_size, ctx);
+        }
+        pb_sort_release(s);
+        return err;
+    }
+
+    if (s->n > 0 && (err = pb_sort_write_run(s)) != ESP_OK) {
+        goto out;
+    }
+    ESP_LOGI(TAG, "%s: %u records in %u runs", s->tag, (unsigned)s->total, (unsigned)(s->run_hi - s->run_lo));
+
+    while (s->run_hi - s->run_lo > PB_SORT_MAX_WAYS) {
+        pb_sort_out_t out = { .s = s };
+        pb_sort_run_path(s, s->run_hi, out.path, sizeof(out.path));
+        flash_sched_flush(portMAX_DELAY);
+        if ((err = flash_sched_create(out.path, NULL, 0)) != ESP_OK) {
+            goto out;
+        }
+        s->run_hi++;
+        err = pb_sort_merge(s, s->run_lo, PB_SORT_MAX_WAYS, pb_sort_out_emit, &out);
+        if (err == ESP_OK && out.n > 0) {
+            err = flash_sched_append(out.path, s->buf, out.n * s->rec_size);
+        }
+        if (err != ESP_OK) {
+            goto out;
+        }
+        for (uint32_t i = 0; i < PB_SORT_MAX_WAYS; i++) {
+            char path[PB_SORT_PATH_LEN];
+            pb_sort_run_path(s, s->run_lo++, path, sizeof(path));
+            flash_sched_remove(path);
+        }
+    }
+
+    flash_sched_flush(portMAX_DELAY);
+    err = pb_sort_merge(s, s->run_lo, s->run_hi - s->run_lo, emit, ctx);
+
+out:
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "%s: sort failed (%s)", s->tag, esp_err_to_name(err));
+    }
+    pb_sort_release(s);
+    return err;
+}
+
+void pb_sort_abort(pb_sort_t *s)
+{
+    pb_sort_release(s);
+}
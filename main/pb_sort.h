@@ -0,0 +1,54 @@
+/*
+ * pb_sort.h - external merge sort of fixed-size records in bounded RAM
+ *
+ * Records are collected in a RAM buffer; each time it fills it is sorted
+ * and written out as a run file through the flash scheduler. finish()
+ * merges the runs, at most PB_SORT_MAX_WAYS at a time so the open file
+ * count stays within the SPIFFS limit, and hands the records to the
+ * caller in order. A sort that fits in the buffer never touches flash.
+ */
+
+#ifndef PB_SORT_H
+#define PB_SORT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PB_SORT_RAM             8192    // run buffer; also the merge output buffer
+#define PB_SORT_MAX_WAYS        3       // runs open at once while merging
+
+typedef int (*pb_sort_cmp_t)(const void *a, const void *b);
+typedef esp_err_t (*pb_sort_emit_t)(const void *rec, void *ctx);
+
+typedef struct {
+    char tag[8];            // run files are /spiffs/<tag><n>.srt
+    size_t rec_size;
+    pb_sort_cmp_t cmp;
+    uint8_t *buf;
+    uint32_t cap;           // records that fit in buf
+    uint32_t n;             // records in buf
+    uint32_t run_lo;        // runs on flash are numbered run_lo..run_hi-1
+    uint32_t run_hi;
+    uint32_t total;
+} pb_sort_t;
+
+esp_err_t pb_sort_begin(pb_sort_t *s, const char *tag, size_t rec_size, pb_sort_cmp_t cmp);
+
+esp_err_t pb_sort_add(pb_sort_t *s, const void *rec);
+
+// Emit every record in order, then release the sorter; emit may stop it early with an error
+esp_err_t pb_sort_finish(pb_sort_t *s, pb_sort_emit_t emit, void *ctx);
+
+// Release the sorter and its run files without emitting
+void pb_sort_abort(pb_sort_t *s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PB_SORT_H
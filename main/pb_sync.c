@@ -0,0 +1,383 @@
+/*
+ * pb_sync.c - incremental phonebook sync state
+ */
+
+#include "pb_sync.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/stat.h>
+#include "esp_log.h"
+#include "flash_sched.h"
+
+static const char *TAG = "PB_SYNC";
+
+/* FNV-1a over the name exactly as listed, escapes and all */
+static uint32_t name_hash(const char *name)
+{
+    uint32_t h = 2166136261u;
+    for (const char *c = name; *c; c++) {
+        h = (h ^ (uint8_t)*c) * 16777619u;
+    }
+    return h;
+}
+
+/* The state file with its header checked; NULL if there is none or it is unreadable */
+static FILE *open_state(const esp_bd_addr_t addr, pb_sync_header_t *hdr)
+{
+    char path[64];
+    phonebook_file_path(addr, ".pbs", path, sizeof(path));
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return NULL;
+    }
+    if (fread(hdr, sizeof(*hdr), 1, f) != 1 || hdr->magic != PB_SYNC_MAGIC || hdr->version != PB_SYNC_VERSION) {
+        fclose(f);
+        return NULL;
+    }
+    return f;
+}
+
+static bool read_entry(FILE *f, pb_sync_entry_t *e)
+{
+    return f != NULL && fread(e, sizeof(*e), 1, f) == 1;
+}
+
+pb_sync_plan_t pb_sync_plan(phonebook_t *pb, const pb_sync_versions_t *now)
+{
+    pb_sync_header_t hdr;
+    FILE *f = open_state(pb->device_addr, &hdr);
+    if (f == NULL) {
+        ESP_LOGI(TAG, "No sync state, full download");
+        return PB_SYNC_PLAN_FULL;
+    }
+    fclose(f);
+
+    if ((now->flags & PB_SYNC_HAS_DB_ID) &&
+        (!(hdr.flags & PB_SYNC_HAS_DB_ID) || memcmp(hdr.db_id, now->db_id, PB_SYNC_ID_LEN) != 0)) {
+        ESP_LOGI(TAG, "Database identifier changed, full download");
+        return PB_SYNC_PLAN_FULL;
+    }
+    if (hdr.book_generation != pb->generation || hdr.records != pb->contact_count) {
+        ESP_LOGW(TAG, "Sync state describes book %u of %d records, book %u has %d; full download",
+                 (unsigned)hdr.book_generation, hdr.records, (unsigned)pb->generation, pb->contact_count);
+        return PB_SYNC_PLAN_FULL;
+    }
+    if (!phonebook_indexes_current(pb)) {
+        ESP_LOGI(TAG, "Book indexes missing or outdated, full download");
+        return PB_SYNC_PLAN_FULL;
+    }
+    if (hdr.deltas >= PB_SYNC_MAX_DELTAS) {
+        ESP_LOGI(TAG, "%d delta syncs since the last full one, full download", hdr.deltas);
+        return PB_SYNC_PLAN_FULL;
+    }
+    if ((now->flags & PB_SYNC_HAS_VERSION) && (hdr.flags & PB_SYNC_HAS_VERSION) &&
+        memcmp(hdr.folder_version, now->version, PB_SYNC_ID_LEN) == 0 && hdr.size == now->size) {
+        return PB_SYNC_PLAN_NONE;
+    }
+    return PB_SYNC_PLAN_LISTING;
+}
+
+static void listing_flush(pb_listing_t *l)
+{
+    if (l->batched == 0) {
+        return;
+    }
+    char path[64];
+    phonebook_file_path(l->addr, ".pbl", path, sizeof(path));
+    esp_err_t err = flash_sched_append(path, l->batch, l->batched * sizeof(l->batch[0]));
+    if (err != ESP_OK && l->err == ESP_OK) {
+        l->err = err;
+    }
+    l->batched = 0;
+}
+
+/* Value of attribute name in elem, cut to out_len; false if it is missing */
+static bool listing_attr(const char *elem, const char *name, char *out, size_t out_len)
+{
+    size_t name_len = strlen(name);
+    for (const char *p = strstr(elem, name); p != NULL; p = strstr(p + 1, name)) {
+        if (p == elem || !isspace((unsigned char)p[-1])) {
+            continue;
+        }
+        const char *v = p + name_len;
+        while (isspace((unsigned char)*v)) v++;
+        if (*v++ != '=') {
+            continue;
+        }
+        while (isspace((unsigned char)*v)) v++;
+        char quote = *v++;
+        if (quote != '"' && quote != '\'') {
+            continue;
+        }
+        size_t n = 0;
+        while (*v && *v != quote && n < out_len - 1) {
+            out[n++] = *v++;
+        }
+        out[n] = '\0';
+        return true;
+    }
+    return false;
+}
+
+/* <card handle="1A.vcf" name="Doe;John"/> */
+static void listing_element(pb_listing_t *l)
+{
+    char handle[16], name[PB_LISTING_ELEMENT_MAX];
+    if (strncmp(l->elem, "card", 4) != 0 || !isspace((unsigned char)l->elem[4]) ||
+        !listing_attr(l->elem, "handle", handle, sizeof(handle))) {
+        return;
+    }
+    if (!listing_attr(l->elem, "name", name, sizeof(name))) {
+        name[0] = '\0';
+    }
+    // handles are hexadecimal
+    uint32_t h = strtoul(handle, NULL, 16);
+    if (l->count > 0 && h <= l->last_handle) {
+        l->ordered = false;
+    }
+    l->last_handle = h;
+    l->count++;
+
+    pb_sync_entry_t *e = &l->batch[l->batched++];
+    e->handle = h;
+    e->name_hash = name_hash(name);
+    e->record = PB_SYNC_NO_RECORD;
+    e->reserved = 0;
+    if (l->batched == PB_SYNC_BATCH) {
+        listing_flush(l);
+    }
+}
+
+esp_err_t pb_listing_begin(pb_listing_t *l, esp_bd_addr_t addr)
+{
+    char path[64];
+    memset(l, 0, sizeof(*l));
+    memcpy(l->addr, addr, ESP_BD_ADDR_LEN);
+    l->ordered = true;
+    phonebook_file_path(addr, ".pbl", path, sizeof(path));
+    l->err = flash_sched_create(path, NULL, 0);
+    return l->err;
+}
+
+void pb_listing_feed(pb_listing_t *l, const char *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        char ch = data[i];
+        if (ch == '<') {
+            l->in_elem = true;
+            l->elem_len = 0;
+        } else if (!l->in_elem) {
+            continue;
+        } else if (ch == '>') {
+            l->elem[l->elem_len] = '\0';
+            l->in_elem = false;
+            listing_element(l);
+        } else if (l->elem_len < PB_LISTING_ELEMENT_MAX - 1) {
+            l->elem[l->elem_len++] = ch;
+        }
+    }
+}
+
+esp_err_t pb_listing_end(pb_listing_t *l)
+{
+    listing_flush(l);
+    // the diff reads the listing back
+    flash_sched_flush(portMAX_DELAY);
+    ESP_LOGI(TAG, "vCard listing: %d entries", l->count);
+    if (l->err != ESP_OK) {
+        return l->err;
+    }
+    if (!l->ordered) {
+        ESP_LOGW(TAG, "vCard listing not in handle order");
+        return ESP_ERR_INVALID_STATE;
+    }
+    return ESP_OK;
+}
+
+static FILE *open_listing(const esp_bd_addr_t addr, uint32_t *entries)
+{
+    char path[64];
+    struct stat st;
+    phonebook_file_path(addr, ".pbl", path, sizeof(path));
+    if (stat(path, &st) != 0) {
+        return NULL;
+    }
+    *entries = st.st_size / sizeof(pb_sync_entry_t);
+    return fopen(path, "rb");
+}
+
+static void drop_record(pb_sync_delta_t *d, const pb_sync_entry_t *old)
+{
+    uint16_t r = old->record;
+    if (r < d->old_count && !(d->drop[r / 8] & (1u << (r % 8)))) {
+        d->drop[r / 8] |= 1u << (r % 8);
+        d->dropped++;
+    }
+}
+
+esp_err_t pb_sync_diff(const phonebook_t *pb, pb_sync_delta_t *d)
+{
+    pb_sync_header_t hdr = {0};
+    uint32_t listed;
+    memset(d, 0, sizeof(*d));
+    FILE *old = open_state(pb->device_addr, &hdr);
+    FILE *now = open_listing(pb->device_addr, &listed);
+    esp_err_t err = (old && now) ? ESP_OK : ESP_ERR_NOT_FOUND;
+
+    d->deltas = hdr.deltas;
+    d->old_count = pb->contact_count;
+    d->drop = calloc(d->old_count / 8 + 1, 1);
+    if (err == ESP_OK && d->drop == NULL) {
+        err = ESP_ERR_NO_MEM;
+    }
+
+    // both files are in handle order: a merge finds what came, went and was renamed
+    pb_sync_entry_t a, b;
+    bool has_a = err == ESP_OK && read_entry(old, &a);
+    bool has_b = err == ESP_OK && read_entry(now, &b);
+    while (err == ESP_OK && (has_a || has_b)) {
+        bool gone = has_a && (!has_b || a.handle < b.handle);
+        bool added = has_b && (!has_a || b.handle < a.handle);
+        bool renamed = !gone && !added && a.name_hash != b.name_hash;
+        if (gone || renamed) {
+            drop_record(d, &a);
+        }
+        if (added || renamed) {
+            if (d->pull_count == PB_SYNC_PULL_MAX) {
+                err = ESP_ERR_INVALID_SIZE;
+                break;
+            }
+            d->pull[d->pull_count++] = b.handle;
+        }
+        if (!added) {
+            has_a = read_entry(old, &a);
+        }
+        if (!gone) {
+            has_b = read_entry(now, &b);
+        }
+    }
+    if (old) fclose(old);
+    if (now) fclose(now);
+
+    if (err != ESP_OK) {
+        pb_sync_delta_free(d);
+        return err;
+    }
+    ESP_LOGI(TAG, "Listing compared: %d entries to fetch, %d records to remove", d->pull_count, d->dropped);
+    return ESP_OK;
+}
+
+void pb_sync_delta_free(pb_sync_delta_t *d)
+{
+    free(d->drop);
+    d->drop = NULL;
+}
+
+/* Dropped records before r, by which r moves down in the new book */
+static uint16_t drop_rank(const pb_sync_delta_t *d, uint16_t r)
+{
+    uint16_t n = 0;
+    for (uint16_t k = 0; k < r / 8; k++) {
+        n += __builtin_popcount(d->drop[k]);
+    }
+    return n + __builtin_popcount(d->drop[r / 8] & ((1u << (r % 8)) - 1));
+}
+
+esp_err_t pb_sync_save(const phonebook_t *pb, const pb_sync_versions_t *now, const pb_sync_delta_t *d)
+{
+    char path[64], state_path[64], listing_path[64];
+    phonebook_file_path(pb->device_addr, ".pbu", path, sizeof(path));
+    phonebook_file_path(pb->device_addr, ".pbs", state_path, sizeof(state_path));
+    phonebook_file_path(pb->device_addr, ".pbl", listing_path, sizeof(listing_path));
+
+    uint32_t listed = 0;
+    FILE *listing = open_listing(pb->device_addr, &listed);
+    if (listing == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (d == NULL && listed != pb->vcards_seen) {
+        // the phone changed between the download and the listing
+        ESP_LOGW(TAG, "Listing has %u entries for %d vCards, next sync will be a full one",
+                 (unsigned)listed, pb->vcards_seen);
+        fclose(listing);
+        pb_sync_forget(pb->device_addr);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    pb_sync_header_t old_hdr;
+    FILE *old = NULL;
+    if (d != NULL && (old = open_state(pb->device_addr, &old_hdr)) == NULL) {
+        fclose(listing);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    pb_sync_header_t hdr = {
+        .magic = PB_SYNC_MAGIC,
+        .version = PB_SYNC_VERSION,
+        .flags = now->flags,
+        .deltas = d ? d->deltas + 1 : 0,
+        .size = now->size,
+        .records = pb->contact_count,
+        .book_generation = pb->generation,
+    };
+    memcpy(hdr.db_id, now->db_id, PB_SYNC_ID_LEN);
+    memcpy(hdr.folder_version, now->version, PB_SYNC_ID_LEN);
+    esp_err_t err = flash_sched_create(path, &hdr, sizeof(hdr));
+
+    // vCards arrived in listing order (full) or pull order (delta), so positions
+    // count through both together; retained records move down past dropped ones
+    pb_sync_entry_t batch[PB_SYNC_BATCH], a;
+    uint16_t batched = 0, pos = 0, stored = 0;
+    bool has_a = read_entry(old, &a);
+    for (uint32_t i = 0; err == ESP_OK && read_entry(listing, &batch[batched]); i++) {
+        pb_sync_entry_t *b = &batch[batched];
+        b->record = PB_SYNC_NO_RECORD;
+        if (d == NULL) {
+            if (phonebook_vcard_stored(pb, i)) {
+                b->record = stored++;
+            }
+        } else {
+            while (has_a && a.handle < b->handle) {
+                has_a = read_entry(old, &a);
+            }
+            if (pos < d->pull_count && d->pull[pos] == b->handle) {
+                if (phonebook_vcard_stored(pb, pos)) {
+                    b->record = pb->retained + stored++;
+                }
+                pos++;
+            } else if (has_a && a.handle == b->handle && a.record < d->old_count) {
+                b->record = a.record - drop_rank(d, a.record);
+            }
+        }
+        if (++batched == PB_SYNC_BATCH) {
+            err = flash_sched_append(path, batch, sizeof(batch));
+            batched = 0;
+        }
+    }
+    fclose(listing);
+    if (old) fclose(old);
+
+    if (err == ESP_OK && batched > 0) {
+        err = flash_sched_append(path, batch, batched * sizeof(batch[0]));
+    }
+    if (err == ESP_OK) {
+        err = flash_sched_rename(path, state_path);
+    }
+    flash_sched_remove(listing_path);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to save sync state: %s", esp_err_to_name(err));
+        return err;
+    }
+    ESP_LOGI(TAG, "Sync state saved: %u handles, %d records, %s", (unsigned)listed,
+             pb->contact_count, d ? "delta" : "full");
+    return ESP_OK;
+}
+
+void pb_sync_forget(const esp_bd_addr_t addr)
+{
+    char path[64];
+    phonebook_file_path(addr, ".pbs", path, sizeof(path));
+    flash_sched_remove(path);
+    phonebook_file_path(addr, ".pbl", path, sizeof(path));
+    flash_sched_remove(path);
+}
@@ -0,0 +1,130 @@
+/*
+ * pb_sync.h - incremental phonebook sync state
+ *
+ * PBAP 1.2 phones report a database identifier and a primary folder
+ * version with each pull. The identifier changes when the phone rebuilds
+ * its contact database and hands out new vCard handles; the folder version
+ * changes whenever a name or number does. After every sync both are kept
+ * in "<addr>.pbs", together with the vCard listing the book was built
+ * from: per handle, a hash of the listed name and the position of the
+ * handle's record in the book.
+ *
+ * On the next connection the stored state decides how much to download.
+ * Unchanged versions mean nothing at all. Otherwise the listing, a few
+ * dozen bytes per contact, is compared with the stored one; new and
+ * renamed entries are pulled one by one and the records of removed and
+ * renamed ones are left out when the book is rewritten. A new database, a
+ * lost state file, a book whose indexes are missing or in an older
+ * format, a large change, or a new folder version with an
+ * unchanged listing (a number edited under the same name) means a full
+ * download. So does every PB_SYNC_MAX_DELTAS-th sync, which catches number
+ * edits that came along with other changes, or on phones without versions.
+ *
+ * Listings come in handle order, the order a full pull returns its vCards
+ * in, which is what ties listing entries to book records.
+ */
+
+#ifndef PB_SYNC_H
+#define PB_SYNC_H
+
+#include "phonebook.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PB_SYNC_MAGIC           0x53534250      // "PBSS", little endian
+#define PB_SYNC_VERSION         2
+#define PB_SYNC_ID_LEN          16              // database identifier and folder version, per PBAP
+#define PB_SYNC_PULL_MAX        64              // entries pulled one by one; beyond this a full download is quicker
+#define PB_SYNC_MAX_DELTAS      8               // delta syncs in a row before a full one
+#define PB_SYNC_BATCH           32              // listing entries per flash write
+#define PB_LISTING_ELEMENT_MAX  160             // longer <card> elements are cut, names included
+#define PB_SYNC_NO_RECORD       0xFFFF
+
+#define PB_SYNC_HAS_DB_ID       0x01
+#define PB_SYNC_HAS_VERSION     0x02
+
+// What the phone reported with its phonebook size
+typedef struct {
+    uint8_t flags;                          // PB_SYNC_HAS_*
+    uint8_t db_id[PB_SYNC_ID_LEN];
+    uint8_t version[PB_SYNC_ID_LEN];        // primary folder version
+    uint16_t size;
+} pb_sync_versions_t;
+
+typedef struct {
+    uint32_t magic;
+    uint8_t version;
+    uint8_t flags;
+    uint8_t deltas;                         // delta syncs since the last full one
+    uint8_t reserved;
+    uint8_t db_id[PB_SYNC_ID_LEN];
+    uint8_t folder_version[PB_SYNC_ID_LEN];
+    uint16_t size;                          // phonebook size the phone reported
+    uint16_t records;                       // records in the book
+    uint32_t book_generation;               // the book this state was saved with
+} pb_sync_header_t;
+
+// One per listed handle, in handle order, after the header
+typedef struct {
+    uint32_t handle;
+    uint32_t name_hash;
+    uint16_t record;                        // ordinal in the book, or PB_SYNC_NO_RECORD
+    uint16_t reserved;
+} pb_sync_entry_t;
+
+typedef enum {
+    PB_SYNC_PLAN_FULL = 0,
+    PB_SYNC_PLAN_NONE,                      // the stored book is current
+    PB_SYNC_PLAN_LISTING,                   // compare listings, then pull what changed
+} pb_sync_plan_t;
+
+// Streaming x-bt/vcard-listing parser; entries go to "<addr>.pbl"
+typedef struct {
+    esp_bd_addr_t addr;
+    char elem[PB_LISTING_ELEMENT_MAX];
+    uint16_t elem_len;
+    bool in_elem;
+    bool ordered;
+    uint16_t count;
+    uint32_t last_handle;
+    uint16_t batched;
+    pb_sync_entry_t batch[PB_SYNC_BATCH];
+    esp_err_t err;
+} pb_listing_t;
+
+typedef struct {
+    uint32_t pull[PB_SYNC_PULL_MAX];        // handles to fetch, ascending
+    uint16_t pull_count;
+    uint8_t *drop;                          // bit per record of the old book
+    uint16_t old_count;
+    uint16_t dropped;
+    uint8_t deltas;
+} pb_sync_delta_t;
+
+pb_sync_plan_t pb_sync_plan(phonebook_t *pb, const pb_sync_versions_t *now);
+
+esp_err_t pb_listing_begin(pb_listing_t *l, esp_bd_addr_t addr);
+void pb_listing_feed(pb_listing_t *l, const char *data, size_t len);
+// Write out the rest; ESP_ERR_INVALID_STATE if the handles were out of order
+esp_err_t pb_listing_end(pb_listing_t *l);
+
+// Compare the listing just pulled with the stored one. ESP_ERR_INVALID_SIZE
+// when more than PB_SYNC_PULL_MAX entries changed.
+esp_err_t pb_sync_diff(const phonebook_t *pb, pb_sync_delta_t *d);
+void pb_sync_delta_free(pb_sync_delta_t *d);
+
+// Store the state of a finished sync: after a full download with d NULL, else
+// after the delta d was applied. The listing must have been pulled afterwards
+// (full) or before (delta) the vCards.
+esp_err_t pb_sync_save(const phonebook_t *pb, const pb_sync_versions_t *now, const pb_sync_delta_t *d);
+
+// Remove the stored state, so the next sync is a full one
+void pb_sync_forget(const esp_bd_addr_t addr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PB_SYNC_H
@@ -0,0 +1,405 @@
+/*
+ * pb_vcard.c - streaming vCard parser
+ */
+
+#include "pb_vcard.h"
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+typedef enum {
+    PB_VCARD_HEAD = 0,                      // property name and parameters, up to ':'
+    PB_VCARD_VALUE,
+    PB_VCARD_CR,                            // line break started
+    PB_VCARD_EOL,                           // line break read; a space or tab next folds the line
+} pb_vcard_state_t;
+
+typedef enum {
+    PB_VCARD_PROP_OTHER = 0,                // skipped
+    PB_VCARD_PROP_BEGIN,
+    PB_VCARD_PROP_END,
+    PB_VCARD_PROP_FN,
+    PB_VCARD_PROP_N,
+    PB_VCARD_PROP_TEL,
+} pb_vcard_prop_t;
+
+typedef enum {
+    PB_QP_OFF = 0,
+    PB_QP_ON,
+    PB_QP_EQ,                               // '=' read
+    PB_QP_HEX,                              // '=' and one hex digit read
+    PB_QP_SOFT,                             // '=' and CR read, LF to come
+} pb_qp_state_t;
+
+typedef enum {
+    PB_CHARSET_UTF8 = 0,
+    PB_CHARSET_LATIN1,
+    PB_CHARSET_CP1252,
+} pb_vcard_charset_t;
+
+/* WINDOWS-1252 0x80..0x9F; the five it leaves undefined stay C1 controls, as in Latin-1 */
+static const uint16_t s_cp1252_80[32] = {
+    0x20AC, 0x0081, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021,
+    0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0x008D, 0x017D, 0x008F,
+    0x0090, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+    0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0x009D, 0x017E, 0x0178,
+};
+
+static const char *s_prop_names[] = {
+    [PB_VCARD_PROP_BEGIN] = "BEGIN",
+    [PB_VCARD_PROP_END]   = "END",
+    [PB_VCARD_PROP_FN]    = "FN",
+    [PB_VCARD_PROP_N]     = "N",
+    [PB_VCARD_PROP_TEL]   = "TEL",
+};
+
+void pb_vcard_init(pb_vcard_t *p, pb_vcard_cb_t cb, void *ctx)
+{
+    memset(p, 0, sizeof(*p));
+    p->cb = cb;
+    p->ctx = ctx;
+}
+
+static int pb_hex(uint8_t c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    return (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+}
+
+/* length of s cut to at most max bytes without splitting a UTF-8 sequence */
+static size_t pb_utf8_cut(const char *s, size_t len, size_t max)
+{
+    if (len <= max) {
+        return len;
+    }
+    size_t i = max;
+    while (i > 0 && ((uint8_t)s[i] & 0xC0) == 0x80) {
+        i--;
+    }
+    return i;
+}
+
+/* copy a text value, undoing vCard escapes; stops at an unescaped ';' when split is set */
+static const char *pb_vcard_text(char *out, size_t out_size, const char *s, bool split)
+{
+    char tmp[PB_VCARD_VALUE_MAX];
+    size_t n = 0;
+    for (; *s && !(split && *s == ';'); s++) {
+        char c = *s;
+        if (c == '\\' && s[1]) {
+            c = *++s;
+            if (c == 'n' || c == 'N') {
+                c = ' ';
+            }
+        }
+        tmp[n++] = c;
+    }
+    n = pb_utf8_cut(tmp, n, out_size - 1);
+    memcpy(out, tmp, n);
+    out[n] = '\0';
+    return *s ? s + 1 : s;
+}
+
+static void pb_vcard_card_begin(pb_vcard_t *p)
+{
+    if (p->in_card) {
+        if (p->depth < UINT8_MAX) {
+            p->depth++;
+        }
+        return;
+    }
+    memset(&p->contact, 0, sizeof(p->contact));
+    p->in_card = true;
+    p->depth = 0;
+}
+
+static void pb_vcard_card_end(pb_vcard_t *p)
+{
+    if (!p->in_card) {
+        return;
+    }
+    if (p->depth > 0) {
+        p->depth--;
+        return;
+    }
+    p->in_card = false;
+    p->contact.active = true;
+    if (p->cb) {
+        p->cb(&p->contact, p->ctx);
+    }
+}
+
+static void pb_vcard_add_type(char *type, size_t size, const char *s)
+{
+    size_t n = strlen(type);
+    if (n > 0 && n < size - 1) {
+        type[n++] = ',';
+    }
+    for (; *s && n < size - 1; s++) {
+        if (*s != '"') {
+            type[n++] = *s;
+        }
+    }
+    type[n] = '\0';
+}
+
+/* the property and its parameters are known; set up decoding of its value */
+static void pb_vcard_head_end(pb_vcard_t *p)
+{
+    p->head[p->head_len] = '\0';
+    p->prop = PB_VCARD_PROP_OTHER;
+    p->qp = PB_QP_OFF;
+    p->charset = PB_CHARSET_UTF8;
+    p->value_len = 0;
+
+    // a group such as "item1." comes before the name
+    char *name = p->head;
+    char *params = strchr(name, ';');
+    char *dot = strchr(name, '.');
+    if (dot != NULL && (params == NULL || dot < params)) {
+        name = dot + 1;
+    }
+    if (params != NULL) {
+        *params++ = '\0';
+    }
+    for (int i = PB_VCARD_PROP_BEGIN; i <= PB_VCARD_PROP_TEL; i++) {
+        if (strcasecmp(name, s_prop_names[i]) == 0) {
+            p->prop = i;
+            break;
+        }
+    }
+
+    // only BEGIN and END count outside a card or inside a nested one
+    bool structural = p->prop == PB_VCARD_PROP_BEGIN || p->prop == PB_VCARD_PROP_END;
+    if (!structural && (!p->in_card || p->depth > 0)) {
+        p->prop = PB_VCARD_PROP_OTHER;
+    }
+    if (p->prop == PB_VCARD_PROP_TEL && p->contact.phone_count >= MAX_PHONES_PER_CONTACT) {
+        p->prop = PB_VCARD_PROP_OTHER;
+    }
+    if (p->prop == PB_VCARD_PROP_OTHER) {
+        return;
+    }
+
+    char *type = p->contact.phones[p->contact.phone_count].type;
+    if (p->prop == PB_VCARD_PROP_TEL) {
+        type[0] = '\0';
+    }
+    while (params != NULL) {
+        char *param = params;
+        params = strchr(param, ';');
+        if (params != NULL) {
+            *params++ = '\0';
+        }
+        char *eq = strchr(param, '=');
+        const char *val = eq ? eq + 1 : param;
+        if (eq != NULL) {
+            *eq = '\0';
+        }
+        if (strcasecmp(val, "QUOTED-PRINTABLE") == 0) {
+            p->qp = PB_QP_ON;
+        } else if (eq != NULL && strcasecmp(param, "CHARSET") == 0) {
+            if (strncasecmp(val, "ISO-8859-1", 10) == 0) {
+                p->charset = PB_CHARSET_LATIN1;
+            } else if (strcasecmp(val, "WINDOWS-1252") == 0 || strcasecmp(val, "CP1252") == 0) {
+                p->charset = PB_CHARSET_CP1252;
+            } else {
+                p->charset = PB_CHARSET_UTF8;
+            }
+        } else if (p->prop == PB_VCARD_PROP_TEL && (eq == NULL || strcasecmp(param, "TYPE") == 0)) {
+            // vCard 2.1 lists types bare, as in TEL;CELL;VOICE
+            pb_vcard_add_type(type, sizeof(p->contact.phones[0].type), val);
+        }
+    }
+    if (p->prop == PB_VCARD_PROP_TEL && type[0] == '\0') {
+        strcpy(type, "OTHER");
+    }
+}
+
+/* one decoded byte of a value */
+static void pb_vcard_put(pb_vcard_t *p, uint8_t c)
+{
+    if (p->prop == PB_VCARD_PROP_OTHER) {
+        return;
+    }
+    // number formatting is dropped here, so a long formatted number still fits
+    if (p->prop == PB_VCARD_PROP_TEL && c != '\0' && strchr(" -()./", c) != NULL) {
+        return;
+    }
+    if (p->charset != PB_CHARSET_UTF8 && c >= 0x80) {
+        uint16_t cp = (p->charset == PB_CHARSET_CP1252 && c < 0xA0) ? s_cp1252_80[c - 0x80] : c;
+        size_t len = cp < 0x800 ? 2 : 3;
+        if (p->value_len + len < sizeof(p->value)) {
+            if (len == 3) {
+                p->value[p->value_len++] = 0xE0 | cp >> 12;
+                p->value[p->value_len++] = 0x80 | ((cp >> 6) & 0x3F);
+            } else {
+                p->value[p->value_len++] = 0xC0 | cp >> 6;
+            }
+            p->value[p->value_len++] = 0x80 | (cp & 0x3F);
+        }
+    } else if (p->value_len + 1u < sizeof(p->value)) {
+        p->value[p->value_len++] = c;
+    }
+
+    // the card is complete at END:VCARD itself, not at a line break that may be in the next chunk
+    if ((p->prop == PB_VCARD_PROP_BEGIN || p->prop == PB_VCARD_PROP_END) &&
+        p->value_len == 5 && strncasecmp(p->value, "VCARD", 5) == 0) {
+        if (p->prop == PB_VCARD_PROP_BEGIN) {
+            pb_vcard_card_begin(p);
+        } else {
+            pb_vcard_card_end(p);
+        }
+        p->prop = PB_VCARD_PROP_OTHER;
+    }
+}
+
+static void pb_vcard_line_end(pb_vcard_t *p)
+{
+    contact_t *c = &p->contact;
+    p->value[p->value_len] = '\0';
+
+    switch (p->prop) {
+    case PB_VCARD_PROP_FN:
+        if (p->value_len > 0) {
+            pb_vcard_text(c->full_name, sizeof(c->full_name), p->value, false);
+        }
+        break;
+    case PB_VCARD_PROP_N:
+        // Family;Given;Additional;Prefix;Suffix, used as "Given Family" when there is no FN
+        if (c->full_name[0] == '\0') {
+            char family[MAX_NAME_LEN], given[MAX_NAME_LEN], name[2 * MAX_NAME_LEN];
+            const char *rest = pb_vcard_text(family, sizeof(family), p->value, true);
+            pb_vcard_text(given, sizeof(given), rest, true);
+            size_t n = snprintf(name, sizeof(name), "%s%s%s", given, (given[0] && family[0]) ? " " : "", family);
+            n = pb_utf8_cut(name, n, sizeof(c->full_name) - 1);
+            memcpy(c->full_name, name, n);
+            c->full_name[n] = '\0';
+        }
+        break;
+    case PB_VCARD_PROP_TEL:
+        if (p->value_len > 0) {
+            phone_number_t *ph = &c->phones[c->phone_count++];
+            size_t n = p->value_len < MAX_PHONE_LEN - 1 ? p->value_len : MAX_PHONE_LEN - 1;
+            memcpy(ph->number, p->value, n);
+            ph->number[n] = '\0';
+        }
+        break;
+    default:
+        break;
+    }
+    p->prop = PB_VCARD_PROP_OTHER;
+    p->qp = PB_QP_OFF;
+    p->charset = PB_CHARSET_UTF8;
+    p->head_len = 0;
+    p->value_len = 0;
+}
+
+static void pb_vcard_line_break(pb_vcard_t *p, uint8_t c)
+{
+    p->folded = p->state;
+    p->state = (c == '\r') ? PB_VCARD_CR : PB_VCARD_EOL;
+}
+
+static void pb_vcard_value_byte(pb_vcard_t *p, uint8_t c)
+{
+    switch (p->qp) {
+    case PB_QP_ON:
+        if (c == '=') {
+            p->qp = PB_QP_EQ;
+            return;
+        }
+        break;
+    case PB_QP_EQ:
+        if (c == '\r') {
+            p->qp = PB_QP_SOFT;
+            return;
+        }
+        p->qp = PB_QP_ON;
+        if (c == '\n') {
+            return;
+        }
+        if (pb_hex(c) >= 0) {
+            p->qp_hi = c;
+            p->qp = PB_QP_HEX;
+            return;
+        }
+        pb_vcard_put(p, '=');
+        break;
+    case PB_QP_HEX:
+        p->qp = PB_QP_ON;
+        if (pb_hex(c) >= 0) {
+            pb_vcard_put(p, pb_hex(p->qp_hi) << 4 | pb_hex(c));
+            return;
+        }
+        // not an escape after all; keep it as it came
+        pb_vcard_put(p, '=');
+        pb_vcard_put(p, p->qp_hi);
+        break;
+    case PB_QP_SOFT:
+        p->qp = PB_QP_ON;
+        if (c == '\n') {
+            return;
+        }
+        break;
+    default:
+        break;
+    }
+    if (c == '\r' || c == '\n') {
+        pb_vcard_line_break(p, c);
+        return;
+    }
+    pb_vcard_put(p, c);
+}
+
+void pb_vcard_feed(pb_vcard_t *p, const char *data, size_t len)
+{
+    for (const uint8_t *s = (const uint8_t *)data, *end = s + len; s < end; s++) {
+        uint8_t c = *s;
+        switch (p->state) {
+        case PB_VCARD_CR:
+            p->state = PB_VCARD_EOL;
+            if (c == '\n') {
+                continue;
+            }
+            // a bare CR ends the line too
+            /* fall through */
+        case PB_VCARD_EOL:
+            if (c == ' ' || c == '\t') {
+                p->state = p->folded;
+                continue;
+            }
+            pb_vcard_line_end(p);
+            p->state = PB_VCARD_HEAD;
+            break;
+        case PB_VCARD_VALUE:
+            pb_vcard_value_byte(p, c);
+            continue;
+        default:
+            break;
+        }
+
+        if (c == '\r' || c == '\n') {
+            pb_vcard_line_break(p, c);
+        } else if (c == ':') {
+            pb_vcard_head_end(p);
+            p->state = PB_VCARD_VALUE;
+        } else if (p->head_len < sizeof(p->head) - 1) {
+            p->head[p->head_len++] = c;
+        }
+    }
+}
+
+void pb_vcard_finish(pb_vcard_t *p)
+{
+    if (p->state != PB_VCARD_HEAD) {
+        pb_vcard_line_end(p);
+    }
+    p->state = PB_VCARD_HEAD;
+    p->head_len = 0;
+    p->in_card = false;
+    p->depth = 0;
+}
@@ -0,0 +1,66 @@
+/*
+ * pb_vcard.h - streaming vCard parser
+ *
+ * PBAP pulls arrive as chunks of a vCard 2.1 or 3.0 stream, cut at any
+ * byte. The parser takes each chunk in place, one byte at a time, and
+ * carries only its state between chunks: the name and parameters of the
+ * property being read, and the value of the few properties a contact is
+ * made of (FN, N, TEL). Every other property, photos included, is skipped
+ * as it streams past, so a vCard of any size parses in the same few
+ * hundred bytes.
+ *
+ * Values are decoded on the way in: folded lines (a line break followed by
+ * a space or tab), QUOTED-PRINTABLE with its soft line breaks, backslash
+ * escapes, and CHARSET=ISO-8859-1 or WINDOWS-1252, which are converted to
+ * UTF-8. Anything else is taken as UTF-8. Without FN the name is made from
+ * N. Numbers keep their digits and dial characters; normalizing them is
+ * left to the caller.
+ *
+ * A contact is handed over as soon as its END:VCARD has been read, so the
+ * caller knows a vCard is done without waiting for the next chunk.
+ */
+
+#ifndef PB_VCARD_H
+#define PB_VCARD_H
+
+#include "phonebook.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PB_VCARD_HEAD_MAX       96              // property name and parameters; the rest is cut
+#define PB_VCARD_VALUE_MAX      (MAX_NAME_LEN * 2)  // room for escapes in a full-length name
+
+// Called for every complete vCard; the contact may be modified, not kept
+typedef void (*pb_vcard_cb_t)(contact_t *contact, void *ctx);
+
+typedef struct pb_vcard {
+    pb_vcard_cb_t cb;
+    void *ctx;
+    uint8_t state;                          // pb_vcard_state_t
+    uint8_t folded;                         // state a folded line continues in
+    uint8_t prop;                           // pb_vcard_prop_t of the current line
+    uint8_t qp;                             // quoted-printable decoder state, 0 when off
+    uint8_t qp_hi;
+    uint8_t charset;                        // pb_vcard_charset_t of the current line
+    bool in_card;
+    uint8_t depth;                          // nested vCards (AGENT), skipped
+    uint8_t head_len;
+    uint8_t value_len;
+    char head[PB_VCARD_HEAD_MAX];
+    char value[PB_VCARD_VALUE_MAX];
+    contact_t contact;
+} pb_vcard_t;
+
+// Also resets a parser for a new stream
+void pb_vcard_init(pb_vcard_t *p, pb_vcard_cb_t cb, void *ctx);
+void pb_vcard_feed(pb_vcard_t *p, const char *data, size_t len);
+// End of stream: takes a last line that has no line break, drops an unfinished vCard
+void pb_vcard_finish(pb_vcard_t *p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PB_VCARD_H
@@ -4,41 +4,95 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <sys/stat.h>
+#include <dirent.h>
 #include "esp_log.h"
 #include "esp_err.h"
 #include "esp_spiffs.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "flash_sched.h"
+#include "metrics.h"
+#include "pb_book.h"
+#include "pb_cache.h"
+#include "pb_fold.h"
+#include "pb_fuzzy.h"
+#include "pb_sync.h"
+#include "pb_vcard.h"
+
+#ifndef PHONEBOOK_BASE_PATH
+#define PHONEBOOK_BASE_PATH     "/spiffs"       // the host tests point this at a directory
+#endif
 
 static const char *TAG = "PHONEBOOK";
-static const char *BASE_PATH = "/spiffs";
+static const char *BASE_PATH = PHONEBOOK_BASE_PATH;
 static phonebook_list_node_t *phonebook_list_head = NULL;
 static bool spiffs_mounted = false;
 static char g_country_code[4] = DEFAULT_COUNTRY_CODE;
+static SemaphoreHandle_t s_index_lock = NULL;   // loading and using a phonebook's indexes
+static metric_t *s_m_lookup_us;
+
+#define PB_NUMBER_MAX_CANDIDATES 8
+#define PB_MIGRATE_MAX          8       // books converted per boot
 
-// Helper function to create file path for a device's phonebook
-static void make_phonebook_path(esp_bd_addr_t device_addr, char *path_out, size_t path_len)
+// Helper function to create the path of one of a device's phonebook files
+static void make_pb_file_path(const esp_bd_addr_t device_addr, const char *ext, char *path_out, size_t path_len)
 {
-    snprintf(path_out, path_len, "%s/%02x%02x%02x%02x%02x%02x.pb",
+    snprintf(path_out, path_len, "%s/%02x%02x%02x%02x%02x%02x%s",
              BASE_PATH,
              device_addr[0], device_addr[1], device_addr[2],
-             device_addr[3], device_addr[4], device_addr[5]);
+             device_addr[3], device_addr[4], device_addr[5], ext);
 }
 
-// Remove all non-digit characters except leading +
-static void strip_formatting(const char *input, char *output, size_t output_len)
+/*
+ * A book lives in one of two slots of files. A sync writes the slot not in
+ * use and, once the new book and its indexes are on flash, stamps it with
+ * the next generation and switches the slot over. Lookups keep using the
+ * previous book until then, and a sync cut short, by a lost connection or
+ * by power, leaves the previous book as it was.
+ */
+typedef enum {
+    PB_FILE_BOOK = 0,
+    PB_FILE_NUMBERS,
+    PB_FILE_NAMES,
+    PB_FILE_KEYS,
+    PB_FILE_TRIGRAMS,
+    PB_FILE_KINDS,
+} pb_file_t;
+
+static const char *s_slot_ext[2][PB_FILE_KINDS] = {
+    { ".pb",  ".pbn",  ".pbi",  ".pbk",  ".pbt"  },
+    { ".pb1", ".pbn1", ".pbi1", ".pbk1", ".pbt1" },
+};
+
+static void make_slot_path(const phonebook_t *pb, uint8_t slot, pb_file_t file, char *path_out, size_t path_len)
 {
-    int out_idx = 0;
-    bool first_char = true;
-    
-    for (int i = 0; input[i] != '\0' && out_idx < output_len - 1; i++) {
-        if (isdigit((unsigned char)input[i])) {
-            output[out_idx++] = input[i];
-            first_char = false;
-        } else if (input[i] == '+' && first_char) {
-            output[out_idx++] = input[i];
-            first_char = false;
-        }
-    }
-    output[out_idx] = '\0';
+    make_pb_file_path(pb->device_addr, s_slot_ext[slot][file], path_out, path_len);
+}
+
+// A file of the live book; readers resolve it with s_index_lock held, so a swap never splits a lookup
+static void make_live_path(const phonebook_t *pb, pb_file_t file, char *path_out, size_t path_len)
+{
+    make_slot_path(pb, pb->slot, file, path_out, path_len);
+}
+
+// A file of the book a sync is writing
+static void make_shadow_path(const phonebook_t *pb, pb_file_t file, char *path_out, size_t path_len)
+{
+    make_slot_path(pb, pb->slot ^ 1, file, path_out, path_len);
+}
+
+void phonebook_file_path(const esp_bd_addr_t device_addr, const char *ext, char *path_out, size_t path_len)
+{
+    make_pb_file_path(device_addr, ext, path_out, path_len);
+}
+
+// Copy a string, cut to fit output_len
+static void copy_bounded(char *output, const char *input, size_t output_len)
+{
+    size_t n = strnlen(input, output_len - 1);
+    memcpy(output, input, n);
+    output[n] = '\0';
 }
 
 // Normalize phone number to E.164 format (+CountryCodeNumber)
@@ -49,7 +103,7 @@ static void normalize_phone_number(const char *input, char *output, size_t outpu
     if (input[0] == '+' && isdigit((unsigned char)input[1])) {
         // Quick check - just copy if already in E.164 format
         bool looks_normalized = true;
-        for (int i = 1; input[i] != '\0' && i < output_len - 1; i++) {
+        for (size_t i = 1; input[i] != '\0' && i < output_len - 1; i++) {
             if (!isdigit((unsigned char)input[i])) {
                 looks_normalized = false;
                 break;
@@ -96,70 +150,57 @@ static void normalize_phone_number(const char *input, char *output, size_t outpu
         // Build: +countrycode + number without leading 0
         char temp[MAX_PHONE_LEN];
         snprintf(temp, MAX_PHONE_LEN, "+%s%s", country_code, output + 1);
-        strncpy(output, temp, output_len - 1);
-        output[output_len - 1] = '\0';
+        copy_bounded(output, temp, output_len);
         return;
     }
     
     // No prefix - add country code
     char temp[MAX_PHONE_LEN];
     snprintf(temp, MAX_PHONE_LEN, "+%s%s", country_code, output);
-    strncpy(output, temp, output_len - 1);
-    output[output_len - 1] = '\0';
+    copy_bounded(output, temp, output_len);
 }
 
-// Initialize file with empty contact count at start of sync
+// Create the shadow book, generation 0 until it is complete
 static esp_err_t init_phonebook_file(phonebook_t *pb)
 {
     char filepath[64];
-    make_phonebook_path(pb->device_addr, filepath, sizeof(filepath));
+    make_shadow_path(pb, PB_FILE_BOOK, filepath, sizeof(filepath));
     
-    remove(filepath);
-    
-    FILE *f = fopen(filepath, "wb");
-    if (f == NULL) {
+    pb_book_header_t hdr = {
+        .magic = PB_BOOK_MAGIC,
+        .version = PB_BOOK_VERSION,
+    };
+    esp_err_t err = flash_sched_create(filepath, &hdr, sizeof(hdr));
+    if (err != ESP_OK) {
         ESP_LOGE(TAG, "Failed to create phonebook file");
-        return ESP_FAIL;
     }
     
-    uint16_t count = 0;
-    fwrite(&count, sizeof(uint16_t), 1, f);
-    fclose(f);
-    
-    return ESP_OK;
+    return err;
 }
 
-// Flush batch buffer to file
+// Hand the block to the flash scheduler; the buffer is free for reuse on return
 static esp_err_t flush_write_buffer(phonebook_t *pb)
 {
-    if (pb->write_buffer_count == 0) {
+    if (pb->write_buffer->hdr.records == 0) {
         return ESP_OK;
     }
     
     char filepath[64];
-    make_phonebook_path(pb->device_addr, filepath, sizeof(filepath));
-    
-    FILE *f = fopen(filepath, "ab");
-    if (f == NULL) {
-        ESP_LOGE(TAG, "Failed to open file for batch write");
-        return ESP_FAIL;
-    }
-    
-    size_t written = fwrite(pb->write_buffer, sizeof(contact_t), pb->write_buffer_count, f);
-    fclose(f);
+    make_shadow_path(pb, PB_FILE_BOOK, filepath, sizeof(filepath));
     
-    if (written != pb->write_buffer_count) {
-        ESP_LOGE(TAG, "Failed to write all contacts in batch");
-        return ESP_FAIL;
+    esp_err_t err = flash_sched_append(filepath, pb->write_buffer, pb_block_size(pb->write_buffer));
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to queue batch write");
+        return err;
     }
     
-    ESP_LOGD(TAG, "Flushed %d contacts to file", pb->write_buffer_count);
-    pb->write_buffer_count = 0;
+    ESP_LOGD(TAG, "Queued %d contacts for flash", pb->write_buffer->hdr.records);
+    memset(&pb->write_buffer->hdr, 0, sizeof(pb->write_buffer->hdr));
     
     return ESP_OK;
 }
 
-// Add contact to batch buffer (batched writes for performance)
+// Encode the contact into the current block, writing the block out once it is full
 static esp_err_t append_contact_to_file(phonebook_t *pb, const contact_t *contact)
 {
     if (pb->write_buffer == NULL) {
@@ -167,57 +208,214 @@ static esp_err_t append_contact_to_file(phonebook_t *pb, const contact_t *contac
         return ESP_FAIL;
     }
     
-    memcpy(&pb->write_buffer[pb->write_buffer_count], contact, sizeof(contact_t));
-    pb->write_buffer_count++;
-    
-    // Flush if batch is full
-    if (pb->write_buffer_count >= CONTACT_BATCH_SIZE) {
-        return flush_write_buffer(pb);
+    uint8_t rec[PB_RECORD_MAX];
+    size_t len = pb_record_encode(contact, rec);
+    if (pb_block_add(pb->write_buffer, rec, len)) {
+        return ESP_OK;
     }
     
-    return ESP_OK;
+    esp_err_t err = flush_write_buffer(pb);
+    if (err == ESP_OK) {
+        pb_block_add(pb->write_buffer, rec, len);
+    }
+    return err;
 }
 
-// Update contact count at end of sync
-static esp_err_t update_contact_count_in_file(phonebook_t *pb)
+// Stamp the shadow book complete: its count, and the generation that makes it the newer slot
+static esp_err_t write_book_header(phonebook_t *pb, uint32_t generation)
 {
     char filepath[64];
-    make_phonebook_path(pb->device_addr, filepath, sizeof(filepath));
+    make_shadow_path(pb, PB_FILE_BOOK, filepath, sizeof(filepath));
     
-    FILE *f = fopen(filepath, "r+b");
-    if (f == NULL) {
-        return ESP_FAIL;
+    pb_book_header_t hdr = {
+        .magic = PB_BOOK_MAGIC,
+        .version = PB_BOOK_VERSION,
+        .contact_count = pb->shadow_count,
+        .generation = generation,
+    };
+    return flash_sched_write_at(filepath, 0, &hdr, sizeof(hdr));
+}
+
+static void remove_slot(const phonebook_t *pb, uint8_t slot)
+{
+    char path[64];
+    for (int f = 0; f < PB_FILE_KINDS; f++) {
+        make_slot_path(pb, slot, f, path, sizeof(path));
+        flash_sched_remove(path);
     }
-    
-    fseek(f, 0, SEEK_SET);
-    fwrite(&pb->contact_count, sizeof(uint16_t), 1, f);
-    fclose(f);
-    
-    return ESP_OK;
 }
 
-// Load contact count from file
-static uint16_t load_contact_count(esp_bd_addr_t device_addr)
+// Take the slot holding the newest complete book; whatever is in the other is left from an interrupted sync
+static void load_live_slot(phonebook_t *pb)
 {
-    char filepath[64];
-    make_phonebook_path(device_addr, filepath, sizeof(filepath));
-    
-    FILE *f = fopen(filepath, "rb");
-    if (f == NULL) {
-        return 0;
+    pb_book_header_t hdr[2];
+    for (uint8_t slot = 0; slot < 2; slot++) {
+        char path[64];
+        make_slot_path(pb, slot, PB_FILE_BOOK, path, sizeof(path));
+        if (pb_book_read_header(path, &hdr[slot]) != ESP_OK) {
+            hdr[slot].generation = 0;
+        }
+    }
+    pb->slot = hdr[1].generation > hdr[0].generation ? 1 : 0;
+    pb->generation = hdr[pb->slot].generation;
+    pb->contact_count = pb->generation ? hdr[pb->slot].contact_count : 0;
+    remove_slot(pb, pb->slot ^ 1);
+}
+
+// Make the finished shadow book the live one. Lookups hold s_index_lock while
+// they use a book, so none sees half of the switch; cursors end on the new generation.
+static void swap_in_shadow(phonebook_t *pb, uint32_t generation)
+{
+    xSemaphoreTake(s_index_lock, portMAX_DELAY);
+    pb_number_index_unload(&pb->number_index);
+    pb_name_index_unload(&pb->name_index);
+    pb_cache_clear(pb->cache);
+    pb->slot ^= 1;
+    pb->generation = generation;
+    pb->contact_count = pb->shadow_count;
+    xSemaphoreGive(s_index_lock);
+    remove_slot(pb, pb->slot ^ 1);
+}
+
+// One pass over the finished shadow book feeding every index builder; the indexes load lazily once it is live
+static esp_err_t build_indexes(phonebook_t *pb)
+{
+    char book_path[64], path[64], name_path[64], keys_path[64], trigram_path[64];
+    make_shadow_path(pb, PB_FILE_BOOK, book_path, sizeof(book_path));
+    make_shadow_path(pb, PB_FILE_NUMBERS, path, sizeof(path));
+    make_shadow_path(pb, PB_FILE_NAMES, name_path, sizeof(name_path));
+    make_shadow_path(pb, PB_FILE_KEYS, keys_path, sizeof(keys_path));
+    make_shadow_path(pb, PB_FILE_TRIGRAMS, trigram_path, sizeof(trigram_path));
+
+    // the builders read the book back, so everything queued must be on flash
+    flash_sched_flush(portMAX_DELAY);
+
+    struct stat st;
+    pb_book_reader_t r;
+    esp_err_t err = pb_book_open(&r, book_path, NULL);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (stat(book_path, &st) != 0) {
+        pb_book_close(&r);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    int64_t t0 = esp_timer_get_time();
+    pb_number_builder_t numbers;
+    pb_name_builder_t names;
+    pb_key_builder_t keys;
+    pb_fuzzy_builder_t trigrams;
+    if ((err = pb_number_index_begin(&numbers)) != ESP_OK) {
+        pb_book_close(&r);
+        return err;
+    }
+    if ((err = pb_name_index_begin(&names)) != ESP_OK) {
+        pb_number_index_abort(&numbers);
+        pb_book_close(&r);
+        return err;
+    }
+    if ((err = pb_key_index_begin(&keys, keys_path)) != ESP_OK) {
+        pb_number_index_abort(&numbers);
+        pb_name_index_abort(&names);
+        pb_book_close(&r);
+        return err;
+    }
+    if ((err = pb_fuzzy_index_begin(&trigrams, trigram_path)) != ESP_OK) {
+        pb_number_index_abort(&numbers);
+        pb_name_index_abort(&names);
+        pb_key_index_abort(&keys);
+        pb_book_close(&r);
+        return err;
+    }
+
+    contact_t *c = malloc(sizeof(contact_t));
+    char key[PB_FOLD_MAX];
+    uint32_t offset;
+    if (c == NULL) {
+        err = ESP_ERR_NO_MEM;
+    }
+    while (err == ESP_OK && pb_book_next(&r, c, &offset)) {
+        // each name is folded once here, so queries compare plain bytes
+        pb_fold(c->full_name, key, sizeof(key));
+        err = pb_name_index_add(&names, key, offset);
+        if (err == ESP_OK) {
+            err = pb_fuzzy_index_add(&trigrams, key, pb_key_index_tell(&keys));
+        }
+        if (err == ESP_OK) {
+            err = pb_key_index_add(&keys, key, offset);
+        }
+        for (int j = 0; j < c->phone_count && err == ESP_OK; j++) {
+            err = pb_number_index_add(&numbers, c->phones[j].number, offset);
+        }
+    }
+    free(c);
+    pb_book_close(&r);
+
+    if (err != ESP_OK) {
+        pb_number_index_abort(&numbers);
+        pb_name_index_abort(&names);
+        pb_key_index_abort(&keys);
+        pb_fuzzy_index_abort(&trigrams);
+        return err;
+    }
+    err = pb_number_index_finish(&numbers, path, st.st_size);
+    esp_err_t name_err = pb_name_index_finish(&names, name_path, st.st_size);
+    esp_err_t key_err = pb_key_index_finish(&keys, st.st_size);
+    esp_err_t trigram_err = pb_fuzzy_index_finish(&trigrams, st.st_size);
+    ESP_LOGI(TAG, "Indexes built in %d ms", (int)((esp_timer_get_time() - t0) / 1000));
+    if (err == ESP_OK) {
+        err = name_err != ESP_OK ? name_err : key_err;
+    }
+    return err != ESP_OK ? err : trigram_err;
+}
+
+// Convert books stored in the old fixed-size record format
+static void migrate_books(void)
+{
+    char paths[PB_MIGRATE_MAX][64];
+    int n = 0;
+    DIR *dir = opendir(BASE_PATH);
+    if (dir == NULL) {
+        return;
+    }
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL && n < PB_MIGRATE_MAX) {
+        size_t len = strlen(de->d_name);
+        if (len > 3 && strcmp(de->d_name + len - 3, ".pb") == 0) {
+            snprintf(paths[n++], sizeof(paths[0]), "%s/%s", BASE_PATH, de->d_name);
+        }
+    }
+    closedir(dir);
+
+    for (int i = 0; i < n; i++) {
+        // into the other slot, which load_live_slot then takes as the newer book
+        char slot_path[sizeof(paths[0]) + 1];
+        snprintf(slot_path, sizeof(slot_path), "%.*s%s", (int)strlen(paths[i]) - 3, paths[i],
+                 s_slot_ext[1][PB_FILE_BOOK]);
+        if (pb_book_migrate(paths[i], slot_path) == ESP_ERR_INVALID_VERSION) {
+            ESP_LOGW(TAG, "Removing unreadable phonebook %s", paths[i]);
+            flash_sched_remove(paths[i]);
+        }
     }
-    
-    uint16_t count = 0;
-    fread(&count, sizeof(uint16_t), 1, f);
-    fclose(f);
-    
-    return count;
 }
 
 esp_err_t phonebook_init(void)
 {
     phonebook_list_head = NULL;
     
+    if (s_index_lock == NULL) {
+        s_index_lock = xSemaphoreCreateMutex();
+        if (s_index_lock == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
+        pb_book_init();
+        pb_cache_init();
+        s_m_lookup_us = metrics_hist("pb.lookup_us");
+        pb_index_init();
+        pb_fuzzy_init();
+    }
+
     if (spiffs_mounted) {
         ESP_LOGI(TAG, "SPIFFS already mounted");
         return ESP_OK;
@@ -251,9 +449,17 @@ esp_err_t phonebook_init(void)
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "Failed to get SPIFFS partition information (%s)", esp_err_to_name(ret));
     } else {
-        ESP_LOGI(TAG, "SPIFFS partition size: total: %d, used: %d", total, used);
+        ESP_LOGI(TAG, "SPIFFS partition size: total: %u, used: %u", (unsigned)total, (unsigned)used);
+    }
+    
+    ret = flash_sched_init();
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to start flash write scheduler");
+        return ret;
     }
     
+    migrate_books();
+    
     spiffs_mounted = true;
     ESP_LOGI(TAG, "Phonebook system initialized with SPIFFS storage");
     ESP_LOGI(TAG, "Country code: %s", g_country_code);
@@ -291,53 +497,167 @@ phonebook_t* phonebook_get_or_create(esp_bd_addr_t device_addr)
 {
     phonebook_t *pb = phonebook_find(device_addr);
     if (pb != NULL) {
-        pb->contact_count = 0;
-        pb->buffer_pos = 0;
-        pb->sync_in_progress = true;
-        pb->write_buffer_count = 0;
-        memset(pb->vcard_buffer, 0, VCARD_BUFFER_SIZE);
-        init_phonebook_file(pb);
         ESP_LOGI(TAG, "Reusing existing phonebook for device");
         return pb;
     }
 
-    phonebook_list_node_t *node = (phonebook_list_node_t*)malloc(sizeof(phonebook_list_node_t));
+    phonebook_list_node_t *node = (phonebook_list_node_t*)calloc(1, sizeof(phonebook_list_node_t));
     if (node == NULL) {
         ESP_LOGE(TAG, "Failed to allocate phonebook node");
         return NULL;
     }
 
     memcpy(node->phonebook.device_addr, device_addr, ESP_BD_ADDR_LEN);
-    node->phonebook.contact_count = 0;
-    node->phonebook.buffer_pos = 0;
-    node->phonebook.sync_in_progress = true;
-    node->phonebook.write_buffer_count = 0;
-    memset(node->phonebook.vcard_buffer, 0, VCARD_BUFFER_SIZE);
-
-    // Allocate batch write buffer
-    node->phonebook.write_buffer = (contact_t*)malloc(sizeof(contact_t) * CONTACT_BATCH_SIZE);
-    if (node->phonebook.write_buffer == NULL) {
+
+    // Allocate the block buffer records are encoded into, the vCard parser and the caller-ID cache
+    node->phonebook.write_buffer = (pb_block_t*)calloc(1, sizeof(pb_block_t));
+    node->phonebook.vcard = (pb_vcard_t*)calloc(1, sizeof(pb_vcard_t));
+    node->phonebook.cache = (pb_cache_t*)calloc(1, sizeof(pb_cache_t));
+    if (node->phonebook.write_buffer == NULL || node->phonebook.vcard == NULL || node->phonebook.cache == NULL) {
         ESP_LOGE(TAG, "Failed to allocate write buffer");
+        free(node->phonebook.write_buffer);
+        free(node->phonebook.vcard);
+        free(node->phonebook.cache);
         free(node);
         return NULL;
     }
 
-    init_phonebook_file(&node->phonebook);
-
     node->next = phonebook_list_head;
     phonebook_list_head = node;
 
-    uint16_t stored_count = load_contact_count(device_addr);
+    // lookups use the stored book, and its indexes, until a sync replaces it
+    load_live_slot(&node->phonebook);
     
     ESP_LOGI(TAG, "Created new phonebook for device "
-             "%02x:%02x:%02x:%02x:%02x:%02x (previously stored: %d contacts)",
+             "%02x:%02x:%02x:%02x:%02x:%02x (previously stored: %d contacts, generation %u)",
              device_addr[0], device_addr[1], device_addr[2],
              device_addr[3], device_addr[4], device_addr[5],
-             stored_count);
+             node->phonebook.contact_count, (unsigned)node->phonebook.generation);
 
     return &node->phonebook;
 }
 
+static void store_vcard(contact_t *contact, void *ctx);
+
+static void reset_sync_state(phonebook_t *pb)
+{
+    pb->shadow_count = 0;
+    pb_vcard_init(pb->vcard, store_vcard, pb);
+    pb->vcards_seen = 0;
+    pb->replay = 0;
+    pb->retained = 0;
+    free(pb->skipped);
+    pb->skipped = NULL;
+    pb->skipped_len = 0;
+    memset(&pb->write_buffer->hdr, 0, sizeof(pb->write_buffer->hdr));
+}
+
+esp_err_t phonebook_begin_sync(phonebook_t *pb)
+{
+    if (pb == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    reset_sync_state(pb);
+    pb->sync_in_progress = true;
+    return init_phonebook_file(pb);
+}
+
+esp_err_t phonebook_begin_delta(phonebook_t *pb, const uint8_t *drop, uint16_t old_count)
+{
+    if (pb == NULL || drop == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    // only this task moves the live slot, so the path holds without the lock
+    char book_path[64];
+    make_live_path(pb, PB_FILE_BOOK, book_path, sizeof(book_path));
+
+    reset_sync_state(pb);
+    pb->sync_in_progress = true;
+    esp_err_t err = init_phonebook_file(pb);
+
+    // the live book is only read here; the scheduler queues the copy for the shadow
+    pb_book_reader_t r;
+    if (err == ESP_OK) {
+        err = pb_book_open(&r, book_path, NULL);
+    }
+    if (err != ESP_OK) {
+        phonebook_abort_sync(pb);
+        return err;
+    }
+    contact_t *c = malloc(sizeof(contact_t));
+    uint16_t ordinal = 0;
+    while (c != NULL && err == ESP_OK && pb_book_next(&r, c, NULL)) {
+        bool dropped = ordinal < old_count && (drop[ordinal / 8] & (1u << (ordinal % 8)));
+        if (!dropped && (err = append_contact_to_file(pb, c)) == ESP_OK) {
+            pb->shadow_count++;
+        }
+        ordinal++;
+    }
+    pb_book_close(&r);
+    if (c == NULL) {
+        err = ESP_ERR_NO_MEM;
+    }
+    free(c);
+    if (err != ESP_OK) {
+        phonebook_abort_sync(pb);
+        return err;
+    }
+    pb->retained = pb->shadow_count;
+    ESP_LOGI(TAG, "Delta sync: kept %d of %d contacts", pb->retained, ordinal);
+    return ESP_OK;
+}
+
+void phonebook_abort_sync(phonebook_t *pb)
+{
+    if (pb == NULL || !pb->sync_in_progress) {
+        return;
+    }
+    remove_slot(pb, pb->slot ^ 1);
+    reset_sync_state(pb);
+    pb->sync_in_progress = false;
+    ESP_LOGW(TAG, "Sync abandoned, keeping %d contacts", pb->contact_count);
+}
+
+// Remember that the vCard at pos was not stored
+static void mark_skipped(phonebook_t *pb, uint16_t pos)
+{
+    if (pos / 8 >= pb->skipped_len) {
+        uint16_t len = (pos / 8 + 64) & ~63;
+        uint8_t *bits = realloc(pb->skipped, len);
+        if (bits == NULL) {
+            return;
+        }
+        memset(bits + pb->skipped_len, 0, len - pb->skipped_len);
+        pb->skipped = bits;
+        pb->skipped_len = len;
+    }
+    pb->skipped[pos / 8] |= 1u << (pos % 8);
+}
+
+void phonebook_skip_vcard(phonebook_t *pb)
+{
+    if (pb != NULL && pb->vcards_seen < UINT16_MAX) {
+        mark_skipped(pb, pb->vcards_seen++);
+    }
+}
+
+void phonebook_resume_at(phonebook_t *pb, uint16_t pos)
+{
+    if (pb == NULL || !pb->sync_in_progress) {
+        return;
+    }
+    pb_vcard_init(pb->vcard, store_vcard, pb);
+    pb->replay = pb->vcards_seen > pos ? pb->vcards_seen - pos : 0;
+}
+
+bool phonebook_vcard_stored(const phonebook_t *pb, uint16_t pos)
+{
+    if (pos >= pb->vcards_seen) {
+        return false;
+    }
+    return pb->skipped == NULL || pos / 8 >= pb->skipped_len || !(pb->skipped[pos / 8] & (1u << (pos % 8)));
+}
+
 esp_err_t phonebook_delete(esp_bd_addr_t device_addr)
 {
     phonebook_list_node_t **node_ptr = &phonebook_list_head;
@@ -347,13 +667,21 @@ esp_err_t phonebook_delete(esp_bd_addr_t device_addr)
             phonebook_list_node_t *to_delete = *node_ptr;
             *node_ptr = (*node_ptr)->next;
             
-            char filepath[64];
-            make_phonebook_path(device_addr, filepath, sizeof(filepath));
-            remove(filepath);
+            phonebook_abort_sync(&to_delete->phonebook);
+            xSemaphoreTake(s_index_lock, portMAX_DELAY);
+            pb_number_index_unload(&to_delete->phonebook.number_index);
+            pb_name_index_unload(&to_delete->phonebook.name_index);
+            xSemaphoreGive(s_index_lock);
+            remove_slot(&to_delete->phonebook, 0);
+            remove_slot(&to_delete->phonebook, 1);
+            pb_sync_forget(device_addr);
             
             if (to_delete->phonebook.write_buffer) {
                 free(to_delete->phonebook.write_buffer);
             }
+            free(to_delete->phonebook.skipped);
+            free(to_delete->phonebook.vcard);
+            free(to_delete->phonebook.cache);
             free(to_delete);
             
             ESP_LOGI(TAG, "Deleted phonebook for device");
@@ -365,124 +693,40 @@ esp_err_t phonebook_delete(esp_bd_addr_t device_addr)
     return ESP_ERR_NOT_FOUND;
 }
 
-static void parse_vcard_line(const char *line, contact_t *contact)
-{
-    if (strncmp(line, "FN;CHARSET=UTF-8:", 17) == 0) {
-        strncpy(contact->full_name, line + 17, MAX_NAME_LEN - 1);
-        contact->full_name[MAX_NAME_LEN - 1] = '\0';
-    }
-    else if (strncmp(line, "FN:", 3) == 0) {
-        strncpy(contact->full_name, line + 3, MAX_NAME_LEN - 1);
-        contact->full_name[MAX_NAME_LEN - 1] = '\0';
-    }
-    else if (strncmp(line, "TEL", 3) == 0) {
-        if (contact->phone_count < MAX_PHONES_PER_CONTACT) {
-            const char *colon = strchr(line, ':');
-            if (colon) {
-                char raw_number[MAX_PHONE_LEN];
-                strncpy(raw_number, colon + 1, MAX_PHONE_LEN - 1);
-                raw_number[MAX_PHONE_LEN - 1] = '\0';
-                
-                // Normalize the phone number
-                normalize_phone_number(raw_number, 
-                                     contact->phones[contact->phone_count].number,
-                                     MAX_PHONE_LEN,
-                                     g_country_code);
-                
-                // Extract type
-                const char *type_start = strstr(line, "TYPE=");
-                if (type_start) {
-                    type_start += 5;
-                    const char *type_end = strchr(type_start, ':');
-                    if (!type_end) type_end = strchr(type_start, ';');
-                    if (type_end) {
-                        size_t len = type_end - type_start;
-                        if (len >= 16) len = 15;
-                        strncpy(contact->phones[contact->phone_count].type, 
-                               type_start, len);
-                        contact->phones[contact->phone_count].type[len] = '\0';
-                    }
-                } else {
-                    strcpy(contact->phones[contact->phone_count].type, "OTHER");
-                }
-                
-                contact->phone_count++;
-            }
-        }
-    }
-}
-
-static esp_err_t parse_vcard(const char *vcard_text, contact_t *contact)
+// One parsed vCard: stored when it has a name and a number, counted either way
+static void store_vcard(contact_t *contact, void *ctx)
 {
-    memset(contact, 0, sizeof(contact_t));
-    contact->active = true;
-    
-    char *line_start = (char*)vcard_text;
-    char *line_end;
-    
-    while ((line_end = strstr(line_start, "\r\n")) != NULL) {
-        *line_end = '\0';
-        
-        if (strlen(line_start) > 0) {
-            parse_vcard_line(line_start, contact);
-        }
-        
-        line_start = line_end + 2;
+    phonebook_t *pb = ctx;
+    if (pb->replay > 0) {
+        pb->replay--;
+        return;
     }
-    
-    if (strlen(line_start) > 0) {
-        parse_vcard_line(line_start, contact);
+    for (int i = 0; i < contact->phone_count; i++) {
+        char raw_number[MAX_PHONE_LEN];
+        strcpy(raw_number, contact->phones[i].number);
+        normalize_phone_number(raw_number, contact->phones[i].number, MAX_PHONE_LEN, g_country_code);
     }
-    
-    return ESP_OK;
-}
 
-static esp_err_t process_complete_vcards(phonebook_t *pb)
-{
-    char *search_start = pb->vcard_buffer;
-    char *vcard_start;
-    char *vcard_end;
-    
-    while ((vcard_start = strstr(search_start, "BEGIN:VCARD")) != NULL) {
-        vcard_end = strstr(vcard_start, "END:VCARD");
-        
-        if (vcard_end == NULL) {
-            size_t remaining = strlen(vcard_start);
-            memmove(pb->vcard_buffer, vcard_start, remaining);
-            pb->buffer_pos = remaining;
-            pb->vcard_buffer[pb->buffer_pos] = '\0';
-            return ESP_OK;
-        }
-        
-        vcard_end += strlen("END:VCARD");
-        char saved_char = *vcard_end;
-        *vcard_end = '\0';
-        
-        contact_t temp_contact;
-        if (parse_vcard(vcard_start, &temp_contact) == ESP_OK) {
-            if (strlen(temp_contact.full_name) > 0 && temp_contact.phone_count > 0) {
-                if (append_contact_to_file(pb, &temp_contact) == ESP_OK) {
-                    pb->contact_count++;
-                    
-                    if (pb->contact_count % 50 == 0) {
-                        ESP_LOGI(TAG, "Processed %d contacts", pb->contact_count);
-                    }
-                } else {
-                    ESP_LOGW(TAG, "Failed to write contact to file");
-                }
+    bool stored = false;
+    if (contact->full_name[0] != '\0' && contact->phone_count > 0) {
+        if (append_contact_to_file(pb, contact) == ESP_OK) {
+            pb->shadow_count++;
+            stored = true;
+            
+            if (pb->shadow_count % 50 == 0) {
+                ESP_LOGI(TAG, "Processed %d contacts", pb->shadow_count);
             }
+        } else {
+            ESP_LOGW(TAG, "Failed to write contact to file");
         }
-        
-        *vcard_end = saved_char;
-        search_start = vcard_end;
     }
-    
-    if (strstr(pb->vcard_buffer, "BEGIN:VCARD") == NULL) {
-        pb->buffer_pos = 0;
-        pb->vcard_buffer[0] = '\0';
+    // positions tie the download to the vCard listing saved with the sync state
+    if (!stored) {
+        mark_skipped(pb, pb->vcards_seen);
+    }
+    if (pb->vcards_seen < UINT16_MAX) {
+        pb->vcards_seen++;
     }
-    
-    return ESP_OK;
 }
 
 esp_err_t phonebook_process_chunk(phonebook_t *pb, const char *data, uint16_t len)
@@ -491,21 +735,9 @@ esp_err_t phonebook_process_chunk(phonebook_t *pb, const char *data, uint16_t le
         return ESP_ERR_INVALID_ARG;
     }
     
-    if (pb->buffer_pos + len >= VCARD_BUFFER_SIZE) {
-        ESP_LOGE(TAG, "vCard buffer overflow, processing partial buffer");
-        process_complete_vcards(pb);
-        
-        if (pb->buffer_pos + len >= VCARD_BUFFER_SIZE) {
-            ESP_LOGE(TAG, "Buffer still full after processing");
-            return ESP_ERR_NO_MEM;
-        }
-    }
-    
-    memcpy(pb->vcard_buffer + pb->buffer_pos, data, len);
-    pb->buffer_pos += len;
-    pb->vcard_buffer[pb->buffer_pos] = '\0';
-    
-    return process_complete_vcards(pb);
+    // parsed in place; only the parser state is carried to the next chunk
+    pb_vcard_feed(pb->vcard, data, len);
+    return ESP_OK;
 }
 
 esp_err_t phonebook_finalize_sync(phonebook_t *pb)
@@ -514,134 +746,320 @@ esp_err_t phonebook_finalize_sync(phonebook_t *pb)
         return ESP_ERR_INVALID_ARG;
     }
     
-    process_complete_vcards(pb);
+    pb_vcard_finish(pb->vcard);
     
     // Flush any remaining contacts in batch buffer
     flush_write_buffer(pb);
     
-    esp_err_t err = update_contact_count_in_file(pb);
+    if (build_indexes(pb) != ESP_OK) {
+        ESP_LOGW(TAG, "Index build failed, lookups will scan the book");
+    }
+    
+    // the generation goes on last, once everything else is on flash
+    uint32_t generation = pb->generation + 1;
+    esp_err_t err = write_book_header(pb, generation);
+    if (err == ESP_OK) {
+        err = flash_sched_flush(portMAX_DELAY);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to finalize phonebook, keeping the previous one");
+        phonebook_abort_sync(pb);
+        return err;
+    }
+    swap_in_shadow(pb, generation);
     
     pb->sync_in_progress = false;
-    pb->buffer_pos = 0;
     
-    if (err == ESP_OK) {
-        ESP_LOGI(TAG, "Phonebook sync completed: %d contacts stored in flash", pb->contact_count);
+    ESP_LOGI(TAG, "Phonebook sync completed: %d contacts stored in flash, generation %u",
+             pb->contact_count, (unsigned)generation);
+    return ESP_OK;
+}
+
+static uint32_t book_file_size(const char *path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 ? (uint32_t)st.st_size : 0;
+}
+
+// Open the live book for a scan; a new book swapped in meanwhile may cut the scan short
+static esp_err_t open_live_book(phonebook_t *pb, pb_book_reader_t *r)
+{
+    char path[64];
+    xSemaphoreTake(s_index_lock, portMAX_DELAY);
+    make_live_path(pb, PB_FILE_BOOK, path, sizeof(path));
+    esp_err_t err = pb_book_open(r, path, NULL);
+    xSemaphoreGive(s_index_lock);
+    return err;
+}
+
+// Load the name index if needed; call with s_index_lock held
+static bool name_index_ready(phonebook_t *pb, const char *index_path, const char *book_path)
+{
+    return pb->name_index.loaded ||
+           pb_name_index_load(&pb->name_index, index_path, book_file_size(book_path)) == ESP_OK;
+}
+
+bool phonebook_indexes_current(phonebook_t *pb)
+{
+    char book_path[64], path[64];
+    pb_key_reader_t keys;
+    xSemaphoreTake(s_index_lock, portMAX_DELAY);
+    make_live_path(pb, PB_FILE_BOOK, book_path, sizeof(book_path));
+    uint32_t book_size = book_file_size(book_path);
+    make_live_path(pb, PB_FILE_NUMBERS, path, sizeof(path));
+    bool current = pb->number_index.loaded ||
+                   pb_number_index_load(&pb->number_index, path, book_size) == ESP_OK;
+    make_live_path(pb, PB_FILE_NAMES, path, sizeof(path));
+    current = current && name_index_ready(pb, path, book_path);
+    make_live_path(pb, PB_FILE_KEYS, path, sizeof(path));
+    if (current && (current = pb_key_index_open(&keys, path, book_size) == ESP_OK)) {
+        pb_key_index_close(&keys);
+    }
+    make_live_path(pb, PB_FILE_TRIGRAMS, path, sizeof(path));
+    current = current && pb_fuzzy_index_current(path, book_size);
+    xSemaphoreGive(s_index_lock);
+    return current;
+}
+
+// Scanning without the search keys: each name is folded here instead
+static bool query_match(const phonebook_cursor_t *cur, const contact_t *c)
+{
+    char key[PB_FOLD_MAX];
+    switch (cur->query.type) {
+    case PHONEBOOK_QUERY_LETTER:
+        pb_fold(c->full_name, key, 8);
+        return pb_name_bucket(key[0]) == cur->bucket;
+    case PHONEBOOK_QUERY_NAME:
+        pb_fold(c->full_name, key, sizeof(key));
+        return strstr(key, cur->key) != NULL;
+    default:
+        return true;
+    }
+}
+
+esp_err_t phonebook_query_open(phonebook_t *pb, const phonebook_query_t *query, phonebook_cursor_t *cur)
+{
+    if (pb == NULL || query == NULL || cur == NULL ||
+        (query->type == PHONEBOOK_QUERY_NAME && query->text == NULL)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(cur, 0, sizeof(*cur));
+    cur->pb = pb;
+    cur->query = *query;
+    cur->bucket = pb_name_bucket(query->letter);
+    if (query->type == PHONEBOOK_QUERY_NAME) {
+        pb_fold(query->text, cur->key, sizeof(cur->key));
+    }
+
+    char book_path[64], index_path[64], keys_path[64];
+    esp_err_t err = ESP_OK;
+    xSemaphoreTake(s_index_lock, portMAX_DELAY);
+    make_live_path(pb, PB_FILE_BOOK, book_path, sizeof(book_path));
+    make_live_path(pb, PB_FILE_NAMES, index_path, sizeof(index_path));
+    make_live_path(pb, PB_FILE_KEYS, keys_path, sizeof(keys_path));
+    cur->generation = pb->generation;
+
+    // Letters and plain paging come straight off the name index, substring matches off the search keys
+    if (query->type != PHONEBOOK_QUERY_NAME && name_index_ready(pb, index_path, book_path)) {
+        bool letter = query->type == PHONEBOOK_QUERY_LETTER;
+        cur->next = (letter ? pb->name_index.jump[cur->bucket] : 0) + query->offset;
+        cur->end = letter ? pb->name_index.jump[cur->bucket + 1] : pb->name_index.entries;
+        cur->indexed = true;
+        cur->book = fopen(book_path, "rb");
+        err = cur->book ? ESP_OK : ESP_ERR_NOT_FOUND;
+    } else if (query->type == PHONEBOOK_QUERY_NAME && (cur->keys = malloc(sizeof(pb_key_reader_t))) != NULL &&
+               pb_key_index_open(cur->keys, keys_path, book_file_size(book_path)) == ESP_OK) {
+        cur->skip = query->offset;
+        cur->book = fopen(book_path, "rb");
+        if (cur->book == NULL) {
+            pb_key_index_close(cur->keys);
+            free(cur->keys);
+            cur->keys = NULL;
+            err = ESP_ERR_NOT_FOUND;
+        }
     } else {
-        ESP_LOGE(TAG, "Failed to finalize phonebook");
+        free(cur->keys);
+        cur->keys = NULL;
+        cur->skip = query->offset;
+        cur->reader = malloc(sizeof(pb_book_reader_t));
+        err = cur->reader ? pb_book_open(cur->reader, book_path, NULL) : ESP_ERR_NO_MEM;
+        if (err != ESP_OK) {
+            free(cur->reader);
+            cur->reader = NULL;
+        }
     }
-    
+    xSemaphoreGive(s_index_lock);
     return err;
 }
 
-contact_t* phonebook_search_by_letter(phonebook_t *pb, char letter, uint16_t *count)
+static bool query_next_indexed(phonebook_cursor_t *cur, contact_t *out)
 {
-    if (pb == NULL || count == NULL) {
-        return NULL;
+    if (cur->page_pos == cur->page_len) {
+        if (cur->next >= cur->end) {
+            return false;
+        }
+        uint32_t n = cur->end - cur->next;
+        if (n > PHONEBOOK_CURSOR_PAGE) {
+            n = PHONEBOOK_CURSOR_PAGE;
+        }
+        // a new book swapped in meanwhile ends the cursor
+        xSemaphoreTake(s_index_lock, portMAX_DELAY);
+        cur->page_len = 0;
+        if (cur->pb->generation == cur->generation) {
+            char index_path[64];
+            make_live_path(cur->pb, PB_FILE_NAMES, index_path, sizeof(index_path));
+            cur->page_len = pb_name_index_read(&cur->pb->name_index, index_path, cur->next, n, cur->page);
+        }
+        xSemaphoreGive(s_index_lock);
+        cur->page_pos = 0;
+        cur->next += cur->page_len;
+        if (cur->page_len == 0) {
+            return false;
+        }
     }
-    
-    letter = toupper(letter);
-    *count = 0;
-    
-    char filepath[64];
-    make_phonebook_path(pb->device_addr, filepath, sizeof(filepath));
-    
-    FILE *f = fopen(filepath, "rb");
-    if (f == NULL) {
-        return NULL;
+    return pb_book_read_at(cur->book, cur->page[cur->page_pos++], out) == ESP_OK;
+}
+
+// Offset of the next record whose search key holds the folded text
+static bool query_next_key(phonebook_cursor_t *cur, uint32_t *offset)
+{
+    char key[PB_FOLD_MAX];
+    if (cur->pb->generation != cur->generation) {
+        return false;
     }
-    
-    uint16_t total_count;
-    fread(&total_count, sizeof(uint16_t), 1, f);
-    
-    for (int i = 0; i < total_count; i++) {
-        contact_t temp_contact;
-        if (fread(&temp_contact, sizeof(contact_t), 1, f) == 1) {
-            if (temp_contact.active && toupper(temp_contact.full_name[0]) == letter) {
-                (*count)++;
-            }
+    while (pb_key_index_next(cur->keys, key, offset)) {
+        if (strstr(key, cur->key) == NULL) {
+            continue;
+        }
+        if (cur->skip > 0) {
+            cur->skip--;
+            continue;
         }
+        return true;
     }
-    
-    if (*count == 0) {
-        fclose(f);
-        return NULL;
+    return false;
+}
+
+bool phonebook_query_next(phonebook_cursor_t *cur, contact_t *out)
+{
+    if (cur->query.limit > 0 && cur->returned >= cur->query.limit) {
+        return false;
     }
-    
-    contact_t *results = (contact_t*)malloc(sizeof(contact_t) * (*count));
-    if (results == NULL) {
-        fclose(f);
-        *count = 0;
-        return NULL;
+    if (cur->keys) {
+        uint32_t offset;
+        if (cur->book == NULL || !query_next_key(cur, &offset) ||
+            pb_book_read_at(cur->book, offset, out) != ESP_OK) {
+            return false;
+        }
+        cur->returned++;
+        return true;
     }
-    
-    fseek(f, sizeof(uint16_t), SEEK_SET);
-    int idx = 0;
-    for (int i = 0; i < total_count && idx < *count; i++) {
-        contact_t temp_contact;
-        if (fread(&temp_contact, sizeof(contact_t), 1, f) == 1) {
-            if (temp_contact.active && toupper(temp_contact.full_name[0]) == letter) {
-                memcpy(&results[idx++], &temp_contact, sizeof(contact_t));
-            }
+    if (cur->indexed) {
+        if (cur->book == NULL || !query_next_indexed(cur, out)) {
+            return false;
         }
+        cur->returned++;
+        return true;
     }
-    
-    fclose(f);
-    return results;
+    // the old book's files go once a new one is swapped in
+    if (cur->reader == NULL || cur->pb->generation != cur->generation) {
+        return false;
+    }
+    while (pb_book_next(cur->reader, out, NULL)) {
+        if (!query_match(cur, out)) {
+            continue;
+        }
+        if (cur->skip > 0) {
+            cur->skip--;
+            continue;
+        }
+        cur->returned++;
+        return true;
+    }
+    return false;
 }
 
-contact_t* phonebook_search_by_name(phonebook_t *pb, const char *name, uint16_t *count)
+void phonebook_query_close(phonebook_cursor_t *cur)
 {
-    if (pb == NULL || name == NULL || count == NULL) {
-        return NULL;
+    if (cur->book) {
+        fclose(cur->book);
     }
-    
-    *count = 0;
-    
-    char filepath[64];
-    make_phonebook_path(pb->device_addr, filepath, sizeof(filepath));
-    
-    FILE *f = fopen(filepath, "rb");
-    if (f == NULL) {
-        return NULL;
+    if (cur->reader) {
+        pb_book_close(cur->reader);
+        free(cur->reader);
     }
-    
-    uint16_t total_count;
-    fread(&total_count, sizeof(uint16_t), 1, f);
-    
-    for (int i = 0; i < total_count; i++) {
-        contact_t temp_contact;
-        if (fread(&temp_contact, sizeof(contact_t), 1, f) == 1) {
-            if (temp_contact.active && strcasestr(temp_contact.full_name, name) != NULL) {
-                (*count)++;
+    if (cur->keys) {
+        pb_key_index_close(cur->keys);
+        free(cur->keys);
+    }
+    memset(cur, 0, sizeof(*cur));
+}
+
+uint16_t phonebook_query(phonebook_t *pb, const phonebook_query_t *query, phonebook_query_cb_t cb, void *ctx)
+{
+    phonebook_cursor_t cur;
+    if (phonebook_query_open(pb, query, &cur) != ESP_OK) {
+        return 0;
+    }
+    uint16_t n = 0;
+    if (cb == NULL && cur.indexed) {
+        // counting an indexed range needs no reads
+        uint32_t left = cur.end > cur.next ? cur.end - cur.next : 0;
+        n = (query->limit > 0 && left > query->limit) ? query->limit : (left > UINT16_MAX ? UINT16_MAX : left);
+    } else if (cb == NULL && cur.keys) {
+        // so does counting name matches, from the search keys alone
+        uint32_t offset;
+        while ((query->limit == 0 || n < query->limit) && n < UINT16_MAX && query_next_key(&cur, &offset)) {
+            n++;
+        }
+    } else {
+        contact_t *c = malloc(sizeof(contact_t));
+        while (c != NULL && phonebook_query_next(&cur, c)) {
+            n++;
+            if (cb != NULL && !cb(c, ctx)) {
+                break;
             }
         }
+        free(c);
     }
-    
-    if (*count == 0) {
-        fclose(f);
-        return NULL;
+    phonebook_query_close(&cur);
+    return n;
+}
+
+uint16_t phonebook_fuzzy_search(phonebook_t *pb, const char *text, phonebook_match_t *out, uint16_t max,
+                                uint32_t budget_us)
+{
+    if (pb == NULL || text == NULL || out == NULL) {
+        return 0;
     }
-    
-    contact_t *results = (contact_t*)malloc(sizeof(contact_t) * (*count));
-    if (results == NULL) {
-        fclose(f);
-        *count = 0;
-        return NULL;
+    char query[PB_FOLD_MAX];
+    pb_fold(text, query, sizeof(query));
+    pb_fuzzy_hit_t hits[PB_FUZZY_MAX_HITS];
+    if (max > PB_FUZZY_MAX_HITS) {
+        max = PB_FUZZY_MAX_HITS;
     }
-    
-    fseek(f, sizeof(uint16_t), SEEK_SET);
-    int idx = 0;
-    for (int i = 0; i < total_count && idx < *count; i++) {
-        contact_t temp_contact;
-        if (fread(&temp_contact, sizeof(contact_t), 1, f) == 1) {
-            if (temp_contact.active && strcasestr(temp_contact.full_name, name) != NULL) {
-                memcpy(&results[idx++], &temp_contact, sizeof(contact_t));
-            }
+
+    char book_path[64], trigram_path[64], keys_path[64];
+    bool complete;
+    uint16_t found = 0;
+    xSemaphoreTake(s_index_lock, portMAX_DELAY);
+    make_live_path(pb, PB_FILE_BOOK, book_path, sizeof(book_path));
+    make_live_path(pb, PB_FILE_TRIGRAMS, trigram_path, sizeof(trigram_path));
+    make_live_path(pb, PB_FILE_KEYS, keys_path, sizeof(keys_path));
+    int n = pb_fuzzy_search(trigram_path, keys_path, book_file_size(book_path), query, hits, max,
+                            budget_us, &complete);
+    FILE *f = n > 0 ? fopen(book_path, "rb") : NULL;
+    for (int i = 0; f != NULL && i < n; i++) {
+        if (pb_book_read_at(f, hits[i].offset, &out[found].contact) == ESP_OK) {
+            out[found++].distance = hits[i].distance;
         }
     }
-    
-    fclose(f);
-    return results;
+    if (f) fclose(f);
+    xSemaphoreGive(s_index_lock);
+    if (!complete) {
+        ESP_LOGD(TAG, "Fuzzy search for '%s' ran out of time, %u matches so far", text, found);
+    }
+    return found;
 }
 
 phone_number_t* phonebook_get_numbers(phonebook_t *pb, const char *full_name, uint8_t *count)
@@ -652,47 +1070,108 @@ phone_number_t* phonebook_get_numbers(phonebook_t *pb, const char *full_name, ui
     
     *count = 0;
     
-    char filepath[64];
-    make_phonebook_path(pb->device_addr, filepath, sizeof(filepath));
-    
-    FILE *f = fopen(filepath, "rb");
-    if (f == NULL) {
+    pb_book_reader_t r;
+    if (open_live_book(pb, &r) != ESP_OK) {
         return NULL;
     }
     
-    uint16_t total_count;
-    fread(&total_count, sizeof(uint16_t), 1, f);
-    
-    for (int i = 0; i < total_count; i++) {
-        contact_t temp_contact;
-        if (fread(&temp_contact, sizeof(contact_t), 1, f) == 1) {
-            if (temp_contact.active && strcmp(temp_contact.full_name, full_name) == 0) {
-                *count = temp_contact.phone_count;
-                
-                if (*count == 0) {
-                    fclose(f);
-                    return NULL;
-                }
-                
-                phone_number_t *numbers = (phone_number_t*)malloc(sizeof(phone_number_t) * (*count));
-                if (numbers == NULL) {
-                    fclose(f);
-                    *count = 0;
-                    return NULL;
-                }
-                
-                memcpy(numbers, temp_contact.phones, sizeof(phone_number_t) * (*count));
-                fclose(f);
-                return numbers;
+    contact_t temp_contact;
+    while (pb_book_next(&r, &temp_contact, NULL)) {
+        if (strcmp(temp_contact.full_name, full_name) == 0) {
+            *count = temp_contact.phone_count;
+            
+            if (*count == 0) {
+                pb_book_close(&r);
+                return NULL;
+            }
+            
+            phone_number_t *numbers = (phone_number_t*)malloc(sizeof(phone_number_t) * (*count));
+            if (numbers == NULL) {
+                pb_book_close(&r);
+                *count = 0;
+                return NULL;
             }
+            
+            memcpy(numbers, temp_contact.phones, sizeof(phone_number_t) * (*count));
+            pb_book_close(&r);
+            return numbers;
         }
     }
     
-    fclose(f);
+    pb_book_close(&r);
+    return NULL;
+}
+
+// Read the record at offset and check it still carries the number; NULL for a hash collision
+static contact_t *read_contact_with_number(FILE *f, uint32_t offset, const char *normalized)
+{
+    contact_t *c = malloc(sizeof(contact_t));
+    if (c == NULL) {
+        return NULL;
+    }
+    if (pb_book_read_at(f, offset, c) == ESP_OK) {
+        for (int j = 0; j < c->phone_count; j++) {
+            if (strcmp(c->phones[j].number, normalized) == 0) {
+                return c;
+            }
+        }
+    }
+    free(c);
     return NULL;
 }
 
 contact_t* phonebook_search_by_number(phonebook_t *pb, const char *number)
+{
+    if (pb == NULL || number == NULL) {
+        return NULL;
+    }
+
+    int64_t t0 = esp_timer_get_time();
+    char normalized_search[MAX_PHONE_LEN];
+    normalize_phone_number(number, normalized_search, MAX_PHONE_LEN, g_country_code);
+
+    char book_path[64], index_path[64];
+    contact_t *result = NULL;
+    contact_t cached;
+    xSemaphoreTake(s_index_lock, portMAX_DELAY);
+    uint32_t generation = pb->generation;
+    make_live_path(pb, PB_FILE_BOOK, book_path, sizeof(book_path));
+    make_live_path(pb, PB_FILE_NUMBERS, index_path, sizeof(index_path));
+    pb_cache_result_t hit = pb_cache_get(pb->cache, normalized_search, &cached);
+    if (hit == PB_CACHE_HIT) {
+        result = malloc(sizeof(contact_t));
+        if (result) {
+            memcpy(result, &cached, sizeof(contact_t));
+        }
+    } else if (hit == PB_CACHE_MISS) {
+        if (pb->number_index.loaded ||
+            pb_number_index_load(&pb->number_index, index_path, book_file_size(book_path)) == ESP_OK) {
+            uint32_t offsets[PB_NUMBER_MAX_CANDIDATES];
+            int n = pb_number_index_find(&pb->number_index, index_path, pb_number_hash(normalized_search),
+                                         offsets, PB_NUMBER_MAX_CANDIDATES);
+            if (n > 0) {
+                FILE *f = fopen(book_path, "rb");
+                for (int i = 0; f != NULL && i < n && result == NULL; i++) {
+                    result = read_contact_with_number(f, offsets[i], normalized_search);
+                }
+                if (f) fclose(f);
+            }
+        } else {
+            xSemaphoreGive(s_index_lock);
+            result = phonebook_scan_by_number(pb, number);
+            xSemaphoreTake(s_index_lock, portMAX_DELAY);
+        }
+        // a new book may have been swapped in meanwhile; it must not inherit this answer
+        if (pb->generation == generation) {
+            pb_cache_put(pb->cache, normalized_search, result);
+        }
+    }
+    xSemaphoreGive(s_index_lock);
+    metrics_observe(s_m_lookup_us, (uint32_t)(esp_timer_get_time() - t0));
+    return result;
+}
+
+contact_t* phonebook_scan_by_number(phonebook_t *pb, const char *number)
 {
     if (pb == NULL || number == NULL) {
         return NULL;
@@ -702,25 +1181,13 @@ contact_t* phonebook_search_by_number(phonebook_t *pb, const char *number)
     char normalized_search[MAX_PHONE_LEN];
     normalize_phone_number(number, normalized_search, MAX_PHONE_LEN, g_country_code);
     
-    char filepath[64];
-    make_phonebook_path(pb->device_addr, filepath, sizeof(filepath));
-    
-    FILE *f = fopen(filepath, "rb");
-    if (f == NULL) {
+    pb_book_reader_t r;
+    if (open_live_book(pb, &r) != ESP_OK) {
         return NULL;
     }
     
-    uint16_t total_count;
-    fread(&total_count, sizeof(uint16_t), 1, f);
-    
-    for (int i = 0; i < total_count; i++) {
-        contact_t temp_contact;
-        if (fread(&temp_contact, sizeof(contact_t), 1, f) != 1) {
-            continue;
-        }
-        
-        if (!temp_contact.active) continue;
-        
+    contact_t temp_contact;
+    while (pb_book_next(&r, &temp_contact, NULL)) {
         // Direct string comparison since all numbers are normalized
         for (int j = 0; j < temp_contact.phone_count; j++) {
             if (strcmp(temp_contact.phones[j].number, normalized_search) == 0) {
@@ -728,17 +1195,17 @@ contact_t* phonebook_search_by_number(phonebook_t *pb, const char *number)
                 if (result) {
                     memcpy(result, &temp_contact, sizeof(contact_t));
                 }
-                fclose(f);
+                pb_book_close(&r);
                 return result;
             }
         }
     }
     
-    fclose(f);
+    pb_book_close(&r);
     return NULL;
 }
 
-void phonebook_print_contact(contact_t *contact)
+void phonebook_print_contact(const contact_t *contact)
 {
     if (contact == NULL) return;
     
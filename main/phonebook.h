@@ -1,10 +1,13 @@
 #ifndef PHONEBOOK_H
 #define PHONEBOOK_H
 
+#include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include "esp_bt_defs.h"
 #include "esp_err.h"
+#include "pb_index.h"
+#include "pb_fold.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -13,8 +16,8 @@ extern "C" {
 #define MAX_NAME_LEN 64
 #define MAX_PHONE_LEN 32
 #define MAX_PHONES_PER_CONTACT 5
-#define VCARD_BUFFER_SIZE 4096
-#define CONTACT_BATCH_SIZE 20
+#define PHONEBOOK_CURSOR_PAGE 16
+#define PHONEBOOK_FUZZY_BUDGET_US 20000     // a fuzzy search per keystroke stays within this
 #define DEFAULT_COUNTRY_CODE "31"  // Netherlands - change as needed
 
 typedef struct {
@@ -31,14 +34,72 @@ typedef struct {
 
 typedef struct {
     esp_bd_addr_t device_addr;
-    uint16_t contact_count;
-    char vcard_buffer[VCARD_BUFFER_SIZE];
-    uint16_t buffer_pos;
+    uint16_t contact_count;             // in the live book; a sync changes it only when it swaps its book in
+    uint16_t shadow_count;              // records written to the shadow book this sync
     bool sync_in_progress;
-    contact_t *write_buffer;
-    uint16_t write_buffer_count;
+    uint16_t vcards_seen;               // vCards parsed this sync, stored or not
+    uint16_t replay;                    // vCards a re-requested page sends again, dropped as they arrive
+    uint16_t retained;                  // records carried over from the old book
+    uint8_t *skipped;                   // bit per vCard seen that was not stored; kept until the next sync
+    uint16_t skipped_len;
+    struct pb_block *write_buffer;      // records waiting to be written, one block
+    struct pb_vcard *vcard;             // parser state carried from one chunk to the next
+    uint8_t slot;                       // file slot of the live book; a sync writes the other
+    uint32_t generation;                // of the live book, 0 for none; bumped by every sync
+    struct pb_cache *cache;             // recent number lookups, cleared when a new book is swapped in
+    pb_number_index_t number_index;     // loaded lazily, dropped when a new book is swapped in
+    pb_name_index_t name_index;         // same
 } phonebook_t;
 
+typedef enum {
+    PHONEBOOK_QUERY_ALL = 0,    // every contact
+    PHONEBOOK_QUERY_LETTER,     // names under a first letter, accents ignored; anything not A-Z for the rest
+    PHONEBOOK_QUERY_NAME,       // names containing text, ignoring case and accents
+} phonebook_query_type_t;
+
+typedef struct {
+    phonebook_query_type_t type;
+    char letter;
+    const char *text;           // must outlive the cursor
+    uint16_t offset;            // matches to skip
+    uint16_t limit;             // 0 for no limit
+} phonebook_query_t;
+
+/*
+ * Results come one at a time, so memory use does not grow with the match
+ * count. ALL and LETTER walk the name index in alphabetical order when it
+ * is loaded, seeking straight to offset; NAME reads the search keys in
+ * stored order and only the records that match. Without those files the
+ * book is scanned block by block. A cursor reads the book that was live
+ * when it opened and ends early if a sync swaps in a new one.
+ */
+typedef struct {
+    phonebook_t *pb;
+    phonebook_query_t query;
+    uint32_t generation;                    // of the book being read
+    int bucket;
+    bool indexed;
+    struct pb_book_reader *reader;          // scanning
+    struct pb_key_reader *keys;             // NAME with search keys
+    char key[PB_FOLD_MAX];                  // NAME: the text folded
+    FILE *book;                             // indexed, or NAME with search keys
+    uint32_t next;                          // indexed: next name index entry to read
+    uint32_t end;
+    uint32_t page[PHONEBOOK_CURSOR_PAGE];   // indexed: record offsets read ahead
+    uint16_t page_len;
+    uint16_t page_pos;
+    uint16_t skip;                          // scanning and NAME: matches still to skip
+    uint16_t returned;
+} phonebook_cursor_t;
+
+// Return false to stop the query
+typedef bool (*phonebook_query_cb_t)(const contact_t *contact, void *ctx);
+
+typedef struct {
+    contact_t contact;
+    uint8_t distance;           // typos between the text and the closest part of the name
+} phonebook_match_t;
+
 typedef struct phonebook_list_node {
     phonebook_t phonebook;
     struct phonebook_list_node *next;
@@ -47,16 +108,47 @@ typedef struct phonebook_list_node {
 // Function prototypes
 esp_err_t phonebook_init(void);
 void phonebook_set_country_code(const char *country_code);
+// Finds or loads a device's book; the stored book stays live until a sync completes
 phonebook_t* phonebook_get_or_create(esp_bd_addr_t device_addr);
+// Path of one of a device's files, ext being ".pbs", ".pbl" and so on
+void phonebook_file_path(const esp_bd_addr_t device_addr, const char *ext, char *path_out, size_t path_len);
+// Start a full download into an empty book
+esp_err_t phonebook_begin_sync(phonebook_t *pb);
+// Start a new book holding the old book's records except those whose bit is set
+// in drop (one bit per record, old_count of them); downloaded vCards follow them
+esp_err_t phonebook_begin_delta(phonebook_t *pb, const uint8_t *drop, uint16_t old_count);
+// Give up on a sync, leaving the live book as it was
+void phonebook_abort_sync(phonebook_t *pb);
+// Count a vCard that never arrived, so later ones keep their positions
+void phonebook_skip_vcard(phonebook_t *pb);
+// A failed page is requested again from vCard pos: drop the vCard it was cut in, and the
+// ones from pos on that already arrived when they come again, so nothing is stored twice
+void phonebook_resume_at(phonebook_t *pb, uint16_t pos);
+// Whether the vCard at a position in this sync's download became a record
+bool phonebook_vcard_stored(const phonebook_t *pb, uint16_t pos);
 phonebook_t* phonebook_find(esp_bd_addr_t device_addr);
 esp_err_t phonebook_delete(esp_bd_addr_t device_addr);
 esp_err_t phonebook_process_chunk(phonebook_t *pb, const char *data, uint16_t len);
 esp_err_t phonebook_finalize_sync(phonebook_t *pb);
-contact_t* phonebook_search_by_letter(phonebook_t *pb, char letter, uint16_t *count);
-contact_t* phonebook_search_by_name(phonebook_t *pb, const char *name, uint16_t *count);
+esp_err_t phonebook_query_open(phonebook_t *pb, const phonebook_query_t *query, phonebook_cursor_t *cur);
+// Copy the next match into out; false once the query is exhausted or its limit reached
+bool phonebook_query_next(phonebook_cursor_t *cur, contact_t *out);
+void phonebook_query_close(phonebook_cursor_t *cur);
+// Run a query to the end, or until cb returns false; returns the matches visited.
+// With no cb, just counts them; an indexed letter or page is counted without reading.
+uint16_t phonebook_query(phonebook_t *pb, const phonebook_query_t *query, phonebook_query_cb_t cb, void *ctx);
+// Names holding text with a few typos at most (none under 4 characters, 1 under 7, else 2),
+// best first, ignoring case and accents. Uses the trigram index; verifying candidates stops
+// after budget_us (0 for no limit) with the best found so far. Returns how many were stored.
+uint16_t phonebook_fuzzy_search(phonebook_t *pb, const char *text, phonebook_match_t *out, uint16_t max,
+                                uint32_t budget_us);
+// Whether the live book has all its indexes, in the current formats
+bool phonebook_indexes_current(phonebook_t *pb);
 phone_number_t* phonebook_get_numbers(phonebook_t *pb, const char *full_name, uint8_t *count);
 contact_t* phonebook_search_by_number(phonebook_t *pb, const char *number);
-void phonebook_print_contact(contact_t *contact);
+// Same, scanning the whole book without the number index; for comparison and fallback
+contact_t* phonebook_scan_by_number(phonebook_t *pb, const char *number);
+void phonebook_print_contact(const contact_t *contact);
 uint16_t phonebook_get_count(phonebook_t *pb);
 
 #ifdef __cplusplus
@@ -0,0 +1,164 @@
+/*
+ * resampler.c - fixed-point sample rate and channel conversion for the I2S tx path
+ */
+
+#include "resampler.h"
+#include <string.h>
+#include <math.h>
+#include "esp_attr.h"
+
+#define RESAMPLER_ONE_Q16       65536u
+#define RESAMPLER_X3_PHASES     3
+#define RESAMPLER_X3_LEN        (RESAMPLER_X3_PHASES * RESAMPLER_X3_TAPS)
+#define RESAMPLER_X3_CUTOFF     0.9f    // fraction of the input Nyquist rate
+#define RESAMPLER_COEF_SHIFT    14      // Q14, leaves headroom for 8 taps of overshoot
+#define RESAMPLER_COEF_ONE      (1 << RESAMPLER_COEF_SHIFT)
+
+/* x3 interpolation filter split into phases: s_x3_coef[p][j] = h[p + 3j] */
+static DRAM_ATTR int16_t s_x3_coef[RESAMPLER_X3_PHASES][RESAMPLER_X3_TAPS];
+static bool s_x3_coef_ready = false;
+
+/* Hann-windowed sinc lowpass at the input Nyquist rate, each phase normalized to unity DC gain */
+void resampler_design_tables(void)
+{
+    if (s_x3_coef_ready) {
+        return;
+    }
+    const float center = (RESAMPLER_X3_LEN - 1) / 2.0f;
+    for (int p = 0; p < RESAMPLER_X3_PHASES; p++) {
+        float h[RESAMPLER_X3_TAPS];
+        float sum = 0.0f;
+        for (int j = 0; j < RESAMPLER_X3_TAPS; j++) {
+            int n = p + RESAMPLER_X3_PHASES * j;
+            float x = RESAMPLER_X3_CUTOFF * (n - center) / RESAMPLER_X3_PHASES;
+            float sinc = (x == 0.0f) ? 1.0f : sinf((float)M_PI * x) / ((float)M_PI * x);
+            float window = 0.5f - 0.5f * cosf(2.0f * (float)M_PI * (n + 1) / (RESAMPLER_X3_LEN + 1));
+            h[j] = sinc * window;
+            sum += h[j];
+        }
+        for (int j = 0; j < RESAMPLER_X3_TAPS; j++) {
+            s_x3_coef[p][j] = (int16_t)lrintf(h[j] / sum * RESAMPLER_COEF_ONE);
+        }
+    }
+    s_x3_coef_ready = true;
+}
+
+IRAM_ATTR void resampler_init(resampler_t *rs, uint32_t in_rate, uint8_t in_ch, uint32_t out_rate, uint8_t out_ch)
+{
+    memset(rs, 0, sizeof(*rs));
+    rs->in_rate = in_rate;
+    rs->out_rate = out_rate;
+    rs->in_ch = in_ch;
+    rs->out_ch = out_ch;
+    if (in_rate == out_rate) {
+        rs->kind = RESAMPLER_COPY;
+    } else if (out_rate == RESAMPLER_X3_PHASES * in_rate) {
+        rs->kind = RESAMPLER_X3;
+    } else {
+        rs->kind = RESAMPLER_CUBIC;
+        rs->step_q16 = (uint32_t)(((uint64_t)in_rate << 16) / out_rate);
+    }
+}
+
+IRAM_ATTR void resampler_reset(resampler_t *rs)
+{
+    rs->pos_q16 = 0;
+    memset(rs->hist, 0, sizeof(rs->hist));
+}
+
+IRAM_ATTR bool resampler_matches(const resampler_t *rs, uint32_t in_rate, uint8_t in_ch, uint32_t out_rate, uint8_t out_ch)
+{
+    return rs->in_rate == in_rate && rs->in_ch == in_ch && rs->out_rate == out_rate && rs->out_ch == out_ch;
+}
+
+static inline int16_t resampler_sat16(int32_t v)
+{
+    return (v > INT16_MAX) ? INT16_MAX : ((v < INT16_MIN) ? INT16_MIN : (int16_t)v);
+}
+
+/* shift one input frame, converted to the output channel count, into the history */
+static inline void resampler_push(resampler_t *rs, const int16_t *frame)
+{
+    memmove(&rs->hist[1], &rs->hist[0], sizeof(rs->hist) - sizeof(rs->hist[0]));
+    if (rs->in_ch == rs->out_ch) {
+        for (int c = 0; c < rs->out_ch; c++) {
+            rs->hist[0][c] = frame[c];
+        }
+    } else if (rs->in_ch == 1) {
+        rs->hist[0][0] = frame[0];
+        rs->hist[0][1] = frame[0];
+    } else {
+        rs->hist[0][0] = (int16_t)(((int32_t)frame[0] + frame[1]) >> 1);
+    }
+}
+
+/* Catmull-Rom between x0 and x1, t in Q16 */
+static inline int16_t resampler_cubic(int32_t xm1, int32_t x0, int32_t x1, int32_t x2, uint32_t t_q16)
+{
+    int64_t t = t_q16 >> 1;     // Q15
+    int32_t a = 3 * (x0 - x1) + x2 - xm1;
+    int32_t b = 2 * xm1 - 5 * x0 + 4 * x1 - x2;
+    int32_t c = x1 - xm1;
+    int32_t v = (int32_t)((a * t) >> 15) + b;
+    v = (int32_t)((v * t) >> 15) + c;
+    return resampler_sat16(x0 + (int32_t)((v * t) >> 16));
+}
+
+IRAM_ATTR size_t resampler_process(resampler_t *rs, const int16_t *in, size_t in_frames, size_t *in_used,
+                                   int16_t *out, size_t out_frames)
+{
+    const uint8_t out_ch = rs->out_ch;
+    size_t produced = 0;
+    size_t used = 0;
+
+    while (used < in_frames) {
+        /* outputs this input frame will produce; stop early rather than overrun out */
+        size_t need;
+        if (rs->kind == RESAMPLER_COPY) {
+            need = 1;
+        } else if (rs->kind == RESAMPLER_X3) {
+            need = RESAMPLER_X3_PHASES;
+        } else {
+            need = (rs->pos_q16 >= RESAMPLER_ONE_Q16) ? 0 :
+                   (RESAMPLER_ONE_Q16 - rs->pos_q16 + rs->step_q16 - 1) / rs->step_q16;
+        }
+        if (produced + need > out_frames) {
+            break;
+        }
+
+        resampler_push(rs, &in[used * rs->in_ch]);
+        used++;
+
+        if (rs->kind == RESAMPLER_COPY) {
+            for (int c = 0; c < out_ch; c++) {
+                out[produced * out_ch + c] = rs->hist[0][c];
+            }
+            produced++;
+        } else if (rs->kind == RESAMPLER_X3) {
+            for (int p = 0; p < RESAMPLER_X3_PHASES; p++) {
+                for (int c = 0; c < out_ch; c++) {
+                    int32_t acc = 0;
+                    for (int j = 0; j < RESAMPLER_X3_TAPS; j++) {
+                        acc += (int32_t)s_x3_coef[p][j] * rs->hist[j][c];
+                    }
+                    out[produced * out_ch + c] = resampler_sat16(acc >> RESAMPLER_COEF_SHIFT);
+                }
+                produced++;
+            }
+        } else {
+            /* interpolate between hist[2] and hist[1], one input frame of lookahead */
+            while (rs->pos_q16 < RESAMPLER_ONE_Q16) {
+                for (int c = 0; c < out_ch; c++) {
+                    out[produced * out_ch + c] = resampler_cubic(rs->hist[3][c], rs->hist[2][c],
+                                                                 rs->hist[1][c], rs->hist[0][c], rs->pos_q16);
+                }
+                produced++;
+                rs->pos_q16 += rs->step_q16;
+            }
+            rs->pos_q16 -= RESAMPLER_ONE_Q16;
+        }
+    }
+
+    *in_used = used;
+    return produced;
+}
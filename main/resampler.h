@@ -0,0 +1,68 @@
+/*
+ * resampler.h - fixed-point sample rate and channel conversion for the I2S tx path
+ *
+ * Three converters, picked from the rates given to resampler_init:
+ *  - equal rates: straight copy (with channel conversion)
+ *  - out = 3 x in (16 kHz HFP/ringtone -> 48 kHz): 24-tap polyphase FIR,
+ *    8 taps per output phase
+ *  - anything else (44.1 kHz A2DP -> 48 kHz): 4-point cubic (Catmull-Rom)
+ *    interpolation with a Q16 phase accumulator
+ * State carries over between calls, so a stream can be fed in arbitrary
+ * block sizes without seams.
+ */
+
+#ifndef RESAMPLER_H
+#define RESAMPLER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RESAMPLER_MAX_CH        2
+#define RESAMPLER_X3_TAPS       8       // per output phase
+
+typedef enum {
+    RESAMPLER_COPY = 0,
+    RESAMPLER_X3,
+    RESAMPLER_CUBIC,
+} resampler_kind_t;
+
+typedef struct {
+    uint32_t in_rate;
+    uint32_t out_rate;
+    uint8_t in_ch;
+    uint8_t out_ch;
+    resampler_kind_t kind;
+    uint32_t step_q16;      // input frames per output frame
+    uint32_t pos_q16;       // next output position between hist[2] and hist[1]
+    int16_t hist[RESAMPLER_X3_TAPS][RESAMPLER_MAX_CH];  // newest input frame at [0]
+} resampler_t;
+
+// Compute the x3 filter; call once before any resampler is used
+void resampler_design_tables(void);
+
+// Cheap enough to call from the audio path when a stream's format changes
+void resampler_init(resampler_t *rs, uint32_t in_rate, uint8_t in_ch, uint32_t out_rate, uint8_t out_ch);
+
+// Forget stream history (start of a new stream with the same format)
+void resampler_reset(resampler_t *rs);
+
+bool resampler_matches(const resampler_t *rs, uint32_t in_rate, uint8_t in_ch, uint32_t out_rate, uint8_t out_ch);
+
+/*
+ * Convert interleaved 16-bit input to interleaved 16-bit output. Stops when
+ * either the input is used up or the output is full; *in_used tells how
+ * many input frames were consumed. Returns output frames written.
+ */
+size_t resampler_process(resampler_t *rs, const int16_t *in, size_t in_frames, size_t *in_used,
+                         int16_t *out, size_t out_frames);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // RESAMPLER_H
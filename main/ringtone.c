@@ -4,6 +4,7 @@
 
 #include "ringtone.h"
 #include "bt_i2s.h"
+#include "app_task_config.h"
 #include "esp_log.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
@@ -14,8 +15,6 @@
 #define RINGTONE_BUFFER_SIZE 1600  // 100ms of audio
 #define RINGTONE_DURATION_MS 2000   // 2 seconds
 
-extern i2s_chan_handle_t tx_chan;
-
 static TaskHandle_t ringtone_task_handle = NULL;
 static volatile bool ringtone_stop_requested = false;
 
@@ -50,7 +49,6 @@ static void ringtone_beep_task(void *arg)
     }
     
     uint32_t phase = 0;
-    size_t bytes_written;
     uint32_t elapsed_ms = 0;
     
     ESP_LOGI(TAG, "Playing ringtone beep");
@@ -61,27 +59,20 @@ static void ringtone_beep_task(void *arg)
         generate_ringtone_buffer(buffer, RINGTONE_BUFFER_SIZE, phase);
         phase += RINGTONE_BUFFER_SIZE;
         
-        // Write to I2S
-        if (tx_chan != NULL) {
-            esp_err_t ret = i2s_channel_write(tx_chan, buffer, 
-                                              RINGTONE_BUFFER_SIZE * sizeof(int16_t), 
-                                              &bytes_written, pdMS_TO_TICKS(100));
-            if (ret != ESP_OK) {
-                ESP_LOGW(TAG, "Failed to write to I2S: %d", ret);
-                break;
-            }
+        // Write to I2S, converted to the tx channel's rate
+        esp_err_t ret = bt_i2s_tx_write_pcm(BT_I2S_TX_SRC_RINGTONE, buffer, RINGTONE_BUFFER_SIZE,
+                                            RINGTONE_SAMPLE_RATE, 1, pdMS_TO_TICKS(100));
+        if (ret != ESP_OK) {
+            ESP_LOGW(TAG, "Failed to write to I2S: %d", ret);
+            break;
         }
         
         elapsed_ms += 100;  // 100ms per buffer
         vTaskDelay(1);
     }
     
-    // Send brief silence to clean up
-    memset(buffer, 0, RINGTONE_BUFFER_SIZE * sizeof(int16_t));
-    if (tx_chan != NULL) {
-        i2s_channel_write(tx_chan, buffer, RINGTONE_BUFFER_SIZE * sizeof(int16_t), 
-                         &bytes_written, pdMS_TO_TICKS(100));
-    }
+    // Fade out instead of stopping on a step
+    bt_i2s_tx_release(BT_I2S_TX_SRC_RINGTONE);
     
     free(buffer);
     ESP_LOGD(TAG, "Ringtone beep finished");
@@ -101,8 +92,9 @@ void ringtone_play_beep(void)
     
     ringtone_stop_requested = false;
     
-    BaseType_t ret = xTaskCreate(ringtone_beep_task, "ringtone_beep", 
-                                  3072, NULL, 5, &ringtone_task_handle);
+    BaseType_t ret = xTaskCreatePinnedToCore(ringtone_beep_task, "ringtone_beep", 
+                                  APP_RINGTONE_TASK_STACK, NULL, APP_RINGTONE_TASK_PRIO,
+                                  &ringtone_task_handle, APP_AUDIO_CORE);
     if (ret != pdPASS) {
         ESP_LOGE(TAG, "Failed to create ringtone task");
     }
@@ -0,0 +1,156 @@
+/*
+ * wsola.c - fixed-point WSOLA time-scale modification for the call speaker path
+ */
+
+#include "wsola.h"
+#include <string.h>
+#include <math.h>
+#include "esp_attr.h"
+
+#define WSOLA_CORR_SHIFT        4       // 12-bit products keep a 120-sample sum in int32
+#define WSOLA_COARSE_STEP       2
+#define WSOLA_STAY_MARGIN       5       // another segment must beat the continuation by 1/32
+
+void wsola_init(wsola_t *w)
+{
+    memset(w, 0, sizeof(*w));
+    /* WSOLA_SEARCH samples of leading silence, so the first search has room behind it */
+    w->len = WSOLA_SEARCH;
+    w->ref_pos = WSOLA_SEARCH;
+    w->nominal_milli = WSOLA_SEARCH * 1000;
+    w->speed = 1000;
+}
+
+IRAM_ATTR void wsola_set_speed(wsola_t *w, uint16_t speed_permille)
+{
+    if (speed_permille < WSOLA_SPEED_MIN) {
+        speed_permille = WSOLA_SPEED_MIN;
+    } else if (speed_permille > WSOLA_SPEED_MAX) {
+        speed_permille = WSOLA_SPEED_MAX;
+    }
+    w->speed = speed_permille;
+}
+
+static IRAM_ATTR int32_t wsola_corr(const int16_t *a, const int16_t *b)
+{
+    int32_t acc = 0;
+    for (int i = 0; i < WSOLA_HOP; i++) {
+        acc += (a[i] >> WSOLA_CORR_SHIFT) * (b[i] >> WSOLA_CORR_SHIFT);
+    }
+    return acc;
+}
+
+/*
+ * Best segment start in [lo, hi] against the continuation at ref_pos: coarse
+ * pass, then the two neighbours. The continuation itself wins unless clearly
+ * beaten, so steady 100% playback is a straight copy.
+ */
+static IRAM_ATTR size_t wsola_search(const int16_t *buf, size_t ref_pos, size_t lo, size_t hi, int32_t *best_corr)
+{
+    const int16_t *ref = &buf[ref_pos];
+    size_t best = lo;
+    int32_t best_c = INT32_MIN;
+    for (size_t c = lo; c <= hi; c += WSOLA_COARSE_STEP) {
+        int32_t v = wsola_corr(&buf[c], ref);
+        if (v > best_c) {
+            best_c = v;
+            best = c;
+        }
+    }
+    size_t center = best;
+    for (int d = -1; d <= 1; d += 2) {
+        if ((d < 0 && center == lo) || (d > 0 && center + 1 > hi)) {
+            continue;
+        }
+        size_t c = center + d;
+        int32_t v = wsola_corr(&buf[c], ref);
+        if (v > best_c) {
+            best_c = v;
+            best = c;
+        }
+    }
+    if (ref_pos >= lo && ref_pos <= hi && best != ref_pos) {
+        int32_t stay = wsola_corr(ref, ref);
+        if (best_c <= stay + (stay >> WSOLA_STAY_MARGIN)) {
+            best = ref_pos;
+            best_c = stay;
+        }
+    }
+    *best_corr = best_c;
+    return best;
+}
+
+IRAM_ATTR size_t wsola_process(wsola_t *w, const int16_t *in, size_t n, int16_t *out, size_t out_max)
+{
+    size_t produced = 0;
+
+    if (w->len + n > WSOLA_BUF_LEN) {
+        w->overflows += w->len + n - WSOLA_BUF_LEN;
+        n = WSOLA_BUF_LEN - w->len;
+    }
+    memcpy(&w->buf[w->len], in, n * sizeof(int16_t));
+    w->len += n;
+    w->samples_in += n;
+
+    for (;;) {
+        size_t nominal = w->nominal_milli / 1000;
+        if (nominal + WSOLA_SEARCH + WSOLA_HOP > w->len || w->ref_pos + WSOLA_HOP > w->len ||
+            produced + WSOLA_HOP > out_max) {
+            break;
+        }
+
+        const int16_t *ref = &w->buf[w->ref_pos];
+        int32_t corr;
+        size_t c;
+        if (w->speed == 1000 && w->ref_pos + WSOLA_SEARCH >= nominal && w->ref_pos <= nominal + WSOLA_SEARCH) {
+            /* nothing to make up at 100%: keep the continuation while the search could reach it */
+            c = w->ref_pos;
+            corr = wsola_corr(ref, ref);
+        } else {
+            c = wsola_search(w->buf, w->ref_pos, nominal - WSOLA_SEARCH, nominal + WSOLA_SEARCH, &corr);
+        }
+        const int16_t *seg = &w->buf[c];
+
+        /* triangular crossfade from the continuation into the chosen segment */
+        for (int i = 0; i < WSOLA_HOP; i++) {
+            out[produced + i] = (int16_t)((ref[i] * (WSOLA_HOP - i) + seg[i] * i) / WSOLA_HOP);
+        }
+        produced += WSOLA_HOP;
+
+        w->steps++;
+        if (w->speed != 1000) {
+            w->stretched_steps++;
+        }
+        w->splice_corr += corr;
+        w->splice_energy_ref += wsola_corr(ref, ref);
+        w->splice_energy_seg += wsola_corr(seg, seg);
+
+        w->ref_pos = c + WSOLA_HOP;
+        w->nominal_milli += (uint32_t)WSOLA_HOP * w->speed;     // exact, so 100% never drifts
+
+        /* drop what neither the next continuation nor the next search can reach */
+        nominal = w->nominal_milli / 1000;
+        size_t keep_from = nominal - WSOLA_SEARCH;
+        if (w->ref_pos < keep_from) {
+            keep_from = w->ref_pos;
+        }
+        if (keep_from > 0) {
+            memmove(w->buf, &w->buf[keep_from], (w->len - keep_from) * sizeof(int16_t));
+            w->len -= keep_from;
+            w->ref_pos -= keep_from;
+            w->nominal_milli -= (uint32_t)keep_from * 1000;
+        }
+    }
+
+    w->samples_out += produced;
+    return produced;
+}
+
+float wsola_quality(const wsola_t *w)
+{
+    if (w->splice_energy_ref == 0 || w->splice_energy_seg == 0) {
+        return 1.0f;        // silence splices cleanly
+    }
+    float q = (float)w->splice_corr / sqrtf((float)w->splice_energy_ref * (float)w->splice_energy_seg);
+    return q < 0.0f ? 0.0f : q;
+}
@@ -0,0 +1,69 @@
+/*
+ * wsola.h - fixed-point WSOLA time-scale modification for the call speaker path
+ *
+ * Plays 16 kHz mono audio at 95..105% speed without changing its pitch, so
+ * the speaker ringbuffer can be pulled toward its target level instead of
+ * dropping or withholding whole frames. Each step emits WSOLA_HOP samples:
+ * the natural continuation of the previous segment is crossfaded into the
+ * input segment, near the nominal read position, that matches it best
+ * (cross-correlation over +-WSOLA_SEARCH samples). At 100% the continuation
+ * is kept without a search and the output equals the input, delayed by
+ * WSOLA_SEARCH samples.
+ */
+
+#ifndef WSOLA_H
+#define WSOLA_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define WSOLA_HOP               120     // synthesis hop and crossfade length, one mSBC frame
+#define WSOLA_SEARCH            80      // +-5 ms, a full pitch period down to 100 Hz
+#define WSOLA_BUF_LEN           512
+#define WSOLA_SPEED_MIN         950     // permille
+#define WSOLA_SPEED_MAX         1050
+#define WSOLA_OUT_MAX           (2 * WSOLA_HOP)     // per call of wsola_process with one frame in
+
+typedef struct {
+    int16_t buf[WSOLA_BUF_LEN];
+    size_t len;                 // valid samples in buf
+    size_t ref_pos;             // natural continuation of the last segment
+    uint32_t nominal_milli;     // nominal read position of the next segment, in 1/1000 samples
+    uint16_t speed;             // permille
+    /* per-stream statistics */
+    uint32_t steps;
+    uint32_t stretched_steps;   // steps at a speed other than 100%
+    uint32_t samples_in;
+    uint32_t samples_out;
+    int64_t splice_corr;        // summed over all splices, for wsola_quality
+    int64_t splice_energy_ref;
+    int64_t splice_energy_seg;
+    uint32_t overflows;         // input dropped because the buffer was full
+} wsola_t;
+
+void wsola_init(wsola_t *w);
+
+// 950..1050; above 1000 consumes input faster than it is played
+void wsola_set_speed(wsola_t *w, uint16_t speed_permille);
+
+/*
+ * Feed n input samples, get back up to out_max output samples. With one
+ * WSOLA_HOP frame in, at most WSOLA_OUT_MAX come out.
+ */
+size_t wsola_process(wsola_t *w, const int16_t *in, size_t n, int16_t *out, size_t out_max);
+
+/*
+ * Normalized cross-correlation between the continuation and the segment
+ * spliced onto it, over all splices since init: 0..1, 1 is seamless.
+ */
+float wsola_quality(const wsola_t *w);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // WSOLA_H
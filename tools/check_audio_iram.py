@@ -0,0 +1,218 @@
+#!/usr/bin/env python
+"""
+check_audio_iram.py - build-time check that the per-frame audio path
+does not live in (or call into) flash.
+
+Usage: check_audio_iram.py <nm> <objdump> <elf> <hotpath list> <main lib>
+
+The list file names one symbol per line. Functions must be placed in IRAM
+and tables in DRAM. The check follows calls transitively through our own
+code (functions defined in <main lib>): every function reached that way
+must be in IRAM too, and must not read constants from flash (an l32r
+literal pointing into DROM). Calls out of our code must land in IRAM or
+ROM, unless the callee is named on an "allow" line (prebuilt codec
+library, I2S driver and BT stack entry points we cannot move). Those are
+not followed further; IDF code in IRAM is trusted to stay there.
+
+Calls are found in both Xtensa forms: call0/4/8/12 with the target in the
+instruction, and callx0/4/8/12 through a register, which is what a
+longcall becomes. For the latter the target is read from the literal the
+register was last loaded from with l32r, scanning the function in address
+order. An indirect call that cannot be resolved that way (a function
+pointer, or a register changed after its l32r) is an error, unless the
+caller is named on an "allow indirect" line after its targets have been
+checked by hand.
+"""
+
+import bisect
+import re
+import struct
+import subprocess
+import sys
+
+# ESP32 address map
+IRAM = (0x40070000, 0x400C0000)
+ROM = (0x40000000, 0x40070000)
+IROM = (0x400C2000, 0x40C00000)
+DRAM = (0x3FF80000, 0x40000000)
+DROM = (0x3F400000, 0x3F800000)
+
+INSN_RE = re.compile(r'^\s*([0-9a-f]+):\s+[0-9a-f]+\s+([a-z0-9.]+)\s*(.*)$')
+CALL_RE = re.compile(r'^call(?:0|4|8|12)$')
+CALLX_RE = re.compile(r'^callx(?:0|4|8|12)$')
+# stores and branches name a register first without writing it
+NO_WRITE_RE = re.compile(r'^(?:s8i|s16i|s32i|s32i\.n|s32c1i|s32e|s32ri|ssi|ssip|ssx|ssxp|b[a-z0-9]*(?:\.n)?|j|jx|ret.*|wsr.*|wur.*)$')
+
+
+def in_range(addr, rng):
+    return rng[0] <= addr < rng[1]
+
+
+def load_list(path):
+    roots, allowed, indirect = [], set(), set()
+    with open(path) as f:
+        for line in f:
+            line = line.split('#', 1)[0].strip()
+            if not line:
+                continue
+            if line.startswith('allow indirect '):
+                indirect.add(line[len('allow indirect '):].strip())
+            elif line.startswith('allow '):
+                allowed.add(line[len('allow '):].strip())
+            else:
+                roots.append(line)
+    return roots, allowed, indirect
+
+
+def load_symbols(nm, elf):
+    out = subprocess.check_output([nm, '-S', '--defined-only', elf], universal_newlines=True)
+    syms = {}
+    for line in out.splitlines():
+        parts = line.split()
+        if len(parts) != 4:
+            continue
+        addr, size, kind, name = parts
+        syms.setdefault(name, (int(addr, 16), int(size, 16), kind))
+    return syms
+
+
+class Image:
+    """Loaded contents of the ELF, to read l32r literals, and a symbol lookup by address."""
+
+    def __init__(self, elf, syms):
+        with open(elf, 'rb') as f:
+            data = f.read()
+        if data[:4] != b'\x7fELF' or data[4] != 1 or data[5] != 1:
+            raise ValueError('%s: not a little-endian ELF32 file' % elf)
+        shoff, = struct.unpack_from('<I', data, 0x20)
+        shentsize, shnum = struct.unpack_from('<HH', data, 0x2e)
+        self.sections = []
+        for i in range(shnum):
+            _, sh_type, _, addr, offset, size = struct.unpack_from('<IIIIII', data, shoff + i * shentsize)
+            if sh_type == 1 and addr:           # SHT_PROGBITS, loaded
+                self.sections.append((addr, size, data[offset:offset + size]))
+        funcs = sorted((a, s, n) for n, (a, s, k) in syms.items() if k in 'tTwW')
+        self.func_addrs = [f[0] for f in funcs]
+        self.funcs = funcs
+
+    def word(self, addr):
+        for base, size, data in self.sections:
+            if base <= addr and addr + 4 <= base + size:
+                return struct.unpack_from('<I', data, addr - base)[0]
+        return None
+
+    def name_at(self, addr):
+        i = bisect.bisect_right(self.func_addrs, addr) - 1
+        if i >= 0:
+            base, size, name = self.funcs[i]
+            if addr == base or addr < base + size:
+                return name
+        return '?'
+
+
+def load_own(nm, lib):
+    out = subprocess.check_output([nm, '--defined-only', lib], universal_newlines=True)
+    own = set()
+    for line in out.splitlines():
+        parts = line.split()
+        if len(parts) == 3 and parts[1] in 'tT':
+            own.add(parts[2])
+    return own
+
+
+def scan(objdump, image, elf, addr, size):
+    """Return the calls and flash literals of a function.
+
+    Calls are (target, name); target is None for an indirect call that could
+    not be resolved. Flash literals are (insn address, value) per l32r that
+    loads an address in DROM.
+    """
+    out = subprocess.check_output([objdump, '-d', '--start-address=0x%x' % addr,
+                                   '--stop-address=0x%x' % (addr + size), elf],
+                                  universal_newlines=True)
+    literal = {}                                # register -> literal address of its last l32r
+    calls, rodata = set(), set()
+    for line in out.splitlines():
+        m = INSN_RE.match(line)
+        if not m:
+            continue
+        op, args = m.group(2), [a.strip() for a in m.group(3).split('<', 1)[0].split(',')]
+        if CALL_RE.match(op):
+            target = int(args[0], 16)
+            calls.add((target, image.name_at(target)))
+        elif CALLX_RE.match(op):
+            lit = literal.get(args[0])
+            target = image.word(lit) if lit is not None else None
+            if target is None:
+                calls.add((None, '%s via %s at 0x%s' % (op, args[0], m.group(1))))
+            else:
+                calls.add((target, image.name_at(target)))
+        elif op == 'l32r':
+            literal[args[0]] = int(args[1], 16)
+            value = image.word(literal[args[0]])
+            if value is not None and in_range(value, DROM):
+                rodata.add((int(m.group(1), 16), value))
+        elif args and args[0] in literal and not NO_WRITE_RE.match(op):
+            del literal[args[0]]
+    return sorted(calls, key=lambda c: (c[0] is None, c[0] or 0, c[1])), sorted(rodata)
+
+
+def main():
+    if len(sys.argv) != 6:
+        print(__doc__)
+        return 2
+    nm, objdump, elf, list_path, lib = sys.argv[1:]
+    roots, allowed, indirect = load_list(list_path)
+    syms = load_symbols(nm, elf)
+    own = load_own(nm, lib)
+    image = Image(elf, syms)
+    errors = 0
+    queue, via = [], {}                         # functions to scan, and the chain that reached each
+    for name in roots:
+        if name not in syms:
+            # static helpers may have been inlined into their (listed) caller
+            print('check_audio_iram: note: %s not found in ELF (inlined?)' % name)
+            continue
+        addr, size, kind = syms[name]
+        if kind in 'tT':
+            via.setdefault(name, name)
+            queue.append(name)
+        elif in_range(addr, DROM) or not in_range(addr, DRAM):
+            print('check_audio_iram: error: table %s is at 0x%08x, not in DRAM' % (name, addr))
+            errors += 1
+    while queue:
+        name = queue.pop(0)
+        chain = via[name]
+        addr, size, kind = syms[name]
+        if not in_range(addr, IRAM):
+            print('check_audio_iram: error: %s is at 0x%08x, not in IRAM' % (chain, addr))
+            errors += 1
+            continue
+        calls, rodata = scan(objdump, image, elf, addr, size)
+        for insn, value in rodata:
+            print('check_audio_iram: error: %s reads flash data at 0x%08x (l32r at 0x%08x)' % (chain, value, insn))
+            errors += 1
+        for target, callee in calls:
+            if target is None:
+                if name not in indirect:
+                    print('check_audio_iram: error: %s makes an unresolved indirect call (%s)' % (chain, callee))
+                    errors += 1
+                continue
+            if callee in own and callee in syms:
+                if callee not in via:
+                    via[callee] = '%s -> %s' % (chain, callee)
+                    queue.append(callee)
+                continue
+            if in_range(target, IRAM) or in_range(target, ROM) or callee in allowed:
+                continue
+            print('check_audio_iram: error: %s calls %s at 0x%08x in flash' % (chain, callee, target))
+            errors += 1
+    if errors:
+        print('check_audio_iram: %d audio hot path placement error(s), see main/audio_hotpath.lst' % errors)
+        return 1
+    print('check_audio_iram: %d functions reached from %d hot path symbols, all IRAM/DRAM resident' % (len(via), len(roots)))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())